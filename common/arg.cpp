@@ -988,6 +988,10 @@ static bool common_params_parse_ex(int argc, char ** argv, common_params_context
         params.tensor_buft_overrides.push_back({nullptr, nullptr});
     }
 
+    if (!params.cache_type_layers.empty()) {
+        params.cache_type_layers.push_back({0, 0, GGML_TYPE_COUNT, GGML_TYPE_COUNT});
+    }
+
     if (params.reranking && params.embedding) {
         throw std::invalid_argument("error: either --embedding or --reranking can be specified, but not both");
     }
@@ -1726,6 +1730,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.sampling.samplers = common_sampler_types_from_chars(value);
         }
     ).set_sparam());
+    add_opt(common_arg(
+        {"--sampling-fused"},
+        string_format("sample from the logits without the candidates of the full vocab when the samplers allow it, faster for large vocabs\n"
+            "but the same seed does not select the same tokens (default: %s)", params.sampling.fused ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.sampling.fused = true;
+        }
+    ).set_sparam());
     add_opt(common_arg(
         {"--ignore-eos"},
         "ignore end of stream token and continue generating (implies --logit-bias EOS-inf)",
@@ -2113,6 +2125,19 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = kv_cache_type_from_str(value);
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"-ctl", "--cache-type-layers"}, "FIRST[..LAST]=TYPE_K[:TYPE_V],...",
+        "KV cache data types for ranges of layers, overriding --cache-type-k/v\n"
+        "negative layer indices are counted from the last layer\n"
+        "example: -ctk q4_0 -ctv q4_0 -ctl 0..3=f16,-4..-1=f16",
+        [](common_params & params, const std::string & value) {
+            for (const auto & item : string_split<std::string>(value, ',')) {
+                if (!string_parse_kv_layer_type(item.c_str(), params.cache_type_layers)) {
+                    throw std::invalid_argument("invalid KV cache layer type: " + item);
+                }
+            }
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_LAYERS"));
     add_opt(common_arg(
         {"--hellaswag"},
         "compute HellaSwag score over random tasks from datafile supplied with -f",
@@ -2190,6 +2215,29 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--kv-block-size"}, "N",
+        string_format("paged KV cache: number of cells per KV block, new tokens of a sequence are appended to its own blocks\n"
+            "so a ubatch does not need a contiguous range of free cells (default: %d, 0 = disabled)", params.kv_block_size),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"--logits-top"}, "N",
+        string_format("select the top N logits of each output in the compute graph and copy only those from the device\n"
+            "the samplers see only these candidates, 1 = argmax for greedy sampling (default: %d, 0 = full logits)\n"
+            "not used with a grammar, which needs the full logits", params.n_logits_top),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_logits_top = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_LOGITS_TOP"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2278,18 +2326,37 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(common_arg(
+        {"--moe-lazy"},
+        "do not prefetch the MoE expert weights, an expert is paged in when it is first used (requires mmap, no mlock)",
+        [](common_params & params) {
+            params.moe_lazy = true;
+        }
+    ).set_env("LLAMA_ARG_MOE_LAZY"));
+    add_opt(common_arg(
+        {"--moe-pin-hits"}, "N",
+        string_format("with --moe-lazy, lock an expert in RAM once it has been used by N batches (default: %d, 0 = never)", params.moe_pin_hits),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.moe_pin_hits = value;
+        }
+    ).set_env("LLAMA_ARG_MOE_PIN_HITS"));
     add_opt(common_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- mirror: like distribute, with a copy of the weights on every node and the KV cache interleaved over the nodes\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggml-org/llama.cpp/issues/1437",
         [](common_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "mirror") { params.numa = GGML_NUMA_STRATEGY_MIRROR; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_env("LLAMA_ARG_NUMA"));
@@ -2460,6 +2527,27 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.no_op_offload = true;
         }
     ));
+    add_opt(common_arg(
+        {"--graph-reuse"},
+        string_format("reuse the compute graph of the previous ubatch when it has the same shape (default: %s)", params.graph_reuse ? "true" : "false"),
+        [](common_params & params) {
+            params.graph_reuse = true;
+        }
+    ).set_env("LLAMA_ARG_GRAPH_REUSE"));
+    add_opt(common_arg(
+        {"--graph-reorder"},
+        string_format("reorder the nodes of the compute graph to reduce the size of the compute buffers (default: %s)", params.graph_reorder ? "true" : "false"),
+        [](common_params & params) {
+            params.graph_reorder = true;
+        }
+    ).set_env("LLAMA_ARG_GRAPH_REORDER"));
+    add_opt(common_arg(
+        {"--parallel-splits"},
+        string_format("compute the independent parts of the graph that run on different devices at the same time (default: %s)", params.parallel_splits ? "true" : "false"),
+        [](common_params & params) {
+            params.parallel_splits = true;
+        }
+    ).set_env("LLAMA_ARG_PARALLEL_SPLITS"));
     add_opt(common_arg(
         {"--lora"}, "FNAME",
         "path to LoRA adapter (can be repeated to use multiple adapters)",
@@ -2815,6 +2903,84 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--cache-share"}, "N",
+        string_format(
+            "min number of extra prompt tokens to attempt sharing from the cache of another slot, the KV cells of the\n"
+            "common prefix (e.g. a system prompt) are shared between the slots instead of being recomputed (default: %d)", params.n_cache_share
+        ),
+        [](common_params & params, int value) {
+            params.n_cache_share = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_SHARE"));
+    add_opt(common_arg(
+        {"--cache-spill"}, "N",
+        string_format(
+            "MiB of host memory to keep the KV cache of idle slots when their cells are reused, the cache is restored\n"
+            "when a later prompt continues the same conversation (default: %d, 0 = disabled)", params.n_cache_spill
+        ),
+        [](common_params & params, int value) {
+            params.n_cache_spill = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_SPILL"));
+    add_opt(common_arg(
+        {"--cache-spill-path"}, "PATH",
+        "path to write the spilled KV cache that does not fit in host memory (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.cache_spill_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.cache_spill_path.empty() && params.cache_spill_path[params.cache_spill_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.cache_spill_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_SPILL_PATH"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format(
+            "max number of prompt tokens to process per batch while other slots are generating, long prompts are\n"
+            "processed in chunks so that the generating slots are not stalled (default: %d, 0 = n_batch)", params.n_prefill
+        ),
+        [](common_params & params, int value) {
+            params.n_prefill = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--slo-ttft"}, "MS",
+        string_format(
+            "target time to first token in milliseconds, prompts waiting longer are processed without the prefill\n"
+            "budget (default: %d, 0 = disabled)", params.slo_ttft
+        ),
+        [](common_params & params, int value) {
+            params.slo_ttft = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLO_TTFT"));
+    add_opt(common_arg(
+        {"--slo-itl"}, "MS",
+        string_format(
+            "target inter-token latency in milliseconds, the prefill budget is adapted to keep the generating slots\n"
+            "within it (default: %d, 0 = disabled)", params.slo_itl
+        ),
+        [](common_params & params, int value) {
+            params.slo_itl = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLO_ITL"));
+    add_opt(common_arg(
+        {"--jump-forward"},
+        string_format(
+            "enable jump-forward decoding: the text forced by the grammar is evaluated in a single batch\n"
+            "instead of being sampled token by token (default: %s)", params.jump_forward ? "enabled" : "disabled"
+        ),
+        [](common_params & params) {
+            params.jump_forward = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_JUMP_FORWARD"));
+    add_opt(common_arg(
+        {"--max-queue"}, "N",
+        string_format("max number of requests waiting for a free slot, new requests are rejected beyond it (default: %d, 0 = unlimited)", params.n_queue_max),
+        [](common_params & params, int value) {
+            params.n_queue_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MAX_QUEUE"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -682,6 +682,76 @@ bool string_parse_kv_override(const char * data, std::vector<llama_model_kv_over
     return true;
 }
 
+bool string_parse_kv_layer_type(const char * data, std::vector<llama_kv_cache_layer_type> & types) {
+    const char * sep = strchr(data, '=');
+    if (sep == nullptr) {
+        LOG_ERR("%s: malformed KV cache layer type '%s'\n", __func__, data);
+        return false;
+    }
+
+    const std::string layers(data, sep);
+    const std::string names(sep + 1);
+
+    llama_kv_cache_layer_type lt;
+
+    try {
+        const size_t pos = layers.find("..");
+        lt.il_first = std::stoi(layers.substr(0, pos));
+        lt.il_last  = pos == std::string::npos ? lt.il_first : std::stoi(layers.substr(pos + 2));
+    } catch (const std::exception &) {
+        LOG_ERR("%s: invalid layer range in KV cache layer type '%s'\n", __func__, data);
+        return false;
+    }
+
+    auto type_from_name = [](const std::string & name) {
+        for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+            const char * type_name = ggml_type_name((ggml_type) i);
+            if (type_name && name == type_name) {
+                return (ggml_type) i;
+            }
+        }
+        return GGML_TYPE_COUNT;
+    };
+
+    const size_t pos = names.find(':');
+    lt.type_k = type_from_name(names.substr(0, pos));
+    lt.type_v = pos == std::string::npos ? lt.type_k : type_from_name(names.substr(pos + 1));
+
+    if (lt.type_k == GGML_TYPE_COUNT || lt.type_v == GGML_TYPE_COUNT) {
+        LOG_ERR("%s: invalid type in KV cache layer type '%s'\n", __func__, data);
+        return false;
+    }
+
+    types.push_back(lt);
+    return true;
+}
+
+std::string string_from(const std::vector<llama_kv_cache_layer_type> & types) {
+    std::stringstream buf;
+
+    for (const auto & lt : types) {
+        if (lt.type_k == GGML_TYPE_COUNT) {
+            break;
+        }
+
+        if (buf.tellp() > 0) {
+            buf << ",";
+        }
+
+        buf << lt.il_first;
+        if (lt.il_last != lt.il_first) {
+            buf << ".." << lt.il_last;
+        }
+
+        buf << "=" << ggml_type_name(lt.type_k);
+        if (lt.type_v != lt.type_k) {
+            buf << ":" << ggml_type_name(lt.type_v);
+        }
+    }
+
+    return buf.str();
+}
+
 //
 // Filesystem utils
 //
@@ -1092,6 +1162,8 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.moe_lazy        = params.moe_lazy;
+    mparams.moe_pin_hits    = params.moe_pin_hits;
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1135,6 +1207,8 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.n_logits_top      = params.sampling.grammar.empty() ? params.n_logits_top : 0; // a grammar needs the full logits
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1142,6 +1216,9 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.no_perf           = params.no_perf;
     cparams.op_offload        = !params.no_op_offload;
     cparams.swa_full          = params.swa_full;
+    cparams.graph_reuse       = params.graph_reuse;
+    cparams.graph_reorder     = params.graph_reorder;
+    cparams.parallel_splits   = params.parallel_splits;
 
     if (params.reranking) {
         cparams.embeddings    = true;
@@ -1151,6 +1228,11 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
 
+    if (!params.cache_type_layers.empty()) {
+        GGML_ASSERT(params.cache_type_layers.back().type_k == GGML_TYPE_COUNT && "KV cache layer types not terminated");
+        cparams.kv_layer_types = params.cache_type_layers.data();
+    }
+
     return cparams;
 }
 
@@ -1334,6 +1416,34 @@ std::string common_detokenize(const struct llama_vocab * vocab, const std::vecto
     return text;
 }
 
+std::string common_detokenizer_push(struct llama_detokenizer * detok, const std::vector<llama_token> & tokens, bool special, int32_t * n_consumed) {
+    std::string text;
+    text.resize(std::max(text.capacity(), 8*tokens.size()));
+    int32_t n_chars = llama_detokenizer_push(detok, tokens.data(), (int32_t)tokens.size(), &text[0], (int32_t)text.size(), special, n_consumed);
+    if (n_chars < 0) {
+        // the tokens are consumed, only the ready text is left
+        text.resize(-n_chars);
+        n_chars = llama_detokenizer_push(detok, nullptr, 0, &text[0], (int32_t)text.size(), special, nullptr);
+        GGML_ASSERT(n_chars == (int32_t)text.size());
+    }
+
+    text.resize(n_chars);
+
+    return text;
+}
+
+std::string common_detokenizer_flush(struct llama_detokenizer * detok) {
+    std::string text;
+    int32_t n_chars = llama_detokenizer_flush(detok, nullptr, 0);
+    if (n_chars < 0) {
+        text.resize(-n_chars);
+        n_chars = llama_detokenizer_flush(detok, &text[0], (int32_t)text.size());
+        GGML_ASSERT(n_chars == (int32_t)text.size());
+    }
+
+    return text;
+}
+
 //
 // Embedding utils
 //
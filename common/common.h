@@ -154,6 +154,7 @@ struct common_params_sampling {
     float   mirostat_eta       = 0.10f; // learning rate
     bool    ignore_eos         = false;
     bool    no_perf            = false; // disable performance metrics
+    bool    fused              = false; // sample without the candidates of the full vocab (the seeds do not reproduce the regular sampling)
     bool    timing_per_token   = false;
 
     std::vector<std::string> dry_sequence_breakers = {"\n", ":", "\"", "*"};     // default sequence breakers for DRY
@@ -239,6 +240,9 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // paged KV cache block size (0 = disabled)
+    int32_t n_logits_top          =     0; // top logits per output computed in the graph (0 = full logits)
+    int32_t moe_pin_hits          =     0; // lock a lazily loaded MoE expert in RAM after this many uses (0 = never)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -335,13 +339,19 @@ struct common_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool moe_lazy          = false; // page in the MoE experts when they are first used
     bool no_op_offload     = false; // globally disable offload host tensor operations to device
+    bool graph_reuse       = false; // reuse the compute graph of the previous ubatch when possible
+    bool graph_reorder     = false; // reorder the compute graph to reduce the size of the compute buffers
+    bool parallel_splits   = false; // compute the independent graph splits of different devices at the same time
 
     bool single_turn       = false; // single turn chat conversation
 
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
     ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
 
+    std::vector<llama_kv_cache_layer_type> cache_type_layers; // per-layer KV cache data types
+
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
     // multimodal models (see tools/mtmd)
@@ -363,6 +373,14 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_cache_share  = 0;            // min number of extra prompt tokens to share from the cache of another slot
+    int32_t n_cache_spill  = 0;            // MiB of host memory for the KV cache spilled from idle slots (0 = disabled)
+    int32_t n_prefill      = 0;            // max prompt tokens per iteration while other slots are generating (0 = n_batch)
+    int32_t n_queue_max    = 0;            // max number of deferred requests before new ones are rejected (0 = unlimited)
+    int32_t slo_ttft       = 0;            // target time to first token in ms (0 = disabled)
+    int32_t slo_itl        = 0;            // target inter-token latency in ms (0 = disabled)
+
+    bool jump_forward = false; // evaluate the text forced by the grammar in one batch instead of sampling it token by token
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -387,6 +405,7 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string cache_spill_path; // directory for the spilled KV cache that does not fit in host memory
 
     float slot_prompt_similarity = 0.5f;
 
@@ -518,6 +537,8 @@ bool string_ends_with(const std::string_view & str, const std::string_view & suf
 size_t string_find_partial_stop(const std::string_view & str, const std::string_view & stop);
 
 bool string_parse_kv_override(const char * data, std::vector<llama_model_kv_override> & overrides);
+bool string_parse_kv_layer_type(const char * data, std::vector<llama_kv_cache_layer_type> & types);
+std::string string_from(const std::vector<llama_kv_cache_layer_type> & types);
 void string_process_escapes(std::string & input);
 
 std::string string_from(bool value);
@@ -624,6 +645,17 @@ std::string common_detokenize(
         const std::vector<llama_token> & tokens,
                                   bool   special = true);
 
+// appends the tokens to the incremental detokenizer and returns the text that is ready to be emitted
+// the tokens after the one that completes a stop string are not consumed, see llama_detokenizer_push
+std::string common_detokenizer_push(
+             struct llama_detokenizer * detok,
+        const std::vector<llama_token> & tokens,
+                                  bool   special = true,
+                               int32_t * n_consumed = nullptr);
+
+// returns the text held back by the incremental detokenizer, at the end of the generation
+std::string common_detokenizer_flush(struct llama_detokenizer * detok);
+
 //
 // Embedding utils
 //
@@ -3,9 +3,10 @@
 #include "common.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cmath>
+#include <stdexcept>
 #include <unordered_map>
-#include <algorithm>
 
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 // TODO: deduplicate with llama-impl.h
@@ -112,21 +113,26 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    // ids == nullptr: logits of the full vocab, otherwise the top logits of the context
+    // the top logits are sorted, but not once the logit bias or the grammar have been applied, so cur_p is not
+    void set_logits(const llama_token * ids, const float * logits, int n) {
+        cur.resize(n);
 
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
+        for (int i = 0; i < n; i++) {
+            cur[i] = llama_token_data{ids ? ids[i] : i, logits[i], 0.0f};
+        }
 
-        const int n_vocab = llama_vocab_n_tokens(vocab);
+        cur_p = { cur.data(), cur.size(), -1, false };
+    }
 
+    // sample with the fused path of the chain, which does not need the candidates of the full vocab
+    // on success, cur_p holds the remaining candidates
+    bool apply_fused(const float * logits, int n_vocab) {
         cur.resize(n_vocab);
 
-        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
-        }
-
         cur_p = { cur.data(), cur.size(), -1, false };
+
+        return llama_sampler_chain_apply_fused(chain, logits, n_vocab, &cur_p);
     }
 };
 
@@ -152,6 +158,7 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
     llama_sampler_chain_params lparams = llama_sampler_chain_default_params();
 
     lparams.no_perf = params.no_perf;
+    lparams.fused   = params.fused;
 
     struct llama_sampler * grmr;
     if (params.grammar.compare(0, 11, "%llguidance") == 0) {
@@ -335,18 +342,46 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+// the logits of an output of the context, see set_logits
+struct common_logits_row {
+    const llama_token * ids;
+    const float       * logits;
+    int                 n;
+};
+
+static common_logits_row common_get_logits_row(struct llama_context * ctx, int idx) {
+    common_logits_row row = { nullptr, nullptr, 0 };
+
+    row.n = llama_get_logits_top_ith(ctx, idx, &row.ids, &row.logits);
+    if (row.n == 0) {
+        row.ids    = nullptr;
+        row.logits = llama_get_logits_ith(ctx, idx);
+        row.n      = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    }
+
+    return row;
+}
 
+static llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const common_logits_row & row, bool grammar_first) {
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
-    auto & cur_p = gsmpl->cur_p; // initialized by set_logits
+    auto & cur_p = gsmpl->cur_p; // initialized by set_logits or apply_fused
 
-    if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
+    // none of the top logits may fit the grammar, and the logits of the other tokens are not known
+    if (row.ids != nullptr && !gsmpl->params.grammar.empty()) {
+        throw std::runtime_error("a grammar needs the logits of the full vocab, the context returns only the top logits (n_logits_top)");
     }
 
-    llama_sampler_apply(chain, &cur_p);
+    // the grammar is checked after sampling, unless it has to be applied first to the full vocab
+    if (grammar_first || row.ids != nullptr || !gsmpl->apply_fused(row.logits, row.n)) {
+        gsmpl->set_logits(row.ids, row.logits, row.n);
+
+        if (grammar_first) {
+            llama_sampler_apply(grmr, &cur_p);
+        }
+
+        llama_sampler_apply(chain, &cur_p);
+    }
 
     GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
@@ -371,7 +406,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(row.ids, row.logits, row.n);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -381,6 +416,42 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    return common_sampler_sample_logits(gsmpl, common_get_logits_row(ctx, idx), grammar_first);
+}
+
+std::vector<llama_token> common_sampler_sample_seqs(const std::vector<common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size() && "gsmpls.size() must be idxs.size()");
+
+    const int n_seqs = gsmpls.size();
+
+    // llama_get_logits_ith synchronizes the context, so the rows are fetched before starting the threads
+    std::vector<common_logits_row> rows(n_seqs);
+    for (int i = 0; i < n_seqs; ++i) {
+        rows[i] = common_get_logits_row(ctx, idxs[i]);
+    }
+
+    std::vector<llama_token> result(n_seqs);
+
+    struct seqs_data {
+        const std::vector<common_sampler *> & gsmpls;
+        const std::vector<common_logits_row> & rows;
+        std::vector<llama_token>             & result;
+        bool                                   grammar_first;
+    } data = { gsmpls, rows, result, grammar_first };
+
+    const int32_t ret = llama_parallel_seqs(ctx, n_seqs, [](int32_t i, void * user_data) {
+        auto * data = (seqs_data *) user_data;
+        data->result[i] = common_sampler_sample_logits(data->gsmpls[i], data->rows[i], data->grammar_first);
+    }, &data);
+
+    if (ret != 0) {
+        throw std::runtime_error("failed to sample the sequences");
+    }
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -434,6 +505,59 @@ llama_token common_sampler_last(const struct common_sampler * gsmpl) {
     return gsmpl->prev.rat(0);
 }
 
+struct llama_sampler * common_sampler_get_grammar(struct common_sampler * gsmpl) {
+    return gsmpl->grmr;
+}
+
+std::vector<llama_token> common_grammar_forced_tokens(const struct llama_context * ctx, const struct llama_sampler * grmr) {
+    char buf[64];
+    const int32_t n_text = llama_sampler_grammar_forced_text(grmr, buf, sizeof(buf));
+    if (n_text <= 0) {
+        return {};
+    }
+
+    const std::string text(buf, n_text);
+
+    // the vocabs that add a space prefix (SPM) add it to the first token of the text
+    // in that case, the text is tokenized again after a new line, and the tokens of the new line are skipped
+    for (const std::string prefix : { "", "\n" }) {
+        const std::vector<llama_token> tokens = common_tokenize(ctx, prefix + text, false, false);
+
+        size_t i = 0;
+
+        std::string skipped;
+        while (i < tokens.size() && skipped.size() <= prefix.size() && !string_ends_with(skipped, prefix)) {
+            skipped += common_token_to_piece(ctx, tokens[i++], false);
+        }
+        if (!string_ends_with(skipped, prefix)) {
+            continue;
+        }
+
+        // keep the tokens as long as they spell the text
+        std::vector<llama_token> result;
+        for (size_t pos = 0; i < tokens.size(); ++i) {
+            const std::string piece = common_token_to_piece(ctx, tokens[i], false);
+            if (text.compare(pos, piece.size(), piece) != 0) {
+                break;
+            }
+            pos += piece.size();
+
+            result.push_back(tokens[i]);
+        }
+
+        // the last token can merge with the text that follows
+        if (i == tokens.size() && !result.empty()) {
+            result.pop_back();
+        }
+
+        if (!result.empty()) {
+            return result;
+        }
+    }
+
+    return {};
+}
+
 std::string common_sampler_print(const struct common_sampler * gsmpl) {
     std::string result = "logits ";
 
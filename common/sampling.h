@@ -60,6 +60,13 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// samples the outputs idxs[i] with the samplers gsmpls[i], one per sequence, in parallel with the generation threads of ctx
+// same as calling common_sampler_sample for each sequence, the tokens are not accepted
+//
+// requires: gsmpls.size() == idxs.size() and the samplers are distinct
+//
+std::vector<llama_token> common_sampler_sample_seqs(const std::vector<common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
@@ -91,6 +98,13 @@ llama_token_data_array * common_sampler_get_candidates(struct common_sampler * g
 // get the last accepted token
 llama_token common_sampler_last(const struct common_sampler * gsmpl);
 
+// access the grammar sampler (it can wrap an empty grammar)
+struct llama_sampler * common_sampler_get_grammar(struct common_sampler * gsmpl);
+
+// tokenize the text forced by a grammar sampler, without the last token, which can merge with the text that follows
+// only the tokens that spell a prefix of the text are kept
+std::vector<llama_token> common_grammar_forced_tokens(const struct llama_context * ctx, const struct llama_sampler * grmr);
+
 // print the sampler chain into a string
 std::string common_sampler_print(const struct common_sampler * gsmpl);
 
@@ -4,6 +4,7 @@
 #include "common.h"
 #include "sampling.h"
 
+#include <cmath>
 #include <cstring>
 #include <algorithm>
 
@@ -237,23 +238,89 @@ llama_tokens common_speculative_gen_draft(
 
     common_sampler_reset(smpl);
 
+    // the drafts follow a clone of the grammar of the target, so that no draft token is rejected by the grammar
+    llama_sampler_ptr grmr(params.grmr ? llama_sampler_clone(params.grmr) : nullptr);
+
+    std::vector<llama_token_data> cur_grmr;
+
     // sample n_draft tokens from the draft model
-    for (int i = 0; i < params.n_draft; ++i) {
+    while ((int) result.size() < params.n_draft) {
         common_batch_clear(batch);
 
-        common_sampler_sample(smpl, ctx, 0, true);
+        // the text forced by the grammar is drafted without sampling
+        if (grmr) {
+            llama_tokens forced = common_grammar_forced_tokens(ctx, grmr.get());
+            forced.resize(std::min<size_t>(forced.size(), params.n_draft - result.size()));
+
+            if (!forced.empty()) {
+                LOG_DBG("%s: %d tokens forced by the grammar: '%s'\n", __func__, (int) forced.size(), common_detokenize(ctx, forced, false).c_str());
+
+                for (size_t k = 0; k < forced.size(); ++k) {
+                    common_sampler_accept(smpl, forced[k], true);
+                    llama_sampler_accept(grmr.get(), forced[k]);
+
+                    common_batch_add(batch, forced[k], n_past + result.size() + 1, { 0 }, k + 1 == forced.size());
+
+                    result.push_back(forced[k]);
+                }
+
+                if (params.n_draft <= (int) result.size()) {
+                    break;
+                }
+
+                llama_decode(ctx, batch);
+
+                prompt.insert(prompt.end(), forced.begin(), forced.end());
+
+                continue;
+            }
+        }
+
+        common_sampler_sample(smpl, ctx, -1, true);
 
         const auto * cur_p = common_sampler_get_candidates(smpl);
 
         for (int k = 0; k < std::min(3, (int) cur_p->size); ++k) {
             LOG_DBG(" - draft candidate %3d, pos %3d: %6d (%8.3f) '%s'\n",
-                    k, i, cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx, cur_p->data[k].id).c_str());
+                    k, (int) result.size(), cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx, cur_p->data[k].id).c_str());
+        }
+
+        // pick the most probable candidate allowed by the grammar
+        // its probability is renormalized over the allowed candidates
+        size_t i_best = 0;
+        float  p_best = cur_p->data[0].p;
+
+        if (grmr) {
+            cur_grmr.assign(cur_p->data, cur_p->data + cur_p->size);
+
+            llama_token_data_array cur_grmr_p = { cur_grmr.data(), cur_grmr.size(), -1, false };
+            llama_sampler_apply(grmr.get(), &cur_grmr_p);
+
+            float p_rejected = 0.0f;
+            i_best = cur_grmr.size();
+            for (size_t k = 0; k < cur_grmr.size(); ++k) {
+                if (cur_grmr[k].logit == -INFINITY) {
+                    p_rejected += cur_p->data[k].p;
+                } else if (i_best == cur_grmr.size()) {
+                    i_best = k;
+                }
+            }
+
+            // none of the candidates is allowed by the grammar
+            if (i_best == cur_grmr.size()) {
+                break;
+            }
+
+            p_best = p_rejected < 1.0f ? cur_p->data[i_best].p / (1.0f - p_rejected) : 0.0f;
         }
 
         // add drafted token for each sequence
-        const llama_token id = cur_p->data[0].id;
+        const llama_token id = cur_p->data[i_best].id;
 
         common_sampler_accept(smpl, id, true);
+        if (grmr) {
+            llama_sampler_accept(grmr.get(), id);
+        }
 
         result.push_back(id);
 
@@ -262,11 +329,11 @@ llama_tokens common_speculative_gen_draft(
         }
 
         // only collect very high-confidence draft tokens
-        if (cur_p->data[0].p < params.p_min) {
+        if (p_best < params.p_min) {
             break;
         }
 
-        common_batch_add(batch, id, n_past + i + 1, { 0 }, true);
+        common_batch_add(batch, id, n_past + result.size(), { 0 }, true);
 
         // evaluate the drafted tokens on the draft model
         llama_decode(ctx, batch);
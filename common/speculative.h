@@ -10,6 +10,8 @@ struct common_speculative_params {
     int n_reuse = 256;
 
     float p_min = 0.75f; // min probability required to accept a token in the draft
+
+    struct llama_sampler * grmr = nullptr; // grammar sampler of the target, the drafts follow a clone of it
 };
 
 struct common_speculative * common_speculative_init(struct llama_context * ctx_dft);
@@ -129,6 +129,7 @@ int main(int argc, char ** argv) {
     params_spec.n_draft = n_draft;
     params_spec.n_reuse = llama_n_ctx(ctx_dft) - n_draft;
     params_spec.p_min   = p_min;
+    params_spec.grmr    = common_sampler_get_grammar(smpl);
 
     struct common_speculative * spec = common_speculative_init(ctx_dft);
 
@@ -66,6 +66,15 @@ GGML_API bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph
 
 GGML_API size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id);
 
+// write the allocation plan of the last allocated graph as JSON: the offset, size and lifetime (first and last node) of each tensor,
+// and the peak of the bytes alive at the same time in each buffer
+GGML_API bool ggml_gallocr_dump_plan(ggml_gallocr_t galloc, const char * fname);
+
+// reorder the independent nodes of the graph to reduce the peak of the memory alive at the same time
+// the nodes that write into the memory of other tensors (e.g. copies into views) keep their position relative to the other nodes
+// returns true if the order of the nodes has changed
+GGML_API bool ggml_graph_reorder_min_memory(struct ggml_cgraph * graph);
+
 // Utils
 // Create a buffer and allocate all the tensors in a ggml_context
 GGML_API struct ggml_backend_buffer * ggml_backend_alloc_ctx_tensors_from_buft(struct ggml_context * ctx, ggml_backend_buffer_type_t buft);
@@ -192,6 +192,11 @@ extern "C" {
     typedef ggml_backend_buffer_type_t * (*ggml_backend_dev_get_extra_bufts_t)(ggml_backend_dev_t device);
     // Set the abort callback for the backend
     typedef void                         (*ggml_backend_set_abort_callback_t)(ggml_backend_t backend, ggml_abort_callback abort_callback, void * abort_callback_data);
+    // Record the time spent by each thread on each node of the next graphs computed by the backend
+    typedef void                         (*ggml_backend_set_profiling_t)(ggml_backend_t backend, bool enable);
+    // Get the times of the last graph computed while profiling: times[(ith*n_nodes + i)*2 + 0/1] are the start and end (ggml_time_ns) of node i on thread ith,
+    // 0 for the threads that did not run and -1 for the nodes computed by the fused kernel of a previous node
+    typedef const int64_t *              (*ggml_backend_get_node_times_t)(ggml_backend_t backend, int * n_threads, int * n_nodes);
     // Get a list of feature flags supported by the backend (returns a NULL-terminated array)
     struct ggml_backend_feature {
         const char * name;
@@ -304,6 +309,9 @@ extern "C" {
 
     GGML_API size_t               ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backend_t backend);
 
+    // Write the allocation plan of the last allocated graph as JSON, the buffer ids are the backend indices (see ggml_gallocr_dump_plan)
+    GGML_API bool                 ggml_backend_sched_dump_alloc_plan(ggml_backend_sched_t sched, const char * fname);
+
     GGML_API void                 ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend);
     GGML_API ggml_backend_t       ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node);
 
@@ -321,6 +329,32 @@ extern "C" {
     // Set a callback to be called for each resulting node during graph compute
     GGML_API void                 ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backend_sched_eval_callback callback, void * user_data);
 
+    // Compute the splits of different backends at the same time when they do not depend on each other, each backend runs its splits in order in its own thread
+    // the backends no longer share their compute buffers, which can increase the memory usage
+    // not used with pipeline parallelism or an eval callback, must be called before the first graph is allocated
+    GGML_API void                 ggml_backend_sched_set_parallel_splits(ggml_backend_sched_t sched, bool enable);
+
+    //
+    // Profiler
+    //
+
+    // Records the time of the splits computed by a scheduler and, for the backends that support it (see ggml_backend_get_node_times_t),
+    // the time spent by each thread on each node - the FLOPs and the bytes read and written by each node are estimated from its op and shapes
+    typedef struct ggml_backend_profiler * ggml_backend_profiler_t;
+
+    // max_events: number of events kept for the trace, the summary includes all the graphs
+    GGML_API ggml_backend_profiler_t ggml_backend_profiler_new(size_t max_events);
+    GGML_API void                    ggml_backend_profiler_free(ggml_backend_profiler_t profiler);
+    GGML_API void                    ggml_backend_profiler_reset(ggml_backend_profiler_t profiler);
+
+    // Write the events as a Chrome trace (JSON), which can be opened with chrome://tracing or https://ui.perfetto.dev
+    GGML_API bool                    ggml_backend_profiler_write_trace(ggml_backend_profiler_t profiler, const char * fname);
+    // Print the time, FLOPs and bytes of each op type, and the time spent by each thread computing and waiting for the other threads
+    GGML_API void                    ggml_backend_profiler_print_summary(ggml_backend_profiler_t profiler, FILE * f);
+
+    // Profile the graphs computed by the scheduler (NULL to stop), the backends are synchronized after each split while profiling
+    GGML_API void                    ggml_backend_sched_set_profiler(ggml_backend_sched_t sched, ggml_backend_profiler_t profiler);
+
     //
     // Utils
     //
@@ -339,7 +373,10 @@ extern "C" {
     typedef bool (*ggml_backend_eval_callback)(int node_index, struct ggml_tensor * t1, struct ggml_tensor * t2, void * user_data);
 
     // Compare the output of two backends
-    GGML_API bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data);
+    // by default the nodes are computed and compared one by one
+    // if test_node is not NULL, the whole graph is computed at once and only test_node is compared, so that backend1 can fuse the ops
+    // the copy of the graph used by backend2 is always computed without fusion
+    GGML_API bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data, struct ggml_tensor * test_node);
 
     // Tensor initialization
     GGML_API enum ggml_status ggml_backend_tensor_alloc(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, void * addr);
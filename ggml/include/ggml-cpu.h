@@ -19,6 +19,15 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // scheduling of the work between the threads, all enabled by `ggml_graph_plan()`
+        bool work_stealing; // idle threads steal the chunks of the heavy ops from the other threads
+        bool skip_barriers; // consecutive nodes that do not depend on each other run without a barrier in between
+        bool fuse_ops;      // chains of nodes with a fused kernel (e.g. RMS_NORM + MUL) run as a single node
+
+        // profiling: when not NULL, each thread records the start and end time (ggml_time_ns) of each node in
+        // node_times[(ith*n_nodes + i)*2 + 0/1], -1 for the nodes computed by the fused kernel of a previous node
+        int64_t * node_times;
     };
 
     // numa strategies
@@ -34,6 +43,14 @@ extern "C" {
     GGML_BACKEND_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_BACKEND_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // GGML_NUMA_STRATEGY_MIRROR: copies a read-only buffer (e.g. the model weights) to every NUMA node, the threads of
+    // each node use their local copy in the matrix multiplications - the copies are freed by ggml_numa_unmirror()
+    GGML_BACKEND_API bool    ggml_numa_mirror(const void * data, size_t size);
+    GGML_BACKEND_API void    ggml_numa_unmirror(const void * data);
+
+    // GGML_NUMA_STRATEGY_MIRROR: zeroes a buffer (e.g. the KV cache) with its pages interleaved between the NUMA nodes
+    GGML_BACKEND_API void    ggml_numa_interleave(void * data, size_t size);
+
     GGML_BACKEND_API struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
     GGML_BACKEND_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
@@ -131,6 +148,10 @@ extern "C" {
     GGML_BACKEND_API void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, ggml_threadpool_t threadpool);
     GGML_BACKEND_API void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // profiling: record the time spent by each thread on each node of the next graphs, see ggml_cplan.node_times
+    GGML_BACKEND_API void            ggml_backend_cpu_set_profiling (ggml_backend_t backend_cpu, bool enable);
+    GGML_BACKEND_API const int64_t * ggml_backend_cpu_get_node_times(ggml_backend_t backend_cpu, int * n_threads, int * n_nodes);
+
     GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
     GGML_BACKEND_API void ggml_cpu_fp32_to_fp16(const float *, ggml_fp16_t *, int64_t);
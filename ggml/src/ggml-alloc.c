@@ -3,6 +3,7 @@
 #include "ggml.h"
 #include "ggml-impl.h"
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -344,6 +345,19 @@ struct hash_node {
     int buffer_id;
     size_t offset; // offset within the buffer
     bool allocated;
+    int lifetime_id; // index in galloc->lifetimes + 1, 0 if the tensor is not allocated by the galloc
+};
+
+// allocation of a tensor in the last reserved graph, reported by ggml_gallocr_dump_plan
+struct tensor_lifetime {
+    char name[GGML_MAX_NAME];
+    enum ggml_op op;
+    int buffer_id;
+    size_t offset;
+    size_t size;
+    int alloc_node; // index of the first node where the tensor is alive, -1 for the leafs and inputs allocated before the first node
+    int free_node;  // index of the last node where the tensor is alive, -1 if it is never freed
+    int parent;     // index of the lifetime whose memory is reused in-place, -1 if none
 };
 
 struct tensor_alloc {
@@ -375,9 +389,14 @@ struct ggml_gallocr {
 
     struct leaf_alloc * leaf_allocs; // [n_leafs]
     int n_leafs;
+
+    struct tensor_lifetime * lifetimes; // [n_lifetimes]
+    int n_lifetimes;
+    int lifetimes_size;
+    int cur_node; // index of the node being allocated, -1 before the first node
 };
 
-ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
+static ggml_gallocr_t ggml_gallocr_new_impl(ggml_backend_buffer_type_t * bufts, int n_bufs, bool share) {
     ggml_gallocr_t galloc = (ggml_gallocr_t)calloc(1, sizeof(struct ggml_gallocr));
     GGML_ASSERT(galloc != NULL);
 
@@ -395,7 +414,7 @@ ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs
         galloc->buffers[i] = NULL;
 
         // check if the same buffer type is used multiple times and reuse the same allocator
-        for (int j = 0; j < i; j++) {
+        for (int j = 0; j < i && share; j++) {
             if (bufts[i] == bufts[j]) {
                 galloc->buf_tallocs[i] = galloc->buf_tallocs[j];
                 break;
@@ -412,6 +431,14 @@ ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs
     return galloc;
 }
 
+ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
+    return ggml_gallocr_new_impl(bufts, n_bufs, true);
+}
+
+ggml_gallocr_t ggml_gallocr_new_n_unshared(ggml_backend_buffer_type_t * bufts, int n_bufs) {
+    return ggml_gallocr_new_impl(bufts, n_bufs, false);
+}
+
 ggml_gallocr_t ggml_gallocr_new(ggml_backend_buffer_type_t buft) {
     return ggml_gallocr_new_n(&buft, 1);
 }
@@ -457,6 +484,7 @@ void ggml_gallocr_free(ggml_gallocr_t galloc) {
     free(galloc->buf_tallocs);
     free(galloc->node_allocs);
     free(galloc->leaf_allocs);
+    free(galloc->lifetimes);
     free(galloc);
 }
 
@@ -475,6 +503,32 @@ static bool ggml_gallocr_is_allocated(ggml_gallocr_t galloc, struct ggml_tensor
     return t->data != NULL || ggml_gallocr_hash_get(galloc, t)->allocated;
 }
 
+static void ggml_gallocr_record_alloc(ggml_gallocr_t galloc, struct ggml_tensor * node, struct hash_node * hn, struct hash_node * p_hn) {
+    if (galloc->n_lifetimes == galloc->lifetimes_size) {
+        galloc->lifetimes_size = MAX(256, 2*galloc->lifetimes_size);
+        galloc->lifetimes = realloc(galloc->lifetimes, galloc->lifetimes_size * sizeof(struct tensor_lifetime));
+        GGML_ASSERT(galloc->lifetimes != NULL);
+    }
+
+    struct tensor_lifetime * lt = &galloc->lifetimes[galloc->n_lifetimes++];
+    snprintf(lt->name, sizeof(lt->name), "%s", node->name);
+    lt->op         = node->op;
+    lt->buffer_id  = hn->buffer_id;
+    lt->offset     = hn->offset;
+    lt->size       = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], node);
+    lt->alloc_node = galloc->cur_node;
+    lt->free_node  = -1;
+    lt->parent     = -1;
+
+    hn->lifetime_id = galloc->n_lifetimes;
+
+    // the memory of the parent is taken over by the node
+    if (p_hn != NULL && p_hn->lifetime_id > 0) {
+        galloc->lifetimes[p_hn->lifetime_id - 1].free_node = galloc->cur_node;
+        lt->parent = p_hn->lifetime_id - 1;
+    }
+}
+
 static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int buffer_id) {
     GGML_ASSERT(buffer_id >= 0);
     struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
@@ -509,6 +563,13 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                 }
 
                 struct hash_node * p_hn = ggml_gallocr_hash_get(galloc, parent);
+
+                // the memory of a parent in a buffer that is not shared with this node cannot be reused
+                if (galloc->buf_tallocs[p_hn->buffer_id] != galloc->buf_tallocs[buffer_id]) {
+                    AT_PRINTF("not reusing parent %s for %s as it is in another buffer\n", parent->name, node->name);
+                    continue;
+                }
+
                 if (p_hn->n_children == 1 && p_hn->n_views == 0) {
                     if (ggml_is_view(parent)) {
                         struct ggml_tensor * view_src = parent->view_src;
@@ -520,6 +581,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                             hn->offset = p_hn->offset;
                             p_hn->allocated = false; // avoid freeing the parent
                             view_src_hn->allocated = false;
+                            ggml_gallocr_record_alloc(galloc, node, hn, view_src_hn);
                             return;
                         }
                     } else {
@@ -527,6 +589,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                         hn->buffer_id = p_hn->buffer_id;
                         hn->offset = p_hn->offset;
                         p_hn->allocated = false; // avoid freeing the parent
+                        ggml_gallocr_record_alloc(galloc, node, hn, p_hn);
                         return;
                     }
                 }
@@ -539,6 +602,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         size_t offset = ggml_dyn_tallocr_alloc(alloc, size, node);
         hn->buffer_id = buffer_id;
         hn->offset = offset;
+        ggml_gallocr_record_alloc(galloc, node, hn, NULL);
     }
 }
 
@@ -557,6 +621,10 @@ static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * n
     size_t size = ggml_backend_buft_get_alloc_size(buft, node);
     ggml_dyn_tallocr_free_tensor(alloc, offset, size, node);
     hn->allocated = false;
+
+    if (hn->lifetime_id > 0) {
+        galloc->lifetimes[hn->lifetime_id - 1].free_node = galloc->cur_node;
+    }
 }
 
 static int get_node_buffer_id(const int * node_buffer_ids, int i) {
@@ -568,6 +636,9 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     ggml_hash_set_reset(&galloc->hash_set);
     memset(galloc->hash_values, 0, sizeof(struct hash_node) * galloc->hash_set.size);
 
+    galloc->n_lifetimes = 0;
+    galloc->cur_node    = -1;
+
     // allocate leafs
     // these may be tensors that the application is not using in the graph, but may still want to allocate for other purposes
     for (int i = 0; i < graph->n_leafs; i++) {
@@ -613,6 +684,8 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
         struct ggml_tensor * node = graph->nodes[i];
         int buffer_id = get_node_buffer_id(node_buffer_ids, i);
 
+        galloc->cur_node = i;
+
         // allocate parents (only leafs need to be allocated at this point)
         for (int j = 0; j < GGML_MAX_SRC; j++) {
             struct ggml_tensor * parent = node->src[j];
@@ -934,6 +1007,387 @@ size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id) {
     return ggml_backend_buffer_get_size(galloc->buffers[buffer_id]);
 }
 
+static void ggml_gallocr_json_str(FILE * f, const char * str) {
+    fputc('"', f);
+    for (const char * c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(f, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(f, "\\u%04x", *c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool ggml_gallocr_dump_plan(ggml_gallocr_t galloc, const char * fname) {
+    FILE * f = ggml_fopen(fname, "w");
+    if (f == NULL) {
+        GGML_LOG_ERROR("%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    const int n_nodes = galloc->n_nodes;
+
+    // bytes alive at each step: step 0 is before the first node, step i + 1 is during node i
+    // the buffers that share an allocator are reported together, with the first of them
+    int64_t * live = calloc((size_t) galloc->n_buffers * (n_nodes + 2), sizeof(int64_t));
+    GGML_ASSERT(live != NULL);
+
+    for (int i = 0; i < galloc->n_lifetimes; i++) {
+        const struct tensor_lifetime * lt = &galloc->lifetimes[i];
+
+        int buffer_id = lt->buffer_id;
+        for (int j = 0; j < buffer_id; j++) {
+            if (galloc->buf_tallocs[j] == galloc->buf_tallocs[lt->buffer_id]) {
+                buffer_id = j;
+                break;
+            }
+        }
+
+        // in-place tensors share the memory of their parent on the node where it is taken over
+        const int start = lt->alloc_node + 1 + (lt->parent >= 0 ? 1 : 0);
+        const int end   = lt->free_node < 0 ? n_nodes : lt->free_node + 1;
+        if (start > end) {
+            continue;
+        }
+
+        int64_t * b = live + (size_t) buffer_id * (n_nodes + 2);
+        b[start]   += lt->size;
+        b[end + 1] -= lt->size;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"n_nodes\": %d,\n", n_nodes);
+    fprintf(f, "  \"buffers\": [\n");
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        int64_t * b = live + (size_t) i * (n_nodes + 2);
+
+        int64_t cur       = 0;
+        int64_t peak_live = 0;
+        int     peak_node = -1;
+        for (int t = 0; t <= n_nodes; t++) {
+            cur += b[t];
+            if (cur > peak_live) {
+                peak_live = cur;
+                peak_node = t - 1;
+            }
+        }
+
+        fprintf(f, "    { \"id\": %d, \"buft\": ", i);
+        ggml_gallocr_json_str(f, ggml_backend_buft_name(galloc->bufts[i]));
+        fprintf(f, ", \"size\": %zu, \"peak_live\": %" PRId64 ", \"peak_node\": %d }%s\n",
+                ggml_gallocr_get_buffer_size(galloc, i), peak_live, peak_node, i < galloc->n_buffers - 1 ? "," : "");
+    }
+    fprintf(f, "  ],\n");
+    fprintf(f, "  \"tensors\": [\n");
+    for (int i = 0; i < galloc->n_lifetimes; i++) {
+        const struct tensor_lifetime * lt = &galloc->lifetimes[i];
+
+        fprintf(f, "    { \"name\": ");
+        ggml_gallocr_json_str(f, lt->name);
+        fprintf(f, ", \"op\": \"%s\", \"buffer\": %d, \"offset\": %zu, \"size\": %zu, \"alloc\": %d, \"free\": %d, \"inplace_of\": %d }%s\n",
+                ggml_op_name(lt->op), lt->buffer_id, lt->offset, lt->size, lt->alloc_node, lt->free_node, lt->parent,
+                i < galloc->n_lifetimes - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+
+    free(live);
+    fclose(f);
+
+    return true;
+}
+
+// graph reordering
+
+// nodes that write into the memory of another tensor or that may have side effects
+// they keep their position relative to all the other nodes of the graph, e.g. the copies into a view of the KV cache and the reads of the cache
+static bool ggml_graph_node_is_ordered(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return false;
+        case GGML_OP_NONE:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+        case GGML_OP_CUSTOM:
+        case GGML_OP_OPT_STEP_ADAMW:
+            return true;
+        default:
+            return node->view_src != NULL;
+    }
+}
+
+struct ggml_graph_order_state {
+    const struct ggml_cgraph * graph;
+    struct ggml_hash_set map;
+    int * map_idx;  // [map.size] node index of the tensors of the map
+    int * n_uses;   // [n_nodes] number of sources of the unscheduled nodes that use the memory of the node
+};
+
+// index of the node that owns the memory of the tensor, -1 if it is not allocated by the graph
+static int ggml_graph_order_owner(const struct ggml_graph_order_state * st, const struct ggml_tensor * t) {
+    if (t->view_src != NULL) {
+        t = t->view_src;
+    }
+    if (t->data != NULL || (t->flags & GGML_TENSOR_FLAG_OUTPUT)) {
+        return -1;
+    }
+    const size_t h = ggml_hash_find(&st->map, t);
+    if (h == GGML_HASHSET_FULL || !ggml_bitset_get(st->map.used, h) || st->map.keys[h] != t) {
+        return -1;
+    }
+    return st->map_idx[h];
+}
+
+static int64_t ggml_graph_order_alloc_size(const struct ggml_tensor * node) {
+    return node->view_src == NULL && node->data == NULL ? (int64_t) ggml_nbytes(node) : 0;
+}
+
+// change of the bytes alive when the node is computed: its result is allocated, and the sources used for the last time are freed
+static int64_t ggml_graph_order_score(const struct ggml_graph_order_state * st, const struct ggml_tensor * node) {
+    int64_t score = ggml_graph_order_alloc_size(node);
+
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        if (node->src[j] == NULL) {
+            continue;
+        }
+        const int o = ggml_graph_order_owner(st, node->src[j]);
+        if (o < 0) {
+            continue;
+        }
+        // count the owner once, on its last use by the node
+        int n_uses = 0;
+        bool last  = true;
+        for (int k = 0; k < GGML_MAX_SRC; k++) {
+            if (node->src[k] != NULL && ggml_graph_order_owner(st, node->src[k]) == o) {
+                n_uses++;
+                last = k <= j;
+            }
+        }
+        if (last && st->n_uses[o] == n_uses) {
+            score -= ggml_graph_order_alloc_size(st->graph->nodes[o]);
+        }
+    }
+
+    return score;
+}
+
+static void ggml_graph_order_count_uses(struct ggml_graph_order_state * st) {
+    const struct ggml_cgraph * graph = st->graph;
+
+    memset(st->n_uses, 0, graph->n_nodes * sizeof(int));
+    for (int i = 0; i < graph->n_nodes; i++) {
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (graph->nodes[i]->src[j] == NULL) {
+                continue;
+            }
+            const int o = ggml_graph_order_owner(st, graph->nodes[i]->src[j]);
+            if (o >= 0) {
+                st->n_uses[o]++;
+            }
+        }
+    }
+}
+
+static void ggml_graph_order_release(struct ggml_graph_order_state * st, const struct ggml_tensor * node) {
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        if (node->src[j] == NULL) {
+            continue;
+        }
+        const int o = ggml_graph_order_owner(st, node->src[j]);
+        if (o >= 0) {
+            st->n_uses[o]--;
+        }
+    }
+}
+
+// peak of the bytes alive at the same time when the nodes are computed in the given order
+static int64_t ggml_graph_order_peak(struct ggml_graph_order_state * st, const int * order) {
+    ggml_graph_order_count_uses(st);
+
+    int64_t cur  = 0;
+    int64_t peak = 0;
+    for (int i = 0; i < st->graph->n_nodes; i++) {
+        const struct ggml_tensor * node = st->graph->nodes[order[i]];
+
+        // the result is allocated while the sources are still alive
+        const int64_t size  = ggml_graph_order_alloc_size(node);
+        const int64_t score = ggml_graph_order_score(st, node);
+
+        cur += size;
+        peak = MAX(peak, cur);
+        cur += score - size;
+
+        ggml_graph_order_release(st, node);
+    }
+
+    return peak;
+}
+
+bool ggml_graph_reorder_min_memory(struct ggml_cgraph * graph) {
+    const int n_nodes = graph->n_nodes;
+    if (n_nodes < 3) {
+        return false;
+    }
+
+    struct ggml_graph_order_state st = {
+        /*.graph   =*/ graph,
+        /*.map     =*/ ggml_hash_set_new(n_nodes),
+        /*.map_idx =*/ NULL,
+        /*.n_uses  =*/ malloc(n_nodes * sizeof(int)),
+    };
+    st.map_idx = malloc(st.map.size * sizeof(int));
+
+    int * n_deps      = calloc(n_nodes, sizeof(int));   // number of sources that are unscheduled nodes
+    int * users_start = calloc(n_nodes + 1, sizeof(int));
+    int * users       = malloc((size_t) n_nodes * (GGML_MAX_SRC + 1) * sizeof(int));
+    int * order       = malloc(n_nodes * sizeof(int));
+    int * order_orig  = malloc(n_nodes * sizeof(int));
+    int * ready       = malloc(n_nodes * sizeof(int));
+    bool * done       = calloc(n_nodes, sizeof(bool));
+
+    GGML_ASSERT(st.map_idx && st.n_uses && n_deps && users_start && users && order && order_orig && ready && done);
+
+    for (int i = 0; i < n_nodes; i++) {
+        const size_t h = ggml_hash_insert(&st.map, graph->nodes[i]);
+        if (h != GGML_HASHSET_ALREADY_EXISTS) {
+            st.map_idx[h] = i;
+        }
+        order_orig[i] = i;
+    }
+
+    // dependencies: the sources of the nodes, and the tensors they are views of
+    #define GGML_ORDER_FOREACH_DEP(node, dep_idx, BODY) \
+        for (int j_ = 0; j_ <= GGML_MAX_SRC; j_++) { \
+            const struct ggml_tensor * t_ = j_ < GGML_MAX_SRC ? (node)->src[j_] : (node)->view_src; \
+            if (t_ == NULL) { continue; } \
+            const size_t h_ = ggml_hash_find(&st.map, t_); \
+            if (h_ == GGML_HASHSET_FULL || !ggml_bitset_get(st.map.used, h_) || st.map.keys[h_] != t_) { continue; } \
+            const int dep_idx = st.map_idx[h_]; \
+            BODY \
+        }
+
+    for (int i = 0; i < n_nodes; i++) {
+        GGML_ORDER_FOREACH_DEP(graph->nodes[i], d, { users_start[d + 1]++; n_deps[i]++; });
+    }
+    for (int i = 0; i < n_nodes; i++) {
+        users_start[i + 1] += users_start[i];
+    }
+    {
+        int * pos = malloc(n_nodes * sizeof(int));
+        GGML_ASSERT(pos != NULL);
+        memcpy(pos, users_start, n_nodes * sizeof(int));
+        for (int i = 0; i < n_nodes; i++) {
+            GGML_ORDER_FOREACH_DEP(graph->nodes[i], d, { users[pos[d]++] = i; });
+        }
+        free(pos);
+    }
+
+    #undef GGML_ORDER_FOREACH_DEP
+
+    ggml_graph_order_count_uses(&st);
+
+    // the ordered nodes split the graph in segments, the nodes of each segment are scheduled greedily:
+    // among the nodes whose sources are computed, pick the one that increases the bytes alive the least,
+    // preferring the users of the last node to keep the chains of ops together
+    int n_order = 0;
+    int last    = -1;
+
+    for (int s = 0; s < n_nodes; ) {
+        int e = s;
+        while (e < n_nodes && !ggml_graph_node_is_ordered(graph->nodes[e])) {
+            e++;
+        }
+        if (e == s) {
+            e = s + 1;
+        }
+
+        int n_ready = 0;
+        for (int i = s; i < e; i++) {
+            if (n_deps[i] == 0) {
+                ready[n_ready++] = i;
+            }
+        }
+
+        while (n_ready > 0) {
+            int     best       = 0;
+            int64_t best_score = INT64_MAX;
+            bool    best_user  = false;
+            for (int r = 0; r < n_ready; r++) {
+                const struct ggml_tensor * node = graph->nodes[ready[r]];
+
+                const int64_t score = ggml_graph_order_score(&st, node);
+
+                bool user = false;
+                for (int j = 0; j < GGML_MAX_SRC && last >= 0; j++) {
+                    user = user || node->src[j] == graph->nodes[last];
+                }
+
+                if (score < best_score || (score == best_score && user && !best_user) ||
+                        (score == best_score && user == best_user && ready[r] < ready[best])) {
+                    best       = r;
+                    best_score = score;
+                    best_user  = user;
+                }
+            }
+
+            const int i = ready[best];
+            ready[best] = ready[--n_ready];
+
+            order[n_order++] = i;
+            done[i] = true;
+            last    = i;
+
+            ggml_graph_order_release(&st, graph->nodes[i]);
+
+            for (int u = users_start[i]; u < users_start[i + 1]; u++) {
+                const int k = users[u];
+                if (--n_deps[k] == 0 && k >= s && k < e && !done[k]) {
+                    ready[n_ready++] = k;
+                }
+            }
+        }
+
+        s = e;
+    }
+
+    GGML_ASSERT(n_order == n_nodes && "the graph has dependencies that are not in topological order");
+
+    // keep the original order if it is not worse
+    const int64_t peak_orig = ggml_graph_order_peak(&st, order_orig);
+    const int64_t peak_new  = ggml_graph_order_peak(&st, order);
+
+    const bool changed = peak_new < peak_orig;
+    if (changed) {
+        struct ggml_tensor ** nodes = malloc(n_nodes * sizeof(struct ggml_tensor *));
+        GGML_ASSERT(nodes != NULL);
+        for (int i = 0; i < n_nodes; i++) {
+            nodes[i] = graph->nodes[order[i]];
+        }
+        memcpy(graph->nodes, nodes, n_nodes * sizeof(struct ggml_tensor *));
+        free(nodes);
+    }
+
+    ggml_hash_set_free(&st.map);
+    free(st.map_idx);
+    free(st.n_uses);
+    free(n_deps);
+    free(users_start);
+    free(users);
+    free(order);
+    free(order_orig);
+    free(ready);
+    free(done);
+
+    return changed;
+}
+
 // utils
 
 static void free_buffers(ggml_backend_buffer_t ** buffers, const size_t * n_buffers) {
@@ -209,6 +209,10 @@ extern "C" {
     // Internal backend registry API
     GGML_API void ggml_backend_register(ggml_backend_reg_t reg);
 
+    // Graph allocator where the buffer types used multiple times do not share their buffers
+    // used by the scheduler when the splits of different backends run at the same time
+    ggml_gallocr_t ggml_gallocr_new_n_unshared(ggml_backend_buffer_type_t * bufts, int n_bufs);
+
     // Add backend dynamic loading support to the backend
 
     // Initialize the backend
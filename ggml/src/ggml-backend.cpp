@@ -14,6 +14,7 @@
 #include "ggml-impl.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -22,6 +23,12 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #ifdef __APPLE__
 #include <sys/types.h>
@@ -628,6 +635,26 @@ struct ggml_backend_sched_split {
     int n_inputs;
     // graph view of this split
     struct ggml_cgraph graph;
+    // with parallel splits: index of the last split of each backend that must be computed before this one, -1 if none
+    int wait[GGML_SCHED_MAX_BACKENDS];
+};
+
+// parallel execution of the splits: each backend has a worker thread that computes its splits in order
+// a split waits for the splits of the other backends that it depends on, the splits are queued in the order of the graph
+struct ggml_backend_sched_workers {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::vector<std::thread> threads;
+
+    std::deque<int> queue[GGML_SCHED_MAX_BACKENDS];
+
+    int last_queued[GGML_SCHED_MAX_BACKENDS]; // index of the last split queued on each backend
+    int last_done  [GGML_SCHED_MAX_BACKENDS]; // index of the last split computed by each backend
+
+    enum ggml_status status = GGML_STATUS_SUCCESS;
+
+    bool stop = false;
 };
 
 struct ggml_backend_sched {
@@ -676,6 +703,14 @@ struct ggml_backend_sched {
 
     bool op_offload;
 
+    // run the independent splits of different backends at the same time
+    bool parallel_splits;
+    struct ggml_backend_sched_workers * workers;
+
+    // the backends are synchronized after each split while profiling
+    ggml_backend_profiler_t profiler;
+    ggml_backend_get_node_times_t profile_get_node_times[GGML_SCHED_MAX_BACKENDS];
+
     int debug;
 };
 
@@ -1034,8 +1069,9 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
                     }
                 }
             }
-        } else {
+        } else if (!sched->parallel_splits) {
             // assigned node: upgrade to higher prio backend if possible
+            // not with parallel splits, where the backends that share a buffer type can still compute at the same time
             for (int b = 0; b < *node_backend_id; b++) {
                 if (sched->bufts[b] == sched->bufts[*node_backend_id] && ggml_backend_supports_op(sched->backends[b], node)) {
                     bool supported = true;
@@ -1322,7 +1358,7 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
     bool backend_ids_changed = false;
     for (int i = 0; i < sched->graph.n_nodes; i++) {
         if (sched->node_backend_ids[i] != sched->prev_node_backend_ids[i] &&
-            sched->bufts[sched->node_backend_ids[i]] != sched->bufts[sched->prev_node_backend_ids[i]]) {
+            (sched->parallel_splits || sched->bufts[sched->node_backend_ids[i]] != sched->bufts[sched->prev_node_backend_ids[i]])) {
             backend_ids_changed = true;
             break;
         }
@@ -1330,7 +1366,7 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
     if (!backend_ids_changed) {
         for (int i = 0; i < sched->graph.n_leafs; i++) {
             if (sched->leaf_backend_ids[i] != sched->prev_leaf_backend_ids[i] &&
-                sched->bufts[sched->leaf_backend_ids[i]] != sched->bufts[sched->prev_leaf_backend_ids[i]]) {
+                (sched->parallel_splits || sched->bufts[sched->leaf_backend_ids[i]] != sched->bufts[sched->prev_leaf_backend_ids[i]])) {
                 backend_ids_changed = true;
                 break;
             }
@@ -1357,47 +1393,290 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
     return true;
 }
 
-static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t sched) {
-    struct ggml_backend_sched_split * splits = sched->splits;
+static void ggml_backend_sched_copy_inputs(ggml_backend_sched_t sched, struct ggml_backend_sched_split * split) {
+    int split_backend_id = split->backend_id;
+    ggml_backend_t split_backend = sched->backends[split_backend_id];
 
-    for (int i = 0; i < sched->n_splits; i++) {
-        struct ggml_backend_sched_split * split = &splits[i];
-        int split_backend_id = split->backend_id;
-        ggml_backend_t split_backend = sched->backends[split_backend_id];
-
-        // copy the input tensors to the split backend
-        for (int j = 0; j < split->n_inputs; j++) {
-            ggml_backend_t input_backend = ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
-            struct ggml_tensor * input = split->inputs[j];
-            struct ggml_tensor * input_cpy = tensor_copy(input, split_backend_id, sched->cur_copy);
+    // copy the input tensors to the split backend
+    for (int j = 0; j < split->n_inputs; j++) {
+        ggml_backend_t input_backend = ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
+        struct ggml_tensor * input = split->inputs[j];
+        struct ggml_tensor * input_cpy = tensor_copy(input, split_backend_id, sched->cur_copy);
 
-            if (input->flags & GGML_TENSOR_FLAG_INPUT) {
-                // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
+        if (input->flags & GGML_TENSOR_FLAG_INPUT) {
+            // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
+            if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
+                ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
+            } else {
+                ggml_backend_synchronize(split_backend);
+            }
+            ggml_backend_tensor_copy(input, input_cpy);
+        } else {
+            // wait for the split backend to finish using the input before overwriting it
+            if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
+                ggml_backend_event_wait(split_backend, sched->events[split_backend_id][sched->cur_copy]);
+            } else {
+                ggml_backend_synchronize(split_backend);
+            }
+            // try async copy, but if not possible, we can still use a sync copy without synchronizing the dst backend, since we handle the synchronization here with multiple copies and events
+            // TODO: add public function to facilitate this, since applications do not have direct access to the backend interface
+            if (!split_backend->iface.cpy_tensor_async || !split_backend->iface.cpy_tensor_async(input_backend, split_backend, input, input_cpy)) {
+                ggml_backend_synchronize(input_backend);
                 if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
                     ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
                 } else {
                     ggml_backend_synchronize(split_backend);
                 }
                 ggml_backend_tensor_copy(input, input_cpy);
-            } else {
-                // wait for the split backend to finish using the input before overwriting it
-                if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                    ggml_backend_event_wait(split_backend, sched->events[split_backend_id][sched->cur_copy]);
-                } else {
-                    ggml_backend_synchronize(split_backend);
+            }
+        }
+    }
+}
+
+// finds the splits of the other backends that each split must wait for when the splits run in parallel:
+//  - the splits that compute its sources (read after write)
+//  - the splits that read the compute buffer of its backend, whose memory may be reused by the split (write after read)
+//  - the splits that read or write the same tensors outside of the compute buffers, e.g. the KV cache
+static void ggml_backend_sched_split_deps(ggml_backend_sched_t sched) {
+    // split that computes each node
+    std::unordered_map<const ggml_tensor *, int> producer;
+
+    // accesses to the bytes [begin, end) of the tensors outside of the compute buffers
+    struct ext_access {
+        size_t begin;
+        size_t end;
+        int    split;
+        bool   write;
+    };
+    std::unordered_map<const ggml_tensor *, std::vector<ext_access>> ext;
+
+    // [owner][reader] last split of the reader backend that read the compute buffer of the owner backend
+    int cross_read[GGML_SCHED_MAX_BACKENDS][GGML_SCHED_MAX_BACKENDS];
+    int last_split[GGML_SCHED_MAX_BACKENDS];
+
+    std::fill(&cross_read[0][0], &cross_read[0][0] + GGML_SCHED_MAX_BACKENDS*GGML_SCHED_MAX_BACKENDS, -1);
+    std::fill(last_split, last_split + GGML_SCHED_MAX_BACKENDS, -1);
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        const int b = split->backend_id;
+
+        std::fill(split->wait, split->wait + GGML_SCHED_MAX_BACKENDS, -1);
+
+        auto add_dep = [&](int s) {
+            if (s >= 0 && sched->splits[s].backend_id != b) {
+                split->wait[sched->splits[s].backend_id] = std::max(split->wait[sched->splits[s].backend_id], s);
+            }
+        };
+
+        // the inputs are copied before the next splits are queued, so only the splits that write them matter
+        auto access = [&](ggml_tensor * t, bool write, bool copied) {
+            ggml_tensor * root = t->view_src ? t->view_src : t;
+
+            for (const ggml_tensor * x : { (const ggml_tensor *) t, (const ggml_tensor *) root }) {
+                auto it = producer.find(x);
+                if (it != producer.end()) {
+                    add_dep(it->second);
                 }
-                // try async copy, but if not possible, we can still use a sync copy without synchronizing the dst backend, since we handle the synchronization here with multiple copies and events
-                // TODO: add public function to facilitate this, since applications do not have direct access to the backend interface
-                if (!split_backend->iface.cpy_tensor_async || !split_backend->iface.cpy_tensor_async(input_backend, split_backend, input, input_cpy)) {
-                    ggml_backend_synchronize(input_backend);
-                    if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
-                        ggml_backend_event_synchronize(sched->events[split_backend_id][sched->cur_copy]);
-                    } else {
-                        ggml_backend_synchronize(split_backend);
+            }
+
+            if (root->buffer == NULL || ggml_backend_buffer_get_usage(root->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS) {
+                return;
+            }
+
+            if (ggml_backend_buffer_get_usage(root->buffer) == GGML_BACKEND_BUFFER_USAGE_COMPUTE) {
+                const int owner = ggml_hash_contains(&sched->hash_set, root) ? tensor_backend_id(root) : -1;
+                if (owner >= 0 && owner != b && !copied) {
+                    cross_read[owner][b] = i;
+                    if (write) {
+                        for (int c = 0; c < sched->n_backends; c++) {
+                            add_dep(last_split[c]);
+                        }
                     }
-                    ggml_backend_tensor_copy(input, input_cpy);
                 }
+                return;
             }
+
+            // only the accesses to overlapping bytes conflict, e.g. writing the new cells of the KV cache while reading the old ones
+            const size_t begin = t->view_src ? t->view_offs : 0;
+            const size_t end   = begin + ggml_nbytes(t);
+
+            std::vector<ext_access> & accesses = ext[root];
+            for (const ext_access & a : accesses) {
+                if ((a.write || write) && a.begin < end && begin < a.end) {
+                    add_dep(a.split);
+                }
+            }
+            if (copied) {
+                return;
+            }
+            if (accesses.empty() || accesses.back().split != i || accesses.back().begin != begin || accesses.back().end != end || accesses.back().write != write) {
+                accesses.push_back({ begin, end, i, write });
+            }
+        };
+
+        for (int c = 0; c < sched->n_backends; c++) {
+            add_dep(cross_read[b][c]);
+        }
+
+        for (int j = 0; j < split->n_inputs; j++) {
+            access(split->inputs[j], false, true);
+        }
+
+        for (int j = 0; j < split->graph.n_nodes; j++) {
+            ggml_tensor * node = split->graph.nodes[j];
+            // the views do not access the memory of their source, their users do
+            for (int k = 0; k < GGML_MAX_SRC && !ggml_is_view_op(node->op); k++) {
+                if (node->src[k] != NULL) {
+                    access(node->src[k], false, false);
+                }
+            }
+            // the node writes into the memory of another tensor
+            if (node->view_src != NULL && !ggml_is_view_op(node->op)) {
+                access(node, true, false);
+            }
+            producer[node] = i;
+        }
+
+        last_split[b] = i;
+    }
+}
+
+static void ggml_backend_sched_profile_copy (ggml_backend_sched_t sched, int split_id, int64_t t_start, int64_t t_end);
+static void ggml_backend_sched_profile_split(ggml_backend_sched_t sched, int split_id, int64_t t_start, int64_t t_end);
+static void ggml_backend_sched_profile_graph_begin(ggml_backend_sched_t sched);
+static void ggml_backend_sched_profile_graph_end  (ggml_backend_sched_t sched, int64_t t_start, int64_t t_end);
+
+static bool ggml_backend_sched_split_ready(const ggml_backend_sched_workers * w, const ggml_backend_sched_split * split, int n_backends) {
+    for (int c = 0; c < n_backends; c++) {
+        if (split->wait[c] > w->last_done[c]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ggml_backend_sched_worker(ggml_backend_sched_t sched, int backend_id) {
+    ggml_backend_sched_workers * w = sched->workers;
+    ggml_backend_t backend = sched->backends[backend_id];
+
+    std::unique_lock<std::mutex> lock(w->mutex);
+    while (true) {
+        w->cv.wait(lock, [&] {
+            return w->stop ||
+                (!w->queue[backend_id].empty() && ggml_backend_sched_split_ready(w, &sched->splits[w->queue[backend_id].front()], sched->n_backends));
+        });
+        if (w->stop) {
+            return;
+        }
+
+        const int i = w->queue[backend_id].front();
+        w->queue[backend_id].pop_front();
+
+        // after an error the remaining splits are only marked as done
+        const bool skip = w->status != GGML_STATUS_SUCCESS;
+
+        lock.unlock();
+
+        enum ggml_status ec = GGML_STATUS_SUCCESS;
+        if (!skip) {
+            const int64_t t_start = sched->profiler ? ggml_time_ns() : 0;
+            ec = ggml_backend_graph_compute_async(backend, &sched->splits[i].graph);
+            ggml_backend_synchronize(backend);
+            if (sched->profiler && ec == GGML_STATUS_SUCCESS) {
+                ggml_backend_sched_profile_split(sched, i, t_start, ggml_time_ns());
+            }
+        }
+
+        lock.lock();
+
+        if (ec != GGML_STATUS_SUCCESS && w->status == GGML_STATUS_SUCCESS) {
+            w->status = ec;
+        }
+        w->last_done[backend_id] = i;
+        w->cv.notify_all();
+    }
+}
+
+static enum ggml_status ggml_backend_sched_compute_splits_parallel(ggml_backend_sched_t sched) {
+    if (sched->workers == NULL) {
+        sched->workers = new ggml_backend_sched_workers;
+        std::fill(sched->workers->last_queued, sched->workers->last_queued + GGML_SCHED_MAX_BACKENDS, -1);
+        std::fill(sched->workers->last_done,   sched->workers->last_done   + GGML_SCHED_MAX_BACKENDS, -1);
+        for (int b = 0; b < sched->n_backends; b++) {
+            sched->workers->threads.emplace_back(ggml_backend_sched_worker, sched, b);
+        }
+    }
+
+    ggml_backend_sched_workers * w = sched->workers;
+
+    {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        std::fill(w->last_queued, w->last_queued + GGML_SCHED_MAX_BACKENDS, -1);
+        std::fill(w->last_done,   w->last_done   + GGML_SCHED_MAX_BACKENDS, -1);
+        w->status = GGML_STATUS_SUCCESS;
+    }
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        const int b = split->backend_id;
+
+        if (split->n_inputs > 0) {
+            // the inputs are copied when their sources are computed and the split backend is idle
+            std::unique_lock<std::mutex> lock(w->mutex);
+            w->cv.wait(lock, [&] {
+                return ggml_backend_sched_split_ready(w, split, sched->n_backends) && w->last_done[b] == w->last_queued[b];
+            });
+            lock.unlock();
+
+            const int64_t t_start = sched->profiler ? ggml_time_ns() : 0;
+            ggml_backend_sched_copy_inputs(sched, split);
+            if (sched->profiler) {
+                ggml_backend_synchronize(sched->backends[b]);
+                ggml_backend_sched_profile_copy(sched, i, t_start, ggml_time_ns());
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(w->mutex);
+        w->queue[b].push_back(i);
+        w->last_queued[b] = i;
+        w->cv.notify_all();
+    }
+
+    std::unique_lock<std::mutex> lock(w->mutex);
+    w->cv.wait(lock, [&] {
+        for (int b = 0; b < sched->n_backends; b++) {
+            if (w->last_done[b] != w->last_queued[b]) {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    return w->status;
+}
+
+static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t sched) {
+    if (sched->parallel_splits && sched->n_copies == 1 && !sched->callback_eval && sched->n_splits > 1) {
+        return ggml_backend_sched_compute_splits_parallel(sched);
+    }
+
+    struct ggml_backend_sched_split * splits = sched->splits;
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &splits[i];
+        int split_backend_id = split->backend_id;
+        ggml_backend_t split_backend = sched->backends[split_backend_id];
+
+        int64_t t_start = sched->profiler ? ggml_time_ns() : 0;
+
+        ggml_backend_sched_copy_inputs(sched, split);
+
+        if (sched->profiler && split->n_inputs > 0) {
+            ggml_backend_synchronize(split_backend);
+            const int64_t t_end = ggml_time_ns();
+            ggml_backend_sched_profile_copy(sched, i, t_start, t_end);
+            t_start = t_end;
         }
 
         if (!sched->callback_eval) {
@@ -1405,6 +1684,10 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
             if (ec != GGML_STATUS_SUCCESS) {
                 return ec;
             }
+            if (sched->profiler) {
+                ggml_backend_synchronize(split_backend);
+                ggml_backend_sched_profile_split(sched, i, t_start, ggml_time_ns());
+            }
         } else {
             // similar to ggml_backend_compare_graph_backend
             for (int j0 = 0; j0 < split->graph.n_nodes; j0++) {
@@ -1519,6 +1802,17 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
             ggml_backend_event_free(sched->events[b][c]);
         }
     }
+    if (sched->workers != NULL) {
+        {
+            std::lock_guard<std::mutex> lock(sched->workers->mutex);
+            sched->workers->stop = true;
+            sched->workers->cv.notify_all();
+        }
+        for (auto & thread : sched->workers->threads) {
+            thread.join();
+        }
+        delete sched->workers;
+    }
     ggml_gallocr_free(sched->galloc);
     ggml_free(sched->ctx);
     ggml_hash_set_free(&sched->hash_set);
@@ -1571,6 +1865,10 @@ bool ggml_backend_sched_alloc_graph(ggml_backend_sched_t sched, struct ggml_cgra
         return false;
     }
 
+    if (sched->parallel_splits) {
+        ggml_backend_sched_split_deps(sched);
+    }
+
     sched->is_alloc = true;
 
     return true;
@@ -1593,7 +1891,19 @@ enum ggml_status ggml_backend_sched_graph_compute_async(ggml_backend_sched_t sch
         }
     }
 
-    return ggml_backend_sched_compute_splits(sched);
+    if (sched->profiler == NULL) {
+        return ggml_backend_sched_compute_splits(sched);
+    }
+
+    const int64_t t_start = ggml_time_ns();
+    ggml_backend_sched_profile_graph_begin(sched);
+
+    enum ggml_status ec = ggml_backend_sched_compute_splits(sched);
+    ggml_backend_sched_synchronize(sched);
+
+    ggml_backend_sched_profile_graph_end(sched, t_start, ggml_time_ns());
+
+    return ec;
 }
 
 void ggml_backend_sched_synchronize(ggml_backend_sched_t sched) {
@@ -1608,6 +1918,21 @@ void ggml_backend_sched_synchronize(ggml_backend_sched_t sched) {
     }
 }
 
+void ggml_backend_sched_set_parallel_splits(ggml_backend_sched_t sched, bool enable) {
+    if (sched->parallel_splits == enable) {
+        return;
+    }
+
+    ggml_backend_sched_synchronize(sched);
+
+    // the backends that compute at the same time cannot share the memory of their compute buffers
+    ggml_gallocr_free(sched->galloc);
+    sched->galloc = enable ? ggml_gallocr_new_n_unshared(sched->bufts, sched->n_backends) : ggml_gallocr_new_n(sched->bufts, sched->n_backends);
+    sched->parallel_splits = enable;
+
+    ggml_backend_sched_reset(sched);
+}
+
 void ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backend_sched_eval_callback callback, void * user_data) {
     sched->callback_eval = callback;
     sched->callback_eval_user_data = user_data;
@@ -1637,6 +1962,10 @@ size_t ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backe
     return ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
 }
 
+bool ggml_backend_sched_dump_alloc_plan(ggml_backend_sched_t sched, const char * fname) {
+    return ggml_gallocr_dump_plan(sched->galloc, fname);
+}
+
 void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend) {
     int backend_index = ggml_backend_sched_backend_id(sched, backend);
     GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
@@ -1653,6 +1982,407 @@ ggml_backend_t ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched,
     return sched->backends[backend_index];
 }
 
+// profiler
+
+struct ggml_backend_profile_event {
+    char    name[GGML_MAX_NAME];
+    char    cat[32];     // the op, the ops of a fused kernel, "split" or "copy"
+    int     backend;
+    int     thread;      // 0 for the splits and the input copies, ith + 1 for the threads that compute the nodes
+    int     graph;
+    int     split;
+    int64_t t_start;     // ns
+    int64_t t_end;
+    int64_t flops;
+    int64_t bytes;
+};
+
+struct ggml_backend_profile_op_stats {
+    int64_t count   = 0;
+    int64_t time_ns = 0; // from the first thread that starts the node to the last one that ends it
+    int64_t flops   = 0;
+    int64_t bytes   = 0;
+
+    // imbalance between the threads: the busy time of the slowest thread and the average busy time
+    double  busy_max_ns  = 0.0;
+    double  busy_mean_ns = 0.0;
+};
+
+struct ggml_backend_profile_thread_stats {
+    int64_t busy_ns = 0;
+    int64_t wait_ns = 0; // time waiting for the slowest thread of each node
+};
+
+struct ggml_backend_profile_backend_stats {
+    int64_t n_splits   = 0;
+    int64_t compute_ns = 0;
+    int64_t copy_ns    = 0;
+};
+
+struct ggml_backend_profiler {
+    std::mutex mutex;
+
+    size_t  max_events;
+    int64_t t_start;
+
+    int     n_graphs = 0;
+    int64_t graph_ns = 0;
+
+    std::vector<ggml_backend_profile_event> events;
+
+    std::vector<std::string> backend_names;
+    std::vector<ggml_backend_profile_backend_stats> backends;
+
+    std::map<std::string, ggml_backend_profile_op_stats> ops;
+    std::map<std::pair<int, int>, ggml_backend_profile_thread_stats> threads;
+};
+
+// rough estimate of the floating point operations of a node
+static int64_t ggml_backend_profile_flops(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            return 2*node->src[0]->ne[0]*ggml_nelements(node);
+        case GGML_OP_OUT_PROD:
+            return 2*node->src[0]->ne[1]*ggml_nelements(node);
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const struct ggml_tensor * q = node->src[0];
+                const struct ggml_tensor * k = node->src[1];
+                const struct ggml_tensor * v = node->src[2];
+                return 2*q->ne[1]*q->ne[2]*q->ne[3]*k->ne[1]*(q->ne[0] + v->ne[0]);
+            }
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SET_ROWS:
+        case GGML_OP_CONCAT:
+            return 0;
+        default:
+            // element-wise ops and reductions: about one operation per element
+            return ggml_nelements(node);
+    }
+}
+
+// rough estimate of the bytes read and written by a node
+static int64_t ggml_backend_profile_bytes(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_GET_ROWS:
+            // only the rows that are gathered are read
+            return 2*ggml_nbytes(node) + ggml_nbytes(node->src[1]);
+        case GGML_OP_SET_ROWS:
+            // only the rows that are scattered are written
+            return 2*ggml_nbytes(node->src[0]) + ggml_nbytes(node->src[1]);
+        case GGML_OP_MUL_MAT_ID:
+            {
+                // only the experts that are used are read
+                const struct ggml_tensor * as  = node->src[0];
+                const struct ggml_tensor * ids = node->src[2];
+                const int64_t n_used = std::min(as->ne[2], ids->ne[0]*ids->ne[1]);
+                return ggml_nbytes(as)/as->ne[2]*n_used + ggml_nbytes(node->src[1]) + ggml_nbytes(ids) + ggml_nbytes(node);
+            }
+        default:
+            {
+                int64_t bytes = ggml_nbytes(node);
+                for (int i = 0; i < GGML_MAX_SRC; i++) {
+                    if (node->src[i] != NULL) {
+                        bytes += ggml_nbytes(node->src[i]);
+                    }
+                }
+                return bytes;
+            }
+    }
+}
+
+static void ggml_backend_profile_add_event(ggml_backend_profiler_t p, const char * name, const char * cat, int backend, int thread, int split, int64_t t_start, int64_t t_end, int64_t flops, int64_t bytes) {
+    if (p->events.size() >= p->max_events) {
+        return;
+    }
+
+    ggml_backend_profile_event ev;
+    snprintf(ev.name, sizeof(ev.name), "%s", name);
+    snprintf(ev.cat,  sizeof(ev.cat),  "%s", cat);
+    ev.backend = backend;
+    ev.thread  = thread;
+    ev.graph   = p->n_graphs - 1;
+    ev.split   = split;
+    ev.t_start = t_start;
+    ev.t_end   = t_end;
+    ev.flops   = flops;
+    ev.bytes   = bytes;
+
+    p->events.push_back(ev);
+}
+
+static void ggml_backend_sched_profile_graph_begin(ggml_backend_sched_t sched) {
+    std::lock_guard<std::mutex> lock(sched->profiler->mutex);
+    sched->profiler->n_graphs++;
+}
+
+static void ggml_backend_sched_profile_graph_end(ggml_backend_sched_t sched, int64_t t_start, int64_t t_end) {
+    ggml_backend_profiler_t p = sched->profiler;
+
+    std::lock_guard<std::mutex> lock(p->mutex);
+    p->graph_ns += t_end - t_start;
+    ggml_backend_profile_add_event(p, "graph", "graph", 0, 0, -1, t_start, t_end, 0, 0);
+}
+
+static void ggml_backend_sched_profile_copy(ggml_backend_sched_t sched, int split_id, int64_t t_start, int64_t t_end) {
+    ggml_backend_profiler_t p = sched->profiler;
+    const int backend_id = sched->splits[split_id].backend_id;
+
+    std::lock_guard<std::mutex> lock(p->mutex);
+
+    p->backends[backend_id].copy_ns += t_end - t_start;
+    ggml_backend_profile_add_event(p, "copy inputs", "copy", backend_id, 0, split_id, t_start, t_end, 0, 0);
+}
+
+// records the time of a split computed by its backend, and the time of its nodes if the backend records them
+static void ggml_backend_sched_profile_split(ggml_backend_sched_t sched, int split_id, int64_t t_start, int64_t t_end) {
+    ggml_backend_profiler_t p = sched->profiler;
+    struct ggml_backend_sched_split * split = &sched->splits[split_id];
+    const int backend_id = split->backend_id;
+
+    int n_threads = 0;
+    int n_nodes   = 0;
+    const int64_t * times = NULL;
+    if (sched->profile_get_node_times[backend_id] != NULL) {
+        times = sched->profile_get_node_times[backend_id](sched->backends[backend_id], &n_threads, &n_nodes);
+    }
+
+    std::lock_guard<std::mutex> lock(p->mutex);
+
+    p->backends[backend_id].n_splits++;
+    p->backends[backend_id].compute_ns += t_end - t_start;
+
+    char name[32];
+    snprintf(name, sizeof(name), "split %d", split_id);
+    ggml_backend_profile_add_event(p, name, "split", backend_id, 0, split_id, t_start, t_end, 0, 0);
+
+    if (times == NULL || n_nodes != split->graph.n_nodes) {
+        return;
+    }
+
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = split->graph.nodes[i];
+        if (ggml_is_view_op(node->op) || node->op == GGML_OP_NONE || times[i*2] < 0) {
+            continue;
+        }
+
+        // the nodes computed by the same fused kernel are recorded together
+        std::string cat = ggml_op_desc(node);
+        int64_t flops = ggml_backend_profile_flops(node);
+        int64_t bytes = ggml_backend_profile_bytes(node);
+        for (int j = i + 1; j < n_nodes && times[j*2] == -1; j++) {
+            cat   += std::string("+") + ggml_op_desc(split->graph.nodes[j]);
+            flops += ggml_backend_profile_flops(split->graph.nodes[j]);
+            bytes += ggml_backend_profile_bytes(split->graph.nodes[j]);
+        }
+
+        int64_t node_start = INT64_MAX;
+        int64_t node_end   = 0;
+        int64_t busy_max   = 0;
+        int64_t busy_sum   = 0;
+        int     n_active   = 0;
+        for (int ith = 0; ith < n_threads; ith++) {
+            const int64_t * t = times + ((size_t) ith*n_nodes + i)*2;
+            if (t[0] <= 0) {
+                continue;
+            }
+            node_start = std::min(node_start, t[0]);
+            node_end   = std::max(node_end,   t[1]);
+            busy_max   = std::max(busy_max,   t[1] - t[0]);
+            busy_sum  += t[1] - t[0];
+            n_active++;
+        }
+        if (n_active == 0) {
+            continue;
+        }
+
+        for (int ith = 0; ith < n_threads; ith++) {
+            const int64_t * t = times + ((size_t) ith*n_nodes + i)*2;
+            if (t[0] <= 0) {
+                continue;
+            }
+            ggml_backend_profile_thread_stats & ts = p->threads[{ backend_id, ith }];
+            ts.busy_ns += t[1] - t[0];
+            ts.wait_ns += node_end - t[1];
+
+            ggml_backend_profile_add_event(p, node->name, cat.c_str(), backend_id, ith + 1, split_id, t[0], t[1], ith == 0 ? flops : 0, ith == 0 ? bytes : 0);
+        }
+
+        ggml_backend_profile_op_stats & os = p->ops[cat];
+        os.count++;
+        os.time_ns      += node_end - node_start;
+        os.flops        += flops;
+        os.bytes        += bytes;
+        os.busy_max_ns  += busy_max;
+        os.busy_mean_ns += (double) busy_sum/n_active;
+    }
+}
+
+ggml_backend_profiler_t ggml_backend_profiler_new(size_t max_events) {
+    ggml_backend_profiler_t p = new ggml_backend_profiler;
+    p->max_events = max_events;
+    p->t_start    = ggml_time_ns();
+    return p;
+}
+
+void ggml_backend_profiler_free(ggml_backend_profiler_t profiler) {
+    delete profiler;
+}
+
+void ggml_backend_profiler_reset(ggml_backend_profiler_t profiler) {
+    std::lock_guard<std::mutex> lock(profiler->mutex);
+
+    profiler->t_start  = ggml_time_ns();
+    profiler->n_graphs = 0;
+    profiler->graph_ns = 0;
+    profiler->events.clear();
+    profiler->ops.clear();
+    profiler->threads.clear();
+    std::fill(profiler->backends.begin(), profiler->backends.end(), ggml_backend_profile_backend_stats());
+}
+
+static void ggml_backend_profile_write_str(FILE * f, const char * s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool ggml_backend_profiler_write_trace(ggml_backend_profiler_t profiler, const char * fname) {
+    FILE * f = ggml_fopen(fname, "w");
+    if (f == NULL) {
+        GGML_LOG_ERROR("%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(profiler->mutex);
+
+    // one process per backend, with a thread for the splits and one for each thread of the backend
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (size_t b = 0; b < profiler->backend_names.size(); b++) {
+        fprintf(f, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %zu, \"args\": {\"name\": ", b);
+        ggml_backend_profile_write_str(f, (profiler->backend_names[b] + " #" + std::to_string(b)).c_str());
+        fprintf(f, "}},\n");
+        fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %zu, \"tid\": 0, \"args\": {\"name\": \"splits\"}},\n", b);
+    }
+    for (const auto & it : profiler->threads) {
+        fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}},\n",
+                it.first.first, it.first.second + 1, it.first.second);
+    }
+
+    for (size_t i = 0; i < profiler->events.size(); i++) {
+        const ggml_backend_profile_event & ev = profiler->events[i];
+        fprintf(f, "  {\"name\": ");
+        ggml_backend_profile_write_str(f, ev.name);
+        fprintf(f, ", \"cat\": ");
+        ggml_backend_profile_write_str(f, ev.cat);
+        fprintf(f, ", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"graph\": %d, \"split\": %d",
+                ev.backend, ev.thread, (ev.t_start - profiler->t_start)/1e3, (ev.t_end - ev.t_start)/1e3, ev.graph, ev.split);
+        if (ev.flops > 0 || ev.bytes > 0) {
+            fprintf(f, ", \"flops\": %" PRId64 ", \"bytes\": %" PRId64, ev.flops, ev.bytes);
+        }
+        fprintf(f, "}}%s\n", i + 1 < profiler->events.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+
+    if (profiler->events.size() >= profiler->max_events) {
+        GGML_LOG_WARN("%s: the trace only contains the first %zu events\n", __func__, profiler->max_events);
+    }
+
+    return ok;
+}
+
+void ggml_backend_profiler_print_summary(ggml_backend_profiler_t profiler, FILE * f) {
+    std::lock_guard<std::mutex> lock(profiler->mutex);
+
+    fprintf(f, "\nprofile: %d graphs, %.3f ms, %.3f ms per graph\n\n", profiler->n_graphs, profiler->graph_ns/1e6, profiler->n_graphs > 0 ? profiler->graph_ns/1e6/profiler->n_graphs : 0.0);
+
+    fprintf(f, "| %-16s | %8s | %12s | %12s |\n", "backend", "splits", "compute ms", "copy ms");
+    fprintf(f, "| %.16s | %.8s:| %.12s:| %.12s:|\n", "------------------", "----------", "--------------", "--------------");
+    for (size_t b = 0; b < profiler->backends.size(); b++) {
+        const ggml_backend_profile_backend_stats & bs = profiler->backends[b];
+        fprintf(f, "| %-16s | %8" PRId64 " | %12.3f | %12.3f |\n",
+                (profiler->backend_names[b] + " #" + std::to_string(b)).c_str(), bs.n_splits, bs.compute_ns/1e6, bs.copy_ns/1e6);
+    }
+
+    if (profiler->ops.empty()) {
+        return;
+    }
+
+    std::vector<std::pair<std::string, ggml_backend_profile_op_stats>> ops(profiler->ops.begin(), profiler->ops.end());
+    std::sort(ops.begin(), ops.end(), [](const auto & a, const auto & b) { return a.second.time_ns > b.second.time_ns; });
+
+    int64_t total_ns = 0;
+    for (const auto & op : ops) {
+        total_ns += op.second.time_ns;
+    }
+
+    // imbalance: time lost by the threads that wait for the slowest one, relative to the time of the slowest one
+    fprintf(f, "\n| %-24s | %8s | %10s | %6s | %9s | %10s | %9s | %10s | %8s | %9s |\n",
+            "op", "count", "time ms", "time %", "avg us", "GFLOP", "GFLOP/s", "GB", "GB/s", "imbalance");
+    fprintf(f, "| %.24s | %.8s:| %.10s:| %.6s:| %.9s:| %.10s:| %.9s:| %.10s:| %.8s:| %.9s:|\n",
+            "--------------------------", "----------", "------------", "--------", "-----------", "------------", "-----------", "------------", "----------", "-----------");
+    for (const auto & op : ops) {
+        const ggml_backend_profile_op_stats & os = op.second;
+        const double t_s = os.time_ns/1e9;
+        fprintf(f, "| %-24s | %8" PRId64 " | %10.3f | %5.1f%% | %9.2f | %10.3f | %9.2f | %10.3f | %8.2f | %8.1f%% |\n",
+                op.first.c_str(), os.count, os.time_ns/1e6, 100.0*os.time_ns/std::max<int64_t>(total_ns, 1), os.time_ns/1e3/os.count,
+                os.flops/1e9, t_s > 0 ? os.flops/1e9/t_s : 0.0, os.bytes/1e9, t_s > 0 ? os.bytes/1e9/t_s : 0.0,
+                os.busy_max_ns > 0 ? 100.0*(1.0 - os.busy_mean_ns/os.busy_max_ns) : 0.0);
+    }
+
+    fprintf(f, "\n| %-16s | %6s | %10s | %10s | %6s |\n", "backend", "thread", "busy ms", "wait ms", "wait %");
+    fprintf(f, "| %.16s | %.6s:| %.10s:| %.10s:| %.6s:|\n", "------------------", "--------", "------------", "------------", "--------");
+    for (const auto & it : profiler->threads) {
+        const ggml_backend_profile_thread_stats & ts = it.second;
+        fprintf(f, "| %-16s | %6d | %10.3f | %10.3f | %5.1f%% |\n",
+                (profiler->backend_names[it.first.first] + " #" + std::to_string(it.first.first)).c_str(), it.first.second,
+                ts.busy_ns/1e6, ts.wait_ns/1e6, 100.0*ts.wait_ns/std::max<int64_t>(ts.busy_ns + ts.wait_ns, 1));
+    }
+}
+
+void ggml_backend_sched_set_profiler(ggml_backend_sched_t sched, ggml_backend_profiler_t profiler) {
+    ggml_backend_sched_synchronize(sched);
+
+    sched->profiler = profiler;
+
+    for (int b = 0; b < sched->n_backends; b++) {
+        ggml_backend_t backend = sched->backends[b];
+        ggml_backend_dev_t dev = ggml_backend_get_device(backend);
+        ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : NULL;
+
+        auto * set_profiling = reg ? (ggml_backend_set_profiling_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_profiling") : NULL;
+        if (set_profiling) {
+            set_profiling(backend, profiler != NULL);
+        }
+        sched->profile_get_node_times[b] = profiler && set_profiling ?
+            (ggml_backend_get_node_times_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_node_times") : NULL;
+    }
+
+    if (profiler != NULL) {
+        std::lock_guard<std::mutex> lock(profiler->mutex);
+        profiler->backend_names.resize(std::max<size_t>(profiler->backend_names.size(), sched->n_backends));
+        profiler->backends.resize(profiler->backend_names.size());
+        for (int b = 0; b < sched->n_backends; b++) {
+            profiler->backend_names[b] = ggml_backend_name(sched->backends[b]);
+        }
+    }
+}
+
 // utils
 
 enum ggml_status ggml_backend_view_init(struct ggml_tensor * tensor) {
@@ -1800,6 +2530,7 @@ struct ggml_backend_graph_copy ggml_backend_graph_copy(ggml_backend_t backend, s
     }
 
     // build graph copy
+    // the nodes are not added to the hash set of the copy, without their use counts the backends do not fuse its ops
     struct ggml_cgraph * graph_copy = ggml_new_graph_custom(ctx_allocated, graph->size, false);
     for (int i = 0; i < graph->n_nodes; i++) {
         struct ggml_tensor * node = graph->nodes[i];
@@ -1826,7 +2557,7 @@ void ggml_backend_graph_copy_free(struct ggml_backend_graph_copy copy) {
     ggml_free(copy.ctx_unallocated);
 }
 
-bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data) {
+bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data, struct ggml_tensor * test_node) {
     struct ggml_backend_graph_copy copy = ggml_backend_graph_copy(backend2, graph);
     if (copy.buffer == NULL) {
         return false;
@@ -1837,6 +2568,26 @@ bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t
 
     assert(g1->n_nodes == g2->n_nodes);
 
+    if (test_node != NULL) {
+        int i_test = -1;
+        for (int i = 0; i < g1->n_nodes; i++) {
+            if (g1->nodes[i] == test_node) {
+                i_test = i;
+                break;
+            }
+        }
+        GGML_ASSERT(i_test >= 0);
+
+        ggml_backend_graph_compute(backend1, g1);
+        ggml_backend_graph_compute(backend2, g2);
+
+        callback(i_test, g1->nodes[i_test], g2->nodes[i_test], user_data);
+
+        ggml_backend_graph_copy_free(copy);
+
+        return true;
+    }
+
     for (int i = 0; i < g1->n_nodes; i++) {
         struct ggml_tensor * t1 = g1->nodes[i];
         struct ggml_tensor * t2 = g2->nodes[i];
@@ -503,6 +503,18 @@ static __m256 __lasx_xvreplfr2vr_s(const float val) {
 // TODO: move to ggml-threading
 void ggml_barrier(struct ggml_threadpool * tp);
 
+// work-stealing distribution of the chunks of an op between the threads
+//   every thread starts with an equal contiguous range of the chunks and, once it is exhausted, steals half of
+//   the remaining chunks of another thread, so that a slow thread does not hold back the others at the barrier
+//   all threads must call ggml_chunks_init() with the same number of chunks, then ggml_chunks_next() until it returns false
+#define GGML_CHUNKS_MAX 4095
+
+void ggml_chunks_init(const struct ggml_compute_params * params, int n_chunks);
+bool ggml_chunks_next(const struct ggml_compute_params * params, int * chunk);
+
+// splits nr rows into chunks, returns the number of rows per chunk
+int64_t ggml_chunks_init_rows(const struct ggml_compute_params * params, int64_t nr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -131,6 +131,14 @@ static LONG atomic_fetch_add_explicit(atomic_int * ptr, LONG inc, memory_order m
     // TODO: add support for explicit memory order
     return InterlockedExchangeAdd(ptr, inc);
 }
+static bool atomic_compare_exchange_strong(atomic_int * ptr, int * expected, int desired) {
+    const LONG prev = InterlockedCompareExchange(ptr, desired, *expected);
+    if (prev == *expected) {
+        return true;
+    }
+    *expected = prev;
+    return false;
+}
 static atomic_bool atomic_flag_test_and_set(atomic_flag * ptr) {
     return InterlockedExchange(ptr, 1);
 }
@@ -432,6 +440,37 @@ typedef pthread_mutex_t    ggml_mutex_t;
 
 #endif
 
+#define GGML_NUMA_MAX_NODES 8
+#define GGML_NUMA_MAX_CPUS 512
+
+struct ggml_numa_node {
+    uint32_t cpus[GGML_NUMA_MAX_CPUS]; // hardware threads on this node
+    uint32_t n_cpus;
+};
+
+struct ggml_numa_nodes {
+    enum ggml_numa_strategy numa_strategy;
+    struct ggml_numa_node nodes[GGML_NUMA_MAX_NODES];
+    uint32_t n_nodes;
+    uint32_t total_cpus; // hardware threads on system
+    uint32_t current_node; // node on which main process is execting
+    uint32_t n_mirror_nodes; // number of copies of the mirrored buffers
+#if defined(__gnu_linux__)
+    cpu_set_t cpuset; // cpuset from numactl
+#else
+    uint32_t cpuset; // no NUMA support outside of Linux at this time. Use a portable datatype
+#endif
+};
+
+// a read-only buffer (e.g. the model weights) with a copy on every NUMA node, see ggml_numa_mirror()
+#define GGML_NUMA_MAX_MIRRORS 64
+
+struct ggml_numa_mirror {
+    const char * data;
+    size_t       size;
+    char       * copies[GGML_NUMA_MAX_NODES];
+};
+
 // Threadpool def
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
@@ -444,7 +483,6 @@ struct ggml_threadpool {
     atomic_int n_graph;       // incremented when there is work to be done (i.e each graph)
     atomic_int GGML_CACHE_ALIGN n_barrier;
     atomic_int GGML_CACHE_ALIGN n_barrier_passed;
-    atomic_int GGML_CACHE_ALIGN current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
 
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
@@ -459,6 +497,11 @@ struct ggml_threadpool {
     uint32_t     poll;        // Polling level (0 - no polling)
 
     enum ggml_status ec;
+
+    // copy of the list of NUMA mirrors taken at the start of the graph, so that the threads never read the global list
+    // while another thread adds or removes a mirror
+    struct ggml_numa_mirror mirrors[GGML_NUMA_MAX_MIRRORS];
+    int n_mirrors;
 };
 
 // Per-thread state
@@ -471,6 +514,11 @@ struct ggml_compute_state {
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
+
+    // range of chunks of the current op that is left to this thread, see ggml_chunks_next()
+    atomic_int GGML_CACHE_ALIGN chunks;
+    int chunks_gen; // incremented by every op that uses chunks, identifies the op that the range belongs to
+    int n_chunks;
 };
 
 // Helpers for polling loops
@@ -490,37 +538,33 @@ static inline void ggml_thread_cpu_relax(void) {;}
 // NUMA support
 //
 
-#define GGML_NUMA_MAX_NODES 8
-#define GGML_NUMA_MAX_CPUS 512
-
-struct ggml_numa_node {
-    uint32_t cpus[GGML_NUMA_MAX_CPUS]; // hardware threads on this node
-    uint32_t n_cpus;
-};
-
-struct ggml_numa_nodes {
-    enum ggml_numa_strategy numa_strategy;
-    struct ggml_numa_node nodes[GGML_NUMA_MAX_NODES];
-    uint32_t n_nodes;
-    uint32_t total_cpus; // hardware threads on system
-    uint32_t current_node; // node on which main process is execting
-#if defined(__gnu_linux__)
-    cpu_set_t cpuset; // cpuset from numactl
-#else
-    uint32_t cpuset; // no NUMA support outside of Linux at this time. Use a portable datatype
-#endif
-};
-
 //
 // ggml state
 //
 
 struct ggml_state {
     struct ggml_numa_nodes numa;
+
+    struct ggml_numa_mirror mirrors[GGML_NUMA_MAX_MIRRORS];
+    int n_mirrors;
 };
 
 static struct ggml_state g_state = {0};
 
+// the copy of the data on the NUMA node of the thread, the data itself if it has not been mirrored
+static inline const char * ggml_numa_local(const struct ggml_compute_params * params, const void * data) {
+    const struct ggml_threadpool * tp = params->threadpool;
+
+    for (int i = 0; i < tp->n_mirrors; i++) {
+        const struct ggml_numa_mirror * m = &tp->mirrors[i];
+        if ((const char *) data >= m->data && (const char *) data < m->data + m->size) {
+            return m->copies[params->ith % g_state.numa.n_mirror_nodes] + ((const char *) data - m->data);
+        }
+    }
+
+    return (const char *) data;
+}
+
 void ggml_barrier(struct ggml_threadpool * tp) {
     int n_threads = atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed);
     if (n_threads == 1) {
@@ -559,6 +603,97 @@ void ggml_barrier(struct ggml_threadpool * tp) {
 #endif
 }
 
+// the range of chunks of a thread is packed in a single int: [gen:8][begin:12][end:12]
+// the generation tells apart the ranges of consecutive ops, so that a range can be claimed by any thread
+
+static inline int ggml_chunks_pack(int gen, int begin, int end) {
+    return (int) (((uint32_t) gen << 24) | ((uint32_t) begin << 12) | (uint32_t) end);
+}
+
+static inline int ggml_chunks_gen  (int s) { return ((uint32_t) s >> 24) & 0xff; }
+static inline int ggml_chunks_begin(int s) { return ((uint32_t) s >> 12) & 0xfff; }
+static inline int ggml_chunks_end  (int s) { return  (uint32_t) s        & 0xfff; }
+
+// set the initial range of thread j for the current op, unless it has already been set by another thread
+static void ggml_chunks_claim(struct ggml_compute_state * state, int j, int nth, int gen, int n_chunks) {
+    int s = atomic_load_explicit(&state->chunks, memory_order_relaxed);
+    if (ggml_chunks_gen(s) == gen) {
+        return;
+    }
+
+    const int begin = (int) (((int64_t) n_chunks*(j + 0))/nth);
+    const int end   = (int) (((int64_t) n_chunks*(j + 1))/nth);
+
+    atomic_compare_exchange_strong(&state->chunks, &s, ggml_chunks_pack(gen, begin, end));
+}
+
+void ggml_chunks_init(const struct ggml_compute_params * params, int n_chunks) {
+    GGML_ASSERT(n_chunks >= 0 && n_chunks <= GGML_CHUNKS_MAX);
+
+    struct ggml_compute_state * state = &params->threadpool->workers[params->ith];
+
+    // all threads run the same ops, so the generations stay in sync without communication
+    state->chunks_gen = (state->chunks_gen + 1) & 0xff;
+    state->n_chunks   = n_chunks;
+
+    ggml_chunks_claim(state, params->ith, params->nth, state->chunks_gen, n_chunks);
+}
+
+bool ggml_chunks_next(const struct ggml_compute_params * params, int * chunk) {
+    struct ggml_threadpool    * tp    = params->threadpool;
+    struct ggml_compute_state * state = &tp->workers[params->ith];
+
+    const int gen = state->chunks_gen;
+
+    // take the next chunk from the front of our own range
+    int s = atomic_load_explicit(&state->chunks, memory_order_relaxed);
+    while (ggml_chunks_begin(s) < ggml_chunks_end(s)) {
+        if (atomic_compare_exchange_strong(&state->chunks, &s, ggml_chunks_pack(gen, ggml_chunks_begin(s) + 1, ggml_chunks_end(s)))) {
+            *chunk = ggml_chunks_begin(s);
+            return true;
+        }
+    }
+
+    if (!tp->cplan->work_stealing) {
+        return false;
+    }
+
+    // steal half of the remaining chunks from the back of the range of another thread
+    // the stolen chunks become our own range, so that they can be stolen again by an idle thread
+    for (int i = 1; i < params->nth; i++) {
+        const int j = (params->ith + i) % params->nth;
+
+        struct ggml_compute_state * victim = &tp->workers[j];
+
+        ggml_chunks_claim(victim, j, params->nth, gen, state->n_chunks);
+
+        int v = atomic_load_explicit(&victim->chunks, memory_order_relaxed);
+        while (ggml_chunks_gen(v) == gen && ggml_chunks_begin(v) < ggml_chunks_end(v)) {
+            const int begin = ggml_chunks_begin(v);
+            const int end   = ggml_chunks_end(v);
+            const int mid   = end - (end - begin + 1)/2;
+
+            if (atomic_compare_exchange_strong(&victim->chunks, &v, ggml_chunks_pack(gen, begin, mid))) {
+                atomic_store_explicit(&state->chunks, ggml_chunks_pack(gen, mid + 1, end), memory_order_relaxed);
+                *chunk = mid;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+int64_t ggml_chunks_init_rows(const struct ggml_compute_params * params, int64_t nr) {
+    // a few chunks per thread are enough to even out the differences in speed between the threads
+    const int64_t n_chunks = MIN(MIN(nr, 8*params->nth), GGML_CHUNKS_MAX);
+    const int64_t dr       = n_chunks > 0 ? (nr + n_chunks - 1)/n_chunks : 0;
+
+    ggml_chunks_init(params, dr > 0 ? (int) ((nr + dr - 1)/dr) : 0);
+
+    return dr;
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -631,6 +766,14 @@ void ggml_numa_init(enum ggml_numa_strategy numa_flag) {
 
     GGML_PRINT_DEBUG("found our process on numa node %u, CPU %u\n", g_state.numa.current_node, current_cpu);
 
+    g_state.numa.n_mirror_nodes = g_state.numa.n_nodes;
+
+    // allows testing the mirror strategy on a single-node machine: the extra copies are placed on the same node
+    const char * mirror_nodes_env = getenv("GGML_NUMA_MIRROR_NODES");
+    if (mirror_nodes_env) {
+        g_state.numa.n_mirror_nodes = MIN(MAX(atoi(mirror_nodes_env), 1), GGML_NUMA_MAX_NODES);
+    }
+
     for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
         struct ggml_numa_node * node = &g_state.numa.nodes[n];
         GGML_PRINT_DEBUG("CPUs on node %u:", n);
@@ -1176,7 +1319,9 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     const int64_t ir0_start,
     const int64_t ir0_end,
     const int64_t ir1_start,
-    const int64_t ir1_end) {
+    const int64_t ir1_end,
+    char * out_data,
+    const float * bias) {
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
@@ -1202,6 +1347,9 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
+    // the copy of src0 on the NUMA node of this thread, if mirrored
+    const char * src0_data = ggml_numa_local(params, src0->data);
+
     assert(ne12 % ne02 == 0);
     assert(ne13 % ne03 == 0);
 
@@ -1230,7 +1378,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 const int64_t i2 = i12;
                 const int64_t i3 = i13;
 
-                const char * src0_row = (const char*)src0->data + (0 + i02 * nb02 + i03 * nb03);
+                const char * src0_row = src0_data + (0 + i02 * nb02 + i03 * nb03);
 
                 // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
                 //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
@@ -1240,7 +1388,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                     (src1_cont || src1->type != vec_dot_type
                         ? (i11 + i12 * ne11 + i13 * ne12 * ne11) * row_size
                         : (i11 * nb11 + i12 * nb12 + i13 * nb13));
-                float * dst_col = (float*)((char*)dst->data + (i1 * nb1 + i2 * nb2 + i3 * nb3));
+                float * dst_col = (float*)(out_data + (i1 * nb1 + i2 * nb2 + i3 * nb3));
 
                 //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir0_end; ++ir0) {
                 //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
@@ -1251,6 +1399,9 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 }
 
                 for (int cn = 0; cn < num_rows_per_vec_dot; ++cn) {
+                    if (bias) {
+                        ggml_vec_add_f32(MIN(iir0 + blck_0, ir0_end) - iir0, tmp + (cn * 16), tmp + (cn * 16), bias + iir0);
+                    }
                     memcpy(&dst_col[iir0 + cn * nb1 / nb0], tmp + (cn * 16), (MIN(iir0 + blck_0, ir0_end) - iir0) * sizeof(float));
                 }
             }
@@ -1258,9 +1409,37 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     }
 }
 
-static void ggml_compute_forward_mul_mat(
+#if GGML_USE_LLAMAFILE
+// adds the bias to the rows of the result computed by llamafile_sgemm, once all the threads are done with it
+static void ggml_compute_forward_mul_mat_add_bias(
         const struct ggml_compute_params * params,
-              struct ggml_tensor * dst) {
+        const struct ggml_tensor * dst,
+              char * out_data,
+              const float * bias) {
+
+    ggml_barrier(params->threadpool);
+
+    const int64_t nr = ggml_nrows(dst);
+
+    for (int64_t ir = params->ith; ir < nr; ir += params->nth) {
+        const int64_t i3 = ir/(dst->ne[2]*dst->ne[1]);
+        const int64_t i2 = (ir - i3*dst->ne[2]*dst->ne[1])/dst->ne[1];
+        const int64_t i1 = (ir - i3*dst->ne[2]*dst->ne[1] - i2*dst->ne[1]);
+
+        float * row = (float *) (out_data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3]);
+
+        ggml_vec_add_f32(dst->ne[0], row, row, bias);
+    }
+}
+#endif
+
+// the result is written to out_data, with the layout of dst
+// if bias is not NULL, it is added to each row of the result (fused MUL_MAT + ADD)
+static void ggml_compute_forward_mul_mat_impl(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst,
+              char * out_data,
+              const float * bias) {
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
@@ -1305,16 +1484,19 @@ static void ggml_compute_forward_mul_mat(
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(params,
                                      ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                     ggml_numa_local(params, src0->data) + i12/r2*nb02 + i13/r3*nb03,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     out_data + i12*nb2 + i13*nb3,
                                      nb1/ggml_type_size(dst->type),
                                      src0->type,
                                      src1->type,
                                      dst->type))
                     goto UseGgmlGemm1;
+        if (bias) {
+            ggml_compute_forward_mul_mat_add_bias(params, dst, out_data, bias);
+        }
         return;
     }
 UseGgmlGemm1:;
@@ -1357,11 +1539,6 @@ UseGgmlGemm1:;
     #endif
     }
 
-    if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
-    }
-
     ggml_barrier(params->threadpool);
 
 #if GGML_USE_LLAMAFILE
@@ -1373,16 +1550,19 @@ UseGgmlGemm1:;
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(params,
                                      ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                     ggml_numa_local(params, src0->data) + i12/r2*nb02 + i13/r3*nb03,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
                                      row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     out_data + i12*nb2 + i13*nb3,
                                      nb1/ggml_type_size(dst->type),
                                      src0->type,
                                      vec_dot_type,
                                      dst->type))
                     goto UseGgmlGemm2;
+        if (bias) {
+            ggml_compute_forward_mul_mat_add_bias(params, dst, out_data, bias);
+        }
         return;
     }
 UseGgmlGemm2:;
@@ -1417,14 +1597,25 @@ UseGgmlGemm2:;
         nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
     }
 
+    // keep the number of chunks within the range of the work-stealing scheduler
+    while (nchunk0 * nchunk1 > GGML_CHUNKS_MAX) {
+        if (nchunk0 > nchunk1) {
+            nchunk0 = (nchunk0 + 1) / 2;
+        } else {
+            nchunk1 = (nchunk1 + 1) / 2;
+        }
+    }
+
     // The number of elements in each chunk
     const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-    // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
+    // Each thread starts with its own range of chunks and steals from the others when done.
+    ggml_chunks_init(params, nchunk0 * nchunk1);
+
+    int current_chunk;
 
-    while (current_chunk < nchunk0 * nchunk1) {
+    while (ggml_chunks_next(params, &current_chunk)) {
         const int64_t ith0 = current_chunk % nchunk0;
         const int64_t ith1 = current_chunk / nchunk0;
 
@@ -1442,16 +1633,16 @@ UseGgmlGemm2:;
         if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0)) {
             num_rows_per_vec_dot = 1;
         }
-        ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
-
-        if (nth >= nchunk0 * nchunk1) {
-            break;
-        }
-
-        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
+        ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end, out_data, bias);
     }
 }
 
+static void ggml_compute_forward_mul_mat(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+    ggml_compute_forward_mul_mat_impl(params, dst, (char *) dst->data, NULL);
+}
+
 // ggml_compute_forward_mul_mat_id
 
 #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ids->ne[0]*ids->ne[1] + (i1)]
@@ -1652,7 +1843,7 @@ static void ggml_compute_forward_mul_mat_id(
             continue;
         }
 
-        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
+        const char * src0_cur = ggml_numa_local(params, src0->data) + cur_a * nb02;
         const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
@@ -1883,6 +2074,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows_back(params, tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor);
+            } break;
         case GGML_OP_DIAG:
             {
                 ggml_compute_forward_diag(params, tensor);
@@ -2074,6 +2269,25 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
 
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__gnu_linux__)
+static void set_numa_node_affinity(int node_num) {
+    size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
+
+    struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
+
+    cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
+    CPU_ZERO_S(setsize, cpus);
+    for (size_t i = 0; i < node->n_cpus; ++i) {
+        CPU_SET_S(node->cpus[i], setsize, cpus);
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
+    if (rv) {
+            fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+
+    CPU_FREE(cpus);
+}
+
 static void set_numa_thread_affinity(int thread_n) {
     if (!ggml_is_numa()) {
         return;
@@ -2085,6 +2299,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_MIRROR:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -2103,20 +2318,7 @@ static void set_numa_thread_affinity(int thread_n) {
             return;
     }
 
-    struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
-
-    cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
-    CPU_ZERO_S(setsize, cpus);
-    for (size_t i = 0; i < node->n_cpus; ++i) {
-        CPU_SET_S(node->cpus[i], setsize, cpus);
-    }
-
-    rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
-    if (rv) {
-            fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
-    }
-
-    CPU_FREE(cpus);
+    set_numa_node_affinity(node_num);
 }
 
 static void clear_numa_thread_affinity(void) {
@@ -2146,6 +2348,170 @@ static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+//
+// NUMA mirror
+//
+
+#if defined(__gnu_linux__)
+#include <sys/mman.h>
+
+// writes the pages part, part + n_parts, ... of a buffer from a thread on the given node, so that the pages are placed on it
+struct ggml_numa_touch {
+    char       * dst;
+    const char * src; // NULL to zero the pages
+    size_t       size;
+    int          node;
+    int          part;
+    int          n_parts;
+};
+
+static void * ggml_numa_touch_thread(void * data) {
+    const struct ggml_numa_touch * t = (const struct ggml_numa_touch *) data;
+
+    // the extra copies emulated with GGML_NUMA_MIRROR_NODES stay on the current node
+    if (ggml_is_numa() && t->node < (int) g_state.numa.n_nodes) {
+        set_numa_node_affinity(t->node);
+    }
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    for (size_t offs = (size_t) t->part*page; offs < t->size; offs += (size_t) t->n_parts*page) {
+        const size_t n = MIN(page, t->size - offs);
+        if (t->src) {
+            memcpy(t->dst + offs, t->src + offs, n);
+        } else {
+            memset(t->dst + offs, 0, n);
+        }
+    }
+
+    return NULL;
+}
+
+static void ggml_numa_touch_all(struct ggml_numa_touch * touch, int n) {
+    pthread_t threads[GGML_NUMA_MAX_NODES];
+
+    for (int i = 0; i < n; i++) {
+        const int rc = pthread_create(&threads[i], NULL, ggml_numa_touch_thread, &touch[i]);
+        GGML_ASSERT(rc == 0);
+    }
+
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+bool ggml_numa_mirror(const void * data, size_t size) {
+    const int n_copies = (int) g_state.numa.n_mirror_nodes;
+
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_MIRROR || n_copies < 2 || size == 0) {
+        return false;
+    }
+
+    struct ggml_numa_mirror m = { (const char *) data, size, { NULL } };
+    struct ggml_numa_touch touch[GGML_NUMA_MAX_NODES];
+
+    for (int i = 0; i < n_copies; i++) {
+        void * copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED) {
+            GGML_LOG_WARN("%s: failed to allocate %zu bytes for a copy of the buffer: %s\n", __func__, size, strerror(errno));
+            for (int j = 0; j < i; j++) {
+                munmap(m.copies[j], size);
+            }
+            return false;
+        }
+
+        m.copies[i] = (char *) copy;
+
+        touch[i] = (struct ggml_numa_touch) { m.copies[i], m.data, size, i, 0, 1 };
+    }
+
+    ggml_numa_touch_all(touch, n_copies);
+
+    // the copies are made outside of the critical section, the graphs computed meanwhile do not wait for them
+    bool ok = false;
+
+    ggml_critical_section_start();
+    if (g_state.n_mirrors < GGML_NUMA_MAX_MIRRORS) {
+        g_state.mirrors[g_state.n_mirrors++] = m;
+        ok = true;
+    }
+    ggml_critical_section_end();
+
+    if (!ok) {
+        GGML_LOG_WARN("%s: too many mirrored buffers, the buffer is not mirrored\n", __func__);
+        for (int i = 0; i < n_copies; i++) {
+            munmap(m.copies[i], size);
+        }
+    }
+
+    return ok;
+}
+
+void ggml_numa_unmirror(const void * data) {
+    struct ggml_numa_mirror m = { NULL, 0, { NULL } };
+
+    ggml_critical_section_start();
+    for (int i = 0; i < g_state.n_mirrors; i++) {
+        if (g_state.mirrors[i].data == (const char *) data) {
+            m = g_state.mirrors[i];
+            g_state.mirrors[i] = g_state.mirrors[--g_state.n_mirrors];
+            break;
+        }
+    }
+    ggml_critical_section_end();
+
+    // the buffer is not used by any graph anymore, so none of the threads can be reading the copies
+    for (uint32_t j = 0; m.data && j < g_state.numa.n_mirror_nodes; j++) {
+        munmap(m.copies[j], m.size);
+    }
+}
+
+void ggml_numa_interleave(void * data, size_t size) {
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_MIRROR || !ggml_is_numa() || size == 0) {
+        return;
+    }
+
+    const int n_nodes = (int) g_state.numa.n_nodes;
+
+    struct ggml_numa_touch touch[GGML_NUMA_MAX_NODES];
+
+    for (int i = 0; i < n_nodes; i++) {
+        touch[i] = (struct ggml_numa_touch) { (char *) data, NULL, size, i, i, n_nodes };
+    }
+
+    ggml_numa_touch_all(touch, n_nodes);
+}
+#else
+bool ggml_numa_mirror(const void * data, size_t size) {
+    UNUSED(data);
+    UNUSED(size);
+    return false;
+}
+
+void ggml_numa_unmirror(const void * data) {
+    UNUSED(data);
+}
+
+void ggml_numa_interleave(void * data, size_t size) {
+    UNUSED(data);
+    UNUSED(size);
+}
+#endif
+
+// the threads of a graph use a copy of the list of mirrors taken before the graph is computed
+static void ggml_numa_mirrors_get(struct ggml_threadpool * threadpool) {
+    threadpool->n_mirrors = 0;
+
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_MIRROR) {
+        return;
+    }
+
+    ggml_critical_section_start();
+    memcpy(threadpool->mirrors, g_state.mirrors, g_state.n_mirrors*sizeof(struct ggml_numa_mirror));
+    threadpool->n_mirrors = g_state.n_mirrors;
+    ggml_critical_section_end();
+}
+
 static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     int n_tasks = 0;
 
@@ -2238,6 +2604,10 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
                 //n_tasks = n_threads;
                 n_tasks = 1;
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                n_tasks = n_threads;
+            } break;
         case GGML_OP_SCALE:
         case GGML_OP_SET:
         case GGML_OP_RESHAPE:
@@ -2848,9 +3218,194 @@ struct ggml_cplan ggml_graph_plan(
     cplan.work_size  = work_size;
     cplan.work_data  = NULL;
 
+    cplan.work_stealing = true;
+    cplan.skip_barriers = true;
+    cplan.fuse_ops      = true;
+
+    cplan.node_times = NULL;
+
     return cplan;
 }
 
+// max number of consecutive nodes that run without a barrier
+#define GGML_MAX_SKIPPED_BARRIERS 8
+
+// ops that split their rows between the threads without a shared work buffer, internal barriers or chunks
+// consecutive nodes of these ops can run without a barrier in between if they do not depend on each other
+static bool ggml_graph_node_is_barrier_free(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SCALE:
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+        case GGML_OP_CONT:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_UNARY:
+            break;
+        default:
+            return false;
+    }
+
+    // the quantized variants of these ops use the work buffer
+    if (node->op != GGML_OP_GET_ROWS && ggml_is_quantized(node->type)) {
+        return false;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        const struct ggml_tensor * src = node->src[i];
+        if (src == NULL) {
+            continue;
+        }
+        // repacked tensors are handled by the extra buffer types
+        if (src->extra != NULL) {
+            return false;
+        }
+        if (node->op != GGML_OP_GET_ROWS && ggml_is_quantized(src->type)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool ggml_graph_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a == NULL || b == NULL || a->data == NULL || b->data == NULL) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// check if the node does not read or write the memory written by the nodes [n0, n1), and does not write the memory they read
+// the memory of the tensors is compared instead of the graph edges, because the allocator reuses the memory of the tensors
+static bool ggml_graph_node_is_independent(const struct ggml_cgraph * cgraph, const struct ggml_tensor * node, int n0, int n1) {
+    for (int i = n0; i < n1; i++) {
+        const struct ggml_tensor * prev = cgraph->nodes[i];
+
+        if (ggml_graph_tensors_overlap(node, prev)) {
+            return false;
+        }
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (ggml_graph_tensors_overlap(node, prev->src[j]) ||
+                ggml_graph_tensors_overlap(node->src[j], prev)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// check if the fused kernel can write dst while it reads src: either dst is computed in-place over src, or they do not overlap
+static bool ggml_graph_fused_can_write(const struct ggml_tensor * dst, const struct ggml_tensor * src) {
+    if (dst->data == src->data && ggml_are_same_shape(dst, src) && memcmp(dst->nb, src->nb, sizeof(dst->nb)) == 0) {
+        return true;
+    }
+
+    return !ggml_graph_tensors_overlap(dst, src);
+}
+
+// returns the number of nodes starting at node_n that are computed by a single fused kernel, or 1 if there is no fused kernel for them
+// the intermediate results are not written, so they must not be used by any other node of the graph
+static int ggml_graph_node_n_fused(const struct ggml_cgraph * cgraph, int node_n) {
+    if (node_n + 1 >= cgraph->n_nodes) {
+        return 1;
+    }
+
+    const struct ggml_tensor * node = cgraph->nodes[node_n];
+    const struct ggml_tensor * next = cgraph->nodes[node_n + 1];
+
+    if (ggml_is_empty(node) || ggml_is_empty(next)) {
+        return 1;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        // repacked tensors are handled by the extra buffer types
+        if ((node->src[i] && node->src[i]->extra) || (next->src[i] && next->src[i]->extra)) {
+            return 1;
+        }
+    }
+
+    // RMS_NORM + MUL by the weight
+    if (ggml_can_fuse(cgraph, node_n, (enum ggml_op[]) { GGML_OP_RMS_NORM, GGML_OP_MUL }, 2)) {
+        const struct ggml_tensor * x = node->src[0];
+        const struct ggml_tensor * w = next->src[0] == node ? next->src[1] : next->src[0];
+
+        if (x->type == GGML_TYPE_F32 && w->type == GGML_TYPE_F32 && next->type == GGML_TYPE_F32 &&
+                x->nb[0] == sizeof(float) && w->nb[0] == sizeof(float) && next->nb[0] == sizeof(float) &&
+                w->ne[0] == x->ne[0] && ggml_can_repeat(w, next) &&
+                ggml_graph_fused_can_write(next, x) && !ggml_graph_tensors_overlap(next, w)) {
+            return 2;
+        }
+    }
+
+    // SILU + MUL by the gate (SwiGLU)
+    if (ggml_can_fuse(cgraph, node_n, (enum ggml_op[]) { GGML_OP_UNARY, GGML_OP_MUL }, 2) &&
+            ggml_get_unary_op(node) == GGML_UNARY_OP_SILU) {
+        const struct ggml_tensor * x = node->src[0];
+        const struct ggml_tensor * g = next->src[0] == node ? next->src[1] : next->src[0];
+
+        if (x->type == GGML_TYPE_F32 && g->type == GGML_TYPE_F32 && next->type == GGML_TYPE_F32 &&
+                ggml_are_same_shape(g, next) &&
+                ggml_is_contiguous_1(x) && ggml_is_contiguous_1(g) && ggml_is_contiguous_1(next) &&
+                ggml_graph_fused_can_write(next, x) && ggml_graph_fused_can_write(next, g)) {
+            return 2;
+        }
+    }
+
+    // MUL_MAT + ADD of the bias
+    if (ggml_can_fuse(cgraph, node_n, (enum ggml_op[]) { GGML_OP_MUL_MAT, GGML_OP_ADD }, 2) && next->src[0] == node) {
+        const struct ggml_tensor * bias = next->src[1];
+
+        if (node->type == GGML_TYPE_F32 && next->type == GGML_TYPE_F32 && bias->type == GGML_TYPE_F32 &&
+                bias->ne[0] == node->ne[0] && ggml_nrows(bias) == 1 && bias->nb[0] == sizeof(float) &&
+                memcmp(node->nb, next->nb, sizeof(node->nb)) == 0 &&
+                !ggml_graph_tensors_overlap(next, node->src[0]) &&
+                !ggml_graph_tensors_overlap(next, node->src[1]) &&
+                !ggml_graph_tensors_overlap(next, bias)) {
+            return 2;
+        }
+    }
+
+    return 1;
+}
+
+// computes the nodes [0, n) with a single kernel, the result is written to the last node
+static void ggml_compute_forward_fused(struct ggml_compute_params * params, struct ggml_tensor ** nodes, int n) {
+    GGML_ASSERT(n == 2);
+
+    switch (nodes[0]->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                ggml_compute_forward_rms_norm_mul(params, nodes[0], nodes[1]);
+            } break;
+        case GGML_OP_UNARY:
+            {
+                ggml_compute_forward_swiglu(params, nodes[0], nodes[1]);
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                ggml_compute_forward_mul_mat_impl(params, nodes[0], (char *) nodes[1]->data, (const float *) nodes[1]->src[1]->data);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2868,10 +3423,43 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
+    // the nodes computed since the last barrier
+    int node_0 = 0;
+
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        // like the barriers, the fusion only depends on the graph, so all threads run the same kernels
+        const int n_fused = cplan->fuse_ops ? ggml_graph_node_n_fused(cgraph, node_n) : 1;
+
+        const int64_t t_start = cplan->node_times ? ggml_time_ns() : 0;
+
+        if (n_fused > 1) {
+            ggml_compute_forward_fused(&params, cgraph->nodes + node_n, n_fused);
+        } else {
+            ggml_compute_forward(&params, node);
+        }
+
+        if (cplan->node_times) {
+            int64_t * times = cplan->node_times + ((size_t) state->ith*cgraph->n_nodes + node_n)*2;
+            times[0] = t_start;
+            times[1] = ggml_time_ns();
+            for (int i = 2; i < 2*n_fused; i++) {
+                times[i] = -1;
+            }
+        }
+
+        node_n += n_fused - 1;
+
+        // the decision only depends on the graph, so all threads skip the same barriers
+        // the abort is only checked before a barrier, so that all threads stop at the same node
+        if (cplan->skip_barriers && n_fused == 1 && node_n + 1 < cgraph->n_nodes && node_n + 1 - node_0 < GGML_MAX_SKIPPED_BARRIERS &&
+                ggml_graph_node_is_barrier_free(node) &&
+                ggml_graph_node_is_barrier_free(cgraph->nodes[node_n + 1]) &&
+                (!cplan->fuse_ops || ggml_graph_node_n_fused(cgraph, node_n + 1) == 1) &&
+                ggml_graph_node_is_independent(cgraph, cgraph->nodes[node_n + 1], node_0, node_n + 1)) {
+            continue;
+        }
 
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
@@ -2881,6 +3469,8 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
         if (node_n + 1 < cgraph->n_nodes) {
             ggml_barrier(state->threadpool);
+
+            node_0 = node_n + 1;
         }
     }
 
@@ -3049,7 +3639,6 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_graph          = 0;
         threadpool->n_barrier        = 0;
         threadpool->n_barrier_passed = 0;
-        threadpool->current_chunk    = 0;
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = -1;
@@ -3059,6 +3648,7 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+        threadpool->n_mirrors        = 0;
     }
 
     // Allocate and init workers state
@@ -3130,11 +3720,17 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         // No worker threads should be accessing the parameters below at this stage
         threadpool->cgraph           = cgraph;
         threadpool->cplan            = cplan;
-        threadpool->current_chunk    = 0;
         threadpool->abort            = -1;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+
+        for (int j = 0; j < threadpool->n_threads_max; j++) {
+            threadpool->workers[j].chunks     = 0;
+            threadpool->workers[j].chunks_gen = 0;
+        }
     }
 
+    ggml_numa_mirrors_get(threadpool);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
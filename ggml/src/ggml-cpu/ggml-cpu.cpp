@@ -91,6 +91,12 @@ struct ggml_backend_cpu_context {
 
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    // profiling: times of the nodes of the last graph, see ggml_cplan.node_times
+    bool                 profiling;
+    std::vector<int64_t> node_times;
+    int                  node_times_n_threads;
+    int                  node_times_n_nodes;
 };
 
 static const char * ggml_backend_cpu_get_name(ggml_backend_t backend) {
@@ -169,6 +175,13 @@ static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, s
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
+    if (cpu_ctx->profiling) {
+        cpu_ctx->node_times.assign((size_t) cplan.n_threads*cgraph->n_nodes*2, 0);
+        cpu_ctx->node_times_n_threads = cplan.n_threads;
+        cpu_ctx->node_times_n_nodes   = cgraph->n_nodes;
+        cplan.node_times = cpu_ctx->node_times.data();
+    }
+
     return ggml_graph_compute(cgraph, &cplan);
 }
 
@@ -202,12 +215,15 @@ ggml_backend_t ggml_backend_cpu_init(void) {
         return NULL;
     }
 
-    ctx->n_threads           = GGML_DEFAULT_N_THREADS;
-    ctx->threadpool          = NULL;
-    ctx->work_data           = NULL;
-    ctx->work_size           = 0;
-    ctx->abort_callback      = NULL;
-    ctx->abort_callback_data = NULL;
+    ctx->n_threads            = GGML_DEFAULT_N_THREADS;
+    ctx->threadpool           = NULL;
+    ctx->work_data            = NULL;
+    ctx->work_size            = 0;
+    ctx->abort_callback       = NULL;
+    ctx->abort_callback_data  = NULL;
+    ctx->profiling            = false;
+    ctx->node_times_n_threads = 0;
+    ctx->node_times_n_nodes   = 0;
 
     ggml_backend_t cpu_backend = new ggml_backend {
         /* .guid      = */ ggml_backend_cpu_guid(),
@@ -255,6 +271,25 @@ void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void ggml_backend_cpu_set_profiling(ggml_backend_t backend_cpu, bool enable) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->profiling = enable;
+    ctx->node_times.clear();
+    ctx->node_times_n_threads = 0;
+    ctx->node_times_n_nodes   = 0;
+}
+
+const int64_t * ggml_backend_cpu_get_node_times(ggml_backend_t backend_cpu, int * n_threads, int * n_nodes) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    *n_threads = ctx->node_times_n_threads;
+    *n_nodes   = ctx->node_times_n_nodes;
+    return ctx->node_times.empty() ? NULL : ctx->node_times.data();
+}
+
 // CPU backend - device
 
 struct ggml_backend_cpu_device_context {
@@ -440,6 +475,9 @@ static bool ggml_backend_cpu_device_supports_op(ggml_backend_dev_t dev, const st
             return src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_F32;
         case GGML_OP_GET_ROWS_BACK:
             return src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16;
+        case GGML_OP_SET_ROWS:
+            return src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_I32 &&
+                (op->type == GGML_TYPE_F32 || ggml_get_type_traits_cpu(op->type)->from_float != nullptr);
         case GGML_OP_OUT_PROD:
             return (src0->type == GGML_TYPE_F32 || (ggml_is_quantized(src0->type) && src0->ne[2] == src1->ne[2] && src0->ne[3] == src1->ne[3])) &&
                 src1->type == GGML_TYPE_F32 && op->type == GGML_TYPE_F32;
@@ -625,12 +663,29 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_set_abort_callback") == 0) {
         return (void *)ggml_backend_cpu_set_abort_callback;
     }
+    if (strcmp(name, "ggml_backend_set_profiling") == 0) {
+        ggml_backend_set_profiling_t fct = ggml_backend_cpu_set_profiling;
+        return (void *)fct;
+    }
+    if (strcmp(name, "ggml_backend_get_node_times") == 0) {
+        ggml_backend_get_node_times_t fct = ggml_backend_cpu_get_node_times;
+        return (void *)fct;
+    }
     if (strcmp(name, "ggml_backend_cpu_numa_init") == 0) {
         return (void *)ggml_numa_init;
     }
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+    if (strcmp(name, "ggml_backend_cpu_numa_mirror") == 0) {
+        return (void *)ggml_numa_mirror;
+    }
+    if (strcmp(name, "ggml_backend_cpu_numa_unmirror") == 0) {
+        return (void *)ggml_numa_unmirror;
+    }
+    if (strcmp(name, "ggml_backend_cpu_numa_interleave") == 0) {
+        return (void *)ggml_numa_interleave;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
@@ -4470,6 +4470,75 @@ void ggml_compute_forward_get_rows(
     //}
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows_f32(
+        const ggml_compute_params * params,
+              ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int64_t nc = ne00;
+    const int64_t nr = ne01;
+
+    assert(ne0  == nc);
+    assert(ne02 == ne2);
+    assert(ne03 == ne3);
+    assert(nc == 1 || nb00 == sizeof(float));
+
+    ggml_from_float_t const from_float = ggml_get_type_traits_cpu(dst->type)->from_float;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t i03 = 0; i03 < ne03; ++i03) {
+        for (int64_t i02 = 0; i02 < ne02; ++i02) {
+            for (int64_t i = ir0; i < ir1; ++i) {
+                const int64_t i1 = *(int32_t *) ((char *) src1->data + i*nb10);
+
+                GGML_ASSERT(i1 >= 0 && i1 < ne1);
+
+                const float * src_row = (const float *) ((char *) src0->data + i*nb01 + i02*nb02 + i03*nb03);
+                      void  * dst_row =                  (char *)  dst->data + i1*nb1 + i02*nb2  + i03*nb3;
+
+                if (dst->type == GGML_TYPE_F32) {
+                    ggml_vec_cpy_f32(nc, (float *) dst_row, src_row);
+                } else {
+                    from_float(src_row, dst_row, nc);
+                }
+            }
+        }
+    }
+}
+
+void ggml_compute_forward_set_rows(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_set_rows_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 // ggml_compute_forward_get_rows_back
 
 static void ggml_compute_forward_get_rows_back_f32_f16(
@@ -4747,7 +4816,6 @@ static void ggml_compute_forward_soft_max_f32(
     // TODO: handle transposed/permuted matrices
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     GGML_TENSOR_UNARY_OP_LOCALS
 
@@ -4764,65 +4832,69 @@ static void ggml_compute_forward_soft_max_f32(
     const int nc = src0->ne[0];
     const int nr = ggml_nrows(src0);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // rows per chunk
+    const int dr = ggml_chunks_init_rows(params, nr);
 
     float * wp = (float *) params->wdata + (nc + CACHE_LINE_SIZE_F32) * ith;
 
     const bool use_f16 = (src1 && src1->type == GGML_TYPE_F16);
 
-    for (int i1 = ir0; i1 < ir1; i1++) {
-        // ALiBi
-        const uint32_t h = (i1/ne01)%ne02; // head
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    int chunk;
 
-        float * sp = (float *)((char *) src0->data + i1*src0->nb[1]);
-        float * dp = (float *)((char *)  dst->data +  i1*dst->nb[1]);
+    while (ggml_chunks_next(params, &chunk)) {
+        // row range for this chunk
+        const int ir0 = dr*chunk;
+        const int ir1 = MIN(ir0 + dr, nr);
 
-        // broadcast the mask across rows
-        ggml_fp16_t * mp_f16 = src1 ? (ggml_fp16_t *)((char *) src1->data) + (i1%ne01)*ne00 : NULL;
-        float       * mp_f32 = src1 ? (float       *)((char *) src1->data) + (i1%ne01)*ne00 : NULL;
+        for (int i1 = ir0; i1 < ir1; i1++) {
+            // ALiBi
+            const uint32_t h = (i1/ne01)%ne02; // head
+            const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
 
-        ggml_vec_cpy_f32  (nc, wp, sp);
-        ggml_vec_scale_f32(nc, wp, scale);
-        if (mp_f32) {
-            if (use_f16) {
-                for (int i = 0; i < nc; ++i) {
-                    wp[i] += slope*GGML_FP16_TO_FP32(mp_f16[i]);
-                }
-            } else {
-                for (int i = 0; i < nc; ++i) {
-                    wp[i] += slope*mp_f32[i];
+            float * sp = (float *)((char *) src0->data + i1*src0->nb[1]);
+            float * dp = (float *)((char *)  dst->data +  i1*dst->nb[1]);
+
+            // broadcast the mask across rows
+            ggml_fp16_t * mp_f16 = src1 ? (ggml_fp16_t *)((char *) src1->data) + (i1%ne01)*ne00 : NULL;
+            float       * mp_f32 = src1 ? (float       *)((char *) src1->data) + (i1%ne01)*ne00 : NULL;
+
+            ggml_vec_cpy_f32  (nc, wp, sp);
+            ggml_vec_scale_f32(nc, wp, scale);
+            if (mp_f32) {
+                if (use_f16) {
+                    for (int i = 0; i < nc; ++i) {
+                        wp[i] += slope*GGML_FP16_TO_FP32(mp_f16[i]);
+                    }
+                } else {
+                    for (int i = 0; i < nc; ++i) {
+                        wp[i] += slope*mp_f32[i];
+                    }
                 }
             }
-        }
 
 #ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            //printf("p[%d] = %f\n", i, p[i]);
-            assert(!isnan(wp[i]));
-        }
+            for (int i = 0; i < nc; ++i) {
+                //printf("p[%d] = %f\n", i, p[i]);
+                assert(!isnan(wp[i]));
+            }
 #endif
 
-        float max = -INFINITY;
-        ggml_vec_max_f32(nc, &max, wp);
+            float max = -INFINITY;
+            ggml_vec_max_f32(nc, &max, wp);
 
-        ggml_float sum = ggml_vec_soft_max_f32(nc, dp, wp, max);
-        assert(sum > 0.0);
+            ggml_float sum = ggml_vec_soft_max_f32(nc, dp, wp, max);
+            assert(sum > 0.0);
 
-        sum = 1.0/sum;
-        ggml_vec_scale_f32(nc, dp, sum);
+            sum = 1.0/sum;
+            ggml_vec_scale_f32(nc, dp, sum);
 
 #ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            assert(!isnan(dp[i]));
-            assert(!isinf(dp[i]));
-        }
+            for (int i = 0; i < nc; ++i) {
+                assert(!isnan(dp[i]));
+                assert(!isinf(dp[i]));
+            }
 #endif
+        }
     }
 }
 
@@ -6945,13 +7017,14 @@ void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
-static void ggml_compute_forward_flash_attn_ext_f16(
+static void ggml_compute_forward_flash_attn_ext_f16_one_chunk(
         const ggml_compute_params * params,
         const ggml_tensor * q,
         const ggml_tensor * k,
         const ggml_tensor * v,
         const ggml_tensor * mask,
-        ggml_tensor * dst) {
+        ggml_tensor * dst,
+        int ir0, int ir1) {
 
     GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
     GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
@@ -6963,7 +7036,6 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
 
     const int ith = params->ith;
-    const int nth = params->nth;
 
     const int64_t DK = nek0;
     const int64_t DV = nev0;
@@ -6996,18 +7068,6 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv2 = neq2/nev2;
     const int64_t rv3 = neq3/nev3;
 
-    // parallelize by q rows using ggml_vec_dot_f32
-
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
     float scale         = 1.0f;
     float max_bias      = 0.0f;
     float logit_softcap = 0.0f;
@@ -7164,6 +7224,32 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 }
 
+static void ggml_compute_forward_flash_attn_ext_f16(
+        const ggml_compute_params * params,
+        const ggml_tensor * q,
+        const ggml_tensor * k,
+        const ggml_tensor * v,
+        const ggml_tensor * mask,
+        ggml_tensor * dst) {
+
+    // parallelize by q rows using ggml_vec_dot_f32
+
+    // total rows in q
+    const int64_t nr = q->ne[1]*q->ne[2]*q->ne[3];
+
+    // rows per chunk
+    const int64_t dr = ggml_chunks_init_rows(params, nr);
+
+    int chunk;
+
+    while (ggml_chunks_next(params, &chunk)) {
+        const int ir0 = dr*chunk;
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        ggml_compute_forward_flash_attn_ext_f16_one_chunk(params, q, k, v, mask, dst, ir0, ir1);
+    }
+}
+
 void ggml_compute_forward_flash_attn_ext(
         const ggml_compute_params * params,
         const ggml_tensor * q,
@@ -9016,3 +9102,99 @@ void ggml_compute_forward_opt_step_adamw(
             }
     }
 }
+
+// ggml_compute_forward_rms_norm_mul
+
+// dst = rms_norm(x)*w, with the weight broadcast over the rows of x
+// the rows are scaled and multiplied in the same order as the unfused ops, so the results are the same
+void ggml_compute_forward_rms_norm_mul(
+        const ggml_compute_params * params,
+        const ggml_tensor * norm,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = norm->src[0];
+    const ggml_tensor * w    = dst->src[0] == norm ? dst->src[1] : dst->src[0];
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F32 && w->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(w, dst));
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(   w->nb[0] == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x  = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * wr = (float *) ((char *) w->data + (i01 % w->ne[1])*w->nb[1] + (i02 % w->ne[2])*w->nb[2] + (i03 % w->ne[3])*w->nb[3]);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                memmove(y, x, ne00 * sizeof(float));
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                ggml_vec_scale_f32(ne00, y, scale);
+                ggml_vec_mul_f32  (ne00, y, y, wr);
+            }
+        }
+    }
+}
+
+// ggml_compute_forward_swiglu
+
+// dst = silu(x)*g
+void ggml_compute_forward_swiglu(
+        const ggml_compute_params * params,
+        const ggml_tensor * silu,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = silu->src[0];
+    const ggml_tensor * g    = dst->src[0] == silu ? dst->src[1] : dst->src[0];
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F32 && g->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous_1(src0) && ggml_is_contiguous_1(g) && ggml_is_contiguous_1(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst) && ggml_are_same_shape(g, dst));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int64_t i03 = ir/(src0->ne[2]*src0->ne[1]);
+        const int64_t i02 = (ir - i03*src0->ne[2]*src0->ne[1])/src0->ne[1];
+        const int64_t i01 = (ir - i03*src0->ne[2]*src0->ne[1] - i02*src0->ne[1]);
+
+        ggml_vec_swiglu_f32(nc,
+                (float *) ((char *)  dst->data + i01* dst->nb[1] + i02* dst->nb[2] + i03* dst->nb[3]),
+                (float *) ((char *) src0->data + i01*src0->nb[1] + i02*src0->nb[2] + i03*src0->nb[3]),
+                (float *) ((char *)    g->data + i01*   g->nb[1] + i02*   g->nb[2] + i03*   g->nb[3]));
+    }
+}
@@ -3215,6 +3215,8 @@ static bool ggml_backend_cuda_device_supports_op(ggml_backend_dev_t dev, const g
         case GGML_OP_SUM:
         case GGML_OP_SUM_ROWS:
         case GGML_OP_ARGSORT:
+            // a row is sorted by a single block, with one thread and one int of shared memory per padded column
+            return op->src[0]->ne[0] <= 1024;
         case GGML_OP_ACC:
             return true;
         case GGML_OP_GROUP_NORM:
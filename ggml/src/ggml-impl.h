@@ -303,6 +303,7 @@ struct ggml_cgraph {
     struct ggml_tensor ** leafs;     // tensors with constant data
 
     struct ggml_hash_set visited_hash_set;
+    int32_t            * use_counts; // number of nodes that use each tensor as a source, indexed by the position in visited_hash_set
 
     enum ggml_cgraph_eval_order order;
 };
@@ -310,8 +311,61 @@ struct ggml_cgraph {
 // returns a slice of cgraph with nodes [i0, i1)
 // the slice does not have leafs or gradients
 // if you need the gradients, get them from the original graph
+// the use counts are the ones of the original graph
 struct ggml_cgraph ggml_graph_view(struct ggml_cgraph * cgraph, int i0, int i1);
 
+// number of nodes of the graph that use the node as a source, -1 if unknown
+static inline int ggml_node_get_use_count(const struct ggml_cgraph * cgraph, int node_idx) {
+    const struct ggml_tensor * node = cgraph->nodes[node_idx];
+
+    if (cgraph->use_counts == NULL || cgraph->visited_hash_set.size == 0) {
+        return -1;
+    }
+
+    const size_t hash_pos = ggml_hash_find(&cgraph->visited_hash_set, node);
+    if (hash_pos == GGML_HASHSET_FULL || !ggml_bitset_get(cgraph->visited_hash_set.used, hash_pos)) {
+        return -1;
+    }
+
+    return cgraph->use_counts[hash_pos];
+}
+
+// check if the nodes [node_idx, node_idx + num_ops) have the given ops and form a chain that a backend can run as one fused op:
+// each node uses the previous one as a source and has the same shape, and the result of each node but the last one is used
+// only by the next node and is not an output of the graph
+static inline bool ggml_can_fuse(const struct ggml_cgraph * cgraph, int node_idx, const enum ggml_op * ops, int num_ops) {
+    if (node_idx + num_ops > cgraph->n_nodes) {
+        return false;
+    }
+
+    for (int i = 0; i < num_ops; ++i) {
+        const struct ggml_tensor * node = cgraph->nodes[node_idx + i];
+
+        if (node->op != ops[i]) {
+            return false;
+        }
+
+        if (i < num_ops - 1) {
+            if (ggml_node_get_use_count(cgraph, node_idx + i) != 1 || (node->flags & GGML_TENSOR_FLAG_OUTPUT)) {
+                return false;
+            }
+        }
+
+        if (i > 0) {
+            const struct ggml_tensor * prev = cgraph->nodes[node_idx + i - 1];
+
+            if (node->src[0] != prev && node->src[1] != prev) {
+                return false;
+            }
+            if (!ggml_are_same_shape(node, prev)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 // Memory allocation
 
 GGML_API void * ggml_aligned_malloc(size_t size);
@@ -24,7 +24,17 @@ struct llama_adapter_lora_deleter {
     void operator()(llama_adapter_lora * adapter) { llama_adapter_lora_free(adapter); }
 };
 
+struct llama_stop_matcher_deleter {
+    void operator()(llama_stop_matcher * matcher) { llama_stop_matcher_free(matcher); }
+};
+
+struct llama_detokenizer_deleter {
+    void operator()(llama_detokenizer * detok) { llama_detokenizer_free(detok); }
+};
+
 typedef std::unique_ptr<llama_model, llama_model_deleter> llama_model_ptr;
 typedef std::unique_ptr<llama_context, llama_context_deleter> llama_context_ptr;
 typedef std::unique_ptr<llama_sampler, llama_sampler_deleter> llama_sampler_ptr;
 typedef std::unique_ptr<llama_adapter_lora, llama_adapter_lora_deleter> llama_adapter_lora_ptr;
+typedef std::unique_ptr<llama_stop_matcher, llama_stop_matcher_deleter> llama_stop_matcher_ptr;
+typedef std::unique_ptr<llama_detokenizer, llama_detokenizer_deleter> llama_detokenizer_ptr;
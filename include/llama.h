@@ -61,6 +61,8 @@ extern "C" {
     struct llama_model;
     struct llama_context;
     struct llama_sampler;
+    struct llama_detokenizer;
+    struct llama_stop_matcher;
     struct llama_kv_cache;
 
     typedef int32_t llama_pos;
@@ -321,6 +323,20 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool moe_lazy;      // do not prefetch the mmap-ed MoE experts, page them in when they are first used
+
+        // with moe_lazy: lock an expert in RAM once it has been used by this many batches (0 = never)
+        uint32_t moe_pin_hits;
+    };
+
+    // KV cache data types for a range of layers
+    // negative layer indices are counted from the end (-1 is the last layer)
+    struct llama_kv_cache_layer_type {
+        int32_t il_first; // first layer of the range
+        int32_t il_last;  // last layer of the range (inclusive)
+
+        enum ggml_type type_k;
+        enum ggml_type type_v;
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -368,6 +384,19 @@ extern "C" {
         bool swa_full;    // use full-size SWA cache (https://github.com/ggml-org/llama.cpp/pull/13194#issuecomment-2868343055)
                           // NOTE: setting to false when n_seq_max > 1 can cause bad performance in some cases
                           //       ref: https://github.com/ggml-org/llama.cpp/pull/13845#issuecomment-2924800573
+
+        uint32_t kv_block_size; // paged KV cache: number of cells per block, 0 = contiguous slots (default)
+
+        // per-layer overrides of type_k/type_v, terminated by an entry with type_k = GGML_TYPE_COUNT, NULL = none [EXPERIMENTAL]
+        // the last matching entry wins
+        const struct llama_kv_cache_layer_type * kv_layer_types;
+
+        uint32_t n_logits_top; // return only the top-k logits of each output, computed in the graph, 0 = full rows (default)
+                               // 1 = argmax only (greedy sampling), see llama_get_logits_top_ith
+
+        bool graph_reuse; // reuse the compute graph of the previous ubatch when only the data of its inputs changes [EXPERIMENTAL]
+        bool graph_reorder; // reorder the independent nodes of the compute graphs to reduce the size of the compute buffers
+        bool parallel_splits; // compute the independent graph splits of different devices at the same time (e.g. CPU and GPU)
     };
 
     // model quantization parameters
@@ -393,6 +422,7 @@ extern "C" {
 
     typedef struct llama_sampler_chain_params {
         bool no_perf; // whether to measure performance timings
+        bool fused;   // whether to use the fused path when the chain supports it (see llama_sampler_chain_apply_fused)
     } llama_sampler_chain_params;
 
     // used in chat template
@@ -485,6 +515,13 @@ extern "C" {
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
 
+    // total size of the compute buffers of all the backends, in bytes
+    LLAMA_API size_t llama_get_compute_buffer_size(const struct llama_context * ctx);
+
+    // write the allocation plan of the last allocated compute graph as JSON: offset, size and lifetime of each tensor
+    // after the context is created, this is the plan of the worst-case prompt processing graph
+    LLAMA_API bool llama_dump_compute_plan(struct llama_context * ctx, const char * fname);
+
     DEPRECATED(LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model), "use llama_model_n_ctx_train instead");
     DEPRECATED(LLAMA_API int32_t llama_n_embd     (const struct llama_model * model), "use llama_model_n_embd instead");
     DEPRECATED(LLAMA_API int32_t llama_n_layer    (const struct llama_model * model), "use llama_model_n_layer instead");
@@ -881,6 +918,10 @@ extern "C" {
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // Profile the graphs computed by the context with a ggml_backend_profiler (NULL to stop)
+    // The backends are synchronized after each graph split while profiling
+    LLAMA_API void llama_set_profiler(struct llama_context * ctx, ggml_backend_profiler_t profiler);
+
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
@@ -899,6 +940,16 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Top logits for the ith token, when the context is created with n_logits_top > 0
+    // The full rows are not copied from the backend in that case, and llama_get_logits_ith returns NULL.
+    // *ids and *logits point to n_logits_top entries sorted by decreasing logit, owned by the context.
+    // Returns the number of entries, 0 when the context returns the full rows or for invalid ids.
+    LLAMA_API int32_t llama_get_logits_top_ith(
+            struct llama_context * ctx,
+                         int32_t   i,
+               const llama_token ** ids,
+                     const float ** logits);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -1029,6 +1080,64 @@ extern "C" {
                             bool   remove_special,
                             bool   unparse_special);
 
+    /// @details Aho-Corasick matcher of a set of stop strings, e.g. the antiprompts.
+    /// The text is fed incrementally and the cost of a byte does not depend on the number of stop strings.
+    LLAMA_API struct llama_stop_matcher * llama_stop_matcher_init(const char ** stop, size_t n_stop);
+
+    LLAMA_API void llama_stop_matcher_free (struct llama_stop_matcher * matcher);
+    LLAMA_API void llama_stop_matcher_reset(struct llama_stop_matcher * matcher);
+
+    /// @details Feed the text to the matcher, up to the end of the first stop string found.
+    /// @param n_fed If not NULL, set to the number of bytes that were fed.
+    /// @return Returns the index of the longest stop string that ends at the last byte fed, or -1 if no stop string was found.
+    LLAMA_API int32_t llama_stop_matcher_feed(
+            struct llama_stop_matcher * matcher,
+                           const char * text,
+                              int32_t   len,
+                              int32_t * n_fed);
+
+    /// @details Length of the longest suffix of the text fed so far that is the beginning of a stop string.
+    LLAMA_API int32_t llama_stop_matcher_n_partial(const struct llama_stop_matcher * matcher);
+
+    /// @details Incremental detokenizer for streaming the generated text.
+    /// The text is held back while it ends with an incomplete UTF-8 sequence or with the beginning of one of the stop strings.
+    /// The stop strings are matched with a llama_stop_matcher, so the cost of a step does not grow with the length of the text.
+    /// @param stop The stop strings, the text is cut before the first one that is found.
+    LLAMA_API struct llama_detokenizer * llama_detokenizer_init(
+            const struct llama_vocab * vocab,
+                          const char ** stop,
+                              size_t   n_stop);
+
+    LLAMA_API void llama_detokenizer_free (struct llama_detokenizer * detok);
+    LLAMA_API void llama_detokenizer_reset(struct llama_detokenizer * detok);
+
+    /// @details Append the pieces of the tokens and write the text that is ready to be emitted.
+    /// The tokens can be a whole run, e.g. the accepted tokens of speculative decoding. The tokens after the one that completes a stop string are not consumed.
+    /// @param n_consumed If not NULL, set to the number of consumed tokens.
+    /// @return Returns the number of chars/bytes written to text, no more than text_len_max.
+    /// @return Returns a negative number if text is too small - the number of chars/bytes that are ready. The tokens are still consumed, the text is returned by the next call.
+    /// @param special If true, special tokens are rendered in the output.
+    LLAMA_API int32_t llama_detokenizer_push(
+            struct llama_detokenizer * detok,
+                   const llama_token * tokens,
+                             int32_t   n_tokens,
+                                char * text,
+                             int32_t   text_len_max,
+                                bool   special,
+                             int32_t * n_consumed);
+
+    /// @details Write the text that is held back, at the end of the generation.
+    LLAMA_API int32_t llama_detokenizer_flush(
+            struct llama_detokenizer * detok,
+                                char * text,
+                             int32_t   text_len_max);
+
+    /// @details Index of the stop string that was found, or -1.
+    LLAMA_API int32_t llama_detokenizer_stop(const struct llama_detokenizer * detok);
+
+    /// @details The held back text ends with an incomplete UTF-8 sequence.
+    LLAMA_API bool llama_detokenizer_incomplete(const struct llama_detokenizer * detok);
+
     //
     // Chat templates
     //
@@ -1136,6 +1245,14 @@ extern "C" {
     // after removing a sampler, the chain will no longer own it, and it will not be freed when the chain is freed
     LLAMA_API struct llama_sampler * llama_sampler_chain_remove(   struct llama_sampler * chain, int32_t i);
 
+    // fused fast path of the chain, samples directly from a row of logits without building the candidates of the full vocab
+    //   the samplers before the first top-k, top-p, min-p or greedy sampler must be logit-bias, penalties or no-ops with
+    //   their parameters; only the candidates that can survive that sampler are collected, the rest of the chain is applied to them
+    //   cur_p->data must have room for n_vocab candidates, on success cur_p holds the remaining candidates and the selected token
+    //   the candidates are not in the same order as with the regular path, so the same seed does not select the same tokens
+    //   returns false without modifying cur_p if the chain was not initialized with the fused param or is not supported
+    LLAMA_API bool                   llama_sampler_chain_apply_fused(struct llama_sampler * chain, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p);
+
     // available samplers:
 
     LLAMA_API struct llama_sampler * llama_sampler_init_greedy(void);
@@ -1226,6 +1343,14 @@ extern "C" {
                const llama_token * trigger_tokens,
                             size_t num_trigger_tokens);
 
+    /// @details Text that the grammar of a grammar sampler forces next: every continuation accepted by the grammar starts with it.
+    /// Useful to draft or skip the tokens of the fixed parts of structured outputs.
+    /// @return Returns the number of bytes written to buf, no more than length. Returns 0 if nothing is forced or if smpl is not a grammar sampler.
+    LLAMA_API int32_t llama_sampler_grammar_forced_text(
+            const struct llama_sampler * smpl,
+                                  char * buf,
+                               int32_t   length);
+
 
     /// NOTE: Avoid using on the full vocabulary as searching for repeated tokens can become slow. For example, apply top-k or top-p sampling first.
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(
@@ -1281,6 +1406,7 @@ extern "C" {
     // Shorthand for:
     //    const auto * logits = llama_get_logits_ith(ctx, idx);
     //    llama_token_data_array cur_p = { ... init from logits ... };
+    //    (or from llama_get_logits_top_ith when the context returns only the top logits)
     //    llama_sampler_apply(smpl, &cur_p);
     //    auto token = cur_p.data[cur_p.selected].id;
     //    llama_sampler_accept(smpl, token);
@@ -1288,6 +1414,31 @@ extern "C" {
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    /// @details Sample and accept the tokens of several sequences from the outputs idxs[i] of the last evaluation
+    //
+    // Same as calling llama_sampler_sample(smpls[i], ctx, idxs[i]) for each i, but the rows are sampled in parallel
+    // with the generation threads of the context. Each sequence must have its own sampler (its own state and RNG)
+    // The sampled tokens are written to tokens[i]
+    // Returns 0 on success, -1 if the sampling of any of the sequences failed
+    LLAMA_API int32_t llama_sampler_sample_seqs(
+            struct llama_sampler ** smpls,
+            struct llama_context  * ctx,
+                   const int32_t * idxs,
+                         int32_t   n_seqs,
+                     llama_token * tokens);
+
+    /// @details Call fn(i, user_data) for each i in [0, n_seqs) in parallel, on the generation threads of the context
+    //
+    // This is what llama_sampler_sample_seqs uses, for the samplers that are not a single llama_sampler
+    // The threads are kept alive between the calls. fn must not call the functions that synchronize the context
+    // (e.g. llama_get_logits_ith), get the logits of the outputs before
+    // Returns 0 on success, -1 if fn failed (threw an exception) for any of the sequences
+    LLAMA_API int32_t llama_parallel_seqs(
+            struct llama_context * ctx,
+                         int32_t   n_seqs,
+                            void (*fn)(int32_t i, void * user_data),
+                            void * user_data);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
@@ -1326,6 +1477,7 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused; // number of times a compute graph has been reused
     };
 
     struct llama_perf_sampler_data {
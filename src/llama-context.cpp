@@ -5,6 +5,7 @@
 #include "llama-mmap.h"
 #include "llama-model.h"
 #include "llama-kv-cache.h"
+#include "llama-kv-cache-unified.h"
 
 #include <cinttypes>
 #include <cstring>
@@ -38,6 +39,8 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.n_logits_top     = std::min<uint32_t>(params.n_logits_top, model.vocab.n_tokens());
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -101,6 +104,10 @@ llama_context::llama_context(
 
     cparams.op_offload = params.op_offload;
 
+    cparams.graph_reuse     = params.graph_reuse;
+    cparams.graph_reorder   = params.graph_reorder;
+    cparams.parallel_splits = params.parallel_splits;
+
     const uint32_t n_ctx_per_seq = cparams.n_ctx / cparams.n_seq_max;
 
     LLAMA_LOG_INFO("%s: n_seq_max     = %u\n",   __func__, cparams.n_seq_max);
@@ -112,6 +119,9 @@ llama_context::llama_context(
     LLAMA_LOG_INFO("%s: flash_attn    = %d\n",   __func__, cparams.flash_attn);
     LLAMA_LOG_INFO("%s: freq_base     = %.1f\n", __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale    = %g\n",   __func__, cparams.rope_freq_scale);
+    if (cparams.n_logits_top > 0) {
+        LLAMA_LOG_INFO("%s: n_logits_top  = %u\n",   __func__, cparams.n_logits_top);
+    }
 
     if (n_ctx_per_seq < hparams.n_ctx_train) {
         LLAMA_LOG_WARN("%s: n_ctx_per_seq (%u) < n_ctx_train (%u) -- the full capacity of the model will not be utilized\n",
@@ -187,11 +197,16 @@ llama_context::llama_context(
     // init the memory module
     if (!hparams.vocab_only) {
         llama_memory_params params_mem = {
-            /*.type_k   =*/ params.type_k,
-            /*.type_v   =*/ params.type_v,
-            /*.swa_full =*/ params.swa_full,
+            /*.type_k      =*/ params.type_k,
+            /*.type_v      =*/ params.type_v,
+            /*.type_layers =*/ {},
+            /*.swa_full    =*/ params.swa_full,
         };
 
+        for (const auto * lt = params.kv_layer_types; lt && lt->type_k != GGML_TYPE_COUNT; ++lt) {
+            params_mem.type_layers.push_back(*lt);
+        }
+
         memory.reset(model.create_memory(params_mem, cparams));
     }
 
@@ -260,6 +275,9 @@ llama_context::llama_context(
 
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
+        } else if (cparams.parallel_splits && backend_ptrs.size() > 1) {
+            ggml_backend_sched_set_parallel_splits(sched.get(), true);
+            LLAMA_LOG_INFO("%s: parallel graph splits enabled\n", __func__);
         }
     }
 
@@ -499,39 +517,47 @@ float * llama_context::get_logits() {
 }
 
 float * llama_context::get_logits_ith(int32_t i) {
-    int32_t j = -1;
-
     try {
         if (logits == nullptr) {
             throw std::runtime_error("no logits");
         }
-
-        if (i < 0) {
-            j = n_outputs + i;
-            if (j < 0) {
-                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
-            }
-        } else if ((size_t) i >= output_ids.size()) {
-            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
-        } else {
-            j = output_ids[i];
+        if (cparams.n_logits_top > 0) {
+            throw std::runtime_error(format("only the top %u logits are available, use llama_get_logits_top_ith", cparams.n_logits_top));
         }
 
-        if (j < 0) {
-            throw std::runtime_error(format("batch.logits[%d] != true", i));
-        }
-        if (j >= n_outputs) {
-            // This should not happen
-            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
+        return logits + output_row(i)*model.vocab.n_tokens();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        GGML_ABORT("fatal error");
+#else
+        return nullptr;
+#endif
+    }
+}
+
+int32_t llama_context::get_logits_top_ith(int32_t i, const llama_token ** ids, const float ** logits) {
+    if (cparams.n_logits_top == 0) {
+        return 0;
+    }
+
+    try {
+        if (this->logits == nullptr) {
+            throw std::runtime_error("no logits");
         }
 
-        return logits + j*model.vocab.n_tokens();
+        const int32_t j = output_row(i);
+
+        *ids    = logits_ids   + j*cparams.n_logits_top;
+        *logits = this->logits + j*cparams.n_logits_top;
+
+        return cparams.n_logits_top;
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
 #ifndef NDEBUG
         GGML_ABORT("fatal error");
 #else
-        return nullptr;
+        return 0;
 #endif
     }
 }
@@ -625,22 +651,40 @@ void llama_context::set_abort_callback(bool (*abort_callback)(void * data), void
     }
 }
 
+void llama_context::set_profiler(ggml_backend_profiler_t profiler) {
+    LLAMA_LOG_DEBUG("%s: call\n", __func__);
+
+    ggml_backend_sched_set_profiler(sched.get(), profiler);
+}
+
+void llama_context::parallel_for(int32_t n, const std::function<void(int32_t)> & fn) {
+    // at least 2 iterations per thread, otherwise waking up the thread costs more than it saves
+    parallel_pool.run(n, std::min<int32_t>(cparams.n_threads, n/2), fn);
+}
+
 void llama_context::set_embeddings(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.embeddings = value;
+
+    // the graph depends on this parameter, it has to be built again
+    gf_res_prev.reset();
 }
 
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.causal_attn = value;
+
+    gf_res_prev.reset();
 }
 
 void llama_context::set_warmup(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.warmup = value;
+
+    gf_res_prev.reset();
 }
 
 void llama_context::set_adapter_lora(
@@ -649,6 +693,8 @@ void llama_context::set_adapter_lora(
     LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f\n", __func__, (void *) adapter, scale);
 
     loras[adapter] = scale;
+
+    gf_res_prev.reset();
 }
 
 bool llama_context::rm_adapter_lora(
@@ -658,6 +704,7 @@ bool llama_context::rm_adapter_lora(
     auto pos = loras.find(adapter);
     if (pos != loras.end()) {
         loras.erase(pos);
+        gf_res_prev.reset();
         return true;
     }
 
@@ -668,6 +715,8 @@ void llama_context::clear_adapter_lora() {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
     loras.clear();
+
+    gf_res_prev.reset();
 }
 
 bool llama_context::apply_adapter_cvec(
@@ -678,38 +727,58 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
+    gf_res_prev.reset();
+
     return cvec.apply(model, data, len, n_embd, il_start, il_end);
 }
 
-llm_graph_result_ptr llama_context::process_ubatch(const llama_ubatch & ubatch, llm_graph_type gtype, llama_memory_state_i * mstate, ggml_status & ret) {
+llm_graph_result_i * llama_context::process_ubatch(const llama_ubatch & ubatch, llm_graph_type gtype, llama_memory_state_i * mstate, ggml_status & ret) {
     if (mstate && !mstate->apply()) {
         LLAMA_LOG_ERROR("%s: failed to apply memory state\n", __func__);
         ret = GGML_STATUS_FAILED;
         return nullptr;
     }
 
-    auto * gf = graph_init();
-    if (!gf) {
-        LLAMA_LOG_ERROR("%s: failed to initialize graph\n", __func__);
-        ret = GGML_STATUS_FAILED;
-        return nullptr;
-    }
+    // the previous graph can be reused if the new ubatch has the same shape and the same number of KV cells
+    // in that case, only the inputs are set again, including the KV cells where the new tokens are stored
+    const bool reuse = cparams.graph_reuse && gf_res_prev && gf_type_prev == gtype &&
+        gf_res_prev->can_reuse(graph_params(ubatch, mstate));
 
-    auto res = graph_build(ctx_compute.get(), gf, ubatch, gtype, mstate);
-    if (!res) {
-        LLAMA_LOG_ERROR("%s: failed to build graph\n", __func__);
-        ret = GGML_STATUS_FAILED;
-        return nullptr;
-    }
+    if (reuse) {
+        n_reused++;
+    } else {
+        ggml_backend_sched_reset(sched.get());
 
-    // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+        auto * gf = graph_init();
+        if (!gf) {
+            LLAMA_LOG_ERROR("%s: failed to initialize graph\n", __func__);
+            ret = GGML_STATUS_FAILED;
+            return nullptr;
+        }
 
-    if (!ggml_backend_sched_alloc_graph(sched.get(), gf)) {
-        LLAMA_LOG_ERROR("%s: failed to allocate graph\n", __func__);
-        ret = GGML_STATUS_ALLOC_FAILED;
-        return nullptr;
+        auto res = graph_build(ctx_compute.get(), gf, ubatch, gtype, mstate);
+        if (!res) {
+            LLAMA_LOG_ERROR("%s: failed to build graph\n", __func__);
+            ret = GGML_STATUS_FAILED;
+            return nullptr;
+        }
+
+        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+        if (!ggml_backend_sched_alloc_graph(sched.get(), gf)) {
+            LLAMA_LOG_ERROR("%s: failed to allocate graph\n", __func__);
+            ret = GGML_STATUS_ALLOC_FAILED;
+            return nullptr;
+        }
+
+        gf_res_prev  = std::move(res);
+        gf_prev      = gf;
+        gf_type_prev = gtype;
     }
 
+    auto * res = gf_res_prev.get();
+    auto * gf  = gf_prev;
+
     res->set_inputs(&ubatch);
 
     const auto status = graph_compute(gf, ubatch.n_tokens > 1);
@@ -785,8 +854,7 @@ int llama_context::encode(llama_batch & inp_batch) {
 
     n_outputs = n_tokens;
 
-    ggml_backend_sched_reset(sched.get());
-    ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    set_eval_callback();
 
     const auto causal_attn_org = cparams.causal_attn;
 
@@ -867,7 +935,10 @@ int llama_context::encode(llama_batch & inp_batch) {
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    // with graph reuse, the graph stays allocated for the next ubatch and is reset only when it is built again
+    if (!cparams.graph_reuse) {
+        ggml_backend_sched_reset(sched.get());
+    }
 
     // TODO: hacky solution
     if (model.arch == LLM_ARCH_T5 && t_embd) {
@@ -919,10 +990,9 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     const llama_batch & batch = batch_allocr.batch;
 
-    const auto & vocab   = model.vocab;
     const auto & hparams = model.hparams;
 
-    const int32_t n_vocab = vocab.n_tokens();
+    const int64_t n_logits = n_logits_row();
 
     const int64_t n_tokens_all = batch.n_tokens;
     const int64_t n_embd       = hparams.n_embd;
@@ -1050,8 +1120,7 @@ int llama_context::decode(llama_batch & inp_batch) {
             n_outputs = n_outputs_new;
         }
 
-        ggml_backend_sched_reset(sched.get());
-        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        set_eval_callback();
 
         ggml_status status;
         const auto res = process_ubatch(ubatch, LLM_GRAPH_TYPE_DECODER, kv_state.get(), status);
@@ -1096,18 +1165,32 @@ int llama_context::decode(llama_batch & inp_batch) {
             t_embd = res->get_embd_pooled();
         }
 
+        // only the top logits are copied, the full rows stay on the backend
+        auto * t_logits_ids = t_logits ? res->get_logits_top_ids() : nullptr;
+        if (t_logits_ids) {
+            t_logits = res->get_logits_top();
+        }
+
         // extract logits
         if (t_logits && n_outputs > 0) {
             ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
             GGML_ASSERT(backend_res != nullptr);
             GGML_ASSERT(logits != nullptr);
 
-            float * logits_out = logits + n_outputs_prev*n_vocab;
+            float * logits_out = logits + n_outputs_prev*n_logits;
 
             if (n_outputs) {
                 GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
-                GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
-                ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
+                GGML_ASSERT((n_outputs_prev + n_outputs)*n_logits <= (int64_t) logits_size);
+                ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_logits*sizeof(float));
+            }
+
+            if (t_logits_ids && n_outputs) {
+                ggml_backend_t backend_ids = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits_ids);
+                GGML_ASSERT(backend_ids != nullptr);
+                GGML_ASSERT(logits_ids != nullptr);
+
+                ggml_backend_tensor_get_async(backend_ids, t_logits_ids, logits_ids + n_outputs_prev*n_logits, 0, n_outputs*n_logits*sizeof(llama_token));
             }
         }
 
@@ -1191,7 +1274,6 @@ int llama_context::decode(llama_batch & inp_batch) {
         // make the outputs have the same order they had in the user-provided batch
         // note: this is mostly relevant for recurrent models atm
         if (!sorted_output) {
-            const uint32_t n_vocab = model.vocab.n_tokens();
             const uint32_t n_embd  = model.hparams.n_embd;
 
             GGML_ASSERT((size_t) n_outputs == out_ids.size());
@@ -1208,8 +1290,13 @@ int llama_context::decode(llama_batch & inp_batch) {
                 if (j_min == i) { continue; }
                 std::swap(out_ids[i], out_ids[j_min]);
                 if (logits_size > 0) {
-                    for (uint32_t k = 0; k < n_vocab; k++) {
-                        std::swap(logits[i*n_vocab + k], logits[j_min*n_vocab + k]);
+                    for (int64_t k = 0; k < n_logits; k++) {
+                        std::swap(logits[i*n_logits + k], logits[j_min*n_logits + k]);
+                    }
+                }
+                if (logits_ids) {
+                    for (int64_t k = 0; k < n_logits; k++) {
+                        std::swap(logits_ids[i*n_logits + k], logits_ids[j_min*n_logits + k]);
                     }
                 }
                 if (embd_size > 0) {
@@ -1230,7 +1317,10 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    // with graph reuse, the graph stays allocated for the next ubatch and is reset only when it is built again
+    if (!cparams.graph_reuse) {
+        ggml_backend_sched_reset(sched.get());
+    }
 
     return 0;
 }
@@ -1241,12 +1331,10 @@ int llama_context::decode(llama_batch & inp_batch) {
 
 int32_t llama_context::output_reserve(int32_t n_outputs) {
     const auto & hparams = model.hparams;
-    const auto & vocab   = model.vocab;
 
     const int64_t n_outputs_max = std::max<int64_t>(n_outputs, n_seq_max());
 
     const auto n_batch = cparams.n_batch;
-    const auto n_vocab = vocab.n_tokens();
     const auto n_embd  = hparams.n_embd;
 
     // TODO: use a per-batch flag for logits presence instead
@@ -1259,8 +1347,11 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
         has_embd   = true;
     }
 
-    logits_size = has_logits ? n_vocab*n_outputs_max : 0;
-    embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    // with the top logits, the ids are stored after the logits
+    const int64_t n_ids = has_logits && cparams.n_logits_top > 0 ? n_logits_row()*n_outputs_max : 0;
+
+    logits_size = has_logits ? n_logits_row()*n_outputs_max : 0;
+    embd_size   = has_embd   ?         n_embd*n_outputs_max : 0;
 
     if (output_ids.empty()) {
         // init, never resized afterwards
@@ -1268,7 +1359,7 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
     }
 
     const size_t prev_size = buf_output ? ggml_backend_buffer_get_size(buf_output.get()) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size) * sizeof(float) + n_ids * sizeof(llama_token);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -1280,6 +1371,7 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
 #endif
             buf_output = nullptr;
             logits = nullptr;
+            logits_ids = nullptr;
             embd = nullptr;
         }
 
@@ -1299,8 +1391,9 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
 
     float * output_base = (float *) ggml_backend_buffer_get_base(buf_output.get());
 
-    logits = has_logits ? output_base               : nullptr;
-    embd   = has_embd   ? output_base + logits_size : nullptr;
+    logits     = has_logits ? output_base               : nullptr;
+    embd       = has_embd   ? output_base + logits_size : nullptr;
+    logits_ids = n_ids > 0  ? (llama_token *) (output_base + logits_size + embd_size) : nullptr;
 
     // set all ids as invalid (negative)
     std::fill(output_ids.begin(), output_ids.end(), -1);
@@ -1311,15 +1404,55 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
     return n_outputs_max;
 }
 
+int64_t llama_context::n_logits_row() const {
+    return cparams.n_logits_top > 0 ? cparams.n_logits_top : model.vocab.n_tokens();
+}
+
+int32_t llama_context::output_row(int32_t i) const {
+    int32_t j = -1;
+
+    if (i < 0) {
+        j = n_outputs + i;
+        if (j < 0) {
+            throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+        }
+    } else if ((size_t) i >= output_ids.size()) {
+        throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+    } else {
+        j = output_ids[i];
+    }
+
+    if (j < 0) {
+        throw std::runtime_error(format("batch.logits[%d] != true", i));
+    }
+    if (j >= n_outputs) {
+        // This should not happen
+        throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
+    }
+
+    return j;
+}
+
 //
 // graph
 //
 
 int32_t llama_context::graph_max_nodes() const {
-    return std::max<int32_t>(65536, 5*model.n_tensors());
+    int32_t res = std::max<int32_t>(65536, 5*model.n_tensors());
+
+    // paged KV cache: each contiguous range of cells in a slot needs its own K and V copy (view + view + cpy + transpose)
+    if (cparams.kv_block_size > 0) {
+        res += 8*model.hparams.n_layer*llama_kv_cache_unified::get_n_runs_max(cparams);
+    }
+
+    return res;
 }
 
 ggml_cgraph * llama_context::graph_init() {
+    // the tensors of the previous graph are freed with ctx_compute
+    gf_res_prev.reset();
+    gf_prev = nullptr;
+
     ggml_init_params params = {
         /*.mem_size   =*/ buf_compute_meta.size(),
         /*.mem_buffer =*/ buf_compute_meta.data(),
@@ -1371,28 +1504,40 @@ ggml_cgraph * llama_context::graph_reserve(uint32_t n_tokens, uint32_t n_seqs, u
     return gf;
 }
 
+llm_graph_params llama_context::graph_params(
+              const llama_ubatch & ubatch,
+      const llama_memory_state_i * mstate,
+                    ggml_context * ctx) {
+    return {
+        /*.ctx         =*/ ctx,
+        /*.arch        =*/ model.arch,
+        /*.hparams     =*/ model.hparams,
+        /*.cparams     =*/ cparams,
+        /*.ubatch      =*/ ubatch,
+        /*.sched       =*/ sched.get(),
+        /*.backend_cpu =*/ backend_cpu,
+        /*.cvec        =*/ &cvec,
+        /*.loras       =*/ &loras,
+        /*.mstate      =*/ mstate,
+        /*.cross       =*/ &cross,
+        /*.n_outputs   =*/ n_outputs,
+        /*.cb          =*/ graph_get_cb(),
+    };
+}
+
 llm_graph_result_ptr llama_context::graph_build(
                     ggml_context * ctx,
                      ggml_cgraph * gf,
               const llama_ubatch & ubatch,
                   llm_graph_type   gtype,
       const llama_memory_state_i * mstate) {
-    return model.build_graph(
-            {
-                /*.ctx         =*/ ctx,
-                /*.arch        =*/ model.arch,
-                /*.hparams     =*/ model.hparams,
-                /*.cparams     =*/ cparams,
-                /*.ubatch      =*/ ubatch,
-                /*.sched       =*/ sched.get(),
-                /*.backend_cpu =*/ backend_cpu,
-                /*.cvec        =*/ &cvec,
-                /*.loras       =*/ &loras,
-                /*.mstate      =*/ mstate,
-                /*.cross       =*/ &cross,
-                /*.n_outputs   =*/ n_outputs,
-                /*.cb          =*/ graph_get_cb(),
-            }, gf, gtype);
+    auto res = model.build_graph(graph_params(ubatch, mstate, ctx), gf, gtype);
+
+    if (cparams.graph_reorder) {
+        ggml_graph_reorder_min_memory(gf);
+    }
+
+    return res;
 }
 
 ggml_status llama_context::graph_compute(
@@ -1455,6 +1600,57 @@ llm_graph_cb llama_context::graph_get_cb() const {
     };
 }
 
+void llama_context::set_eval_callback() {
+    if (model.moe_lazy()) {
+        ggml_backend_sched_set_eval_callback(sched.get(), moe_eval_callback, this);
+    } else {
+        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    }
+}
+
+bool llama_context::moe_eval_callback(ggml_tensor * t, bool ask, void * user_data) {
+    auto * lctx = (llama_context *) user_data;
+
+    const char * prefix = "ffn_moe_argsort-";
+    const bool is_argsort = strncmp(t->name, prefix, strlen(prefix)) == 0;
+
+    if (ask) {
+        // the scheduler computes the graph up to the first node that is needed
+        lctx->moe_cb_eval_need = lctx->cparams.cb_eval && lctx->cparams.cb_eval(t, true, lctx->cparams.cb_eval_user_data);
+
+        return is_argsort || lctx->moe_cb_eval_need;
+    }
+
+    if (is_argsort) {
+        // [n_expert, n_tokens], the first n_expert_used of each row are the selected experts
+        const int64_t n_expert      = t->ne[0];
+        const int64_t n_expert_used = lctx->model.hparams.n_expert_used;
+
+        std::vector<int32_t> ids(ggml_nelements(t));
+        ggml_backend_tensor_get(t, ids.data(), 0, ggml_nbytes(t));
+
+        std::vector<int32_t> experts;
+        std::vector<bool>    used(n_expert, false);
+        for (int64_t i = 0; i < ggml_nrows(t); ++i) {
+            for (int64_t k = 0; k < n_expert_used; ++k) {
+                const int32_t e = ids[i*n_expert + k];
+                if (!used[e]) {
+                    used[e] = true;
+                    experts.push_back(e);
+                }
+            }
+        }
+
+        lctx->model.moe_record(atoi(t->name + strlen(prefix)), experts);
+    }
+
+    if (lctx->moe_cb_eval_need) {
+        return lctx->cparams.cb_eval(t, false, lctx->cparams.cb_eval_user_data);
+    }
+
+    return true;
+}
+
 //
 // state save/load
 //
@@ -1606,6 +1802,10 @@ size_t llama_context::state_get_size() {
 size_t llama_context::state_get_data(uint8_t * dst, size_t size) {
     llama_io_write_buffer io(dst, size);
     try {
+        // apply the pending copy-on-write copies and K-shift, so that the saved cells hold their data
+        // note: not done in state_write_data, which also computes the size of the state
+        kv_self_update(false);
+
         return state_write_data(io);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error saving state: %s\n", __func__, err.what());
@@ -1636,6 +1836,8 @@ size_t llama_context::state_seq_get_size(llama_seq_id seq_id) {
 size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size) {
     llama_io_write_buffer io(dst, size);
     try {
+        kv_self_update(false);
+
         return state_seq_write_data(io, seq_id);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error saving state: %s\n", __func__, err.what());
@@ -1706,6 +1908,8 @@ bool llama_context::state_save_file(const char * filepath, const llama_token * t
     file.write_u32((uint32_t) n_token_count);
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
+    kv_self_update(false);
+
     // save the context state using stream saving
     llama_io_write_file io(&file);
     state_write_data(io);
@@ -1766,6 +1970,8 @@ size_t llama_context::state_seq_save_file(llama_seq_id seq_id, const char * file
     file.write_u32((uint32_t) n_token_count);
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
+    kv_self_update(false);
+
     // save the context state using stream saving
     llama_io_write_file io(&file);
     state_seq_write_data(io, seq_id);
@@ -1822,7 +2028,9 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
     {
         LLAMA_LOG_DEBUG("%s: - writing logits\n", __func__);
 
-        const uint64_t logits_size = std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * model.vocab.n_tokens());
+        // the top logits are not saved, they are recomputed when the last token is evaluated again
+        const uint64_t logits_size = cparams.n_logits_top > 0 ? 0 :
+            std::min((uint64_t) this->logits_size, (uint64_t) n_outputs * model.vocab.n_tokens());
 
         io.write(&logits_size, sizeof(logits_size));
 
@@ -1907,12 +2115,19 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
         uint64_t logits_size;
         io.read_to(&logits_size, sizeof(logits_size));
 
-        if (this->logits_size < logits_size) {
-            throw std::runtime_error("logits buffer too small");
-        }
+        if (cparams.n_logits_top > 0) {
+            // the full rows of a context without n_logits_top are not used
+            if (logits_size) {
+                io.read(logits_size * sizeof(float));
+            }
+        } else {
+            if (this->logits_size < logits_size) {
+                throw std::runtime_error("logits buffer too small");
+            }
 
-        if (logits_size) {
-            io.read_to(this->logits, logits_size * sizeof(float));
+            if (logits_size) {
+                io.read_to(this->logits, logits_size * sizeof(float));
+            }
         }
     }
 
@@ -1980,6 +2195,7 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_eval_ms   = 1e-3 * t_eval_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_reused    = n_reused;
 
     return data;
 }
@@ -1988,6 +2204,7 @@ void llama_context::perf_reset() {
     t_start_us  = ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+    n_reused    = 0;
 }
 
 //
@@ -2237,6 +2454,12 @@ llama_context_params llama_context_default_params() {
         /*.no_perf                     =*/ true,
         /*.op_offload                  =*/ true,
         /*.swa_full                    =*/ true,
+        /*.kv_block_size               =*/ 0,
+        /*.kv_layer_types              =*/ nullptr,
+        /*.n_logits_top                =*/ 0,
+        /*.graph_reuse                 =*/ false,
+        /*.graph_reorder               =*/ false,
+        /*.parallel_splits             =*/ false,
     };
 
     return result;
@@ -2270,6 +2493,13 @@ llama_context * llama_init_from_model(
         return nullptr;
     }
 
+    for (const auto * lt = params.kv_layer_types; lt && lt->type_k != GGML_TYPE_COUNT; ++lt) {
+        if (ggml_is_quantized(lt->type_v) && !params.flash_attn) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+            return nullptr;
+        }
+    }
+
     try {
         auto * ctx = new llama_context(*model, params);
         return ctx;
@@ -2307,6 +2537,21 @@ uint32_t llama_n_seq_max(const llama_context * ctx) {
     return ctx->n_seq_max();
 }
 
+size_t llama_get_compute_buffer_size(const llama_context * ctx) {
+    ggml_backend_sched_t sched = ctx->get_sched();
+
+    size_t size = 0;
+    for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
+        size += ggml_backend_sched_get_buffer_size(sched, ggml_backend_sched_get_backend(sched, i));
+    }
+
+    return size;
+}
+
+bool llama_dump_compute_plan(llama_context * ctx, const char * fname) {
+    return ggml_backend_sched_dump_alloc_plan(ctx->get_sched(), fname);
+}
+
 const llama_model * llama_get_model(const llama_context * ctx) {
     return &ctx->get_model();
 }
@@ -2351,6 +2596,23 @@ void llama_set_abort_callback(llama_context * ctx, bool (*abort_callback)(void *
     ctx->set_abort_callback(abort_callback, abort_callback_data);
 }
 
+void llama_set_profiler(llama_context * ctx, ggml_backend_profiler_t profiler) {
+    ctx->set_profiler(profiler);
+}
+
+int32_t llama_parallel_seqs(llama_context * ctx, int32_t n_seqs, void (*fn)(int32_t i, void * user_data), void * user_data) {
+    try {
+        ctx->parallel_for(n_seqs, [fn, user_data](int32_t i) {
+            fn(i, user_data);
+        });
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return -1;
+    }
+
+    return 0;
+}
+
 void llama_set_embeddings(llama_context * ctx, bool embeddings) {
     ctx->set_embeddings(embeddings);
 }
@@ -2379,6 +2641,12 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+int32_t llama_get_logits_top_ith(llama_context * ctx, int32_t i, const llama_token ** ids, const float ** logits) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_ith(i, ids, logits);
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2742,6 +3010,7 @@ void llama_perf_context_print(const llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
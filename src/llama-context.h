@@ -5,10 +5,12 @@
 #include "llama-cparams.h"
 #include "llama-graph.h"
 #include "llama-adapter.h"
+#include "llama-parallel.h"
 
 #include "ggml-cpp.h"
 #include "ggml-opt.h"
 
+#include <functional>
 #include <map>
 #include <vector>
 
@@ -60,6 +62,8 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    int32_t get_logits_top_ith(int32_t i, const llama_token ** ids, const float ** logits);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
@@ -74,6 +78,11 @@ struct llama_context {
 
     void set_abort_callback(bool (*abort_callback)(void * data), void * abort_callback_data);
 
+    void set_profiler(ggml_backend_profiler_t profiler);
+
+    // calls fn(i) for i in [0, n) on the generation threads of the context, see llama_parallel_pool::run()
+    void parallel_for(int32_t n, const std::function<void(int32_t)> & fn);
+
     void set_embeddings (bool value);
     void set_causal_attn(bool value);
     void set_warmup(bool value);
@@ -98,7 +107,8 @@ struct llama_context {
     // if memory_state is provided, it will be applied first to the context's memory
     // ret contains the status of the graph computation
     // returns nullptr only if ret != GGML_STATUS_SUCCESS
-    llm_graph_result_ptr process_ubatch(
+    // the result is owned by the context and is valid until the next call
+    llm_graph_result_i * process_ubatch(
               const llama_ubatch & ubatch,
                   llm_graph_type   gtype,
             llama_memory_state_i * mstate,
@@ -185,6 +195,12 @@ private:
     // Returns max number of outputs for which space was reserved.
     int32_t output_reserve(int32_t n_outputs);
 
+    // number of logits per output in the logits buffer (n_vocab, or n_logits_top)
+    int64_t n_logits_row() const;
+
+    // row of the ith output in the output buffers, throws for invalid ids
+    int32_t output_row(int32_t i) const;
+
     //
     // graph
     //
@@ -202,6 +218,12 @@ public:
     ggml_cgraph * graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs, const llama_memory_state_i * mstate);
 
 private:
+    // the parameters used to build the graph of the ubatch, also compared to the ones of the previous graph
+    llm_graph_params graph_params(
+              const llama_ubatch & ubatch,
+      const llama_memory_state_i * mstate,
+                    ggml_context * ctx = nullptr);
+
     llm_graph_result_ptr graph_build(
                     ggml_context * ctx,
                      ggml_cgraph * gf,
@@ -211,6 +233,13 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // the eval callback of the scheduler: cparams.cb_eval, with lazy MoE experts wrapped by moe_eval_callback
+    void set_eval_callback();
+
+    // records the experts selected by each layer as soon as the selection is computed, before they are used
+    // the nodes are passed to cparams.cb_eval too
+    static bool moe_eval_callback(ggml_tensor * t, bool ask, void * user_data);
+
     // TODO: read/write lora adapters and cvec
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
@@ -236,8 +265,10 @@ private:
     bool memory_force_optimize = false;
 
     // decode output (2-dimensional array: [n_outputs][n_vocab])
-    size_t  logits_size = 0; // capacity (of floats) for logits
-    float * logits      = nullptr;
+    // with n_logits_top > 0: [n_outputs][n_logits_top], with the token ids in logits_ids
+    size_t        logits_size = 0; // capacity (of floats) for logits
+    float       * logits      = nullptr;
+    llama_token * logits_ids  = nullptr;
 
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
@@ -260,6 +291,15 @@ private:
 
     ggml_context_ptr ctx_compute;
 
+    // the graph of the last ubatch, reused for the next one when only the data of its inputs changes
+    // reset by graph_init() and by any change of the parameters used to build the graph
+    llm_graph_result_ptr gf_res_prev;
+    ggml_cgraph *        gf_prev      = nullptr;
+    llm_graph_type       gf_type_prev = LLM_GRAPH_TYPE_DEFAULT;
+
+    // with lazy MoE experts, cparams.cb_eval asked for the node that is computed next
+    bool moe_cb_eval_need = false;
+
     // training
     ggml_opt_context_t opt_ctx = nullptr;
 
@@ -294,4 +334,8 @@ private:
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+
+    mutable int32_t n_reused = 0; // number of ubatches that reused the graph of the previous one
+
+    llama_parallel_pool parallel_pool;
 };
@@ -26,6 +26,9 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t kv_block_size; // paged KV cache block size (0 = disabled)
+    uint32_t n_logits_top;  // number of top logits per output computed in the graph (0 = full rows)
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
@@ -33,6 +36,9 @@ struct llama_cparams {
     bool no_perf;
     bool warmup;
     bool op_offload;
+    bool graph_reuse;
+    bool graph_reorder;
+    bool parallel_splits;
 
     enum llama_pooling_type pooling_type;
 
@@ -4,10 +4,15 @@
 #include "llama-vocab.h"
 #include "llama-sampling.h"
 
+#include "unicode.h"
+
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
 
+// minimum number of candidates for computing the allowed tokens of a grammar state for the whole vocab
+#define LLAMA_GRAMMAR_MASK_MIN_CANDIDATES 256
+
 //
 // helpers
 //
@@ -823,11 +828,14 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
     return grammar->stacks;
 }
 
-void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+static llama_grammar_stacks llama_grammar_accept_chr(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+                          uint32_t   chr) {
     llama_grammar_stacks stacks_new;
-    stacks_new.reserve(grammar->stacks.size());
+    stacks_new.reserve(stacks.size());
 
-    for (const auto & stack : grammar->stacks) {
+    for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
         }
@@ -841,11 +849,15 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new);
         }
     }
 
-    grammar->stacks = std::move(stacks_new);
+    return stacks_new;
+}
+
+void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    grammar->stacks = llama_grammar_accept_chr(grammar->rules, grammar->stacks, chr);
 }
 
 llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
@@ -903,6 +915,171 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+//
+// token trie
+//
+
+llama_grammar_trie::llama_grammar_trie(const llama_vocab & vocab) {
+    struct entry {
+        std::vector<uint32_t> code_points;
+        llama_token           id;
+        llama_partial_utf8    partial_utf8;
+    };
+
+    std::vector<entry> entries;
+    entries.reserve(vocab.n_tokens());
+
+    for (llama_token id = 0; id < (llama_token) vocab.n_tokens(); ++id) {
+        const std::string & piece = vocab.token_to_piece(id);
+        if (vocab.is_eog(id) || piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        auto decoded = decode_utf8(piece, { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+
+        decoded.first.pop_back(); // terminating 0
+        entries.push_back({ std::move(decoded.first), id, decoded.second });
+    }
+
+    // with sorted sequences, the children of a node are created in order and shared prefixes are adjacent
+    std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+        return a.code_points < b.code_points;
+    });
+
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> node_children(1);
+    std::vector<std::vector<std::pair<llama_token, llama_partial_utf8>>> node_tokens(1);
+
+    for (const auto & e : entries) {
+        uint32_t cur = 0;
+        for (const uint32_t cp : e.code_points) {
+            auto & kids = node_children[cur];
+            if (kids.empty() || kids.back().first != cp) {
+                kids.emplace_back(cp, (uint32_t) node_children.size());
+                node_children.emplace_back();
+                node_tokens.emplace_back();
+            }
+            cur = node_children[cur].back().second;
+        }
+        node_tokens[cur].emplace_back(e.id, e.partial_utf8);
+    }
+
+    nodes.resize(node_children.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i] = { (uint32_t) children.size(), (uint32_t) node_children[i].size(), (uint32_t) tokens.size(), (uint32_t) node_tokens[i].size() };
+        children.insert(children.end(), node_children[i].begin(), node_children[i].end());
+        tokens.insert(tokens.end(), node_tokens[i].begin(), node_tokens[i].end());
+    }
+}
+
+const llama_grammar_mask_cache::mask_t * llama_grammar_mask_cache::get(const llama_grammar_stacks & stacks) {
+    auto it = index.find(stacks);
+    if (it == index.end()) {
+        return nullptr;
+    }
+
+    entries.splice(entries.begin(), entries, it->second);
+
+    return &it->second->second;
+}
+
+const llama_grammar_mask_cache::mask_t * llama_grammar_mask_cache::put(const llama_grammar_stacks & stacks, mask_t && mask) {
+    if (entries.size() >= n_max) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+
+    entries.emplace_front(stacks, std::move(mask));
+    index[stacks] = entries.begin();
+
+    return &entries.front().second;
+}
+
+// sets the bits of the tokens below node i_node that the stack allows
+// same logic as llama_grammar_reject_candidates_for_stack(), with the work shared by the tokens with a common prefix
+static void llama_grammar_trie_walk(
+        const llama_grammar_rules & rules,
+        const llama_grammar_trie  & trie,
+        const llama_grammar_stack & stack,
+                         uint32_t   i_node,
+            std::vector<uint64_t> & mask) {
+    const auto & node = trie.nodes[i_node];
+
+    const auto * tok_first = trie.tokens.data() + node.i_token;
+    const auto * tok_last  = tok_first + node.n_token;
+
+    if (stack.empty()) {
+        // the grammar is complete, only the tokens that end here with a full code point are allowed
+        for (const auto * tok = tok_first; tok != tok_last; ++tok) {
+            if (tok->second.n_remain == 0) {
+                mask[tok->first / 64] |= uint64_t(1) << (tok->first % 64);
+            }
+        }
+        return;
+    }
+
+    const llama_grammar_element * pos = stack.back();
+
+    for (const auto * tok = tok_first; tok != tok_last; ++tok) {
+        if (tok->second.n_remain == 0 || llama_grammar_match_partial_char(pos, tok->second)) {
+            mask[tok->first / 64] |= uint64_t(1) << (tok->first % 64);
+        }
+    }
+
+    if (node.n_child == 0) {
+        return;
+    }
+
+    llama_grammar_stacks next_stacks;
+    bool advanced = false;
+
+    auto visit = [&](uint32_t i_child) {
+        if (!advanced) {
+            const auto * pos_after = llama_grammar_match_char(pos, 0).second;
+
+            // update top of stack to next element, if any
+            llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+            if (!llama_grammar_is_end_of_sequence(pos_after)) {
+                stack_after.push_back(pos_after);
+            }
+            llama_grammar_advance_stack(rules, stack_after, next_stacks);
+            advanced = true;
+        }
+
+        for (const auto & next_stack : next_stacks) {
+            llama_grammar_trie_walk(rules, trie, next_stack, i_child, mask);
+        }
+    };
+
+    const auto * first = trie.children.data() + node.i_child;
+    const auto * last  = first + node.n_child;
+
+    if (pos->type == LLAMA_GRETYPE_CHAR) {
+        // only visit the children in the chars and ranges of the element
+        const llama_grammar_element * cur = pos;
+        do {
+            const uint32_t lo = cur->value;
+            const uint32_t hi = cur[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ? cur[1].value : cur->value;
+            cur += cur[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ? 2 : 1;
+
+            auto it = std::lower_bound(first, last, lo, [](const std::pair<uint32_t, uint32_t> & child, uint32_t cp) {
+                return child.first < cp;
+            });
+            for (; it != last && it->first <= hi; ++it) {
+                visit(it->second);
+            }
+        } while (cur->type == LLAMA_GRETYPE_CHAR_ALT);
+    } else {
+        for (const auto * it = first; it != last; ++it) {
+            if (llama_grammar_match_char(pos, it->first).first) {
+                visit(it->second);
+            }
+        }
+    }
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -970,6 +1147,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .mask_cache = */       {},
     };
 }
 
@@ -1075,6 +1253,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .mask_cache = */       {},
     };
 }
 
@@ -1097,6 +1276,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        /* .mask_cache = */ {},
     };
 
     // redirect elements in stacks to point to new rules
@@ -1130,6 +1310,38 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    // the allowed tokens of the state are cached, or computed for the whole vocab when there are enough candidates
+    // for small candidate sets (e.g. checking a single sampled token) matching the candidates directly is cheaper
+    if (grammar.partial_utf8.n_remain == 0) {
+        const auto * mask = grammar.mask_cache.get(grammar.stacks);
+
+        if (mask == nullptr && cur_p->size >= LLAMA_GRAMMAR_MASK_MIN_CANDIDATES) {
+            const auto & trie = grammar.vocab->get_grammar_trie();
+
+            llama_grammar_mask_cache::mask_t mask_new((grammar.vocab->n_tokens() + 63) / 64, 0);
+            for (const auto & stack : grammar.stacks) {
+                llama_grammar_trie_walk(grammar.rules, trie, stack, 0, mask_new);
+            }
+
+            mask = grammar.mask_cache.put(grammar.stacks, std::move(mask_new));
+        }
+
+        if (mask != nullptr) {
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                const llama_token id = cur_p->data[i].id;
+
+                if (grammar.vocab->is_eog(id)) {
+                    if (!allow_eog) {
+                        cur_p->data[i].logit = -INFINITY;
+                    }
+                } else if (((*mask)[id / 64] & (uint64_t(1) << (id % 64))) == 0) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            }
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -1213,6 +1425,53 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
     llama_grammar_accept_str(grammar, piece);
 }
 
+std::string llama_grammar_forced_text_impl(const struct llama_grammar & grammar, size_t n_max) {
+    std::string result;
+
+    if (grammar.awaiting_trigger || grammar.partial_utf8.n_remain > 0) {
+        return result;
+    }
+
+    llama_grammar_stacks stacks = grammar.stacks;
+
+    while (!stacks.empty()) {
+        // the next code point is forced if all the stacks expect the same single character
+        bool     forced = true;
+        uint32_t chr    = 0;
+
+        for (size_t i = 0; i < stacks.size() && forced; ++i) {
+            if (stacks[i].empty()) {
+                // the grammar can also end here
+                forced = false;
+                break;
+            }
+
+            const llama_grammar_element * pos = stacks[i].back();
+
+            forced = pos[0].type == LLAMA_GRETYPE_CHAR &&
+                     pos[1].type != LLAMA_GRETYPE_CHAR_ALT &&
+                     pos[1].type != LLAMA_GRETYPE_CHAR_RNG_UPPER &&
+                     (i == 0 || pos[0].value == chr);
+
+            chr = pos[0].value;
+        }
+
+        if (!forced) {
+            break;
+        }
+
+        const std::string chr_str = unicode_cpt_to_utf8(chr);
+        if (result.size() + chr_str.size() > n_max) {
+            break;
+        }
+
+        result += chr_str;
+        stacks  = llama_grammar_accept_chr(grammar.rules, stacks, chr);
+    }
+
+    return result;
+}
+
 void llama_grammar_accept_str(struct llama_grammar & grammar, const std::string & piece) {
     // Note terminating 0 in decoded string
     const auto   decoded     = decode_utf8(piece, grammar.partial_utf8);
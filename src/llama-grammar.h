@@ -2,6 +2,7 @@
 
 #include "llama.h"
 
+#include <list>
 #include <map>
 #include <regex>
 #include <string>
@@ -76,6 +77,42 @@ std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
         const llama_grammar_stack      & stack,
         const llama_grammar_candidates & candidates);
 
+// trie of the code points of the token pieces of a vocab, built once per vocab (see llama_vocab::get_grammar_trie)
+// the tokens allowed by a grammar stack are found by walking the trie once, instead of matching every token
+struct llama_grammar_trie {
+    struct node {
+        uint32_t i_child; // children in [i_child, i_child + n_child)
+        uint32_t n_child;
+        uint32_t i_token; // tokens that end at this node in [i_token, i_token + n_token)
+        uint32_t n_token;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+
+    // (code point, node), sorted by code point for the children of each node
+    std::vector<std::pair<uint32_t, uint32_t>> children;
+
+    // the tokens and the incomplete UTF-8 sequence they end with, if any
+    // EOG tokens and tokens that are not valid UTF-8 are not in the trie
+    std::vector<std::pair<llama_token, llama_partial_utf8>> tokens;
+
+    explicit llama_grammar_trie(const llama_vocab & vocab);
+};
+
+// LRU cache of the allowed tokens of the most recent grammar states
+struct llama_grammar_mask_cache {
+    using mask_t = std::vector<uint64_t>; // bit `id` is set if token `id` is allowed
+
+    static constexpr size_t n_max = 32;
+
+    // most recently used first
+    std::list<std::pair<llama_grammar_stacks, mask_t>> entries;
+    std::map<llama_grammar_stacks, decltype(entries)::iterator> index;
+
+    const mask_t * get(const llama_grammar_stacks & stacks);
+    const mask_t * put(const llama_grammar_stacks & stacks, mask_t && mask);
+};
+
 struct llama_grammar_parser {
     std::map<std::string, uint32_t> symbol_ids;
 
@@ -132,6 +169,8 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // allowed tokens of the recent states, the keys point into `rules` so the cache is not copied by clones
+    mutable llama_grammar_mask_cache mask_cache;
 };
 
 //
@@ -171,3 +210,8 @@ void llama_grammar_accept_impl(
 void llama_grammar_accept_str(
               struct llama_grammar & grammar,
                  const std::string & piece);
+
+// text that every continuation accepted by the grammar starts with, up to n_max bytes
+std::string llama_grammar_forced_text_impl(
+        const struct llama_grammar & grammar,
+                            size_t   n_max);
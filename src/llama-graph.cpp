@@ -27,6 +27,15 @@ void llm_graph_input_embd::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_embd::can_reuse(const llm_graph_params & params) {
+    bool res = true;
+
+    res &= (!tokens && !params.ubatch.token) || (tokens && tokens->ne[0] == params.ubatch.n_tokens);
+    res &= (!embd   && !params.ubatch.embd)  || (embd   &&   embd->ne[1] == params.ubatch.n_tokens);
+
+    return res;
+}
+
 void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
     if (ubatch->pos && pos) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -49,6 +58,10 @@ void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_pos::can_reuse(const llm_graph_params & params) {
+    return pos->ne[0] == params.ubatch.n_tokens*n_pos_per_embd;
+}
+
 void llm_graph_input_attn_temp::set_input(const llama_ubatch * ubatch) {
     if (ubatch->pos && attn_scale) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -65,6 +78,10 @@ void llm_graph_input_attn_temp::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_attn_temp::can_reuse(const llm_graph_params & params) {
+    return attn_scale->ne[2] == params.ubatch.n_tokens;
+}
+
 void llm_graph_input_pos_bucket::set_input(const llama_ubatch * ubatch) {
     if (pos_bucket) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -125,6 +142,10 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_out_ids::can_reuse(const llm_graph_params & params) {
+    return n_outputs == params.n_outputs;
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -367,6 +388,26 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     if (self_kq_mask) {
         kv_state->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
     }
+
+    if (self_kv_idxs) {
+        kv_state->set_input_kv_idxs(self_kv_idxs);
+    }
+}
+
+bool llm_graph_input_attn_kv_unified::can_reuse(const llm_graph_params & params) {
+    const auto * kv_state_new = static_cast<const llama_kv_cache_unified_state *>(params.mstate);
+
+    bool res = true;
+
+    // without the cells as an input, the stores are copies to views of the cells of the previous ubatch
+    res &= self_kv_idxs != nullptr;
+
+    res &= self_kq_mask->ne[0] == kv_state_new->get_n_kv();
+    res &= self_kq_mask->ne[1] == GGML_PAD(params.ubatch.n_tokens, GGML_KQ_MASK_PAD);
+
+    kv_state = kv_state_new;
+
+    return res;
 }
 
 void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch) {
@@ -377,6 +418,31 @@ void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch
     if (self_kq_mask_swa) {
         kv_state->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn);
     }
+
+    if (self_kv_idxs) {
+        kv_state->get_base()->set_input_kv_idxs(self_kv_idxs);
+    }
+
+    if (self_kv_idxs_swa) {
+        kv_state->get_swa()->set_input_kv_idxs(self_kv_idxs_swa);
+    }
+}
+
+bool llm_graph_input_attn_kv_unified_iswa::can_reuse(const llm_graph_params & params) {
+    const auto * kv_state_new = static_cast<const llama_kv_cache_unified_iswa_state *>(params.mstate);
+
+    bool res = true;
+
+    res &= self_kv_idxs != nullptr && self_kv_idxs_swa != nullptr;
+
+    res &= !self_kq_mask     || self_kq_mask->ne[0]     == kv_state_new->get_base()->get_n_kv();
+    res &= !self_kq_mask_swa || self_kq_mask_swa->ne[0] == kv_state_new->get_swa ()->get_n_kv();
+    res &= !self_kq_mask     || self_kq_mask->ne[1]     == GGML_PAD(params.ubatch.n_tokens, GGML_KQ_MASK_PAD);
+    res &= !self_kq_mask_swa || self_kq_mask_swa->ne[1] == GGML_PAD(params.ubatch.n_tokens, GGML_KQ_MASK_PAD);
+
+    kv_state = kv_state_new;
+
+    return res;
 }
 
 void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
@@ -412,6 +478,27 @@ void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+//
+// llm_graph_result
+//
+
+bool llm_graph_result::can_reuse(const llm_graph_params & params) {
+    bool res = true;
+
+    res &= n_tokens     == params.ubatch.n_tokens;
+    res &= n_seq_tokens == params.ubatch.n_seq_tokens;
+    res &= n_seqs       == params.ubatch.n_seqs;
+    res &= equal_seqs   == params.ubatch.equal_seqs;
+    res &= has_token    == (params.ubatch.token != nullptr);
+    res &= n_outputs    == params.n_outputs;
+
+    for (auto & input : inputs) {
+        res = res && input->can_reuse(params);
+    }
+
+    return res;
+}
+
 //
 // llm_graph_context
 //
@@ -455,7 +542,13 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     cross            (params.cross),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
-    }
+    res->n_tokens     = ubatch.n_tokens;
+    res->n_seq_tokens = ubatch.n_seq_tokens;
+    res->n_seqs       = ubatch.n_seqs;
+    res->equal_seqs   = ubatch.equal_seqs;
+    res->has_token    = ubatch.token != nullptr;
+    res->n_outputs    = params.n_outputs;
+}
 
 int64_t llm_graph_context::n_pos_per_embd() const {
     return hparams.rope_type == LLAMA_ROPE_TYPE_MROPE ? 4 : 1;
@@ -662,7 +755,8 @@ ggml_tensor * llm_graph_context::build_ffn(
     }
 
     if (gate && type_gate == LLM_FFN_PAR) {
-        cur = ggml_mul(ctx0, cur, tmp);
+        // the activation is the last operand, so that it is computed right before the product and the backends can fuse them
+        cur = ggml_mul(ctx0, tmp, cur);
         cb(cur, "ffn_gate_par", il);
     }
 
@@ -802,7 +896,7 @@ ggml_tensor * llm_graph_context::build_moe_ffn(
     }
 
     if (gate_exps) {
-        cur = ggml_mul(ctx0, cur, up); // [n_ff, n_expert_used, n_tokens]
+        cur = ggml_mul(ctx0, up, cur); // [n_ff, n_expert_used, n_tokens]
         cb(cur, "ffn_moe_gate_par", il);
     }
 
@@ -1247,6 +1341,12 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
         ggml_set_input(inp->self_kq_mask);
 
         inp->self_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask, GGML_TYPE_F16) : inp->self_kq_mask;
+
+        // with graph reuse, the cells of the ubatch are an input so that the stores do not depend on them
+        if (cparams.graph_reuse && kv_state->get_supports_set_rows()) {
+            inp->self_kv_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+            ggml_set_input(inp->self_kv_idxs);
+        }
     }
 
     return (llm_graph_input_attn_kv_unified *) res->add_input(std::move(inp));
@@ -1274,8 +1374,8 @@ ggml_tensor * llm_graph_context::build_attn(
 
     // store to KV cache
     {
-        ggml_build_forward_expand(gf, kv_state->cpy_k(ctx0, k_cur, il));
-        ggml_build_forward_expand(gf, kv_state->cpy_v(ctx0, v_cur, il));
+        kv_state->cpy_k(ctx0, gf, k_cur, inp->self_kv_idxs, il);
+        kv_state->cpy_v(ctx0, gf, v_cur, inp->self_kv_idxs, il);
     }
 
     const auto & kq_mask = inp->get_kq_mask();
@@ -1315,6 +1415,11 @@ llm_graph_input_attn_kv_unified_iswa * llm_graph_context::build_attn_inp_kv_unif
         ggml_set_input(inp->self_kq_mask);
 
         inp->self_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask, GGML_TYPE_F16) : inp->self_kq_mask;
+
+        if (cparams.graph_reuse && kv_state->get_base()->get_supports_set_rows()) {
+            inp->self_kv_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+            ggml_set_input(inp->self_kv_idxs);
+        }
     }
 
     {
@@ -1327,6 +1432,11 @@ llm_graph_input_attn_kv_unified_iswa * llm_graph_context::build_attn_inp_kv_unif
         ggml_set_input(inp->self_kq_mask_swa);
 
         inp->self_kq_mask_swa_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask_swa, GGML_TYPE_F16) : inp->self_kq_mask_swa;
+
+        if (cparams.graph_reuse && kv_state->get_swa()->get_supports_set_rows()) {
+            inp->self_kv_idxs_swa = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+            ggml_set_input(inp->self_kv_idxs_swa);
+        }
     }
 
     return (llm_graph_input_attn_kv_unified_iswa *) res->add_input(std::move(inp));
@@ -1356,10 +1466,12 @@ ggml_tensor * llm_graph_context::build_attn(
 
     const auto * kv_state = is_swa ? kv_state_iswa->get_swa() : kv_state_iswa->get_base();
 
+    ggml_tensor * kv_idxs = is_swa ? inp->self_kv_idxs_swa : inp->self_kv_idxs;
+
     // store to KV cache
     {
-        ggml_build_forward_expand(gf, kv_state->cpy_k(ctx0, k_cur, il));
-        ggml_build_forward_expand(gf, kv_state->cpy_v(ctx0, v_cur, il));
+        kv_state->cpy_k(ctx0, gf, k_cur, kv_idxs, il);
+        kv_state->cpy_v(ctx0, gf, v_cur, kv_idxs, il);
     }
 
     const auto & kq_mask = is_swa ? inp->get_kq_mask_swa() : inp->get_kq_mask();
@@ -1597,6 +1709,42 @@ void llm_graph_context::build_pooling(
     ggml_build_forward_expand(gf, cur);
 }
 
+void llm_graph_context::build_logits_top(ggml_cgraph * gf) const {
+    if (cparams.embeddings || cparams.n_logits_top == 0 || res->t_logits == nullptr) {
+        return;
+    }
+
+    ggml_tensor * logits = res->t_logits;
+
+    const int64_t n_vocab = logits->ne[0];
+    const int64_t n_out   = logits->ne[1];
+    const int64_t n_top   = cparams.n_logits_top;
+
+    ggml_tensor * ids;
+    if (n_top == 1) {
+        // greedy: a single pass over the rows instead of a sort
+        ids = ggml_reshape_2d(ctx0, ggml_argmax(ctx0, logits), 1, n_out);
+    } else {
+        // the GPU backends sort a row in a single block and do not support the argsort of a full vocab row,
+        // the scheduler computes it on the CPU then
+        ids = ggml_cont(ctx0, ggml_top_k(ctx0, logits, n_top));
+    }
+    cb(ids, "result_output_top_ids", -1);
+
+    // the ids are read back too, so they must not be overwritten by get_rows
+    ggml_set_output(ids);
+
+    // gather the logits of the selected tokens, each row of logits is a column of single-element rows
+    ggml_tensor * cur = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, logits, 1, n_vocab, n_out), ids);
+    cur = ggml_reshape_2d(ctx0, cur, n_top, n_out);
+    cb(cur, "result_output_top", -1);
+
+    res->t_logits_top     = cur;
+    res->t_logits_top_ids = ids;
+
+    ggml_build_forward_expand(gf, cur);
+}
+
 int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t n_buckets, bool bidirectional) {
     // TODO move to hparams if a T5 variant appears that uses a different value
     const int64_t max_distance = 128;
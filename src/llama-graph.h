@@ -17,6 +17,8 @@ struct ggml_tensor;
 struct llama_ubatch;
 struct llama_cparams;
 
+struct llm_graph_params;
+
 class llama_memory_state_i;
 
 class llama_kv_cache_unified_state;
@@ -75,6 +77,13 @@ public:
     virtual ~llm_graph_input_i() = default;
 
     virtual void set_input(const llama_ubatch * ubatch) = 0;
+
+    // true if the input tensors built with the given parameters would have the same shape as the current ones
+    // the input is then updated to refer to the new memory state, so that the graph can be reused
+    virtual bool can_reuse(const llm_graph_params & params) {
+        GGML_UNUSED(params);
+        return false;
+    }
 };
 
 using llm_graph_input_ptr = std::unique_ptr<llm_graph_input_i>;
@@ -87,6 +96,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * tokens = nullptr; // I32 [n_batch]
     ggml_tensor * embd   = nullptr; // F32 [n_embd, n_batch]
 };
@@ -98,6 +109,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * pos = nullptr; // I32 [n_batch]
 
     const int64_t n_pos_per_embd = 1;
@@ -112,6 +125,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * attn_scale = nullptr; // F32 [n_batch]
 
     const uint32_t n_attn_temp_floor_scale;
@@ -155,6 +170,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * out_ids; // I32 [n_outputs]
 
     const llama_hparams & hparams;
@@ -257,10 +274,13 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * get_kq_mask() const { return self_kq_mask_cnv; }
 
     ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch]
+    ggml_tensor * self_kv_idxs     = nullptr; // I32 [n_batch], the cells where K and V are stored, only with graph reuse
 
     const llama_hparams & hparams;
     const llama_cparams & cparams;
@@ -282,6 +302,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * get_kq_mask()     const { return self_kq_mask_cnv; }
     ggml_tensor * get_kq_mask_swa() const { return self_kq_mask_swa_cnv; }
 
@@ -289,6 +311,8 @@ public:
     ggml_tensor * self_kq_mask_cnv     = nullptr; //     [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch]
+    ggml_tensor * self_kv_idxs         = nullptr; // I32 [n_batch], only with graph reuse
+    ggml_tensor * self_kv_idxs_swa     = nullptr; // I32 [n_batch], only with graph reuse
 
     const llama_hparams & hparams;
     const llama_cparams & cparams;
@@ -325,12 +349,17 @@ class llm_graph_result_i {
 public:
     virtual ~llm_graph_result_i() = default;
 
-    virtual ggml_tensor * get_tokens()      = 0;
-    virtual ggml_tensor * get_logits()      = 0;
-    virtual ggml_tensor * get_embd()        = 0;
-    virtual ggml_tensor * get_embd_pooled() = 0;
+    virtual ggml_tensor * get_tokens()         = 0;
+    virtual ggml_tensor * get_logits()         = 0;
+    virtual ggml_tensor * get_logits_top()     = 0;
+    virtual ggml_tensor * get_logits_top_ids() = 0;
+    virtual ggml_tensor * get_embd()           = 0;
+    virtual ggml_tensor * get_embd_pooled()    = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
+
+    // true if the graph can be used for a ubatch with the given parameters, after updating its inputs
+    virtual bool can_reuse(const llm_graph_params & params) = 0;
 };
 
 using llm_graph_result_ptr = std::unique_ptr<llm_graph_result_i>;
@@ -340,10 +369,12 @@ class llm_graph_result : public llm_graph_result_i {
 public:
     virtual ~llm_graph_result() = default;
 
-    ggml_tensor * get_tokens()      override { return t_tokens; }
-    ggml_tensor * get_logits()      override { return t_logits; }
-    ggml_tensor * get_embd()        override { return t_embd; }
-    ggml_tensor * get_embd_pooled() override { return t_embd_pooled; }
+    ggml_tensor * get_tokens()         override { return t_tokens; }
+    ggml_tensor * get_logits()         override { return t_logits; }
+    ggml_tensor * get_logits_top()     override { return t_logits_top; }
+    ggml_tensor * get_logits_top_ids() override { return t_logits_top_ids; }
+    ggml_tensor * get_embd()           override { return t_embd; }
+    ggml_tensor * get_embd_pooled()    override { return t_embd_pooled; }
 
     void set_inputs(const llama_ubatch * ubatch) override {
         for (auto & input : inputs) {
@@ -351,6 +382,8 @@ public:
         }
     }
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     llm_graph_input_i * add_input(llm_graph_input_ptr input) {
         inputs.emplace_back(std::move(input));
         return inputs.back().get();
@@ -360,9 +393,21 @@ public:
     ggml_tensor * t_tokens      = nullptr;
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
+
+    // with n_logits_top > 0: the top logits of each output and their token ids, [n_logits_top, n_outputs]
+    ggml_tensor * t_logits_top     = nullptr;
+    ggml_tensor * t_logits_top_ids = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
 
     std::vector<llm_graph_input_ptr> inputs;
+
+    // the shape of the ubatch that the graph was built for
+    uint32_t n_tokens     = 0;
+    uint32_t n_seq_tokens = 0;
+    uint32_t n_seqs       = 0;
+    bool     equal_seqs   = false;
+    bool     has_token    = false;
+    int32_t  n_outputs    = 0;
 };
 
 //
@@ -391,7 +436,7 @@ struct llm_graph_params {
 
     int32_t n_outputs;
 
-    const llm_graph_cb & cb;
+    llm_graph_cb cb;
 };
 
 struct llm_graph_context {
@@ -635,6 +680,13 @@ struct llm_graph_context {
             ggml_tensor * cls_b,
             ggml_tensor * cls_out,
             ggml_tensor * cls_out_b) const;
+
+    //
+    // logits
+    //
+
+    // select the top n_logits_top logits of each output in the graph, so that only those are copied to the host
+    void build_logits_top(ggml_cgraph * gf) const;
 };
 
 // TODO: better name
@@ -12,16 +12,17 @@
 //
 
 llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
-        const llama_model & model,
-                ggml_type   type_k,
-                ggml_type   type_v,
-                     bool   v_trans,
-                     bool   offload,
-                     bool   swa_full,
-                 uint32_t   kv_size,
-                 uint32_t   n_seq_max,
-                 uint32_t   n_ubatch,
-                 uint32_t   n_pad) : hparams(model.hparams) {
+                   const llama_model & model,
+        const std::vector<ggml_type> & type_k,
+        const std::vector<ggml_type> & type_v,
+                                bool   v_trans,
+                                bool   offload,
+                                bool   swa_full,
+                            uint32_t   kv_size,
+                            uint32_t   n_seq_max,
+                            uint32_t   n_ubatch,
+                            uint32_t   n_pad,
+                            uint32_t   n_blk) : hparams(model.hparams) {
     llama_kv_cache_unified::layer_filter_cb filter_base = [&](int32_t il) { return !model.hparams.is_swa(il); };
     llama_kv_cache_unified::layer_filter_cb filter_swa  = [&](int32_t il) { return  model.hparams.is_swa(il); };
 
@@ -41,14 +42,14 @@ llama_kv_cache_unified_iswa::llama_kv_cache_unified_iswa(
 
     kv_base = std::make_unique<llama_kv_cache_unified>(
             model, std::move(filter_base), type_k, type_v,
-            v_trans, offload, size_base, n_seq_max, n_pad,
+            v_trans, offload, size_base, n_seq_max, n_pad, n_blk,
             0, LLAMA_SWA_TYPE_NONE);
 
     LLAMA_LOG_INFO("%s: creating     SWA KV cache, size = %u cells\n", __func__, size_swa);
 
     kv_swa = std::make_unique<llama_kv_cache_unified>(
             model, std::move(filter_swa), type_k, type_v,
-            v_trans, offload, size_swa, n_seq_max, n_pad,
+            v_trans, offload, size_swa, n_seq_max, n_pad, n_blk,
             hparams.n_swa, hparams.swa_type);
 }
 
@@ -101,30 +102,37 @@ llama_memory_state_ptr llama_kv_cache_unified_iswa::init_batch(const llama_batch
     // TODO: if we fail with split_simple, we should attempt different splitting strategies
     //       but to do that properly, we first have to refactor the batches to be more flexible
 
-    auto sbatch = llama_sbatch(batch, hparams.n_embd, true, logits_all);
+    // in paged mode, retry with smaller ubatches that span fewer blocks of a fragmented cache (see llama_kv_cache_unified::init_batch)
+    const bool paged = kv_base->get_blk_size() > 0;
 
-    std::vector<llama_ubatch> ubatches;
+    for (uint32_t n_ubatch_cur = n_ubatch; n_ubatch_cur > 0; n_ubatch_cur = paged ? n_ubatch_cur/2 : 0) {
+        auto sbatch = llama_sbatch(batch, hparams.n_embd, true, logits_all);
 
-    while (sbatch.n_tokens > 0) {
-        auto ubatch = sbatch.split_simple(n_ubatch);
+        std::vector<llama_ubatch> ubatches;
 
-        ubatches.push_back(ubatch);
-    }
+        while (sbatch.n_tokens > 0) {
+            auto ubatch = sbatch.split_simple(n_ubatch_cur);
 
-    auto heads_base = kv_base->prepare(ubatches);
-    if (heads_base.empty()) {
-        return std::make_unique<llama_kv_cache_unified_iswa_state>(LLAMA_MEMORY_STATUS_FAILED_PREPARE);
-    }
+            ubatches.push_back(ubatch);
+        }
 
-    auto heads_swa = kv_swa->prepare(ubatches);
-    if (heads_swa.empty()) {
-        return std::make_unique<llama_kv_cache_unified_iswa_state>(LLAMA_MEMORY_STATUS_FAILED_PREPARE);
-    }
+        auto sinfos_base = kv_base->prepare(ubatches);
+        if (sinfos_base.empty()) {
+            continue;
+        }
 
-    assert(heads_base.size() == heads_swa.size());
+        auto sinfos_swa = kv_swa->prepare(ubatches);
+        if (sinfos_swa.empty()) {
+            continue;
+        }
+
+        assert(sinfos_base.size() == sinfos_swa.size());
+
+        return std::make_unique<llama_kv_cache_unified_iswa_state>(
+                this, std::move(sbatch), std::move(sinfos_base), std::move(sinfos_swa), std::move(ubatches));
+    }
 
-    return std::make_unique<llama_kv_cache_unified_iswa_state>(
-            this, std::move(sbatch), std::move(heads_base), std::move(heads_swa), std::move(ubatches));
+    return std::make_unique<llama_kv_cache_unified_iswa_state>(LLAMA_MEMORY_STATUS_FAILED_PREPARE);
 }
 
 llama_memory_state_ptr llama_kv_cache_unified_iswa::init_full() {
@@ -184,15 +192,15 @@ llama_kv_cache_unified_iswa_state::llama_kv_cache_unified_iswa_state(
 llama_kv_cache_unified_iswa_state::llama_kv_cache_unified_iswa_state(
         llama_kv_cache_unified_iswa * kv,
         llama_sbatch sbatch,
-        std::vector<uint32_t> heads_base,
-        std::vector<uint32_t> heads_swa,
+        slot_info_vec_t sinfos_base,
+        slot_info_vec_t sinfos_swa,
         std::vector<llama_ubatch> ubatches)
         : status(LLAMA_MEMORY_STATUS_SUCCESS),
         sbatch(std::move(sbatch)),
         ubatches(std::move(ubatches)) {
     // note: here we copy the ubatches. not sure if this is ideal
-    state_base.reset(new llama_kv_cache_unified_state(kv->get_base(), {}, std::move(heads_base), this->ubatches));
-    state_swa .reset(new llama_kv_cache_unified_state(kv->get_swa (), {}, std::move(heads_swa),  this->ubatches));
+    state_base.reset(new llama_kv_cache_unified_state(kv->get_base(), {}, std::move(sinfos_base), this->ubatches));
+    state_swa .reset(new llama_kv_cache_unified_state(kv->get_swa (), {}, std::move(sinfos_swa),  this->ubatches));
 
     status = llama_memory_status_combine(state_base->get_status(), state_swa->get_status());
 }
@@ -14,16 +14,17 @@
 class llama_kv_cache_unified_iswa : public llama_kv_cache {
 public:
     llama_kv_cache_unified_iswa(
-            const llama_model & model,
-                    ggml_type   type_k,
-                    ggml_type   type_v,
-                         bool   v_trans,
-                         bool   offload,
-                         bool   swa_full,
-                     uint32_t   kv_size,
-                     uint32_t   n_seq_max,
-                     uint32_t   n_ubatch,
-                     uint32_t   n_pad);
+                       const llama_model & model,
+            const std::vector<ggml_type> & type_k,
+            const std::vector<ggml_type> & type_v,
+                                    bool   v_trans,
+                                    bool   offload,
+                                    bool   swa_full,
+                                uint32_t   kv_size,
+                                uint32_t   n_seq_max,
+                                uint32_t   n_ubatch,
+                                uint32_t   n_pad,
+                                uint32_t   n_blk);
 
     ~llama_kv_cache_unified_iswa() = default;
 
@@ -79,6 +80,8 @@ private:
 
 class llama_kv_cache_unified_iswa_state : public llama_memory_state_i {
 public:
+    using slot_info_vec_t = llama_kv_cache_unified::slot_info_vec_t;
+
     // used for errors
     llama_kv_cache_unified_iswa_state(llama_memory_status status);
 
@@ -96,8 +99,8 @@ public:
     llama_kv_cache_unified_iswa_state(
             llama_kv_cache_unified_iswa * kv,
             llama_sbatch sbatch,
-            std::vector<uint32_t> heads_base,
-            std::vector<uint32_t> heads_swa,
+            slot_info_vec_t sinfos_base,
+            slot_info_vec_t sinfos_swa,
             std::vector<llama_ubatch> ubatches);
 
     virtual ~llama_kv_cache_unified_iswa_state();
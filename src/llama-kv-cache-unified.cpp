@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <stdexcept>
@@ -16,20 +17,40 @@
 // llama_kv_cache_unified
 //
 
+// in paged mode, each contiguous range of cells of a ubatch costs a separate K and V copy in the graph
+// a ubatch of n_tokens tokens fills at most n_tokens/n_blk whole blocks, plus for each sequence the rest of the block
+// that it last wrote to and one partially filled new block
+static uint32_t llama_kv_n_runs_max(uint32_t n_blk, uint32_t n_tokens, uint32_t n_seq_max) {
+    return n_blk > 0 ? n_tokens/n_blk + 2*n_seq_max : 1;
+}
+
+uint32_t llama_kv_cache_unified::slot_info::n_runs() const {
+    uint32_t res = idxs.empty() ? 0 : 1;
+
+    for (size_t i = 1; i < idxs.size(); ++i) {
+        if (idxs[i] != idxs[i - 1] + 1) {
+            res++;
+        }
+    }
+
+    return res;
+}
+
 llama_kv_cache_unified::llama_kv_cache_unified(
-        const llama_model &  model,
-          layer_filter_cb && filter,
-                ggml_type    type_k,
-                ggml_type    type_v,
-                     bool    v_trans,
-                     bool    offload,
-                 uint32_t    kv_size,
-                 uint32_t    n_seq_max,
-                 uint32_t    n_pad,
-                 uint32_t    n_swa,
-           llama_swa_type    swa_type) :
+                   const llama_model &  model,
+                     layer_filter_cb && filter,
+        const std::vector<ggml_type> &  type_k,
+        const std::vector<ggml_type> &  type_v,
+                                bool    v_trans,
+                                bool    offload,
+                            uint32_t    kv_size,
+                            uint32_t    n_seq_max,
+                            uint32_t    n_pad,
+                            uint32_t    n_blk,
+                            uint32_t    n_swa,
+                      llama_swa_type    swa_type) :
     model(model), hparams(model.hparams), v_trans(v_trans),
-    n_seq_max(n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
+    n_seq_max(n_seq_max), n_pad(n_pad), n_blk(swa_type == LLAMA_SWA_TYPE_NONE ? n_blk : 0), n_swa(n_swa), swa_type(swa_type) {
 
     GGML_ASSERT(kv_size % n_pad == 0);
 
@@ -61,6 +82,16 @@ llama_kv_cache_unified::llama_kv_cache_unified(
     head = 0;
 
     cells.resize(kv_size);
+    cells.blk_init(this->n_blk);
+
+    blk_reset();
+
+    if (this->n_blk > 0) {
+        LLAMA_LOG_INFO("%s: paged KV cache: %u blocks of %u cells\n", __func__, cells.blk_count(), this->n_blk);
+    } else if (n_blk > 0) {
+        // the paged allocation does not reuse the cells masked by the sliding window
+        LLAMA_LOG_INFO("%s: paged KV cache: not used with SWA\n", __func__);
+    }
 
     for (uint32_t il = 0; il < hparams.n_layer; il++) {
         if (filter && !filter(il)) {
@@ -82,7 +113,8 @@ llama_kv_cache_unified::llama_kv_cache_unified(
             dev_name = ggml_backend_dev_name(dev);
         }
 
-        LLAMA_LOG_DEBUG("%s: layer %3d: dev = %s\n", __func__, il, dev_name);
+        LLAMA_LOG_DEBUG("%s: layer %3d: dev = %s, type_k = %s, type_v = %s\n", __func__, il, dev_name,
+                ggml_type_name(type_k[il]), ggml_type_name(type_v[il]));
 
         ggml_context * ctx = ctx_for_buft(buft);
         if (!ctx) {
@@ -92,8 +124,8 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         ggml_tensor * k;
         ggml_tensor * v;
 
-        k = ggml_new_tensor_2d(ctx, type_k, n_embd_k_gqa, kv_size);
-        v = ggml_new_tensor_2d(ctx, type_v, n_embd_v_gqa, kv_size);
+        k = ggml_new_tensor_2d(ctx, type_k[il], n_embd_k_gqa, kv_size);
+        v = ggml_new_tensor_2d(ctx, type_v[il], n_embd_v_gqa, kv_size);
 
         ggml_format_name(k, "cache_k_l%d", il);
         ggml_format_name(v, "cache_v_l%d", il);
@@ -114,18 +146,76 @@ llama_kv_cache_unified::llama_kv_cache_unified(
 
         LLAMA_LOG_INFO("%s: %10s KV buffer size = %8.2f MiB\n", __func__, ggml_backend_buffer_name(buf), ggml_backend_buffer_get_size(buf)/1024.0/1024.0);
 
+        // spread the pages of the cache over the NUMA nodes, before they are touched by the clear
+        if (ggml_backend_buffer_is_host(buf)) {
+            auto * reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+            auto * numa_interleave_fn = reg ? (decltype(ggml_numa_interleave) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_interleave") : nullptr;
+            if (numa_interleave_fn) {
+                numa_interleave_fn(ggml_backend_buffer_get_base(buf), ggml_backend_buffer_get_size(buf));
+            }
+        }
+
         ggml_backend_buffer_clear(buf, 0);
         bufs.emplace_back(buf);
     }
 
+    // check if the K and V of the ubatches can be stored with GGML_OP_SET_ROWS on the devices of the cache
+    {
+        ggml_init_params params = {
+            /*.mem_size   =*/ ggml_tensor_overhead()*4,
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+
+        supports_set_rows = true;
+
+        for (const auto & layer : layers) {
+            for (ggml_tensor * t : { layer.k, layer.v }) {
+                ggml_context_ptr ctx { ggml_init(params) };
+                if (!ctx) {
+                    throw std::runtime_error("failed to create ggml context for kv cache");
+                }
+
+                ggml_tensor * rows = ggml_new_tensor_2d(ctx.get(), GGML_TYPE_F32, t->ne[0], 1);
+                ggml_tensor * idxs = ggml_new_tensor_1d(ctx.get(), GGML_TYPE_I32, 1);
+
+                ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(t->buffer));
+                if (!dev && ggml_backend_buffer_is_host(t->buffer)) {
+                    // note: the CPU buffer type does not have a device
+                    dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+                }
+
+                supports_set_rows = supports_set_rows && dev && ggml_backend_dev_supports_op(dev, ggml_set_rows(ctx.get(), t, rows, idxs));
+            }
+        }
+    }
+
     {
         const size_t memory_size_k = size_k_bytes();
         const size_t memory_size_v = size_v_bytes();
 
+        // the distinct types of the layers, e.g. "f16/q8_0" with mixed precision
+        auto type_names = [&](bool is_k) {
+            std::vector<ggml_type> types;
+            for (const auto & layer : layers) {
+                const ggml_type type = is_k ? layer.k->type : layer.v->type;
+                if (std::find(types.begin(), types.end(), type) == types.end()) {
+                    types.push_back(type);
+                }
+            }
+
+            std::string res;
+            for (const auto type : types) {
+                res += (res.empty() ? "" : "/") + std::string(ggml_type_name(type));
+            }
+
+            return res;
+        };
+
         LLAMA_LOG_INFO("%s: size = %7.2f MiB (%6u cells, %3d layers, %2u seqs), K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                 (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f), kv_size, (int) layers.size(), n_seq_max,
-                ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                type_names(true).c_str(),  (float)memory_size_k / (1024.0f * 1024.0f),
+                type_names(false).c_str(), (float)memory_size_v / (1024.0f * 1024.0f));
     }
 }
 
@@ -134,6 +224,10 @@ void llama_kv_cache_unified::clear() {
 
     head = 0;
 
+    blk_reset();
+
+    cow_cpys.clear();
+
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -246,16 +340,36 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    // note: collect the cells first, because copy-on-write can move the sequence into cells that would be visited later
+    std::vector<uint32_t> idxs;
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
         }
 
         if (cells.seq_has(i, seq_id)) {
-            if (cells.pos_add(i, shift)) {
-                if (new_head == cells.size()) {
-                    new_head = i;
-                }
+            idxs.push_back(i);
+        }
+    }
+
+    for (uint32_t idx : idxs) {
+        // do not shift the cell for the other sequences that share it
+        if (cells.seq_count(idx) > 1) {
+            if (cells.pos_get(idx) + shift < 0) {
+                cells.seq_rm(idx, seq_id);
+                continue;
+            }
+
+            const int32_t idx_cow = cow_cell(idx, seq_id);
+            if (idx_cow >= 0) {
+                idx = idx_cow;
+            }
+        }
+
+        if (cells.pos_add(idx, shift)) {
+            if (new_head == cells.size()) {
+                new_head = idx;
             }
         }
     }
@@ -283,15 +397,59 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    // note: collect the cells first, because copy-on-write can move the sequence into cells that would be visited later
+    std::vector<uint32_t> idxs;
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
         }
 
         if (cells.seq_has(i, seq_id)) {
-            cells.pos_div(i, d);
+            idxs.push_back(i);
+        }
+    }
+
+    for (uint32_t idx : idxs) {
+        // do not modify the cell for the other sequences that share it
+        if (cells.seq_count(idx) > 1) {
+            const int32_t idx_cow = cow_cell(idx, seq_id);
+            if (idx_cow >= 0) {
+                idx = idx_cow;
+            }
         }
+
+        cells.pos_div(idx, d);
+    }
+}
+
+int32_t llama_kv_cache_unified::cow_cell(uint32_t i, llama_seq_id seq_id) {
+    for (uint32_t j = 0; j < cells.size(); ++j) {
+        // note: start searching from the head, as the cells before it are likely in use
+        const uint32_t idx = (head + j) % cells.size();
+
+        if (!cells.is_empty(idx)) {
+            continue;
+        }
+
+        cells.seq_mv(i, idx, seq_id);
+
+        // the cell may itself still be waiting for its data, then the copy is made from its source
+        uint32_t isrc = i;
+        for (const auto & cpy : cow_cpys) {
+            if (cpy.second == i) {
+                isrc = cpy.first;
+            }
+        }
+
+        cow_cpys.emplace_back(isrc, idx);
+
+        return idx;
     }
+
+    LLAMA_LOG_WARN("%s: no free cells to un-share cell %u for seq_id %d - the other sequences will be affected\n", __func__, i, seq_id);
+
+    return -1;
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
@@ -309,20 +467,30 @@ llama_memory_state_ptr llama_kv_cache_unified::init_batch(
             bool logits_all) {
     GGML_UNUSED(embd_pooled);
 
-    auto sbatch = llama_sbatch(batch, hparams.n_embd, true, logits_all);
+    // in paged mode, a fragmented cache can have neither enough free blocks nor a contiguous range of free cells for
+    // a ubatch - smaller ubatches fit in the free cells left by the other sequences, so retry with them before giving up
+    for (uint32_t n_ubatch_cur = n_ubatch; n_ubatch_cur > 0; n_ubatch_cur = n_blk > 0 ? n_ubatch_cur/2 : 0) {
+        auto sbatch = llama_sbatch(batch, hparams.n_embd, true, logits_all);
 
-    std::vector<llama_ubatch> ubatches;
-    while (sbatch.n_tokens > 0) {
-        ubatches.push_back(sbatch.split_simple(n_ubatch));
-    }
+        std::vector<llama_ubatch> ubatches;
+        while (sbatch.n_tokens > 0) {
+            ubatches.push_back(sbatch.split_simple(n_ubatch_cur));
+        }
 
-    auto heads = prepare(ubatches);
-    if (heads.empty()) {
-        return std::make_unique<llama_kv_cache_unified_state>(LLAMA_MEMORY_STATUS_FAILED_PREPARE);
+        auto heads = prepare(ubatches);
+        if (heads.empty()) {
+            continue;
+        }
+
+        if (n_ubatch_cur < n_ubatch) {
+            LLAMA_LOG_DEBUG("%s: fragmented paged KV cache - using ubatches of %u tokens\n", __func__, n_ubatch_cur);
+        }
+
+        return std::make_unique<llama_kv_cache_unified_state>(
+                this, std::move(sbatch), std::move(heads), std::move(ubatches));
     }
 
-    return std::make_unique<llama_kv_cache_unified_state>(
-            this, std::move(sbatch), std::move(heads), std::move(ubatches));
+    return std::make_unique<llama_kv_cache_unified_state>(LLAMA_MEMORY_STATUS_FAILED_PREPARE);
 }
 
 llama_memory_state_ptr llama_kv_cache_unified::init_full() {
@@ -330,7 +498,8 @@ llama_memory_state_ptr llama_kv_cache_unified::init_full() {
 }
 
 llama_memory_state_ptr llama_kv_cache_unified::init_update(llama_context * lctx, bool optimize) {
-    bool do_shift = get_has_shift();
+    // note: the pending copy-on-write copies are applied together with the K-shift
+    bool do_shift = get_has_shift() || get_has_cow();
 
     defrag_info dinfo;
 
@@ -340,7 +509,9 @@ llama_memory_state_ptr llama_kv_cache_unified::init_update(llama_context * lctx,
 
         const auto thold = lctx->get_cparams().defrag_thold;
 
-        if (!do_defrag && thold > 0.0f) {
+        // in paged mode the cells are allocated per block and new tokens never need a contiguous range of cells,
+        // the cache is defragmented only when requested explicitly (init_batch uses smaller ubatches when it is fragmented)
+        if (!do_defrag && thold > 0.0f && n_blk == 0) {
             const auto n_kv = cells.used_max_p1();
 
             // - do not defrag small contexts (i.e. < 2048 tokens)
@@ -362,12 +533,13 @@ llama_memory_state_ptr llama_kv_cache_unified::init_update(llama_context * lctx,
     return std::make_unique<llama_kv_cache_unified_state>(this, lctx, do_shift, std::move(dinfo));
 }
 
-llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::vector<llama_ubatch> & ubatches) {
-    llama_kv_cache_unified::ubatch_heads res;
+llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const std::vector<llama_ubatch> & ubatches) {
+    llama_kv_cache_unified::slot_info_vec_t res;
 
     struct state {
         uint32_t head_old; // old position of the head, before placing the ubatch
-        uint32_t head_new; // new position of the head, after placing the ubatch
+
+        slot_info sinfo; // slot info for the ubatch
 
         llama_kv_cells_unified cells; // copy of the old cells, before placing the ubatch
     };
@@ -375,32 +547,41 @@ llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::
     // remember the old state of the cells so we can restore it in the end
     std::vector<state> states;
 
+    // the block bookkeeping is restored in one go at the end
+    const auto blk_owner_old = blk_owner;
+
+    int32_t blk_tail_old[LLAMA_MAX_PARALLEL_SEQUENCES];
+    std::copy(std::begin(blk_tail), std::end(blk_tail), std::begin(blk_tail_old));
+
     bool success = true;
 
     for (const auto & ubatch : ubatches) {
         // only find a suitable slot for the ubatch. don't modify the cells yet
-        const int32_t head_new = find_slot(ubatch);
-        if (head_new < 0) {
+        auto sinfo_new = find_slot(ubatch);
+        if (sinfo_new.empty()) {
             success = false;
             break;
         }
 
         // remeber the position that we found
-        res.push_back(head_new);
+        res.push_back(sinfo_new);
 
         // store the old state of the cells in the recovery stack
-        states.push_back({head, (uint32_t) head_new, cells.cp(head_new, ubatch.n_tokens)});
+        states.push_back({head, sinfo_new, cells.cp(sinfo_new.idxs)});
 
         // now emplace the ubatch
-        apply_ubatch(head_new, ubatch);
+        apply_ubatch(sinfo_new, ubatch);
     }
 
     // iterate backwards and restore the cells to their original state
     for (auto it = states.rbegin(); it != states.rend(); ++it) {
-        cells.set(it->head_new, it->cells);
+        cells.set(it->sinfo.idxs, it->cells);
         head = it->head_old;
     }
 
+    blk_owner = blk_owner_old;
+    std::copy(std::begin(blk_tail_old), std::end(blk_tail_old), std::begin(blk_tail));
+
     if (!success) {
         return {};
     }
@@ -413,7 +594,44 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
 
     auto * sched = lctx->get_sched();
 
-    if (do_shift) {
+    if (!cow_cpys.empty()) {
+        LLAMA_LOG_DEBUG("%s: copy-on-write of %zu cells\n", __func__, cow_cpys.size());
+
+        // each copy costs up to 6 graph nodes per layer, so split them into multiple graphs if needed
+        const size_t n_cpy_max = std::max<size_t>(1, lctx->graph_max_nodes()/(6*std::max<size_t>(1, layers.size())));
+
+        for (size_t i0 = 0; i0 < cow_cpys.size(); i0 += n_cpy_max) {
+            const size_t i1 = std::min(cow_cpys.size(), i0 + n_cpy_max);
+
+            ggml_backend_sched_reset(sched);
+
+            auto * gf = lctx->graph_init();
+
+            auto res = build_graph_cow(lctx->get_ctx_compute(), gf, i0, i1);
+            if (!res) {
+                LLAMA_LOG_ERROR("%s: failed to build graph for copy-on-write\n", __func__);
+                return updated;
+            }
+
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                LLAMA_LOG_ERROR("%s: failed to allocate compute graph for copy-on-write\n", __func__);
+                return updated;
+            }
+
+            res->set_inputs(nullptr);
+
+            if (lctx->graph_compute(gf, false) != GGML_STATUS_SUCCESS) {
+                LLAMA_LOG_ERROR("%s: failed to compute copy-on-write\n", __func__);
+                return updated;
+            }
+        }
+
+        cow_cpys.clear();
+
+        updated = true;
+    }
+
+    if (do_shift && get_has_shift()) {
         if (!get_can_shift()) {
             GGML_ABORT("The current KV cache / model configuration does not support K-shift");
         }
@@ -469,6 +687,9 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
 
             // reset the head so we can find the first free slot during the next ubatch
             head = 0;
+
+            // the cells have moved across blocks, so the block ownership is no longer valid
+            blk_reset();
         }
 
         ggml_backend_sched_reset(sched);
@@ -499,7 +720,20 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
     return updated;
 }
 
-int32_t llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) const {
+llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) const {
+    if (n_blk > 0) {
+        auto res = find_slot_paged(ubatch);
+        if (!res.empty()) {
+            return res;
+        }
+
+        // no free blocks left for some of the sequences - try to find any contiguous range of usable cells
+    }
+
+    return find_slot_contiguous(ubatch);
+}
+
+llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot_contiguous(const llama_ubatch & ubatch) const {
     const uint32_t n_tokens = ubatch.n_tokens;
 
     uint32_t head_cur = this->head;
@@ -514,7 +748,7 @@ int32_t llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) const {
 
     if (n_tokens > cells.size()) {
         LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %u\n", __func__, n_tokens, cells.size());
-        return -1;
+        return {};
     }
 
 //#define FIND_SLOT_DEBUG 1
@@ -613,28 +847,127 @@ int32_t llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) const {
 
         if (n_tested >= cells.size()) {
             //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return -1;
+            return {};
         }
     }
 
-    return head_cur;
+    slot_info res;
+
+    res.idxs.resize(n_tokens);
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        res.idxs[i] = head_cur + i;
+    }
+
+    return res;
 }
 
-void llama_kv_cache_unified::apply_ubatch(uint32_t head_cur, const llama_ubatch & ubatch) {
+llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot_paged(const llama_ubatch & ubatch) const {
+    const uint32_t n_tokens = ubatch.n_tokens;
+    const uint32_t n_blks   = cells.blk_count();
+
+    // local copies of the block bookkeeping, updated as we place the tokens
+    std::vector<llama_seq_id> owner = blk_owner;
+
+    int32_t tail[LLAMA_MAX_PARALLEL_SEQUENCES];
+    std::copy(std::begin(blk_tail), std::end(blk_tail), std::begin(tail));
+
+    // blocks that received tokens from this ubatch - they cannot be claimed as free anymore
+    std::vector<bool> touched(n_blks, false);
+
+    // free blocks are claimed in increasing order to keep n_kv as small as possible
+    uint32_t blk_next = 0;
+
+    slot_info res;
+    res.idxs.resize(n_tokens);
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        // a block belongs to a single sequence - the tokens shared by several sequences are placed by find_slot_contiguous
+        if (ubatch.n_seq_id[i] > 1) {
+            return {};
+        }
+
+        const llama_seq_id seq_id = ubatch.seq_id[i][0];
+
+        int32_t idx = -1;
+
+        // try to append to the last block owned by the sequence
+        if (tail[seq_id] >= 0) {
+            const uint32_t b = tail[seq_id]/n_blk;
+            const uint32_t c = tail[seq_id] + 1;
+
+            if (owner[b] == seq_id && c < cells.size() && c/n_blk == b && cells.is_empty(c)) {
+                idx = c;
+            }
+        }
+
+        // otherwise claim a new block
+        if (idx < 0) {
+            while (blk_next < n_blks && (touched[blk_next] || cells.blk_get_used(blk_next) > 0)) {
+                blk_next++;
+            }
+
+            if (blk_next == n_blks) {
+                return {};
+            }
+
+            owner[blk_next] = seq_id;
+
+            idx = blk_next*n_blk;
+        }
+
+        touched[idx/n_blk] = true;
+        tail[seq_id] = idx;
+
+        res.idxs[i] = idx;
+    }
+
+    // each contiguous range of cells costs a separate copy in the graph
+    if (res.n_runs() > llama_kv_n_runs_max(n_blk, n_tokens, n_seq_max)) {
+        return {};
+    }
+
+    return res;
+}
+
+void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
+    assert(sinfo.size() == ubatch.n_tokens);
+
     for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
-        if (!cells.is_empty(head_cur + i)) {
-            cells.rm(head_cur + i);
+        const uint32_t idx = sinfo.idxs[i];
+
+        if (n_blk > 0) {
+            const uint32_t     b      = idx/n_blk;
+            const llama_seq_id seq_id = ubatch.seq_id[i][0];
+
+            // a sequence takes ownership of the free blocks that it writes to
+            if (cells.blk_get_used(b) == 0) {
+                blk_owner[b] = seq_id;
+            }
+
+            if (blk_owner[b] == seq_id) {
+                blk_tail[seq_id] = idx;
+            }
+        }
+
+        if (!cells.is_empty(idx)) {
+            cells.rm(idx);
         }
 
-        cells.pos_set(head_cur + i, ubatch.pos[i]);
+        cells.pos_set(idx, ubatch.pos[i]);
 
         for (int32_t j = 0; j < ubatch.n_seq_id[i]; j++) {
-            cells.seq_add(head_cur + i, ubatch.seq_id[i][j]);
+            cells.seq_add(idx, ubatch.seq_id[i][j]);
         }
     }
 
     // move the head at the end of the slot
-    head = head_cur + ubatch.n_tokens;
+    head = sinfo.idxs.back() + 1;
+}
+
+void llama_kv_cache_unified::blk_reset() {
+    blk_owner.assign(cells.blk_count(), -1);
+
+    std::fill(std::begin(blk_tail), std::end(blk_tail), -1);
 }
 
 bool llama_kv_cache_unified::get_can_shift() const {
@@ -649,6 +982,22 @@ bool llama_kv_cache_unified::get_has_shift() const {
     return cells.get_has_shift();
 }
 
+bool llama_kv_cache_unified::get_has_cow() const {
+    return !cow_cpys.empty();
+}
+
+uint32_t llama_kv_cache_unified::get_blk_size() const {
+    return n_blk;
+}
+
+bool llama_kv_cache_unified::get_supports_set_rows() const {
+    return supports_set_rows;
+}
+
+uint32_t llama_kv_cache_unified::get_n_runs_max(const llama_cparams & cparams) {
+    return llama_kv_n_runs_max(cparams.kv_block_size, cparams.n_ubatch, cparams.n_seq_max);
+}
+
 uint32_t llama_kv_cache_unified::get_n_kv() const {
     return std::min(cells.size(), std::max(n_pad, GGML_PAD(cells.used_max_p1(), n_pad)));
 }
@@ -687,45 +1036,116 @@ ggml_tensor * llama_kv_cache_unified::get_v(ggml_context * ctx, int32_t il, uint
             0);
 }
 
-ggml_tensor * llama_kv_cache_unified::cpy_k(ggml_context * ctx, ggml_tensor * k_cur, int32_t il, uint32_t head_cur) const {
+// call fn(i0, head_cur, n) for each range of tokens [i0, i0 + n) stored in cells [head_cur, head_cur + n)
+template <typename F>
+static void llama_kv_slot_foreach_run(const llama_kv_cache_unified::slot_info & sinfo, F && fn) {
+    uint32_t i0 = 0;
+
+    for (uint32_t i = 1; i <= sinfo.size(); ++i) {
+        if (i == sinfo.size() || sinfo.idxs[i] != sinfo.idxs[i - 1] + 1) {
+            fn(i0, sinfo.idxs[i0], i - i0);
+            i0 = i;
+        }
+    }
+}
+
+void llama_kv_cache_unified::cpy_k(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * k_cur, ggml_tensor * kv_idxs, int32_t il, const slot_info & sinfo) const {
     const int32_t ikv = map_layer_ids.at(il);
 
     auto * k = layers[ikv].k;
 
     const int64_t n_tokens = k_cur->ne[2];
 
-    ggml_tensor * k_view = ggml_view_1d(ctx, k,
-            n_tokens*hparams.n_embd_k_gqa(il),
-            ggml_row_size(k->type, hparams.n_embd_k_gqa(il))*head_cur);
+    GGML_ASSERT(n_tokens == (int64_t) sinfo.size());
+
+    if (kv_idxs) {
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+
+        k_cur = ggml_reshape_2d(ctx, k_cur, k->ne[0], n_tokens);
+
+        ggml_build_forward_expand(gf, ggml_set_rows(ctx, k, k_cur, kv_idxs));
+
+        return;
+    }
+
+    llama_kv_slot_foreach_run(sinfo, [&](uint32_t i0, uint32_t head_cur, uint32_t n) {
+        ggml_tensor * k_src = k_cur;
+        if (n != n_tokens) {
+            k_src = ggml_view_3d(ctx, k_cur, k_cur->ne[0], k_cur->ne[1], n, k_cur->nb[1], k_cur->nb[2], i0*k_cur->nb[2]);
+        }
 
-    return ggml_cpy(ctx, k_cur, k_view);
+        ggml_tensor * k_view = ggml_view_1d(ctx, k,
+                n*hparams.n_embd_k_gqa(il),
+                ggml_row_size(k->type, hparams.n_embd_k_gqa(il))*head_cur);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, k_src, k_view));
+    });
 }
 
-ggml_tensor * llama_kv_cache_unified::cpy_v(ggml_context * ctx, ggml_tensor * v_cur, int32_t il, uint32_t head_cur) const {
+void llama_kv_cache_unified::cpy_v(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * v_cur, ggml_tensor * kv_idxs, int32_t il, const slot_info & sinfo) const {
     const int32_t ikv = map_layer_ids.at(il);
 
     auto * v = layers[ikv].v;
 
     const int64_t n_tokens = v_cur->ne[2];
 
+    GGML_ASSERT(n_tokens == (int64_t) sinfo.size());
+
     v_cur = ggml_reshape_2d(ctx, v_cur, hparams.n_embd_v_gqa(il), n_tokens);
 
-    ggml_tensor * v_view = nullptr;
+    if (kv_idxs) {
+        if (!v_trans) {
+            ggml_build_forward_expand(gf, ggml_set_rows(ctx, v, v_cur, kv_idxs));
+        } else {
+            // the V cache is transposed: each element of a token is a row of its own, with the cell as row index
+            // v     [1, kv_size,  n_embd_v_gqa]
+            // v_cur [1, n_tokens, n_embd_v_gqa]
+            ggml_tensor * v_view = ggml_reshape_3d(ctx, v, 1, v->ne[1], v->ne[0]);
 
-    if (!v_trans) {
-        v_view = ggml_view_1d(ctx, v,
-                n_tokens*hparams.n_embd_v_gqa(il),
-                ggml_row_size(v->type, hparams.n_embd_v_gqa(il))*head_cur);
-    } else {
-        // note: the V cache is transposed when not using flash attention
-        v_view = ggml_view_2d(ctx, v, n_tokens, hparams.n_embd_v_gqa(il),
-                (v->ne[1])*ggml_element_size(v),
-                (head_cur)*ggml_element_size(v));
+            v_cur = ggml_permute(ctx, ggml_reshape_3d(ctx, v_cur, v_cur->ne[0], 1, n_tokens), 2, 0, 1, 3);
+
+            ggml_build_forward_expand(gf, ggml_set_rows(ctx, v_view, v_cur, kv_idxs));
+        }
 
-        v_cur = ggml_transpose(ctx, v_cur);
+        return;
     }
 
-    return ggml_cpy(ctx, v_cur, v_view);
+    llama_kv_slot_foreach_run(sinfo, [&](uint32_t i0, uint32_t head_cur, uint32_t n) {
+        ggml_tensor * v_src = v_cur;
+        if (n != n_tokens) {
+            v_src = ggml_view_2d(ctx, v_cur, v_cur->ne[0], n, v_cur->nb[1], i0*v_cur->nb[1]);
+        }
+
+        ggml_tensor * v_view = nullptr;
+
+        if (!v_trans) {
+            v_view = ggml_view_1d(ctx, v,
+                    n*hparams.n_embd_v_gqa(il),
+                    ggml_row_size(v->type, hparams.n_embd_v_gqa(il))*head_cur);
+        } else {
+            // note: the V cache is transposed when not using flash attention
+            v_view = ggml_view_2d(ctx, v, n, hparams.n_embd_v_gqa(il),
+                    (v->ne[1])*ggml_element_size(v),
+                    (head_cur)*ggml_element_size(v));
+
+            v_src = ggml_transpose(ctx, v_src);
+        }
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, v_src, v_view));
+    });
+}
+
+void llama_kv_cache_unified::set_input_kv_idxs(ggml_tensor * dst, const slot_info & sinfo) const {
+    GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
+    GGML_ASSERT(dst->ne[0] == (int64_t) sinfo.size());
+
+    int32_t * data = (int32_t *) dst->data;
+
+    for (uint32_t i = 0; i < sinfo.size(); ++i) {
+        data[i] = sinfo.idxs[i];
+    }
 }
 
 void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
@@ -750,14 +1170,45 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
+    //
+    // in paged mode, the blocks that do not contain any cells of the sequence are masked as a whole
+    // blk_has[seq_id][b] is computed once per sequence in the ubatch
+    const uint32_t n_blk_kv = n_blk > 0 ? (n_kv + n_blk - 1)/n_blk : 0;
+
+    std::vector<std::vector<bool>> blk_has(n_blk > 0 ? LLAMA_MAX_PARALLEL_SEQUENCES : 0);
+
     for (int h = 0; h < 1; ++h) {
         for (int s = 0; s < n_seqs; ++s) {
             const llama_seq_id seq_id = ubatch->seq_id[s][0];
 
+            if (n_blk > 0 && blk_has[seq_id].empty()) {
+                blk_has[seq_id].resize(n_blk_kv, false);
+
+                for (uint32_t i = 0; i < n_kv; ++i) {
+                    if (!cells.is_empty(i) && cells.seq_has(i, seq_id)) {
+                        blk_has[seq_id][i/n_blk] = true;
+
+                        // skip to the next block
+                        i = (i/n_blk + 1)*n_blk - 1;
+                    }
+                }
+            }
+
             for (int j = 0; j < n_seq_tokens; ++j) {
                 const llama_pos p1 = ubatch->pos[s*n_seq_tokens + j];
 
+                float * row = data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+
                 for (uint32_t i = 0; i < n_kv; ++i) {
+                    if (n_blk > 0 && i % n_blk == 0 && !blk_has[seq_id][i/n_blk]) {
+                        const uint32_t i1 = std::min<uint32_t>(i + n_blk, n_kv);
+
+                        std::fill(row + i, row + i1, -INFINITY);
+
+                        i = i1 - 1;
+                        continue;
+                    }
+
                     float f = 0.0f;
 
                     bool masked = false;
@@ -785,7 +1236,7 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
                         f = -INFINITY;
                     }
 
-                    data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                    row[i] = f;
                 }
             }
         }
@@ -1125,6 +1576,76 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_defrag(
     return res;
 }
 
+llm_graph_result_ptr llama_kv_cache_unified::build_graph_cow(
+                       ggml_context * ctx,
+                        ggml_cgraph * gf,
+                             size_t   i0,
+                             size_t   i1) const {
+    auto res = std::make_unique<llm_graph_result>();
+
+    // note: the copies are added in order, so a cell can be the destination of one copy and the source of a later one
+    for (size_t i = i0; i < i1; ++i) {
+        const uint32_t isrc = cow_cpys[i].first;
+        const uint32_t idst = cow_cpys[i].second;
+
+        // merge consecutive copies of contiguous ranges
+        uint32_t nm = 1;
+
+        while (i + nm < i1 && cow_cpys[i + nm].first == isrc + nm && cow_cpys[i + nm].second == idst + nm) {
+            nm++;
+        }
+
+        for (const auto & layer : layers) {
+            const uint32_t il = layer.il;
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor * view_k_src = ggml_view_2d(ctx, layer.k,
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(layer.k->type, n_embd_k_gqa),
+                    ggml_row_size(layer.k->type, n_embd_k_gqa*isrc));
+
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx, layer.k,
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(layer.k->type, n_embd_k_gqa),
+                    ggml_row_size(layer.k->type, n_embd_k_gqa*idst));
+
+            ggml_tensor * view_v_src;
+            ggml_tensor * view_v_dst;
+
+            if (!v_trans) {
+                view_v_src = ggml_view_2d(ctx, layer.v,
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(layer.v->type, n_embd_v_gqa),
+                        ggml_row_size(layer.v->type, n_embd_v_gqa*isrc));
+
+                view_v_dst = ggml_view_2d(ctx, layer.v,
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(layer.v->type, n_embd_v_gqa),
+                        ggml_row_size(layer.v->type, n_embd_v_gqa*idst));
+            } else {
+                view_v_src = ggml_view_2d(ctx, layer.v,
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(layer.v->type, cells.size()),
+                        ggml_row_size(layer.v->type, isrc));
+
+                view_v_dst = ggml_view_2d(ctx, layer.v,
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(layer.v->type, cells.size()),
+                        ggml_row_size(layer.v->type, idst));
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_v_src, view_v_dst));
+        }
+
+        i += nm - 1;
+    }
+
+    return res;
+}
+
 llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) const {
     const uint32_t n_layer = layers.size();
 
@@ -1474,13 +1995,16 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
             batch.seq_id[i]   = &dest_seq_id;
         }
 
-        const auto head_cur = find_slot(batch);
-        if (head_cur < 0) {
+        // note: the data is read in one go in state_read_data(), so we need a contiguous range of cells
+        const auto sinfo = find_slot_contiguous(batch);
+        if (sinfo.empty()) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
         }
 
-        apply_ubatch(head_cur, batch);
+        apply_ubatch(sinfo, batch);
+
+        const auto head_cur = sinfo.head();
 
         // keep the head at the old position because we will read the KV data into it in state_read_data()
         head = head_cur;
@@ -1666,7 +2190,6 @@ llama_kv_cache_unified_state::llama_kv_cache_unified_state(llama_memory_status s
 llama_kv_cache_unified_state::llama_kv_cache_unified_state(
         llama_kv_cache_unified * kv) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv) {
     n_kv = kv->get_size();
-    head = 0;
 }
 
 llama_kv_cache_unified_state::llama_kv_cache_unified_state(
@@ -1682,8 +2205,8 @@ llama_kv_cache_unified_state::llama_kv_cache_unified_state(
 llama_kv_cache_unified_state::llama_kv_cache_unified_state(
         llama_kv_cache_unified * kv,
         llama_sbatch sbatch,
-        llama_kv_cache_unified::ubatch_heads heads,
-        std::vector<llama_ubatch> ubatches) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), sbatch(std::move(sbatch)), heads(std::move(heads)), ubatches(std::move(ubatches)) {
+        llama_kv_cache_unified::slot_info_vec_t sinfos,
+        std::vector<llama_ubatch> ubatches) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), sbatch(std::move(sbatch)), sinfos(std::move(sinfos)), ubatches(std::move(ubatches)) {
 }
 
 llama_kv_cache_unified_state::~llama_kv_cache_unified_state() = default;
@@ -1708,10 +2231,9 @@ bool llama_kv_cache_unified_state::apply() {
         return true;
     }
 
-    kv->apply_ubatch(heads[i_next], ubatches[i_next]);
+    kv->apply_ubatch(sinfos[i_next], ubatches[i_next]);
 
     n_kv = kv->get_n_kv();
-    head = heads[i_next];
 
     return true;
 }
@@ -1736,6 +2258,10 @@ uint32_t llama_kv_cache_unified_state::get_n_kv() const {
     return n_kv;
 }
 
+bool llama_kv_cache_unified_state::get_supports_set_rows() const {
+    return kv->get_supports_set_rows();
+}
+
 ggml_tensor * llama_kv_cache_unified_state::get_k(ggml_context * ctx, int32_t il) const {
     return kv->get_k(ctx, il, n_kv);
 }
@@ -1744,18 +2270,38 @@ ggml_tensor * llama_kv_cache_unified_state::get_v(ggml_context * ctx, int32_t il
     return kv->get_v(ctx, il, n_kv);
 }
 
-ggml_tensor * llama_kv_cache_unified_state::cpy_k(ggml_context * ctx, ggml_tensor * k_cur, int32_t il) const {
-    return kv->cpy_k(ctx, k_cur, il, head);
+void llama_kv_cache_unified_state::cpy_k(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * k_cur, ggml_tensor * kv_idxs, int32_t il) const {
+    kv->cpy_k(ctx, gf, k_cur, kv_idxs, il, get_sinfo(k_cur->ne[2]));
+}
+
+void llama_kv_cache_unified_state::cpy_v(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * v_cur, ggml_tensor * kv_idxs, int32_t il) const {
+    kv->cpy_v(ctx, gf, v_cur, kv_idxs, il, get_sinfo(v_cur->ne[2]));
 }
 
-ggml_tensor * llama_kv_cache_unified_state::cpy_v(ggml_context * ctx, ggml_tensor * v_cur, int32_t il) const {
-    return kv->cpy_v(ctx, v_cur, il, head);
+llama_kv_cache_unified::slot_info llama_kv_cache_unified_state::get_sinfo(int64_t n_tokens) const {
+    if (!sinfos.empty()) {
+        return sinfos[i_next];
+    }
+
+    // full-cache state (used for graph reservation) - store the tokens at the beginning of the cache
+    llama_kv_cache_unified::slot_info res;
+
+    res.idxs.resize(n_tokens);
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        res.idxs[i] = i;
+    }
+
+    return res;
 }
 
 void llama_kv_cache_unified_state::set_input_k_shift(ggml_tensor * dst) const {
     kv->set_input_k_shift(dst);
 }
 
+void llama_kv_cache_unified_state::set_input_kv_idxs(ggml_tensor * dst) const {
+    kv->set_input_kv_idxs(dst, get_sinfo(dst->ne[0]));
+}
+
 void llama_kv_cache_unified_state::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
     kv->set_input_kq_mask(dst, ubatch, causal_attn);
 }
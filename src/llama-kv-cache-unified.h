@@ -24,7 +24,29 @@ public:
     // this callback is used to filter out layers that should not be included in the cache
     using layer_filter_cb = std::function<bool(int32_t il)>;
 
-    using ubatch_heads = std::vector<uint32_t>;
+    // the cells in which the tokens of a ubatch are stored - one cell per token
+    // in the default mode the cells form a single contiguous range [head, head + n_tokens)
+    // in paged mode (kv_block_size > 0) the cells can be scattered across multiple blocks
+    struct slot_info {
+        std::vector<uint32_t> idxs;
+
+        bool empty() const {
+            return idxs.empty();
+        }
+
+        uint32_t size() const {
+            return idxs.size();
+        }
+
+        uint32_t head() const {
+            return idxs.at(0);
+        }
+
+        // number of contiguous ranges of cells in the slot
+        uint32_t n_runs() const;
+    };
+
+    using slot_info_vec_t = std::vector<slot_info>;
 
     struct defrag_info {
         bool empty() const {
@@ -37,18 +59,20 @@ public:
         std::vector<uint32_t> ids;
     };
 
+    // type_k and type_v hold the data types for each layer of the model
     llama_kv_cache_unified(
-            const llama_model &  model,
-              layer_filter_cb && filter,
-                    ggml_type    type_k,
-                    ggml_type    type_v,
-                         bool    v_trans,
-                         bool    offload,
-                     uint32_t    kv_size,
-                     uint32_t    n_seq_max,
-                     uint32_t    n_pad,
-                     uint32_t    n_swa,
-               llama_swa_type    swa_type);
+                       const llama_model &  model,
+                         layer_filter_cb && filter,
+            const std::vector<ggml_type> &  type_k,
+            const std::vector<ggml_type> &  type_v,
+                                    bool    v_trans,
+                                    bool    offload,
+                                uint32_t    kv_size,
+                                uint32_t    n_seq_max,
+                                uint32_t    n_pad,
+                                uint32_t    n_blk,
+                                uint32_t    n_swa,
+                          llama_swa_type    swa_type);
 
     ~llama_kv_cache_unified() = default;
 
@@ -96,6 +120,19 @@ public:
 
     bool get_has_shift() const;
 
+    // true if there are pending copy-on-write copies that have to be applied with update()
+    bool get_has_cow() const;
+
+    // size of the KV blocks in paged mode, 0 if the cache is not paged
+    uint32_t get_blk_size() const;
+
+    // true if the devices of all the layers can store K and V to cells given by a graph input (GGML_OP_SET_ROWS)
+    bool get_supports_set_rows() const;
+
+    // upper bound for the number of contiguous ranges of cells used by a single ubatch
+    // the graph needs a separate copy of K and V per range, so this determines the extra graph nodes
+    static uint32_t get_n_runs_max(const llama_cparams & cparams);
+
     //
     // graph_build API
     //
@@ -106,26 +143,28 @@ public:
     ggml_tensor * get_k(ggml_context * ctx, int32_t il, uint32_t n_kv) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il, uint32_t n_kv) const;
 
-    // store k_cur and v_cur in the cache based on the provided head location
-    ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, int32_t il, uint32_t head_cur) const;
-    ggml_tensor * cpy_v(ggml_context * ctx, ggml_tensor * v_cur, int32_t il, uint32_t head_cur) const;
+    // store k_cur and v_cur in the cache based on the provided slot
+    // with kv_idxs, the cells are read from that graph input (see set_input_kv_idxs), so the graph does not depend on the slot
+    // otherwise one copy is added to the graph for each contiguous range of cells in the slot
+    void cpy_k(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * k_cur, ggml_tensor * kv_idxs, int32_t il, const slot_info & sinfo) const;
+    void cpy_v(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * v_cur, ggml_tensor * kv_idxs, int32_t il, const slot_info & sinfo) const;
 
     //
     // preparation API
     //
 
-    // find places for the provided ubatches in the cache, returns the head locations
+    // find places for the provided ubatches in the cache, returns the slot infos
     // return empty vector on failure
-    ubatch_heads prepare(const std::vector<llama_ubatch> & ubatches);
+    slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches);
 
     bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo);
 
-    // return the cell position where we can insert the ubatch
-    // return -1 on failure to find a contiguous slot of kv cells
-    int32_t find_slot(const llama_ubatch & ubatch) const;
+    // return the cells where we can insert the ubatch
+    // return an empty slot_info on failure
+    slot_info find_slot(const llama_ubatch & ubatch) const;
 
-    // emplace the ubatch context into slot: [head_cur, head_cur + ubatch.n_tokens)
-    void apply_ubatch(uint32_t head_cur, const llama_ubatch & ubatch);
+    // emplace the ubatch context into the cells of the slot
+    void apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch);
 
     //
     // set_input API
@@ -133,6 +172,7 @@ public:
 
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_k_shift   (ggml_tensor * dst) const;
+    void set_input_kv_idxs   (ggml_tensor * dst, const slot_info & sinfo) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
 private:
@@ -150,6 +190,8 @@ private:
 
     bool v_trans = true;  // the value tensor is transposed
 
+    bool supports_set_rows = false;
+
     // the current index from where we start searching for a free slot in the ring buffer of KV cells (see find_slot())
     // note: this is not part of the KV state and it's only used to speed-up the find_slot() method
     uint32_t head = 0;
@@ -159,6 +201,22 @@ private:
     // required padding
     const uint32_t n_pad = 1;
 
+    // paged mode: number of cells per KV block (0 - disabled)
+    const uint32_t n_blk = 0;
+
+    // copy-on-write: pairs of (src, dst) cells whose data has to be copied during the next update()
+    // cells that are shared by multiple sequences (e.g. after seq_cp) are duplicated when one of the
+    // sequences changes their position (seq_add/seq_div), so that the other sequences are not affected
+    std::vector<std::pair<uint32_t, uint32_t>> cow_cpys;
+
+    // paged mode: per-block owner sequence and the last cell written by each sequence
+    // a sequence appends new tokens only to a block that it owns - once the block is full (or shared after
+    // a seq_cp), a new free block is claimed. this way the cache never needs a contiguous run of free cells
+    // note: this is not part of the KV state - it is only used to speed-up find_slot()
+    std::vector<llama_seq_id> blk_owner;
+
+    int32_t blk_tail[LLAMA_MAX_PARALLEL_SEQUENCES];
+
     // SWA
     const uint32_t n_swa = 0;
 
@@ -174,6 +232,19 @@ private:
     // model layer id -> KV cache layer id
     std::unordered_map<int32_t, int32_t> map_layer_ids;
 
+    // find a contiguous range of cells for the ubatch - used when the cache is not paged
+    // and as a fallback in paged mode
+    slot_info find_slot_contiguous(const llama_ubatch & ubatch) const;
+
+    // place the tokens of each sequence into the blocks owned by the sequence
+    slot_info find_slot_paged(const llama_ubatch & ubatch) const;
+
+    void blk_reset();
+
+    // move seq_id out of the shared cell i into a new cell and schedule the data copy
+    // return the index of the new cell or -1 if there are no free cells
+    int32_t cow_cell(uint32_t i, llama_seq_id seq_id);
+
     // return non-empty vector if cells have been moved
     defrag_info defrag_prepare(int32_t n_max_nodes) const;
 
@@ -204,6 +275,13 @@ private:
                     ggml_cgraph * gf,
               const defrag_info & dinfo) const;
 
+    // copy the data of cells cpys[i0, i1) - used for copy-on-write
+    llm_graph_result_ptr build_graph_cow(
+                   ggml_context * ctx,
+                    ggml_cgraph * gf,
+                         size_t   i0,
+                         size_t   i1) const;
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
@@ -214,8 +292,8 @@ private:
 class llama_kv_cache_unified_state : public llama_memory_state_i {
 public:
     // some shorthands
-    using ubatch_heads = llama_kv_cache_unified::ubatch_heads;
-    using defrag_info  = llama_kv_cache_unified::defrag_info;
+    using slot_info_vec_t = llama_kv_cache_unified::slot_info_vec_t;
+    using defrag_info     = llama_kv_cache_unified::defrag_info;
 
     // used for errors
     llama_kv_cache_unified_state(llama_memory_status status);
@@ -235,7 +313,7 @@ public:
     llama_kv_cache_unified_state(
             llama_kv_cache_unified * kv,
             llama_sbatch sbatch,
-            ubatch_heads heads,
+            slot_info_vec_t sinfos,
             std::vector<llama_ubatch> ubatches);
 
     virtual ~llama_kv_cache_unified_state();
@@ -258,15 +336,19 @@ public:
 
     uint32_t get_n_kv() const;
 
+    bool get_supports_set_rows() const;
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
 
-    // store k_cur and v_cur in the cache based on the provided head location
-    ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, int32_t il) const;
-    ggml_tensor * cpy_v(ggml_context * ctx, ggml_tensor * v_cur, int32_t il) const;
+    // store k_cur and v_cur in the cache based on the current slot
+    // with kv_idxs, the cells of the slot are set by set_input_kv_idxs
+    void cpy_k(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * k_cur, ggml_tensor * kv_idxs, int32_t il) const;
+    void cpy_v(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * v_cur, ggml_tensor * kv_idxs, int32_t il) const;
 
     void set_input_k_shift(ggml_tensor * dst) const;
+    void set_input_kv_idxs(ggml_tensor * dst) const;
 
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
@@ -277,6 +359,9 @@ private:
     llama_kv_cache_unified * kv;
     llama_context * lctx;
 
+    // the slot of the current ubatch
+    llama_kv_cache_unified::slot_info get_sinfo(int64_t n_tokens) const;
+
     //
     // update state
     //
@@ -294,7 +379,7 @@ private:
     // the index of the next ubatch to process
     size_t i_next = 0;
 
-    ubatch_heads heads;
+    slot_info_vec_t sinfos;
 
     std::vector<llama_ubatch> ubatches;
 
@@ -305,7 +390,4 @@ private:
     // a heuristic, to avoid attending the full cache if it is not yet utilized
     // as the cache gets filled, the benefit from this heuristic disappears
     int32_t n_kv;
-
-    // the beginning of the current slot in which the ubatch will be inserted
-    int32_t head;
 };
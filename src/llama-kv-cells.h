@@ -3,6 +3,7 @@
 #include "llama.h"
 #include "llama-cparams.h"
 
+#include <algorithm>
 #include <bitset>
 #include <cassert>
 #include <vector>
@@ -23,6 +24,8 @@ public:
 
         used.clear();
 
+        std::fill(blk_used.begin(), blk_used.end(), 0);
+
         for (uint32_t s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; ++s) {
             seq_pos[s].clear();
         }
@@ -45,9 +48,38 @@ public:
         shift.resize(n);
         seq.resize(n);
 
+        if (blk_size > 0) {
+            blk_used.resize((n + blk_size - 1)/blk_size);
+        }
+
         reset();
     }
 
+    // group the cells into fixed-size blocks and keep track of the number of used cells in each block
+    // used by the paged mode of the KV cache to quickly find free blocks
+    // note: call before adding any cells
+    void blk_init(uint32_t n) {
+        assert(used.empty());
+
+        blk_size = n;
+        blk_used.assign(n > 0 ? (pos.size() + n - 1)/n : 0, 0);
+    }
+
+    uint32_t get_blk_size() const {
+        return blk_size;
+    }
+
+    uint32_t blk_count() const {
+        return blk_used.size();
+    }
+
+    // number of non-empty cells in block b
+    uint32_t blk_get_used(uint32_t b) const {
+        assert(b < blk_used.size());
+
+        return blk_used[b];
+    }
+
     bool is_empty(uint32_t i) const {
         assert(i < pos.size());
         assert((pos[i] < 0 && pos[i] == -1) || pos[i] >= 0);
@@ -88,8 +120,8 @@ public:
         shift[isrc] =  0;
         seq  [isrc].reset();
 
-        used.erase (isrc);
-        used.insert(idst);
+        used_rm(isrc);
+        used_add(idst);
     }
 
     // copy the state of cells [i, i + n) (used for save/restore the state of the cells)
@@ -116,11 +148,11 @@ public:
 
         for (uint32_t j = 0; j < other.pos.size(); ++j) {
             if (pos[i + j] == -1 && other.pos[j] != -1) {
-                used.insert(i + j);
+                used_add(i + j);
             }
 
             if (pos[i + j] != -1 && other.pos[j] == -1) {
-                used.erase(i + j);
+                used_rm(i + j);
             }
 
             if (pos[i + j] != -1) {
@@ -138,6 +170,56 @@ public:
         }
     }
 
+    // copy the state of an arbitrary set of cells (used to save/restore the cells of a non-contiguous slot)
+    llama_kv_cells_unified cp(const std::vector<uint32_t> & idxs) const {
+        llama_kv_cells_unified res;
+
+        res.resize(idxs.size());
+
+        for (uint32_t j = 0; j < idxs.size(); ++j) {
+            assert(idxs[j] < pos.size());
+
+            res.pos[j] = pos[idxs[j]];
+            res.seq[j] = seq[idxs[j]];
+
+            assert(shift[idxs[j]] == 0);
+        }
+
+        return res;
+    }
+
+    // set the state of the cells idxs[j] from other.pos[j] (used to save/restore the cells of a non-contiguous slot)
+    void set(const std::vector<uint32_t> & idxs, const llama_kv_cells_unified & other) {
+        assert(idxs.size() == other.pos.size());
+
+        for (uint32_t j = 0; j < idxs.size(); ++j) {
+            const uint32_t i = idxs[j];
+
+            assert(i < pos.size());
+
+            if (pos[i] == -1 && other.pos[j] != -1) {
+                used_add(i);
+            }
+
+            if (pos[i] != -1 && other.pos[j] == -1) {
+                used_rm(i);
+            }
+
+            if (pos[i] != -1) {
+                seq_pos_rm(i);
+            }
+
+            pos[i] = other.pos[j];
+            seq[i] = other.seq[j];
+
+            if (pos[i] != -1) {
+                seq_pos_add(i);
+            }
+
+            assert(shift[i] == 0);
+        }
+    }
+
     // clear a non-empty cell
     void rm(uint32_t i) {
         assert(i < pos.size());
@@ -148,7 +230,7 @@ public:
         pos[i] = -1;
         seq[i].reset();
 
-        used.erase(i);
+        used_rm(i);
     }
 
     // note: call only if the cell has seq_id
@@ -165,7 +247,7 @@ public:
         if (seq[i].none()) {
             pos[i] = -1;
 
-            used.erase(i);
+            used_rm(i);
 
             return true;
         }
@@ -193,7 +275,7 @@ public:
 
             pos[i] = -1;
 
-            used.erase(i);
+            used_rm(i);
 
             return true;
         }
@@ -229,6 +311,27 @@ public:
         seq_pos[seq_id].insert(pos[i]);
     }
 
+    // move seq_id from the shared cell isrc to the empty cell idst, keeping the position and the pending shift
+    // used to un-share a cell before modifying its position (copy-on-write)
+    // note: call only if isrc contains seq_id and at least one more sequence
+    void seq_mv(uint32_t isrc, uint32_t idst, llama_seq_id seq_id) {
+        assert(isrc < pos.size());
+        assert(idst < pos.size());
+        assert(pos[idst] == -1);
+        assert(seq[isrc].test(seq_id));
+        assert(seq[isrc].count() > 1);
+
+        pos  [idst] = pos  [isrc];
+        shift[idst] = shift[isrc];
+
+        seq[isrc].reset(seq_id);
+        seq[idst].set  (seq_id);
+
+        // note: seq_pos[seq_id] does not change because the position is the same
+
+        used_add(idst);
+    }
+
     // return the sequence id of this cell
     // note: call only for cells with exactly one sequence
     llama_seq_id seq_get(uint32_t i) const {
@@ -302,7 +405,7 @@ public:
 
         pos[i] = p;
 
-        used.insert(i);
+        used_add(i);
     }
 
     // pos[i] = pos[i] + d
@@ -327,7 +430,7 @@ public:
             seq[i].reset();
             pos[i] = -1;
 
-            used.erase(i);
+            used_rm(i);
 
             return true;
         }
@@ -362,6 +465,12 @@ private:
 
     std::vector<llama_pos> pos;
 
+    // block size used for the blk_used counters (0 - no blocks)
+    uint32_t blk_size = 0;
+
+    // blk_used[b] is the number of used cells in [b*blk_size, (b + 1)*blk_size)
+    std::vector<uint32_t> blk_used;
+
     // this array accumulates any applied shifts to the pos array since the last reset_shift() call
     // this is used to queue multiple updates to the pos array, which in the end can be applied in one go:
     //
@@ -388,6 +497,21 @@ private:
     // this way seq_pos[s].begin() and seq_pos[s].rbegin() give us the min/max positions currently in the cache
     std::set<llama_pos> seq_pos[LLAMA_MAX_PARALLEL_SEQUENCES];
 
+    // helper functions for updating `used` and the block counters, one cell at a time:
+
+    void used_add(uint32_t i) {
+        if (used.insert(i).second && blk_size > 0) {
+            blk_used[i/blk_size]++;
+        }
+    }
+
+    void used_rm(uint32_t i) {
+        if (used.erase(i) > 0 && blk_size > 0) {
+            assert(blk_used[i/blk_size] > 0);
+            blk_used[i/blk_size]--;
+        }
+    }
+
     // helper functions for updating `seq_pos`, once cell at a time:
 
     // remove cell i
@@ -12,6 +12,9 @@ struct llama_memory_params {
     ggml_type type_k;
     ggml_type type_v;
 
+    // per-layer overrides of type_k/type_v
+    std::vector<llama_kv_cache_layer_type> type_layers;
+
     // use full-size SWA cache
     bool swa_full;
 };
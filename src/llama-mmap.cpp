@@ -126,6 +126,26 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &ov);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -209,6 +229,25 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            ssize_t ret = pread(fileno(fp), (char *) ptr + bytes_read, chunk_size, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -261,6 +300,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -446,6 +486,34 @@ void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
 
+void llama_mmap::prefetch(const void * addr, size_t len) {
+#ifdef _POSIX_MAPPED_FILES
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t first  = (uintptr_t) addr & ~(page_size - 1);
+    if (posix_madvise((void *) first, (uintptr_t) addr + len - first, POSIX_MADV_WILLNEED)) {
+        LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", strerror(errno));
+    }
+#elif defined(_WIN32) && _WIN32_WINNT >= 0x602
+    BOOL (WINAPI *pPrefetchVirtualMemory) (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+    HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
+
+    pPrefetchVirtualMemory = (decltype(pPrefetchVirtualMemory))(void *) GetProcAddress(hKernel32, "PrefetchVirtualMemory");
+
+    if (pPrefetchVirtualMemory) {
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = (PVOID) addr;
+        range.NumberOfBytes  = (SIZE_T) len;
+        if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+            LLAMA_LOG_WARN("warning: PrefetchVirtualMemory failed: %s\n",
+                    llama_format_win_err(GetLastError()).c_str());
+        }
+    }
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(len);
+#endif
+}
+
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
 #else
@@ -24,6 +24,7 @@ struct llama_file {
     void seek(size_t offset, int whence) const;
 
     void read_raw(void * ptr, size_t len) const;
+    void read_raw_at(void * ptr, size_t len, size_t offset) const; // positional read, can be called from several threads
     uint32_t read_u32() const;
 
     void write_raw(const void * ptr, size_t len) const;
@@ -44,6 +45,9 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // ask the OS to start reading a range of mapped memory
+    static void prefetch(const void * addr, size_t len);
+
     static const bool SUPPORTED;
 
 private:
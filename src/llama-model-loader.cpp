@@ -3,9 +3,14 @@
 #include "ggml.h"
 
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
-#include <future>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -890,6 +895,115 @@ void llama_model_loader::load_data_for(struct ggml_tensor * cur) const {
     }
 }
 
+// pool of threads used by load_all_data() to read, validate and set the tensors in parallel
+//   submit() blocks while too many jobs or too much staging memory are in flight, so that the reads do not run ahead
+//   of the uploads - the first error of a job cancels the remaining jobs and is rethrown by wait()
+struct llama_load_pool {
+    llama_load_pool(int n_threads, size_t n_jobs_max, size_t n_staging_max) : n_jobs_max(n_jobs_max), n_staging_max(n_staging_max) {
+        for (int i = 0; i < n_threads; ++i) {
+            workers.emplace_back([this] { worker(); });
+        }
+    }
+
+    ~llama_load_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs.clear();
+            stop = true;
+        }
+        cv_job.notify_all();
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    // n_size is added to size_done() when the job is finished, n_staging is the temporary memory used by the job
+    void submit(size_t n_size, size_t n_staging, std::function<void()> && fn) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] {
+            return !error.empty() || (jobs.size() + n_running < n_jobs_max && (n_staging_cur == 0 || n_staging_cur + n_staging <= n_staging_max));
+        });
+        if (!error.empty()) {
+            return;
+        }
+        n_staging_cur += n_staging;
+        jobs.push_back({ n_size, n_staging, std::move(fn) });
+        cv_job.notify_one();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return jobs.empty() && n_running == 0; });
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    size_t size_done() const {
+        return n_size_done.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct job {
+        size_t n_size;
+        size_t n_staging;
+        std::function<void()> fn;
+    };
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_job.wait(lock, [&] { return stop || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+
+            job cur = std::move(jobs.front());
+            jobs.pop_front();
+            n_running++;
+
+            lock.unlock();
+            std::string err;
+            try {
+                cur.fn();
+                n_size_done += cur.n_size;
+            } catch (const std::exception & e) {
+                err = e.what();
+            }
+            lock.lock();
+
+            if (!err.empty() && error.empty()) {
+                error = err;
+                for (const auto & j : jobs) {
+                    n_staging_cur -= j.n_staging;
+                }
+                jobs.clear();
+            }
+            n_running--;
+            n_staging_cur -= cur.n_staging;
+            cv_done.notify_all();
+        }
+    }
+
+    const size_t n_jobs_max;
+    const size_t n_staging_max;
+
+    std::mutex mutex;
+    std::condition_variable cv_job;
+    std::condition_variable cv_done;
+
+    std::vector<std::thread> workers;
+    std::deque<job> jobs;
+
+    size_t n_running     = 0;
+    size_t n_staging_cur = 0;
+    bool   stop          = false;
+
+    std::string error;
+
+    std::atomic<size_t> n_size_done{0};
+};
+
 bool llama_model_loader::load_all_data(
         struct ggml_context * ctx,
         llama_buf_map & bufs,
@@ -898,8 +1012,52 @@ bool llama_model_loader::load_all_data(
         void * progress_callback_user_data) {
     GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
+    if (t_load_start_us == 0) {
+        t_load_start_us = ggml_time_us();
+    }
+
     std::vector<no_init<uint8_t>> read_buf;
-    std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
+
+    std::atomic<int64_t> t_read_us{0};
+    std::atomic<int64_t> t_validate_us{0};
+    std::atomic<int64_t> t_upload_us{0};
+    std::atomic<bool>    validation_failed{false};
+
+    auto read_data = [&](const llama_file * file, void * dst, size_t n_size, size_t offs) {
+        const int64_t t_start_us = ggml_time_us();
+        file->read_raw_at(dst, n_size, offs);
+        t_read_us += ggml_time_us() - t_start_us;
+    };
+
+    auto validate_data = [&](const ggml_tensor * cur, const void * data, size_t n_size) {
+        const int64_t t_start_us = ggml_time_us();
+        if (!ggml_validate_row_data(cur->type, data, n_size)) {
+            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(cur));
+            validation_failed = true;
+        }
+        t_validate_us += ggml_time_us() - t_start_us;
+    };
+
+    auto upload_data = [&](ggml_tensor * cur, const void * data, size_t n_size) {
+        const int64_t t_start_us = ggml_time_us();
+        ggml_backend_tensor_set(cur, data, 0, n_size);
+        t_upload_us += ggml_time_us() - t_start_us;
+    };
+
+    // the CPU backend can set tensors from several threads at once, this includes the repacking of the extra buffer types
+    auto is_cpu_buffer = [](ggml_backend_buffer_t buf) {
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(buf));
+        return dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU;
+    };
+
+    // the tensors in host and CPU buffers are read, validated and set by a pool of threads,
+    // the tensors of the other devices go through the sequential path, with async uploads when possible
+    constexpr int    n_threads_max = 8;
+    constexpr size_t n_staging_max = 512*MiB;
+
+    const int n_threads = std::max(1, std::min<int>(n_threads_max, std::thread::hardware_concurrency()));
+
+    llama_load_pool pool(n_threads, 4*n_threads, n_staging_max);
 
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
@@ -998,7 +1156,7 @@ bool llama_model_loader::load_all_data(
         }
 
         if (progress_callback) {
-            if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+            if (!progress_callback((float) (size_done + pool.size_done()) / size_data, progress_callback_user_data)) {
                 return false;
             }
         }
@@ -1013,12 +1171,6 @@ bool llama_model_loader::load_all_data(
             }
             uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
-            if (check_tensors) {
-                validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                    return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
-                }));
-            }
-
             GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
             if (buf_mmap && cur->data == nullptr) {
                 ggml_backend_tensor_alloc(buf_mmap, cur, data);
@@ -1030,46 +1182,71 @@ bool llama_model_loader::load_all_data(
                 auto & mmap_used = mmaps_used[weight->idx];
                 mmap_used.first  = std::min(mmap_used.first,  weight->offs);
                 mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
+
+                if (check_tensors) {
+                    pool.submit(0, 0, [&validate_data, cur, data, n_size] { validate_data(cur, data, n_size); });
+                }
+            } else if (is_cpu_buffer(cur->buffer)) {
+                pool.submit(n_size, 0, [&, cur, data, n_size] {
+                    if (check_tensors) {
+                        validate_data(cur, data, n_size);
+                    }
+                    upload_data(cur, data, n_size);
+                });
+                continue;
             } else {
-                ggml_backend_tensor_set(cur, data, 0, n_size);
+                if (check_tensors) {
+                    pool.submit(0, 0, [&validate_data, cur, data, n_size] { validate_data(cur, data, n_size); });
+                }
+                upload_data(cur, data, n_size);
             }
         } else {
-            const auto & file = files.at(weight->idx);
+            const llama_file * file = files.at(weight->idx).get();
+            const size_t offs = weight->offs;
             if (ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
-                }
-            } else {
-                // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
-                if (upload_backend) {
-                    file->seek(weight->offs, SEEK_SET);
+                pool.submit(n_size, 0, [&, file, cur, offs, n_size] {
+                    read_data(file, cur->data, n_size, offs);
+                    if (check_tensors) {
+                        validate_data(cur, cur->data, n_size);
+                    }
+                });
+                continue;
+            }
+            if (is_cpu_buffer(cur->buffer)) {
+                // e.g. the repacked extra buffer types, the file data is staged in a temporary buffer
+                pool.submit(n_size, n_size, [&, file, cur, offs, n_size] {
+                    std::vector<no_init<uint8_t>> staging(n_size);
+                    read_data(file, staging.data(), n_size, offs);
+                    if (check_tensors) {
+                        validate_data(cur, staging.data(), n_size);
+                    }
+                    upload_data(cur, staging.data(), n_size);
+                });
+                continue;
+            }
 
-                    size_t bytes_read = 0;
+            // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
+            if (upload_backend) {
+                size_t bytes_read = 0;
 
-                    while (bytes_read < n_size) {
-                        size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
+                while (bytes_read < n_size) {
+                    size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
 
-                        ggml_backend_event_synchronize(events[buffer_idx]);
-                        file->read_raw(host_ptrs[buffer_idx], read_iteration);
-                        ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
-                        ggml_backend_event_record(events[buffer_idx], upload_backend);
+                    ggml_backend_event_synchronize(events[buffer_idx]);
+                    read_data(file, host_ptrs[buffer_idx], read_iteration, offs + bytes_read);
+                    ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
+                    ggml_backend_event_record(events[buffer_idx], upload_backend);
 
-                        bytes_read += read_iteration;
-                        ++buffer_idx;
-                        buffer_idx %= n_buffers;
-                    }
-                } else {
-                    read_buf.resize(n_size);
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                    if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
-                    }
+                    bytes_read += read_iteration;
+                    ++buffer_idx;
+                    buffer_idx %= n_buffers;
+                }
+            } else {
+                read_buf.resize(n_size);
+                read_data(file, read_buf.data(), n_size, offs);
+                upload_data(cur, read_buf.data(), n_size);
+                if (check_tensors) {
+                    validate_data(cur, read_buf.data(), n_size);
                 }
             }
         }
@@ -1077,6 +1254,10 @@ bool llama_model_loader::load_all_data(
         size_done += n_size;
     }
 
+    pool.wait();
+
+    size_done += pool.size_done();
+
     // free temporary resources used for async uploads
     for (auto * event : events) {
         ggml_backend_event_synchronize(event);
@@ -1087,15 +1268,11 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
+    t_load_read_us     += t_read_us;
+    t_load_validate_us += t_validate_us;
+    t_load_upload_us   += t_upload_us;
+
     // check validation results
-    bool validation_failed = false;
-    for (auto & future : validation_result) {
-        auto result = future.get();
-        if (!result.second) {
-            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(result.first));
-            validation_failed = true;
-        }
-    }
     if (validation_failed) {
         throw std::runtime_error("found tensors with invalid data");
     }
@@ -1113,11 +1290,15 @@ bool llama_model_loader::load_all_data(
                 }
             }
         }
-        if (progress_callback) {
-            // Even though the model is done loading, we still honor
-            // cancellation since we need to free allocations.
-            return progress_callback(1.0f, progress_callback_user_data);
-        }
+        // Even though the model is done loading, we still honor
+        // cancellation since we need to free allocations.
+        const bool ok = progress_callback ? progress_callback(1.0f, progress_callback_user_data) : true;
+
+        LLAMA_LOG_INFO("%s: loaded %.2f MiB in %.2f s - read %.2f s, validate %.2f s, upload %.2f s (summed over %d threads)\n", __func__,
+                size_data/1024.0/1024.0, (ggml_time_us() - t_load_start_us)/1e6,
+                t_load_read_us/1e6, t_load_validate_us/1e6, t_load_upload_us/1e6, n_threads);
+
+        return ok;
     }
 
     return true;
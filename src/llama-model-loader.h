@@ -91,6 +91,12 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // per-stage timings of load_all_data(), summed over the loader threads
+    int64_t t_load_start_us    = 0;
+    int64_t t_load_read_us     = 0;
+    int64_t t_load_validate_us = 0;
+    int64_t t_load_upload_us   = 0;
+
     llama_model_loader(
         const std::string & fname,
         std::vector<std::string> & splits, // optional, only need if the split does not follow naming scheme
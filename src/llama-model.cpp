@@ -20,7 +20,9 @@
 #include <cmath>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <regex>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 
@@ -387,6 +389,21 @@ struct llama_model::impl {
     // the model memory buffers for the tensor data
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // host buffers copied to every NUMA node with --numa mirror
+    std::vector<const void *> numa_mirrors;
+
+    // lazily loaded MoE experts, per layer and expert (empty if disabled)
+    struct moe_expert {
+        uint64_t n_hits = 0;
+        bool     pinned = false;
+    };
+
+    std::vector<std::vector<moe_expert>> moe_experts;
+    std::mutex moe_mutex;
+
+    // the experts locked in RAM after params.moe_pin_hits uses
+    llama_mlocks moe_pins;
+
     buft_list_t cpu_buft_list;
     std::map<ggml_backend_dev_t, buft_list_t> gpu_buft_list;
 
@@ -406,7 +423,28 @@ llama_model::llama_model(const llama_model_params & params) : params(params), pi
     pimpl->has_tensor_overrides = params.tensor_buft_overrides && params.tensor_buft_overrides[0].pattern;
 }
 
-llama_model::~llama_model() {}
+llama_model::~llama_model() {
+    if (moe_lazy()) {
+        int n_used   = 0;
+        int n_pinned = 0;
+        for (const auto & layer : pimpl->moe_experts) {
+            for (const auto & st : layer) {
+                n_used   += st.n_hits > 0;
+                n_pinned += st.pinned;
+            }
+        }
+        LLAMA_LOG_INFO("%s: MoE experts used: %d of %d, pinned: %d\n", __func__,
+                n_used, (int) (pimpl->moe_experts.size()*hparams.n_expert), n_pinned);
+    }
+
+    if (!pimpl->numa_mirrors.empty()) {
+        auto * reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+        auto * numa_unmirror_fn = (decltype(ggml_numa_unmirror) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_unmirror");
+        for (const void * data : pimpl->numa_mirrors) {
+            numa_unmirror_fn(data);
+        }
+    }
+}
 
 void llama_model::load_stats(llama_model_loader & ml) {
     pimpl->n_elements = ml.n_elements;
@@ -1469,6 +1507,12 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     const bool use_mmap_buffer = true;
 
+    bool moe_lazy = params.moe_lazy && hparams.n_expert > 0;
+    if (moe_lazy && (!ml.use_mmap || use_mlock)) {
+        LLAMA_LOG_WARN("%s: lazy loading of the MoE experts requires mmap without mlock, disabling\n", __func__);
+        moe_lazy = false;
+    }
+
     LLAMA_LOG_INFO("%s: loading model tensors, this can take a while... (mmap = %s)\n", __func__, ml.use_mmap ? "true" : "false");
 
     // build a list of buffer types for the CPU and GPU devices
@@ -4131,7 +4175,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    // with lazy MoE experts the mappings are not prefetched, the other tensors are prefetched after loading
+    ml.init_mappings(!moe_lazy, use_mlock ? &pimpl->mlock_mmaps : nullptr);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -4259,9 +4304,144 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    if (moe_lazy) {
+        moe_lazy_init();
+    }
+
+    // copy the weights in host memory to every NUMA node
+    {
+        auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        auto * numa_mirror_fn = cpu_dev ? (decltype(ggml_numa_mirror) *)
+            ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_numa_mirror") : nullptr;
+        if (numa_mirror_fn) {
+            size_t n_bytes = 0;
+            for (auto & buf : pimpl->bufs) {
+                if (!ggml_backend_buffer_is_host(buf.get())) {
+                    continue;
+                }
+                const void * base = ggml_backend_buffer_get_base(buf.get());
+                const size_t size = ggml_backend_buffer_get_size(buf.get());
+                // the lazily loaded MoE experts stay in the mmap-ed files, copying their buffer would load all of them
+                if (moe_lazy_in_buffer(base, size)) {
+                    LLAMA_LOG_INFO("%s: %s buffer holds MoE experts loaded on demand, not mirrored\n", __func__, ggml_backend_buffer_name(buf.get()));
+                    continue;
+                }
+                if (numa_mirror_fn(base, size)) {
+                    pimpl->numa_mirrors.push_back(base);
+                    n_bytes += size;
+                }
+            }
+            if (n_bytes > 0) {
+                LLAMA_LOG_INFO("%s: mirrored %.2f MiB of weights to every NUMA node\n", __func__, n_bytes / 1024.0 / 1024.0);
+            }
+        }
+    }
+
     return true;
 }
 
+// returns the slices of the experts of a layer that are in the mmap-ed model files
+std::vector<std::pair<const uint8_t *, size_t>> llama_model::moe_expert_slices(int il, int32_t expert) const {
+    std::vector<std::pair<const uint8_t *, size_t>> res;
+
+    for (const ggml_tensor * t : { layers[il].ffn_gate_exps, layers[il].ffn_up_exps, layers[il].ffn_down_exps }) {
+        if (t == nullptr || t->data == nullptr) {
+            continue;
+        }
+
+        const uint8_t * data = (const uint8_t *) t->data;
+        for (const auto & mapping : pimpl->mappings) {
+            const uint8_t * addr = (const uint8_t *) mapping->addr();
+            if (data >= addr && data + ggml_nbytes(t) <= addr + mapping->size()) {
+                res.emplace_back(data + expert*t->nb[2], t->nb[2]);
+                break;
+            }
+        }
+    }
+
+    return res;
+}
+
+void llama_model::moe_lazy_init() {
+    std::set<const ggml_tensor *> exps;
+    for (const auto & layer : layers) {
+        exps.insert({ layer.ffn_gate_exps, layer.ffn_up_exps, layer.ffn_down_exps });
+    }
+
+    size_t n_bytes_lazy = 0;
+    for (int il = 0; il < (int) layers.size(); ++il) {
+        for (const auto & slice : moe_expert_slices(il, 0)) {
+            n_bytes_lazy += slice.second*hparams.n_expert;
+        }
+    }
+
+    if (n_bytes_lazy == 0) {
+        LLAMA_LOG_WARN("%s: no MoE experts in mmap-ed memory, lazy loading is disabled\n", __func__);
+
+        // the mappings were not prefetched when they were created, do it now like without lazy loading
+        for (const auto & mapping : pimpl->mappings) {
+            llama_mmap::prefetch(mapping->addr(), mapping->size());
+        }
+        return;
+    }
+
+    pimpl->moe_experts.assign(layers.size(), std::vector<impl::moe_expert>(hparams.n_expert));
+
+    // the other tensors are used by every batch, prefetch them
+    for (const auto & it : tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (exps.count(t) == 0 && t->buffer && ggml_backend_buffer_is_host(t->buffer)) {
+            llama_mmap::prefetch(t->data, ggml_nbytes(t));
+        }
+    }
+
+    LLAMA_LOG_INFO("%s: %.2f MiB of MoE experts are loaded on demand\n", __func__, n_bytes_lazy/1024.0/1024.0);
+}
+
+bool llama_model::moe_lazy() const {
+    return !pimpl->moe_experts.empty();
+}
+
+bool llama_model::moe_lazy_in_buffer(const void * base, size_t size) const {
+    if (!moe_lazy()) {
+        return false;
+    }
+
+    for (int il = 0; il < (int) layers.size(); ++il) {
+        for (const auto & slice : moe_expert_slices(il, 0)) {
+            if (slice.first >= (const uint8_t *) base && slice.first < (const uint8_t *) base + size) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void llama_model::moe_record(int il, const std::vector<int32_t> & experts) const {
+    std::lock_guard<std::mutex> lock(pimpl->moe_mutex);
+
+    for (const int32_t e : experts) {
+        auto & st = pimpl->moe_experts[il][e];
+
+        // the expert matmuls of the layer are computed next, read the slices of an expert that was not used yet ahead
+        if (st.n_hits++ == 0) {
+            for (const auto & slice : moe_expert_slices(il, e)) {
+                llama_mmap::prefetch(slice.first, slice.second);
+            }
+        }
+
+        if (params.moe_pin_hits > 0 && !st.pinned && st.n_hits >= params.moe_pin_hits && llama_mlock::SUPPORTED) {
+            for (const auto & slice : moe_expert_slices(il, e)) {
+                auto & pin = pimpl->moe_pins.emplace_back(std::make_unique<llama_mlock>());
+                pin->init(const_cast<uint8_t *>(slice.first));
+                pin->grow_to(slice.second);
+            }
+            st.pinned = true;
+        }
+    }
+}
+
 std::string llama_model::arch_name() const {
     return llm_arch_name(arch);
 }
@@ -13223,33 +13403,50 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
 
                 LLAMA_LOG_DEBUG("%s: n_ctx = %u (padded)\n", __func__, cparams.n_ctx);
 
+                // resolve the KV cache types of each layer
+                std::vector<ggml_type> type_k(hparams.n_layer, params.type_k);
+                std::vector<ggml_type> type_v(hparams.n_layer, params.type_v);
+
+                for (const auto & lt : params.type_layers) {
+                    const int32_t n_layer  = hparams.n_layer;
+                    const int32_t il_first = lt.il_first < 0 ? n_layer + lt.il_first : lt.il_first;
+                    const int32_t il_last  = lt.il_last  < 0 ? n_layer + lt.il_last  : lt.il_last;
+
+                    for (int32_t il = std::max(il_first, 0); il <= std::min(il_last, n_layer - 1); ++il) {
+                        type_k[il] = lt.type_k;
+                        type_v[il] = lt.type_v;
+                    }
+                }
+
                 if (hparams.swa_type != LLAMA_SWA_TYPE_NONE) {
                     GGML_ASSERT(hparams.is_swa_any());
 
                     res = new llama_kv_cache_unified_iswa(
                             *this,
-                            params.type_k,
-                            params.type_v,
+                            type_k,
+                            type_v,
                             !cparams.flash_attn,
                             cparams.offload_kqv,
                             params.swa_full,
                             cparams.n_ctx,
                             cparams.n_seq_max,
                             cparams.n_ubatch,
-                            padding);
+                            padding,
+                            cparams.kv_block_size);
                 } else {
                     GGML_ASSERT(!hparams.is_swa_any());
 
                     res = new llama_kv_cache_unified(
                             *this,
                             nullptr,
-                            params.type_k,
-                            params.type_v,
+                            type_k,
+                            type_v,
                             !cparams.flash_attn,
                             cparams.offload_kqv,
                             cparams.n_ctx,
                             cparams.n_seq_max,
                             padding,
+                            cparams.kv_block_size,
                             hparams.n_swa,
                             hparams.swa_type);
                 }
@@ -13534,6 +13731,9 @@ llm_graph_result_ptr llama_model::build_graph(
     // add on pooling layer
     llm->build_pooling(gf, cls, cls_b, cls_out, cls_out_b);
 
+    // select the top logits on the device
+    llm->build_logits_top(gf);
+
     return std::move(llm->res);
 }
 
@@ -13556,6 +13756,8 @@ llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.moe_lazy                    =*/ false,
+        /*.moe_pin_hits                =*/ 0,
     };
 
 #ifdef GGML_USE_METAL
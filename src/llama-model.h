@@ -403,6 +403,13 @@ struct llama_model {
 
     ggml_tensor * get_rope_factors(const llama_cparams & cparams, int il) const;
 
+    // lazy loading of the MoE experts (params.moe_lazy)
+    bool moe_lazy() const;
+
+    // records the experts selected by a batch in layer il before they are used, prefetches the experts used for the
+    // first time and pins the experts used params.moe_pin_hits times
+    void moe_record(int il, const std::vector<int32_t> & experts) const;
+
     // note: can mutate `cparams`
     // TODO: move this to new llm_arch_model_i interface
     llama_memory_i * create_memory(const llama_memory_params & params, llama_cparams & cparams) const;
@@ -414,6 +421,13 @@ struct llama_model {
                     llm_graph_type   type) const;
 
 private:
+    void moe_lazy_init();
+
+    // true if the buffer holds experts that are loaded on demand
+    bool moe_lazy_in_buffer(const void * base, size_t size) const;
+
+    std::vector<std::pair<const uint8_t *, size_t>> moe_expert_slices(int il, int32_t expert) const;
+
     struct impl;
     std::unique_ptr<impl> pimpl;
 };
@@ -0,0 +1,94 @@
+#include "llama-parallel.h"
+
+#include <algorithm>
+
+//
+// llama_parallel_pool
+//
+
+llama_parallel_pool::~llama_parallel_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv_start.notify_all();
+
+    for (auto & t : threads) {
+        t.join();
+    }
+}
+
+void llama_parallel_pool::run(int32_t n, int32_t n_threads, const std::function<void(int32_t)> & fn) {
+    n_threads = std::max(1, std::min(n_threads, n));
+
+    // the threads are started on first use and kept for the next loops
+    while ((int32_t) threads.size() < n_threads - 1) {
+        threads.emplace_back(&llama_parallel_pool::worker, this, (int32_t) threads.size(), gen);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->fn  = &fn;
+        this->n   = n;
+        i_next    = 0;
+        n_workers = n_threads - 1;
+        n_busy    = n_threads - 1;
+        error     = nullptr;
+        gen++;
+    }
+    cv_start.notify_all();
+
+    work();
+
+    std::exception_ptr err;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this] { return n_busy == 0; });
+        this->fn = nullptr;
+        err = error;
+    }
+
+    if (err) {
+        std::rethrow_exception(err);
+    }
+}
+
+void llama_parallel_pool::worker(int32_t ith, uint64_t gen_start) {
+    uint64_t gen_last = gen_start;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_start.wait(lock, [&] { return stop || gen != gen_last; });
+            if (stop) {
+                return;
+            }
+            gen_last = gen;
+            if (ith >= n_workers) {
+                continue;
+            }
+        }
+
+        work();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n_busy--;
+        }
+        cv_done.notify_one();
+    }
+}
+
+void llama_parallel_pool::work() {
+    int32_t i;
+    while ((i = i_next.fetch_add(1)) < n) {
+        try {
+            (*fn)(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+}
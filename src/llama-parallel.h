@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// threads that are kept alive between the calls, to run loops outside of the compute graphs (e.g. sampling, tokenization)
+struct llama_parallel_pool {
+    ~llama_parallel_pool();
+
+    // calls fn(i) for i in [0, n) on up to n_threads threads, including the calling thread
+    // if fn throws, the remaining iterations are still run and the first exception is rethrown
+    void run(int32_t n, int32_t n_threads, const std::function<void(int32_t)> & fn);
+
+private:
+    void worker(int32_t ith, uint64_t gen_start);
+
+    // runs the iterations of the current loop until there are none left
+    void work();
+
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    // current loop
+    const std::function<void(int32_t)> * fn = nullptr;
+
+    int32_t              n = 0;
+    std::atomic<int32_t> i_next { 0 };
+
+    int32_t  n_workers = 0; // number of threads of the pool that take part in the current loop
+    int32_t  n_busy    = 0; // number of these threads that are not done yet
+    uint64_t gen       = 0; // incremented for each loop
+    bool     stop      = false;
+
+    std::exception_ptr error;
+};
@@ -376,26 +376,50 @@ void llama_sampler_free(struct llama_sampler * smpl) {
     delete smpl;
 }
 
-llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
-    const auto * logits = llama_get_logits_ith(ctx, idx);
+static bool llama_sampler_sample_fused(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token & token);
+
+// an output of the context: the logits of the full vocab, or only the top logits sorted by decreasing logit
+struct llama_logits_row {
+    const llama_token * ids; // nullptr for the full vocab
+    const float       * logits;
+    int32_t             n;
+};
+
+static llama_logits_row llama_get_logits_row(struct llama_context * ctx, int32_t idx) {
+    llama_logits_row row = { nullptr, nullptr, 0 };
+
+    row.n = llama_get_logits_top_ith(ctx, idx, &row.ids, &row.logits);
+    if (row.n == 0) {
+        row.ids    = nullptr;
+        row.logits = llama_get_logits_ith(ctx, idx);
+        row.n      = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    }
+
+    return row;
+}
 
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
+static llama_token llama_sampler_sample_impl(struct llama_sampler * smpl, const llama_logits_row & row) {
+    if (row.ids == nullptr) {
+        llama_token token;
+        if (llama_sampler_sample_fused(smpl, row.logits, row.n, token)) {
+            llama_sampler_accept(smpl, token);
 
-    const int n_vocab = llama_vocab_n_tokens(vocab);
+            return token;
+        }
+    }
 
     // TODO: do not allocate each time
     std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    cur.reserve(row.n);
+    for (int32_t i = 0; i < row.n; i++) {
+        cur.emplace_back(llama_token_data{row.ids ? row.ids[i] : i, row.logits[i], 0.0f});
     }
 
     llama_token_data_array cur_p = {
         /* .data       = */ cur.data(),
         /* .size       = */ cur.size(),
         /* .selected   = */ -1,
-        /* .sorted     = */ false,
+        /* .sorted     = */ false, // the top logits are sorted, but the logit bias or a grammar can change their order
     };
 
     llama_sampler_apply(smpl, &cur_p);
@@ -409,6 +433,33 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
     return token;
 }
 
+llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
+    return llama_sampler_sample_impl(smpl, llama_get_logits_row(ctx, idx));
+}
+
+int32_t llama_sampler_sample_seqs(struct llama_sampler ** smpls, struct llama_context * ctx, const int32_t * idxs, int32_t n_seqs, llama_token * tokens) {
+    // llama_get_logits_ith synchronizes the context, so the rows are fetched before sampling in parallel
+    std::vector<llama_logits_row> rows(n_seqs);
+    for (int32_t i = 0; i < n_seqs; ++i) {
+        rows[i] = llama_get_logits_row(ctx, idxs[i]);
+        if (rows[i].logits == nullptr) {
+            LLAMA_LOG_ERROR("%s: no logits for output %d\n", __func__, idxs[i]);
+            return -1;
+        }
+    }
+
+    struct seqs_data {
+        llama_sampler         ** smpls;
+        const llama_logits_row * rows;
+        llama_token            * tokens;
+    } data = { smpls, rows.data(), tokens };
+
+    return llama_parallel_seqs(ctx, n_seqs, [](int32_t i, void * user_data) {
+        auto * data = (seqs_data *) user_data;
+        data->tokens[i] = llama_sampler_sample_impl(data->smpls[i], data->rows[i]);
+    }, &data);
+}
+
 // sampler chain
 
 static const char * llama_sampler_chain_name(const struct llama_sampler * /*smpl*/) {
@@ -487,6 +538,8 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
             /* .samplers    = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
+            /* .cur         = */ {},
+            /* .sparse      = */ {},
         }
     );
 }
@@ -1598,6 +1651,23 @@ struct llama_sampler * llama_sampler_init_grammar_lazy_patterns(
     return llama_sampler_init_grammar_impl(vocab, grammar_str, grammar_root, /* lazy= */ true, nullptr, 0, trigger_tokens, num_trigger_tokens, trigger_patterns, num_trigger_patterns);
 }
 
+int32_t llama_sampler_grammar_forced_text(const struct llama_sampler * smpl, char * buf, int32_t length) {
+    if (smpl == nullptr || smpl->iface != &llama_sampler_grammar_i) {
+        return 0;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+    if (!ctx->grammar) {
+        return 0;
+    }
+
+    const std::string text = llama_grammar_forced_text_impl(*ctx->grammar, length);
+
+    memcpy(buf, text.data(), text.size());
+
+    return text.size();
+}
+
 // penalties
 
 struct llama_sampler_penalties {
@@ -2540,6 +2610,452 @@ uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
     return LLAMA_DEFAULT_SEED;
 }
 
+// fused chain
+//
+// when the samplers at the start of the chain only modify a few tokens (logit-bias, penalties) and are followed by a
+// sampler that keeps only the best candidates (top-k, top-p, min-p, greedy), the candidates of the full vocab are not
+// needed: a threshold is derived from a histogram of the logits below the maximum, only the tokens above it are
+// collected, and the rest of the chain is applied to them
+
+static constexpr int   LLAMA_FUSED_BLOCK  = 64;    // logits per block of the passes over the full row
+static constexpr int   LLAMA_FUSED_STRIDE = 16;    // the count-only histogram uses every LLAMA_FUSED_STRIDE-th logit
+static constexpr int   LLAMA_FUSED_NBINS  = 256;   // bins of the histogram
+static constexpr float LLAMA_FUSED_RANGE  = 16.0f; // range below the maximum covered by the histogram
+static constexpr float LLAMA_FUSED_TAIL   = 30.0f; // the tokens further below the maximum are ignored for top-p (p < e^-30)
+
+// the samplers that do not change the candidates with their current parameters
+static bool llama_sampler_is_noop(const struct llama_sampler * smpl) {
+    const auto * iface = smpl->iface;
+
+    if (iface == &llama_sampler_top_k_i) {
+        return ((const llama_sampler_top_k *) smpl->ctx)->k <= 0;
+    }
+    if (iface == &llama_sampler_top_p_i) {
+        return ((const llama_sampler_top_p *) smpl->ctx)->p >= 1.0f;
+    }
+    if (iface == &llama_sampler_min_p_i) {
+        return ((const llama_sampler_min_p *) smpl->ctx)->p <= 0.0f;
+    }
+    if (iface == &llama_sampler_typical_i) {
+        return ((const llama_sampler_typical *) smpl->ctx)->p >= 1.0f;
+    }
+    if (iface == &llama_sampler_temp_i) {
+        return ((const llama_sampler_temp *) smpl->ctx)->temp == 1.0f;
+    }
+    if (iface == &llama_sampler_temp_ext_i) {
+        const auto * ctx = (const llama_sampler_temp_ext *) smpl->ctx;
+        return ctx->temp == 1.0f && ctx->delta <= 0.0f;
+    }
+    if (iface == &llama_sampler_xtc_i) {
+        const auto * ctx = (const llama_sampler_xtc *) smpl->ctx;
+        return ctx->probability <= 0.0f || ctx->threshold > 0.5f;
+    }
+    if (iface == &llama_sampler_top_n_sigma_i) {
+        return ((const llama_sampler_top_n_sigma *) smpl->ctx)->n <= 0.0f;
+    }
+    if (iface == &llama_sampler_dry_i) {
+        const auto * ctx = (const llama_sampler_dry *) smpl->ctx;
+        return ctx->dry_multiplier == 0.0f || ctx->dry_base < 1.0f || ctx->dry_penalty_last_n == 0;
+    }
+    if (iface == &llama_sampler_penalties_i) {
+        const auto * ctx = (const llama_sampler_penalties *) smpl->ctx;
+        return ctx->penalty_last_n == 0 ||
+              (ctx->penalty_repeat == 1.0f && ctx->penalty_freq == 0.0f && ctx->penalty_present == 0.0f);
+    }
+    if (iface == &llama_sampler_logit_bias_i) {
+        return ((const llama_sampler_logit_bias *) smpl->ctx)->logit_bias.empty();
+    }
+    if (iface == &llama_sampler_grammar_i) {
+        return ((const llama_sampler_grammar *) smpl->ctx)->grammar == nullptr;
+    }
+
+    return false;
+}
+
+// the number of logits >= thr in a block, written so that the compiler can vectorize it
+static int llama_logits_block_count(const float * logits, float thr) {
+    int res = 0;
+    for (int j = 0; j < LLAMA_FUSED_BLOCK; ++j) {
+        res += logits[j] >= thr;
+    }
+    return res;
+}
+
+// the floats are compared as integers, whose maximum can be vectorized without -ffast-math
+static float llama_logits_max(const float * logits, int32_t n) {
+    int32_t res = INT32_MIN;
+
+    for (int32_t i = 0; i < n; ++i) {
+        int32_t bits;
+        memcpy(&bits, logits + i, sizeof(bits));
+
+        // flip the negative floats so that the order of the integers matches the order of the floats
+        bits ^= (bits >> 31) & 0x7FFFFFFF;
+        res = bits > res ? bits : res;
+    }
+
+    res ^= (res >> 31) & 0x7FFFFFFF;
+
+    float max;
+    memcpy(&max, &res, sizeof(max));
+
+    return max;
+}
+
+// histogram of the logits in (max - LLAMA_FUSED_RANGE, max], the bin 0 is at the maximum
+// with probs, also accumulates exp(logit - max) per bin and over all the logits in [max - LLAMA_FUSED_TAIL, max]
+static void llama_logits_histogram(const float * logits, int32_t n, float max, bool probs, int32_t * count, float * mass, double & sum) {
+    const float lo    = max - (probs ? LLAMA_FUSED_TAIL : LLAMA_FUSED_RANGE);
+    const float scale = LLAMA_FUSED_NBINS/LLAMA_FUSED_RANGE;
+
+    auto add = [&](float l) {
+        const float d = max - l;
+        const int  ib = d < LLAMA_FUSED_RANGE ? std::min(LLAMA_FUSED_NBINS - 1, int(d*scale)) : -1;
+
+        if (probs) {
+            const float e = expf(l - max);
+            sum += e;
+            if (ib >= 0) {
+                mass[ib] += e;
+            }
+        }
+        if (ib >= 0) {
+            count[ib]++;
+        }
+    };
+
+    int32_t i = 0;
+    for (; i + LLAMA_FUSED_BLOCK <= n; i += LLAMA_FUSED_BLOCK) {
+        if (llama_logits_block_count(logits + i, lo) == 0) {
+            continue;
+        }
+        for (int j = 0; j < LLAMA_FUSED_BLOCK; ++j) {
+            if (logits[i + j] >= lo) {
+                add(logits[i + j]);
+            }
+        }
+    }
+    for (; i < n; ++i) {
+        if (logits[i] >= lo) {
+            add(logits[i]);
+        }
+    }
+}
+
+// histogram of every LLAMA_FUSED_STRIDE-th logit in (max - LLAMA_FUSED_RANGE, max], to estimate the threshold of the
+// best tokens without a full pass
+static void llama_logits_histogram_sampled(const float * logits, int32_t n, float max, int32_t * count) {
+    const float scale = LLAMA_FUSED_NBINS/LLAMA_FUSED_RANGE;
+
+    for (int32_t i = 0; i < n; i += LLAMA_FUSED_STRIDE) {
+        const float d = max - logits[i];
+        if (d < LLAMA_FUSED_RANGE) {
+            count[std::min(LLAMA_FUSED_NBINS - 1, int(d*scale))]++;
+        }
+    }
+}
+
+// the highest threshold such that the bins above it hold at least n_min tokens and (with mass) a mass of at least mass_min
+// the threshold is one bin lower than needed, to stay safe from the rounding at the edges of the bins
+static float llama_logits_threshold(const int32_t * count, const float * mass, float max, size_t n_min, double mass_min) {
+    const float scale = LLAMA_FUSED_NBINS/LLAMA_FUSED_RANGE;
+
+    size_t n = 0;
+    double m = 0.0;
+
+    for (int ib = 0; ib < LLAMA_FUSED_NBINS; ++ib) {
+        n += count[ib];
+        m += mass ? mass[ib] : 0.0f;
+
+        if (n >= n_min && m >= mass_min) {
+            return max - (ib + 2)/scale;
+        }
+    }
+
+    // the histogram does not cover enough tokens
+    return -INFINITY;
+}
+
+// collects the tokens with logit >= thr into dst, the tokens in sparse (sorted by id) use their modified logits
+static size_t llama_logits_collect(const float * logits, int32_t n, float thr, const std::vector<llama_token_data> & sparse, llama_token_data * dst) {
+    size_t n_dst    = 0;
+    size_t i_sparse = 0;
+
+    auto add = [&](llama_token id) {
+        while (i_sparse < sparse.size() && sparse[i_sparse].id < id) {
+            i_sparse++;
+        }
+        if (i_sparse < sparse.size() && sparse[i_sparse].id == id) {
+            return;
+        }
+        dst[n_dst++] = llama_token_data{id, logits[id], 0.0f};
+    };
+
+    int32_t i = 0;
+    for (; i + LLAMA_FUSED_BLOCK <= n; i += LLAMA_FUSED_BLOCK) {
+        if (llama_logits_block_count(logits + i, thr) == 0) {
+            continue;
+        }
+        for (int j = 0; j < LLAMA_FUSED_BLOCK; ++j) {
+            if (logits[i + j] >= thr) {
+                add(i + j);
+            }
+        }
+    }
+    for (; i < n; ++i) {
+        if (logits[i] >= thr) {
+            add(i);
+        }
+    }
+
+    for (const auto & td : sparse) {
+        if (td.logit >= thr) {
+            dst[n_dst++] = td;
+        }
+    }
+
+    return n_dst;
+}
+
+bool llama_sampler_chain_apply_fused(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    if (smpl->iface != &llama_sampler_chain_i || n_vocab <= 0) {
+        return false;
+    }
+
+    auto * chain = (llama_sampler_chain *) smpl->ctx;
+
+    if (!chain->params.fused) {
+        return false;
+    }
+
+    // find the sampler that filters the candidates, the samplers before it can only modify a few tokens
+    size_t i_filter = 0;
+    for (; i_filter < chain->samplers.size(); ++i_filter) {
+        const auto * cur = chain->samplers[i_filter];
+        if (!llama_sampler_is_noop(cur) && cur->iface != &llama_sampler_logit_bias_i && cur->iface != &llama_sampler_penalties_i) {
+            break;
+        }
+    }
+
+    if (i_filter == chain->samplers.size()) {
+        return false;
+    }
+
+    const auto * filter = chain->samplers[i_filter];
+
+    size_t n_min = 1;    // the number of tokens that the filter needs
+    float  min_p = 0.0f;
+    float  top_p = 1.0f;
+
+    if (filter->iface == &llama_sampler_top_k_i) {
+        n_min = std::min(((const llama_sampler_top_k *) filter->ctx)->k, n_vocab);
+    } else if (filter->iface == &llama_sampler_top_p_i) {
+        const auto * ctx = (const llama_sampler_top_p *) filter->ctx;
+        top_p = ctx->p;
+        n_min = std::min<size_t>(std::max<size_t>(ctx->min_keep, 1), n_vocab);
+    } else if (filter->iface == &llama_sampler_min_p_i) {
+        const auto * ctx = (const llama_sampler_min_p *) filter->ctx;
+        min_p = ctx->p;
+        n_min = std::min<size_t>(std::max<size_t>(ctx->min_keep, 1), n_vocab);
+    } else if (filter->iface != &llama_sampler_greedy_i) {
+        return false;
+    }
+
+    float max = llama_logits_max(logits, n_vocab);
+    if (!std::isfinite(max)) {
+        return false;
+    }
+
+    time_meas tm(chain->t_sample_us, chain->params.no_perf);
+
+    // the tokens modified by the samplers before the filter, with their modified logits
+    auto & sparse = chain->sparse;
+    sparse.clear();
+
+    for (size_t i = 0; i < i_filter; ++i) {
+        const auto * cur = chain->samplers[i];
+        if (llama_sampler_is_noop(cur)) {
+            continue;
+        }
+        if (cur->iface == &llama_sampler_logit_bias_i) {
+            for (const auto & lb : ((const llama_sampler_logit_bias *) cur->ctx)->logit_bias) {
+                if (lb.token >= 0 && lb.token < n_vocab) {
+                    sparse.push_back(llama_token_data{lb.token, logits[lb.token], 0.0f});
+                }
+            }
+        } else {
+            for (const auto & it : ((const llama_sampler_penalties *) cur->ctx)->token_count) {
+                if (it.first >= 0 && it.first < n_vocab) {
+                    sparse.push_back(llama_token_data{it.first, logits[it.first], 0.0f});
+                }
+            }
+        }
+    }
+
+    if (!sparse.empty()) {
+        auto by_id = [](const llama_token_data & a, const llama_token_data & b) { return a.id < b.id; };
+        std::sort(sparse.begin(), sparse.end(), by_id);
+        sparse.erase(std::unique(sparse.begin(), sparse.end(),
+                    [](const llama_token_data & a, const llama_token_data & b) { return a.id == b.id; }), sparse.end());
+
+        llama_token_data_array sparse_p = { sparse.data(), sparse.size(), -1, false };
+        for (size_t i = 0; i < i_filter; ++i) {
+            llama_sampler_apply(chain->samplers[i], &sparse_p);
+        }
+
+        for (const auto & td : sparse) {
+            max = std::max(max, td.logit);
+        }
+    }
+
+    float  thr = INFINITY;
+    double sum = 0.0; // sum of exp(logit - max) over the vocab, for top-p
+
+    int32_t count[LLAMA_FUSED_NBINS] = {};
+    float   mass [LLAMA_FUSED_NBINS] = {};
+
+    size_t n_samples = 0; // samples of the count-only histogram above the threshold
+
+    if (min_p > 0.0f) {
+        thr = max + logf(min_p);
+    }
+
+    if (top_p < 1.0f) {
+        llama_logits_histogram(logits, n_vocab, max, true, count, mass, sum);
+
+        // the sparse tokens are in the histogram with their original logits, leave room for them
+        double mass_sparse = 0.0;
+        for (const auto & td : sparse) {
+            if (logits[td.id] >= max - LLAMA_FUSED_TAIL) {
+                sum         -= expf(logits[td.id] - max);
+                mass_sparse += expf(logits[td.id] - max);
+            }
+            if (td.logit >= max - LLAMA_FUSED_TAIL) {
+                sum += expf(td.logit - max);
+            }
+        }
+
+        thr = llama_logits_threshold(count, mass, max, n_min + sparse.size(), top_p*sum + mass_sparse);
+    } else if (filter->iface == &llama_sampler_greedy_i && sparse.empty()) {
+        thr = max;
+    } else if (min_p <= 0.0f || n_min > 1) {
+        llama_logits_histogram_sampled(logits, n_vocab, max, count);
+
+        // aim for about twice the needed tokens
+        n_samples = std::max<size_t>(8, 2*(n_min + sparse.size())/LLAMA_FUSED_STRIDE);
+
+        thr = std::min(thr, llama_logits_threshold(count, nullptr, max, n_samples, 0.0));
+    }
+
+    // collect the candidates above the threshold, in the rare cases where they are not enough, lower it
+    while (true) {
+        cur_p->size     = llama_logits_collect(logits, n_vocab, thr, sparse, cur_p->data);
+        cur_p->selected = -1;
+        cur_p->sorted   = false;
+
+        if (thr == -INFINITY) {
+            break;
+        }
+
+        if (cur_p->size < n_min) {
+            if (n_samples > 0 && n_samples < 512) {
+                n_samples *= 8;
+                thr = std::min(thr, llama_logits_threshold(count, nullptr, max, n_samples, 0.0));
+            } else {
+                thr = -INFINITY;
+            }
+            continue;
+        }
+
+        // the candidates are all the tokens above the threshold, so they contain the maximum after the modifications
+        if (min_p > 0.0f) {
+            float max_cur = -INFINITY;
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                max_cur = std::max(max_cur, cur_p->data[i].logit);
+            }
+            if (thr > max_cur + logf(min_p)) {
+                thr = max_cur + logf(min_p);
+                continue;
+            }
+        }
+
+        if (top_p < 1.0f) {
+            double mass = 0.0;
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                mass += expf(cur_p->data[i].logit - max);
+            }
+            if (mass < top_p*sum) {
+                thr = -INFINITY;
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    size_t i_next = i_filter;
+
+    if (top_p < 1.0f) {
+        // same as llama_sampler_top_p_apply, but the probabilities are normalized over the full vocab
+        const auto * ctx = (const llama_sampler_top_p *) filter->ctx;
+
+        std::sort(cur_p->data, cur_p->data + cur_p->size, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+        cur_p->sorted = true;
+
+        float cum_sum = 0.0f;
+        size_t last_idx = cur_p->size;
+
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            cur_p->data[i].p = expf(cur_p->data[i].logit - max)/sum;
+            cum_sum += cur_p->data[i].p;
+
+            if (cum_sum >= ctx->p && i + 1 >= ctx->min_keep) {
+                last_idx = i + 1;
+                break;
+            }
+        }
+
+        cur_p->size = last_idx;
+
+        i_next++;
+    }
+
+    for (size_t i = i_next; i < chain->samplers.size(); ++i) {
+        llama_sampler_apply(chain->samplers[i], cur_p);
+    }
+
+    return true;
+}
+
+static bool llama_sampler_sample_fused(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token & token) {
+    if (smpl->iface != &llama_sampler_chain_i) {
+        return false;
+    }
+
+    auto * chain = (llama_sampler_chain *) smpl->ctx;
+
+    chain->cur.resize(n_vocab);
+
+    llama_token_data_array cur_p = {
+        /* .data       = */ chain->cur.data(),
+        /* .size       = */ chain->cur.size(),
+        /* .selected   = */ -1,
+        /* .sorted     = */ false,
+    };
+
+    if (!llama_sampler_chain_apply_fused(smpl, logits, n_vocab, &cur_p)) {
+        return false;
+    }
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
+
+    token = cur_p.data[cur_p.selected].id;
+
+    return true;
+}
+
 // perf
 
 struct llama_perf_sampler_data llama_perf_sampler(const struct llama_sampler * chain) {
@@ -21,6 +21,11 @@ struct llama_sampler_chain {
     mutable int64_t t_sample_us;
 
     mutable int32_t n_sample;
+
+    // buffers of the fused path, reused between the calls
+
+    std::vector<llama_token_data> cur;    // the candidates, used by llama_sampler_sample
+    std::vector<llama_token_data> sparse; // the tokens modified by the logit-bias and penalties samplers
 };
 
 struct llama_sampler * llama_sampler_init_dry_testing(
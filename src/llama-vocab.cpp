@@ -3,7 +3,9 @@
 #include "ggml.h"
 #include "gguf.h"
 #include "llama-impl.h"
+#include "llama-grammar.h"
 #include "llama-model-loader.h"
+#include "llama-parallel.h"
 
 #include "unicode.h"
 
@@ -14,9 +16,12 @@
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
 #include <unordered_map>
 #include <cctype>
 
@@ -437,8 +442,61 @@ struct llm_tokenizer_bpe : llm_tokenizer {
     }
 
     std::vector<std::string> regex_exprs;
+
+    // LRU cache of the tokens of the most recently merged words, shared by all the sessions
+    struct word_cache {
+        static constexpr size_t n_max = 65536;
+
+        // words longer than this are rare and not worth caching
+        static constexpr size_t word_len_max = 64;
+
+        // most recently used first
+        std::list<std::pair<std::string, std::vector<llama_token>>> entries;
+        std::unordered_map<std::string, decltype(entries)::iterator> index;
+
+        std::mutex mutex;
+
+        bool get(const std::string & word, std::vector<llama_token> & tokens) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto it = index.find(word);
+            if (it == index.end()) {
+                return false;
+            }
+
+            entries.splice(entries.begin(), entries, it->second);
+            tokens = it->second->second;
+
+            return true;
+        }
+
+        void put(const std::string & word, const std::vector<llama_token> & tokens) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (index.find(word) != index.end()) {
+                return;
+            }
+
+            entries.emplace_front(word, tokens);
+            index.emplace(word, entries.begin());
+
+            if (entries.size() > n_max) {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+        }
+    };
+
+    mutable word_cache cache;
+
+    // tokenizes the ranges of words of long texts, used by one session at a time
+    mutable llama_parallel_pool pool;
+    mutable std::mutex          pool_mutex;
 };
 
+// minimum number of words per thread when tokenizing long texts
+static constexpr size_t LLAMA_BPE_WORDS_PER_THREAD = 8192;
+
 struct llm_tokenizer_bpe_session {
     llm_tokenizer_bpe_session(const llama_vocab & vocab, const llm_tokenizer_bpe & tokenizer) : vocab(vocab), tokenizer(tokenizer) {}
 
@@ -480,106 +538,144 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
+        const size_t n_words   = word_collection.size();
+        const size_t n_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), n_words/LLAMA_BPE_WORDS_PER_THREAD);
 
-        for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+        // the pool is busy with the text of another caller, which is already tokenized in parallel
+        std::unique_lock<std::mutex> lock(tokenizer.pool_mutex, std::defer_lock);
 
-            int index = 0;
-            size_t offset = 0;
+        if (n_threads <= 1 || !lock.try_lock()) {
+            tokenize_words(word_collection, 0, n_words, output);
+            return;
+        }
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
-            }
+        // the words are merged independently of each other, so long texts are split into ranges of words
+        // tokenized by separate sessions and the results are concatenated in order
+        std::vector<std::vector<llama_token>> outputs(n_threads);
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
+        tokenizer.pool.run(n_threads, n_threads, [&](int32_t ith) {
+            llm_tokenizer_bpe_session session(vocab, tokenizer);
+            session.tokenize_words(word_collection, n_words*ith/n_threads, n_words*(ith + 1)/n_threads, outputs[ith]);
+        });
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        for (const auto & out : outputs) {
+            output.insert(output.end(), out.begin(), out.end());
+        }
+    }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+    void tokenize_words(const std::vector<std::string> & words, size_t i0, size_t i1, std::vector<llama_token> & output) {
+        std::vector<llama_token> word_tokens;
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
+        for (size_t i = i0; i < i1; ++i) {
+            const std::string & word = words[i];
+
+            // the words of a text repeat a lot: look them up in the session first, then in the cache of the tokenizer
+            const bool cacheable = word.size() <= llm_tokenizer_bpe::word_cache::word_len_max;
+            if (cacheable) {
+                const auto it = cache.find(word);
+                if (it != cache.end()) {
+                    output.insert(output.end(), it->second.begin(), it->second.end());
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
+                if (tokenizer.cache.get(word, word_tokens)) {
+                    output.insert(output.end(), word_tokens.begin(), word_tokens.end());
+                    cache.emplace(word, word_tokens);
+                    continue;
                 }
+            }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+            word_tokens.clear();
+            merge_word(word, word_tokens);
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            if (cacheable) {
+                tokenizer.cache.put(word, word_tokens);
+                cache.emplace(word, word_tokens);
+            }
+
+            output.insert(output.end(), word_tokens.begin(), word_tokens.end());
+        }
+    }
+
+    void merge_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+
+        int index = 0;
+        size_t offset = 0;
+
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
+
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            // same as comparing the concatenation of the two symbols with the text of the bigram, without allocating
+            if (left_symbol.n + right_symbol.n != bigram.text.size() ||
+                memcmp(bigram.text.data(),                 left_symbol.text,  left_symbol.n)  != 0 ||
+                memcmp(bigram.text.data() + left_symbol.n, right_symbol.text, right_symbol.n) != 0) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        // the symbols are always merged into the left one, so the remaining ones are in order
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.text_to_token(str);
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (token == LLAMA_TOKEN_NULL) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(token);
             }
         }
     }
@@ -615,8 +711,10 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
+
+    // tokens of the words already seen in this session
+    std::unordered_map<std::string, std::vector<llama_token>> cache;
 };
 
 //
@@ -1295,6 +1393,9 @@ struct llama_vocab::impl {
 
     std::vector<char> precompiled_charsmap;
 
+    std::once_flag                      grammar_trie_once;
+    std::unique_ptr<llama_grammar_trie> grammar_trie;
+
     impl(const llama_vocab & vocab) : vocab(vocab) {
     }
 
@@ -3070,6 +3171,14 @@ std::vector<llama_token> llama_vocab::tokenize(
     return pimpl->tokenize(raw_text, add_special, parse_special);
 }
 
+const llama_grammar_trie & llama_vocab::get_grammar_trie() const {
+    std::call_once(pimpl->grammar_trie_once, [this]() {
+        pimpl->grammar_trie = std::make_unique<llama_grammar_trie>(*this);
+    });
+
+    return *pimpl->grammar_trie;
+}
+
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
@@ -3108,6 +3217,172 @@ void llama_vocab::print_info() const {
     pimpl->print_info();
 }
 
+//
+// llama_stop_matcher
+//
+
+llama_stop_matcher::llama_stop_matcher(std::vector<std::string> stop) : stop(std::move(stop)) {
+    nodes.emplace_back();
+
+    // trie of the stop strings
+    for (size_t i = 0; i < this->stop.size(); ++i) {
+        int32_t cur = 0;
+        for (const char ch : this->stop[i]) {
+            const uint32_t key = cur*256u + (uint8_t) ch;
+
+            auto it = edges.find(key);
+            if (it == edges.end()) {
+                it = edges.emplace(key, nodes.size()).first;
+                nodes.emplace_back();
+                nodes.back().depth = nodes[cur].depth + 1;
+            }
+            cur = it->second;
+        }
+
+        // the first of duplicate stop strings is reported, empty stop strings never match
+        if (cur != 0 && nodes[cur].out < 0) {
+            nodes[cur].out = i;
+        }
+    }
+
+    // failure links in BFS order, so the links of the shorter prefixes are ready
+    std::vector<std::vector<std::pair<uint8_t, int32_t>>> children(nodes.size());
+    for (const auto & [key, id] : edges) {
+        children[key/256].emplace_back(key%256, id);
+    }
+
+    std::vector<int32_t> queue = { 0 };
+    for (size_t qi = 0; qi < queue.size(); ++qi) {
+        const int32_t cur = queue[qi];
+        for (const auto & [c, id] : children[cur]) {
+            if (cur != 0) {
+                int32_t f = nodes[cur].fail;
+                while (f != 0 && child(f, c) < 0) {
+                    f = nodes[f].fail;
+                }
+                nodes[id].fail = std::max(child(f, c), 0);
+            }
+
+            if (nodes[id].out < 0) {
+                nodes[id].out = nodes[nodes[id].fail].out;
+            }
+
+            queue.push_back(id);
+        }
+    }
+}
+
+int32_t llama_stop_matcher::child(int32_t state, uint8_t c) const {
+    const auto it = edges.find(state*256u + c);
+    return it == edges.end() ? -1 : it->second;
+}
+
+int32_t llama_stop_matcher::feed(uint8_t c) {
+    int32_t next = child(state, c);
+    while (next < 0 && state != 0) {
+        state = nodes[state].fail;
+        next  = child(state, c);
+    }
+    state = std::max(next, 0);
+
+    return nodes[state].out;
+}
+
+int32_t llama_stop_matcher::n_partial() const {
+    return nodes[state].depth;
+}
+
+void llama_stop_matcher::reset() {
+    state = 0;
+}
+
+//
+// llama_detokenizer
+//
+
+// number of bytes of the UTF-8 sequence that is cut off at the end of the text
+static size_t utf8_incomplete_tail(const std::string & text) {
+    for (size_t i = 1; i <= 4 && i <= text.size(); ++i) {
+        const uint8_t c = text[text.size() - i];
+        if ((c & 0xC0) != 0x80) {
+            const size_t n_seq = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+            return i < n_seq ? i : 0;
+        }
+    }
+    return 0;
+}
+
+llama_detokenizer::llama_detokenizer(const llama_vocab & vocab, std::vector<std::string> stop) : vocab(vocab), matcher(std::move(stop)) {
+}
+
+int32_t llama_detokenizer::push(const llama_token * tokens, int32_t n_tokens, bool special) {
+    if (stop_idx >= 0) {
+        return 0;
+    }
+
+    char buf[128];
+
+    int32_t n_consumed = 0;
+    while (n_consumed < n_tokens) {
+        const llama_token token = tokens[n_consumed++];
+
+        const size_t n_prev = pending.size();
+        {
+            const int32_t n = vocab.token_to_piece(token, buf, sizeof(buf), 0, special);
+            if (n >= 0) {
+                pending.append(buf, n);
+            } else {
+                std::string piece(-n, '\0');
+                vocab.token_to_piece(token, &piece[0], piece.size(), 0, special);
+                pending += piece;
+            }
+        }
+
+        // of the stop strings that end in this piece, the one that starts first wins
+        size_t stop_pos = std::string::npos;
+        for (size_t i = n_prev; i < pending.size(); ++i) {
+            const int32_t idx = matcher.feed(pending[i]);
+            if (idx >= 0) {
+                const size_t pos = i + 1 - matcher.stop[idx].size();
+                if (pos < stop_pos) {
+                    stop_pos = pos;
+                    stop_idx = idx;
+                }
+            }
+        }
+
+        if (stop_pos != std::string::npos) {
+            ready.append(pending, 0, stop_pos);
+            pending.clear();
+            return n_consumed;
+        }
+    }
+
+    // hold back the beginning of a stop string and an incomplete UTF-8 sequence at the end
+    const size_t n_hold = std::min(pending.size(), std::max<size_t>(matcher.n_partial(), utf8_incomplete_tail(pending)));
+
+    ready.append(pending, 0, pending.size() - n_hold);
+    pending.erase(0, pending.size() - n_hold);
+
+    return n_consumed;
+}
+
+void llama_detokenizer::flush() {
+    ready += pending;
+    pending.clear();
+}
+
+void llama_detokenizer::reset() {
+    matcher.reset();
+    ready.clear();
+    pending.clear();
+    stop_idx = -1;
+}
+
+bool llama_detokenizer::incomplete() const {
+    return utf8_incomplete_tail(pending) > 0;
+}
+
 //
 // interface implementation
 //
@@ -3343,3 +3618,116 @@ int32_t llama_detokenize(
     return vocab->detokenize(tokens, n_tokens, text, text_len_max, remove_special, unparse_special);
 }
 
+
+//
+// stop matcher
+//
+
+struct llama_stop_matcher * llama_stop_matcher_init(const char ** stop, size_t n_stop) {
+    std::vector<std::string> stop_vec;
+    for (size_t i = 0; i < n_stop; ++i) {
+        stop_vec.emplace_back(stop[i]);
+    }
+
+    return new llama_stop_matcher(std::move(stop_vec));
+}
+
+void llama_stop_matcher_free(struct llama_stop_matcher * matcher) {
+    delete matcher;
+}
+
+void llama_stop_matcher_reset(struct llama_stop_matcher * matcher) {
+    matcher->reset();
+}
+
+int32_t llama_stop_matcher_feed(struct llama_stop_matcher * matcher, const char * text, int32_t len, int32_t * n_fed) {
+    for (int32_t i = 0; i < len; ++i) {
+        const int32_t idx = matcher->feed(text[i]);
+        if (idx >= 0) {
+            if (n_fed) {
+                *n_fed = i + 1;
+            }
+            return idx;
+        }
+    }
+
+    if (n_fed) {
+        *n_fed = len;
+    }
+
+    return -1;
+}
+
+int32_t llama_stop_matcher_n_partial(const struct llama_stop_matcher * matcher) {
+    return matcher->n_partial();
+}
+
+//
+// detokenizer
+//
+
+struct llama_detokenizer * llama_detokenizer_init(
+    const struct llama_vocab * vocab,
+                 const char ** stop,
+                       size_t   n_stop) {
+    std::vector<std::string> stop_vec;
+    for (size_t i = 0; i < n_stop; ++i) {
+        stop_vec.emplace_back(stop[i]);
+    }
+
+    return new llama_detokenizer(*vocab, std::move(stop_vec));
+}
+
+void llama_detokenizer_free(struct llama_detokenizer * detok) {
+    delete detok;
+}
+
+void llama_detokenizer_reset(struct llama_detokenizer * detok) {
+    detok->reset();
+}
+
+// moves the ready text of the detokenizer to the buffer, if it fits
+static int32_t llama_detokenizer_copy(struct llama_detokenizer * detok, char * text, int32_t text_len_max) {
+    const int32_t n = detok->ready.size();
+    if (n > text_len_max) {
+        return -n;
+    }
+
+    memcpy(text, detok->ready.data(), n);
+    detok->ready.clear();
+
+    return n;
+}
+
+int32_t llama_detokenizer_push(
+    struct llama_detokenizer * detok,
+           const llama_token * tokens,
+                     int32_t   n_tokens,
+                        char * text,
+                     int32_t   text_len_max,
+                        bool   special,
+                     int32_t * n_consumed) {
+    const int32_t n = detok->push(tokens, n_tokens, special);
+    if (n_consumed) {
+        *n_consumed = n;
+    }
+
+    return llama_detokenizer_copy(detok, text, text_len_max);
+}
+
+int32_t llama_detokenizer_flush(
+    struct llama_detokenizer * detok,
+                        char * text,
+                     int32_t   text_len_max) {
+    detok->flush();
+
+    return llama_detokenizer_copy(detok, text, text_len_max);
+}
+
+int32_t llama_detokenizer_stop(const struct llama_detokenizer * detok) {
+    return detok->stop_idx;
+}
+
+bool llama_detokenizer_incomplete(const struct llama_detokenizer * detok) {
+    return detok->incomplete();
+}
@@ -3,11 +3,13 @@
 #include "llama.h"
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 
 struct LLM_KV;
 struct llama_model_loader;
+struct llama_grammar_trie;
 
 struct llama_vocab {
     struct token_data {
@@ -45,6 +47,9 @@ struct llama_vocab {
 
     llama_token text_to_token(const std::string & text) const;
 
+    // code point trie of the token pieces used by the grammar sampler, built on first use
+    const llama_grammar_trie & get_grammar_trie() const;
+
     const token_data & get_token_data(llama_token id) const;
 
     const char *     token_get_text (llama_token id) const;
@@ -129,3 +134,64 @@ private:
     struct impl;
     std::unique_ptr<impl> pimpl;
 };
+
+// Aho-Corasick automaton of a set of stop strings
+//   the text is fed one byte at a time, the cost of a byte does not depend on the number of stop strings
+struct llama_stop_matcher {
+    llama_stop_matcher(std::vector<std::string> stop);
+
+    // advances with the next byte of the text
+    // returns the index of the longest stop string that ends at this byte, or -1
+    int32_t feed(uint8_t c);
+
+    // length of the longest suffix of the text that is a prefix of a stop string
+    int32_t n_partial() const;
+
+    void reset();
+
+    const std::vector<std::string> stop;
+
+private:
+    struct node {
+        int32_t fail  = 0;
+        int32_t depth = 0;
+        int32_t out   = -1; // the longest stop string that is a suffix of this prefix
+    };
+
+    int32_t child(int32_t state, uint8_t c) const;
+
+    std::vector<node> nodes;
+
+    // trie edges, indexed by state*256 + byte
+    std::unordered_map<uint32_t, int32_t> edges;
+
+    int32_t state = 0;
+};
+
+// incremental detokenizer for streaming the generated text
+//   the text is held back while it ends with an incomplete UTF-8 sequence or with the beginning of a stop string
+//   the stop strings are matched incrementally, so each step does not depend on the length of the text
+struct llama_detokenizer {
+    llama_detokenizer(const llama_vocab & vocab, std::vector<std::string> stop);
+
+    // appends the pieces of the tokens and moves the text that is ready to `ready`
+    // stops at the token that completes a stop string, returns the number of consumed tokens
+    int32_t push(const llama_token * tokens, int32_t n_tokens, bool special);
+
+    // moves the pending text to `ready`, used at the end of the generation
+    void flush();
+
+    void reset();
+
+    // the pending text ends with an incomplete UTF-8 sequence
+    bool incomplete() const;
+
+    const llama_vocab & vocab;
+
+    llama_stop_matcher matcher;
+
+    std::string ready;   // text that can be emitted, cleared by the caller
+    std::string pending; // text that is held back
+
+    int32_t stop_idx = -1; // index of the stop string that was found
+};
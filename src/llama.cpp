@@ -28,6 +28,7 @@
 struct llama_sampler_chain_params llama_sampler_chain_default_params() {
     struct llama_sampler_chain_params result = {
         /*.no_perf                     =*/ true,
+        /*.fused                       =*/ false,
     };
 
     return result;
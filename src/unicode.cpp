@@ -6,6 +6,7 @@
 #include "unicode-data.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <codecvt>
 #include <cstddef>
@@ -215,31 +216,47 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
+// encode the UTF-8 bytes of the words given by their lengths in code points with unicode_byte_to_utf8
+static std::vector<std::string> unicode_byte_encoding_process(const std::vector<uint32_t> & cpts, const std::vector<size_t> & bpe_offsets) {
+    static const auto byte_to_utf8 = [] {
+        std::array<std::string, 256> table;
+        const auto map = unicode_byte_to_utf8_map();
+        for (int ch = 0; ch < 256; ++ch) {
+            table[ch] = map.at(ch);
         }
+        return table;
+    }();
+
+    std::vector<std::string> bpe_encoded_words;
+    bpe_encoded_words.reserve(bpe_offsets.size());
 
+    size_t start = 0;
+    for (const size_t offset : bpe_offsets) {
         std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
+        encoded_token.reserve(2*offset);
+
+        for (size_t i = start; i < start + offset; ++i) {
+            if (cpts[i] < 0x80) {
+                encoded_token += byte_to_utf8[cpts[i]];
+                continue;
+            }
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                encoded_token += byte_to_utf8[(uint8_t) c];
+            }
         }
-        bpe_encoded_words.emplace_back(encoded_token);
+
+        bpe_encoded_words.emplace_back(std::move(encoded_token));
+        start += offset;
     }
+
     return bpe_encoded_words;
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -352,12 +369,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// QWEN2 system regex: the same, with \p{N} instead of \p{N}{1,3} (n_digits_max = 1)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, size_t n_digits_max) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -429,7 +445,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= n_digits_max) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -552,16 +568,61 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+// regex: \p{N}, \p{N}{1,3} or \p{N}+ (n_digits_max = 1, 3 or SIZE_MAX), the text between the numbers is kept as one word
+static std::vector<size_t> unicode_regex_split_custom_numbers(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, size_t n_digits_max) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    auto _is_number = [&] (const size_t pos) -> bool {
+        return unicode_cpt_flags_from_cpt(cpts[pos]).is_number;
+    };
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+
+        for (size_t pos = start; pos < offset_end; ) {
+            const size_t ini = pos;
+            if (_is_number(pos)) {
+                while (pos < offset_end && pos - ini < n_digits_max && _is_number(pos)) {
+                    pos++;
+                }
+            } else {
+                while (pos < offset_end && !_is_number(pos)) {
+                    pos++;
+                }
+            }
+            bpe_offsets.push_back(pos - ini);
+        }
+
+        start = offset_end;
+    }
+
+    return bpe_offsets;
+}
+
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (
             regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 3);
+    } else if (
+            regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1);
+    } else if (regex_expr == "\\p{N}") {
+        bpe_offsets = unicode_regex_split_custom_numbers(cpts, offsets, 1);
+    } else if (regex_expr == "\\p{N}{1,3}") {
+        bpe_offsets = unicode_regex_split_custom_numbers(cpts, offsets, 3);
+    } else if (regex_expr == "\\p{N}+") {
+        bpe_offsets = unicode_regex_split_custom_numbers(cpts, offsets, SIZE_MAX);
     }
 
     return bpe_offsets;
@@ -739,7 +800,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        auto tmp = unicode_regex_split_custom(cpts, regex_expr, bpe_offsets);
 
         if (!tmp.empty()) {
             bpe_offsets = std::move(tmp);
@@ -833,17 +894,5 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    std::vector<std::string> bpe_words;
-    bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
-
-    size_t start = 0;
-    for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
-        for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
-        }
-        start += offset;
-    }
-
-    return unicode_byte_encoding_process(bpe_words);
+    return unicode_byte_encoding_process(cpts, bpe_offsets);
 }
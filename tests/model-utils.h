@@ -0,0 +1,169 @@
+#pragma once
+
+// helpers of the tests that decode with a model:
+//   the model can be a vocab only GGUF, a small llama model with random weights is made for it then
+//   the prompts of the sequences are made of test_tok tokens
+
+#include "llama.h"
+#include "common.h"
+#include "ggml.h"
+#include "gguf.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+// token i of the prompt of seq
+inline llama_token test_tok(int i, llama_seq_id seq) {
+    return 1 + (i*31 + seq*97) % 250;
+}
+
+// adds the tokens [i0, i1) of the prompt of seq_tok to seq at the same positions, with the logits of the last one
+// the tokens are the ones of seq if seq_tok is not set
+inline void test_batch_add_seq(llama_batch & batch, llama_seq_id seq, int i0, int i1, llama_seq_id seq_tok = -1) {
+    for (int i = i0; i < i1; i++) {
+        common_batch_add(batch, test_tok(i, seq_tok >= 0 ? seq_tok : seq), i, { seq }, i == i1 - 1);
+    }
+}
+
+// decodes the tokens [i0, i1) of the prompt of seq, see test_batch_add_seq
+inline bool test_decode(llama_context * ctx, llama_seq_id seq, int i0, int i1, llama_seq_id seq_tok = -1) {
+    llama_batch batch = llama_batch_init(i1 - i0, 0, 1);
+    test_batch_add_seq(batch, seq, i0, i1, seq_tok);
+    const int ret = llama_decode(ctx, batch);
+    llama_batch_free(batch);
+    if (ret != 0) {
+        fprintf(stderr, "%s: llama_decode failed for seq %d, tokens [%d, %d): %d\n", __func__, seq, i0, i1, ret);
+    }
+    return ret == 0;
+}
+
+// writes a llama model with the vocab of vocab and random weights to fname
+inline bool test_write_random_model(const gguf_context * vocab, const char * fname) {
+    const int64_t n_embd    = 64;
+    const int64_t n_ff      = 128;
+    const int64_t n_layer   = 2;
+    const int64_t n_head    = 4;
+    const int64_t n_head_kv = 2;
+    const int64_t n_gqa     = n_embd/n_head*n_head_kv;
+
+    const int64_t key_tokens = gguf_find_key(vocab, "tokenizer.ggml.tokens");
+    if (key_tokens < 0) {
+        fprintf(stderr, "%s: no vocab\n", __func__);
+        return false;
+    }
+    const int64_t n_vocab = gguf_get_arr_n(vocab, key_tokens);
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_kv(gguf, vocab);
+
+    gguf_set_val_str(gguf, "general.architecture",                   "llama");
+    gguf_set_val_u32(gguf, "llama.context_length",                   4096);
+    gguf_set_val_u32(gguf, "llama.embedding_length",                 n_embd);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length",              n_ff);
+    gguf_set_val_u32(gguf, "llama.block_count",                      n_layer);
+    gguf_set_val_u32(gguf, "llama.attention.head_count",             n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv",          n_head_kv);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count",             n_embd/n_head);
+    gguf_set_val_u32(gguf, "llama.vocab_size",                       n_vocab);
+    gguf_set_val_u32(gguf, "general.file_type",                      LLAMA_FTYPE_ALL_F32);
+
+    const size_t n_params = n_vocab*n_embd + n_embd + n_layer*(2*n_embd*n_embd + 2*n_embd*n_gqa + 3*n_embd*n_ff + 2*n_embd);
+
+    ggml_init_params params = {
+        /* .mem_size   = */ n_params*sizeof(float) + (2 + 9*n_layer)*ggml_tensor_overhead(),
+        /* .mem_buffer = */ nullptr,
+        /* .no_alloc   = */ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+
+    const auto add = [&](const std::string & name, int64_t ne0, int64_t ne1, float stddev) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+
+        std::normal_distribution<float> dist(0.0f, stddev);
+
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); i++) {
+            data[i] = stddev > 0.0f ? dist(rng) : 1.0f;
+        }
+
+        gguf_add_tensor(gguf, t);
+    };
+
+    // the output shares the weights of the token embeddings
+    add("token_embd.weight",  n_embd, n_vocab, 1.0f);
+    add("output_norm.weight", n_embd, 0,       0.0f);
+
+    for (int64_t il = 0; il < n_layer; il++) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",   n_embd, 0,      0.0f);
+        add(blk + "attn_q.weight",      n_embd, n_embd, 0.1f);
+        add(blk + "attn_k.weight",      n_embd, n_gqa,  0.1f);
+        add(blk + "attn_v.weight",      n_embd, n_gqa,  0.1f);
+        add(blk + "attn_output.weight", n_embd, n_embd, 0.1f);
+        add(blk + "ffn_norm.weight",    n_embd, 0,      0.0f);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff,   0.1f);
+        add(blk + "ffn_up.weight",      n_embd, n_ff,   0.1f);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd, 0.1f);
+    }
+
+    const bool ok = gguf_write_to_file(gguf, fname, false);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write %s\n", __func__, fname);
+    }
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+
+    return ok;
+}
+
+// loads the model of path, or a llama model with random weights if path is a vocab only GGUF
+inline llama_model * test_load_model(const char * path) {
+    llama_model_params mparams = llama_model_default_params();
+
+    gguf_init_params params = {
+        /* .no_alloc = */ true,
+        /* .ctx      = */ nullptr,
+    };
+    gguf_context * vocab = gguf_init_from_file(path, params);
+    if (vocab == nullptr || gguf_get_n_tensors(vocab) > 0) {
+        if (vocab != nullptr) {
+            gguf_free(vocab);
+        }
+
+        llama_model * model = llama_model_load_from_file(path, mparams);
+        if (model == nullptr) {
+            fprintf(stderr, "%s: failed to load %s\n", __func__, path);
+        }
+        return model;
+    }
+
+    const std::string fname = (std::filesystem::temp_directory_path() /
+        ("test-model-" + std::to_string(std::random_device()()) + ".gguf")).string();
+
+    const bool ok = test_write_random_model(vocab, fname.c_str());
+    gguf_free(vocab);
+    if (!ok) {
+        return nullptr;
+    }
+
+    // read into memory, the file is removed right away
+    mparams.use_mmap = false;
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load the random model for the vocab %s\n", __func__, path);
+    }
+
+    std::filesystem::remove(fname);
+
+    return model;
+}
@@ -259,6 +259,10 @@ static std::string var_to_str(ggml_type type) {
     return ggml_type_name(type);
 }
 
+static std::string var_to_str(ggml_op op) {
+    return ggml_op_name(op);
+}
+
 static std::string var_to_str(ggml_prec prec) {
     return prec == GGML_PREC_F32 ? "f32" : "def";
 }
@@ -366,6 +370,12 @@ struct test_case {
         }
     }
 
+    // If true, the whole graph is computed at once and only the output is compared, so that the backend can fuse the ops.
+    // If false, the nodes are computed and compared one by one.
+    virtual bool run_whole_graph() {
+        return false;
+    }
+
     virtual size_t op_size(ggml_tensor * t) {
         size_t size = ggml_nbytes(t);
         // add source tensors
@@ -574,7 +584,7 @@ struct test_case {
             GGML_UNUSED(index);
         };
 
-        const bool cmp_ok = ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud);
+        const bool cmp_ok = ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud, run_whole_graph() ? out : nullptr);
 
         if (!cmp_ok) {
             printf("compare failed ");
@@ -1213,6 +1223,56 @@ struct test_get_rows_back : public test_case {
     }
 };
 
+// GGML_OP_SET_ROWS
+struct test_set_rows : public test_case {
+    const ggml_type type;
+    const int n; // cols
+    const int m; // rows
+    const int r; // rows to set
+    const int b; // batch size
+
+    std::string vars() override {
+        return VARS_TO_STR5(type, n, m, r, b);
+    }
+
+    test_set_rows(ggml_type type = GGML_TYPE_F32, int n = 10, int m = 5, int r = 3, int b = 1)
+        : type(type), n(n), m(m), r(r), b(b) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * dst = ggml_new_tensor_3d(ctx, type, n, m, b);
+        ggml_set_name(dst, "dst");
+
+        ggml_tensor * src = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n, r, b);
+        ggml_set_name(src, "src");
+
+        ggml_tensor * rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, r);
+        ggml_set_name(rows, "rows");
+
+        ggml_tensor * out = ggml_set_rows(ctx, dst, src, rows);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        std::random_device rd;
+        std::default_random_engine rng(rd());
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t->type == GGML_TYPE_I32) {
+                // distinct rows, the order of the writes to the same row is not defined
+                std::vector<int> data(m);
+                for (int i = 0; i < m; i++) {
+                    data[i] = i;
+                }
+                std::shuffle(data.begin(), data.end(), rng);
+                ggml_backend_tensor_set(t, data.data(), 0, r * sizeof(int));
+            } else {
+                init_tensor_uniform(t);
+            }
+        }
+    }
+};
+
 // GGML_OP_ARGMAX
 struct test_argmax : public test_case {
     const ggml_type type;
@@ -3875,6 +3935,85 @@ struct test_falcon : public test_llm {
     }
 };
 
+// chains of ops that the backends can fuse: RMS_NORM + MUL, SILU + MUL, MUL_MAT + ADD
+// the reference backend computes the graph node by node, without fusion
+struct test_fusion : public test_case {
+    const ggml_op op; // first op of the chain
+    const ggml_type type_w; // type of the weight of MUL_MAT
+    const std::array<int64_t, 4> ne;
+    const bool reuse; // whether the intermediate result is also used by another node, which prevents the fusion
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "FUSION";
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR4(op, type_w, ne, reuse);
+    }
+
+    double max_nmse_err() override {
+        return op == GGML_OP_MUL_MAT ? 5e-4 : 1e-7;
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_fusion(ggml_op op = GGML_OP_RMS_NORM,
+            ggml_type type_w = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {64, 5, 4, 3},
+            bool reuse = false)
+        : op(op), type_w(type_w), ne(ne), reuse(reuse) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+        ggml_set_name(a, "a");
+
+        ggml_tensor * cur = nullptr;
+        ggml_tensor * out = nullptr;
+
+        switch (op) {
+            case GGML_OP_RMS_NORM:
+                {
+                    ggml_tensor * w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne[0]);
+                    ggml_set_name(w, "w");
+
+                    cur = ggml_rms_norm(ctx, a, 1e-6f);
+                    out = ggml_mul(ctx, cur, w);
+                } break;
+            case GGML_OP_UNARY:
+                {
+                    ggml_tensor * g = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+                    ggml_set_name(g, "g");
+
+                    cur = ggml_silu(ctx, a);
+                    out = ggml_mul(ctx, cur, g);
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    // a is [k, n, ne2, ne3], the result is [ne[0], n, ne2, ne3]
+                    ggml_tensor * w = ggml_new_tensor_2d(ctx, type_w, ne[0], ne[0] + 3);
+                    ggml_set_name(w, "w");
+
+                    ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne[0] + 3);
+                    ggml_set_name(b, "b");
+
+                    cur = ggml_mul_mat(ctx, w, a);
+                    out = ggml_add(ctx, cur, b);
+                } break;
+            default:
+                GGML_ABORT("fatal error");
+        }
+
+        if (reuse) {
+            out = ggml_add(ctx, out, cur);
+        }
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+};
 
 // ###########################################
 // ## Section 3: GGML Op Test Instantiation ##
@@ -3955,6 +4094,12 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         test_cases.emplace_back(new test_get_rows_back(GGML_TYPE_I32, 256, 5, 4, 1, v));
     }
 
+    for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0}) {
+        for (int b : {1, 3}) {
+            test_cases.emplace_back(new test_set_rows(type, 256, 16, 5, b));
+        }
+    }
+
     for (ggml_type type_input : {GGML_TYPE_F32}) {
         for (ggml_op_pool pool_type : {GGML_OP_POOL_AVG, GGML_OP_POOL_MAX}) {
             for (int k0 : {1, 3}) {
@@ -4190,6 +4335,18 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
 
     test_cases.emplace_back(new test_l2_norm(GGML_TYPE_F32, {64, 5, 4, 3}, 1e-12f));
 
+    for (bool reuse : {false, true}) {
+        test_cases.emplace_back(new test_fusion(GGML_OP_RMS_NORM, GGML_TYPE_F32, {64, 5, 4, 3}, reuse));
+        test_cases.emplace_back(new test_fusion(GGML_OP_RMS_NORM, GGML_TYPE_F32, {4096, 7, 1, 1}, reuse));
+        test_cases.emplace_back(new test_fusion(GGML_OP_UNARY,    GGML_TYPE_F32, {67, 5, 4, 3}, reuse));
+        test_cases.emplace_back(new test_fusion(GGML_OP_UNARY,    GGML_TYPE_F32, {11008, 7, 1, 1}, reuse));
+        for (ggml_type type_w : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q4_K}) {
+            for (int64_t n : {1, 16, 33}) {
+                test_cases.emplace_back(new test_fusion(GGML_OP_MUL_MAT, type_w, {256, n, 2, 1}, reuse));
+            }
+        }
+    }
+
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {4, 1536, 1, 1}, {4, 1536, 1, 1}));
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {8, 1536, 1, 1}, {4, 1536, 1, 1}));
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {4, 1536, 4, 1}, {4, 1536, 1, 1}));
@@ -4484,6 +4641,7 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {8, 1, 1, 1}, order));
         test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {16, 10, 10, 10}, order));
         test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {60, 10, 10, 10}, order)); // qwen
+        test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {32000, 2, 1, 1}, order)); // full vocab row
     }
 
     for (ggml_scale_mode mode : {GGML_SCALE_MODE_NEAREST, GGML_SCALE_MODE_BILINEAR}) {
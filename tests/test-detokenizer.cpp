@@ -0,0 +1,219 @@
+// checks that the text streamed by the incremental detokenizer matches the concatenation of the token pieces
+//   the tokens are pushed in runs of random length, like the accepted tokens of speculative decoding
+//   the text must be cut before the first stop string and must never end in the middle of a UTF-8 character
+//   the stop matcher is also checked against a naive search
+
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char * texts[] = {
+    "Hello world! This is a test of the streaming detokenizer.\nUser: what is 2 + 2?\nAssistant: 4",
+    "Привет, мир! 你好，世界！ こんにちは 🦙🦙🦙 héllo wörld ### Instruction: stop here",
+    "</s> <|im_end|> some text after the special tokens\n\n\n   indented\tline",
+};
+
+static const char * stop_words[] = {
+    "User:",
+    "世界",
+    "🦙",
+    "###",
+    "\n\n",
+};
+
+static std::string token_to_piece(const llama_vocab * vocab, llama_token token) {
+    std::string piece(64, '\0');
+    int32_t n = llama_token_to_piece(vocab, token, &piece[0], piece.size(), 0, true);
+    if (n < 0) {
+        piece.resize(-n);
+        n = llama_token_to_piece(vocab, token, &piece[0], piece.size(), 0, true);
+    }
+    piece.resize(n);
+    return piece;
+}
+
+static bool is_incomplete_utf8(const std::string & text) {
+    for (size_t i = 1; i <= 4 && i <= text.size(); ++i) {
+        const uint8_t c = text[text.size() - i];
+        if ((c & 0xC0) != 0x80) {
+            const size_t n_seq = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+            return i < n_seq;
+        }
+    }
+    return false;
+}
+
+// compares the stop matcher with a naive search on random texts over a small alphabet, where the stop strings overlap a lot
+static int test_stop_matcher(std::mt19937 & rng) {
+    int n_failed = 0;
+
+    auto rand_str = [&](int n) {
+        std::string res;
+        for (int i = 0; i < n; ++i) {
+            res += "abc"[rng() % 3];
+        }
+        return res;
+    };
+
+    for (int round = 0; round < 200; ++round) {
+        std::vector<std::string> stop;
+        for (int i = 0, n = 1 + rng() % 8; i < n; ++i) {
+            stop.push_back(rand_str(1 + rng() % 5));
+        }
+
+        std::vector<const char *> stop_cstr;
+        for (const auto & word : stop) {
+            stop_cstr.push_back(word.c_str());
+        }
+
+        llama_stop_matcher * matcher = llama_stop_matcher_init(stop_cstr.data(), stop_cstr.size());
+
+        const std::string text = rand_str(64);
+
+        for (int32_t n_fed = 0; n_fed < (int32_t) text.size(); ) {
+            int32_t n = 0;
+            const int32_t idx = llama_stop_matcher_feed(matcher, text.data() + n_fed, text.size() - n_fed, &n);
+            n_fed += n;
+
+            // reference: the first end position of a stop string, and the longest stop string that ends there
+            int32_t end_ref = text.size();
+            int32_t idx_ref = -1;
+            for (int32_t end = n_fed - n + 1; end <= (int32_t) text.size() && idx_ref < 0; ++end) {
+                for (size_t i = 0; i < stop.size(); ++i) {
+                    const int32_t len = stop[i].size();
+                    if (len <= end && text.compare(end - len, len, stop[i]) == 0 && (idx_ref < 0 || len > (int32_t) stop[idx_ref].size())) {
+                        end_ref = end;
+                        idx_ref = i;
+                    }
+                }
+            }
+
+            if (idx != idx_ref || n_fed != end_ref) {
+                fprintf(stderr, "%s: text '%s': found stop %d at %d, expected %d at %d\n", __func__, text.c_str(), idx, n_fed, idx_ref, end_ref);
+                n_failed++;
+                break;
+            }
+
+            // reference: the longest suffix of the text fed so far that is a proper prefix of a stop string
+            int32_t n_partial_ref = 0;
+            for (const auto & word : stop) {
+                for (int32_t len = std::min<int32_t>(word.size() - 1, n_fed); len > n_partial_ref; --len) {
+                    if (text.compare(n_fed - len, len, word, 0, len) == 0) {
+                        n_partial_ref = len;
+                        break;
+                    }
+                }
+            }
+            if (idx < 0 && llama_stop_matcher_n_partial(matcher) != n_partial_ref) {
+                fprintf(stderr, "%s: text '%s': partial match of %d bytes, expected %d\n", __func__, text.c_str(), llama_stop_matcher_n_partial(matcher), n_partial_ref);
+                n_failed++;
+                break;
+            }
+        }
+
+        llama_stop_matcher_free(matcher);
+    }
+
+    return n_failed;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    std::mt19937 rng(42);
+
+    int n_failed = test_stop_matcher(rng);
+
+    for (const char * text : texts) {
+        std::vector<llama_token> tokens(1024);
+        tokens.resize(llama_tokenize(vocab, text, strlen(text), tokens.data(), tokens.size(), false, true));
+
+        for (int n_stop : { 0, 1, (int) (sizeof(stop_words)/sizeof(stop_words[0])) }) {
+            // reference: the text of the first prefix of the tokens that contains a stop string, cut before it
+            std::string ref;
+            int32_t n_tokens_ref = tokens.size();
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                ref += token_to_piece(vocab, tokens[i]);
+
+                size_t pos = std::string::npos;
+                for (int j = 0; j < n_stop; ++j) {
+                    pos = std::min(pos, ref.find(stop_words[j]));
+                }
+                if (pos != std::string::npos) {
+                    ref.resize(pos);
+                    n_tokens_ref = i + 1;
+                    break;
+                }
+            }
+
+            for (int round = 0; round < 8; ++round) {
+                llama_detokenizer * detok = llama_detokenizer_init(vocab, stop_words, n_stop);
+
+                std::string res;
+                int32_t n_tokens = 0;
+
+                char buf[256];
+                for (size_t i = 0; i < tokens.size() && llama_detokenizer_stop(detok) < 0; ) {
+                    const int32_t n_run = std::min<int32_t>(1 + rng() % 4, tokens.size() - i);
+
+                    int32_t n_consumed = 0;
+                    const int32_t n = llama_detokenizer_push(detok, tokens.data() + i, n_run, buf, sizeof(buf), true, &n_consumed);
+                    if (n < 0) {
+                        fprintf(stderr, "%s: unexpected buffer overflow\n", __func__);
+                        return 1;
+                    }
+
+                    const std::string chunk(buf, n);
+                    if (is_incomplete_utf8(chunk)) {
+                        fprintf(stderr, "%s: chunk '%s' ends with an incomplete UTF-8 character\n", __func__, chunk.c_str());
+                        n_failed++;
+                    }
+
+                    res      += chunk;
+                    n_tokens += n_consumed;
+                    i        += n_run;
+                }
+
+                if (llama_detokenizer_stop(detok) < 0) {
+                    res += std::string(buf, llama_detokenizer_flush(detok, buf, sizeof(buf)));
+                }
+
+                if (res != ref || n_tokens != n_tokens_ref) {
+                    fprintf(stderr, "%s: n_stop = %d: got '%s' (%d tokens), expected '%s' (%d tokens)\n",
+                            __func__, n_stop, res.c_str(), n_tokens, ref.c_str(), n_tokens_ref);
+                    n_failed++;
+                }
+
+                llama_detokenizer_free(detok);
+            }
+        }
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
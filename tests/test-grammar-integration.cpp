@@ -1295,6 +1295,50 @@ static void test_json_schema() {
     );
 }
 
+static void test_forced_text() {
+    fprintf(stderr, "⚫ Testing forced text\n");
+
+    struct test_case {
+        const char * grammar_str;
+        const char * prefix;
+        const char * forced;
+    };
+
+    const test_case cases[] = {
+        { R"""(root ::= "{\"name\": \"" [a-z]+ "\", \"age\": " [0-9]+ "}")""", "",            "{\"name\": \"" },
+        { R"""(root ::= "{\"name\": \"" [a-z]+ "\", \"age\": " [0-9]+ "}")""", "{\"name\": \"bob", ""          },
+        { R"""(root ::= "{\"name\": \"" [a-z]+ "\", \"age\": " [0-9]+ "}")""", "{\"name\": \"bob\"", ", \"age\": " },
+        { R"""(root ::= "héllo " ("wörld" | "wörd"))""",                     "",            "héllo wör" },
+        { R"""(root ::= "ab" "c"?)""",                                        "",            "ab"       },
+        { R"""(root ::= "ab" "c"?)""",                                        "ab",          ""         },
+        { R"""(root ::= [a] "b")""",                                          "",            "ab"       },
+        { R"""(root ::= [ab] "c")""",                                         "",            ""         },
+    };
+
+    for (const auto & tc : cases) {
+        llama_grammar * grammar = build_grammar(tc.grammar_str);
+        assert(grammar != nullptr);
+
+        for (const auto & cpt : unicode_cpts_from_utf8(tc.prefix)) {
+            llama_grammar_accept(grammar, cpt);
+        }
+
+        const std::string forced = llama_grammar_forced_text_impl(*grammar, 64);
+        if (forced != tc.forced) {
+            fprintf(stderr, "  ❌ grammar %s after '%s': forced '%s', expected '%s'\n", tc.grammar_str, tc.prefix, forced.c_str(), tc.forced);
+        }
+        assert(forced == tc.forced);
+
+        // the forced text is cut before a code point that does not fit
+        const std::string forced_max = llama_grammar_forced_text_impl(*grammar, 2);
+        assert(forced_max.size() <= 2 && std::string(tc.forced).compare(0, forced_max.size(), forced_max) == 0);
+
+        llama_grammar_free_impl(grammar);
+    }
+
+    fprintf(stderr, "  ✅︎\n");
+}
+
 int main() {
     fprintf(stdout, "Running grammar integration tests...\n");
     test_simple_grammar();
@@ -1305,6 +1349,7 @@ int main() {
     test_failure_missing_reference();
     test_failure_left_recursion();
     test_json_schema();
+    test_forced_text();
     fprintf(stdout, "All tests passed.\n");
     return 0;
 }
@@ -0,0 +1,143 @@
+// checks that the allowed tokens computed with the token trie of the vocab (large candidate sets)
+// match the ones computed by matching the candidates one by one (small candidate sets)
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+
+#include "../src/llama-grammar.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char * grammars[] = {
+    // JSON (grammars/json.gbnf)
+    R"""(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+object ::= "{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws
+array  ::= "[" ws ( value ("," ws value)* )? "]" ws
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) )* "\"" ws
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+ws ::= | " " | "\n" [ \t]{0,20}
+)""",
+    // inverse char ranges and repetitions
+    R"""(
+root ::= [^\n]+ "\n" [0-9]{1,3}
+)""",
+    // multi-byte code points, the tokens can end in the middle of a code point
+    R"""(
+root ::= ("你好" | "héllo" | [α-ω]+) " " . [^a-z]*
+)""",
+    // alternatives that are prefixes of each other
+    R"""(
+root ::= ("a" | "ab" | "abc") [x-z]* "."
+)""",
+};
+
+// returns the tokens that are not rejected by the grammar, applied to the candidates in chunks of n_chunk
+static std::vector<bool> get_allowed(const llama_grammar & grammar, int n_vocab, int n_chunk) {
+    std::vector<bool> allowed(n_vocab, false);
+
+    std::vector<llama_token_data> cur;
+    for (int i0 = 0; i0 < n_vocab; i0 += n_chunk) {
+        cur.clear();
+        for (int id = i0; id < std::min(n_vocab, i0 + n_chunk); ++id) {
+            cur.push_back({ id, 0.0f, 0.0f });
+        }
+
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+        llama_grammar_apply_impl(grammar, &cur_p);
+
+        for (const auto & td : cur) {
+            allowed[td.id] = td.logit != -INFINITY;
+        }
+    }
+
+    return allowed;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::mt19937 rng(42);
+
+    int n_failed = 0;
+
+    for (const char * grammar_str : grammars) {
+        llama_grammar * grammar     = llama_grammar_init_impl(vocab, grammar_str, "root", false, nullptr, 0, nullptr, 0);
+        llama_grammar * grammar_ref = llama_grammar_init_impl(vocab, grammar_str, "root", false, nullptr, 0, nullptr, 0);
+        GGML_ASSERT(grammar && grammar_ref);
+
+        double t_trie_ms = 0.0;
+        double t_ref_ms  = 0.0;
+
+        int n_steps = 0;
+        for (; n_steps < 16; ++n_steps) {
+            const auto t0 = std::chrono::high_resolution_clock::now();
+            const auto allowed = get_allowed(*grammar, n_vocab, n_vocab);
+            const auto t1 = std::chrono::high_resolution_clock::now();
+            const auto allowed_ref = get_allowed(*grammar_ref, n_vocab, 64);
+            const auto t2 = std::chrono::high_resolution_clock::now();
+
+            t_trie_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+            t_ref_ms  += std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+            std::vector<llama_token> choices;
+            for (llama_token id = 0; id < n_vocab; ++id) {
+                if (allowed[id] != allowed_ref[id]) {
+                    fprintf(stderr, "step %d: token %d ('%s') is %s by the trie but not by the reference\n",
+                            n_steps, id, llama_vocab_get_text(vocab, id), allowed[id] ? "allowed" : "rejected");
+                    n_failed++;
+                    break;
+                }
+                if (allowed[id] && !llama_vocab_is_eog(vocab, id)) {
+                    choices.push_back(id);
+                }
+            }
+
+            if (choices.empty()) {
+                break;
+            }
+
+            const llama_token id = choices[rng() % choices.size()];
+            llama_grammar_accept_impl(*grammar,     id);
+            llama_grammar_accept_impl(*grammar_ref, id);
+        }
+
+        fprintf(stderr, "%s: %2d steps, trie: %8.2f ms, reference: %8.2f ms\n", __func__, n_steps, t_trie_ms, t_ref_ms);
+
+        llama_grammar_free_impl(grammar);
+        llama_grammar_free_impl(grammar_ref);
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
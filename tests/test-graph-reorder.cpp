@@ -0,0 +1,293 @@
+// checks the reordering of the graph nodes that reduces the peak memory of the compute buffer
+//   the results must not change, and the buffer must not grow for graphs built in a bad order
+//   the allocation plan written by ggml_gallocr_dump_plan is checked: two tensors alive at the same time must not share memory
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <nlohmann/json.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static const int n_embd = 256;
+static const int n_rows = 16;
+
+struct test_weights {
+    ggml_context * ctx = nullptr;
+    ggml_backend_buffer_t buf = nullptr;
+
+    ggml_tensor * x = nullptr;
+    ggml_tensor * cache = nullptr;
+    std::vector<ggml_tensor *> w;
+};
+
+// builds the graph in ctx and returns its result
+using graph_builder = std::function<ggml_tensor *(ggml_context * ctx, ggml_cgraph * gf, const test_weights & tw)>;
+
+// the large results of independent branches are all computed before their reductions
+static ggml_tensor * build_fan_out(ggml_context * ctx, ggml_cgraph * gf, const test_weights & tw) {
+    std::vector<ggml_tensor *> a;
+    for (size_t k = 0; k < tw.w.size(); k++) {
+        a.push_back(ggml_mul(ctx, ggml_repeat(ctx, tw.w[k], ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, 8*n_rows)), tw.x));
+        ggml_build_forward_expand(gf, a.back());
+    }
+
+    ggml_tensor * out = nullptr;
+    for (size_t k = 0; k < a.size(); k++) {
+        ggml_tensor * s = ggml_sum_rows(ctx, ggml_sqr(ctx, a[k]));
+        out = out ? ggml_add(ctx, out, s) : s;
+    }
+
+    return out;
+}
+
+// a copy into a view of a tensor that is not allocated by the graph, and later reads of that tensor
+static ggml_tensor * build_cache(ggml_context * ctx, ggml_cgraph * gf, const test_weights & tw) {
+    ggml_tensor * big = ggml_mul(ctx, ggml_repeat(ctx, tw.w[0], ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, 8*n_rows)), tw.x);
+    ggml_build_forward_expand(gf, big);
+
+    ggml_tensor * k = ggml_scale(ctx, ggml_add(ctx, tw.w[1], tw.x), 0.5f);
+    ggml_build_forward_expand(gf, ggml_cpy(ctx, k, ggml_view_2d(ctx, tw.cache, n_embd, n_rows, tw.cache->nb[1], 0)));
+
+    ggml_tensor * kv  = ggml_view_2d(ctx, tw.cache, n_embd, 2*n_rows, tw.cache->nb[1], 0);
+    ggml_tensor * out = ggml_sum_rows(ctx, ggml_mul(ctx, kv, ggml_repeat(ctx, tw.x, kv)));
+
+    return ggml_add(ctx, ggml_sum(ctx, big), ggml_sum(ctx, out));
+}
+
+// random DAG of element-wise ops, the nodes are added in the order they are created
+static graph_builder make_random(uint32_t seed) {
+    return [seed](ggml_context * ctx, ggml_cgraph * gf, const test_weights & tw) {
+        std::mt19937 rng(seed);
+
+        std::vector<ggml_tensor *> nodes = { tw.w[0], tw.w[1], tw.w[2] };
+        std::vector<int> n_users(nodes.size(), 1);
+
+        const int n_nodes = 16 + rng() % 48;
+        for (int i = 0; i < n_nodes; i++) {
+            const size_t ia = rng() % nodes.size();
+            const size_t ib = nodes.size() - 1 - rng() % std::min<size_t>(nodes.size(), 4);
+
+            ggml_tensor * a = nodes[ia];
+            ggml_tensor * b = nodes[ib];
+
+            ggml_tensor * cur = nullptr;
+            switch (rng() % 5) {
+                case 0: cur = ggml_add  (ctx, a, b);          break;
+                case 1: cur = ggml_mul  (ctx, a, b);          break;
+                case 2: cur = ggml_sub  (ctx, a, b);          break;
+                case 3: cur = ggml_scale(ctx, a, 0.75f);      break;
+                case 4: cur = ggml_tanh (ctx, ggml_add(ctx, a, b)); break;
+            }
+
+            n_users[ia]++;
+            n_users[ib]++;
+
+            nodes.push_back(cur);
+            n_users.push_back(0);
+
+            ggml_build_forward_expand(gf, cur);
+        }
+
+        // the results that are not used by other nodes are summed
+        ggml_tensor * out = nullptr;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (n_users[i] == 0) {
+                ggml_tensor * s = ggml_sum(ctx, nodes[i]);
+                out = out ? ggml_add(ctx, out, s) : s;
+            }
+        }
+
+        return out;
+    };
+}
+
+struct test_graph {
+    ggml_context * ctx = nullptr;
+    ggml_cgraph  * gf  = nullptr;
+    ggml_tensor  * out = nullptr;
+
+    test_graph(const graph_builder & build, const test_weights & tw) {
+        ggml_init_params params = {
+            /* .mem_size   = */ ggml_tensor_overhead()*4096 + ggml_graph_overhead_custom(4096, false),
+            /* .mem_buffer = */ NULL,
+            /* .no_alloc   = */ true,
+        };
+        ctx = ggml_init(params);
+        gf  = ggml_new_graph_custom(ctx, 4096, false);
+        out = build(ctx, gf, tw);
+        ggml_set_output(out);
+        ggml_build_forward_expand(gf, out);
+    }
+
+    ~test_graph() {
+        ggml_free(ctx);
+    }
+};
+
+static size_t reserve_size(ggml_cgraph * gf) {
+    ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    GGML_ASSERT(ggml_gallocr_reserve(galloc, gf));
+    const size_t size = ggml_gallocr_get_buffer_size(galloc, 0);
+    ggml_gallocr_free(galloc);
+    return size;
+}
+
+// returns the number of pairs of tensors alive at the same time with overlapping memory
+static int check_plan(const std::string & fname) {
+    std::ifstream f(fname);
+    const json plan = json::parse(f);
+
+    const int n_nodes = plan["n_nodes"];
+    const auto & tensors = plan["tensors"];
+
+    int n_overlap = 0;
+    for (size_t i = 0; i < tensors.size(); i++) {
+        for (size_t j = i + 1; j < tensors.size(); j++) {
+            const auto & a = tensors[i];
+            const auto & b = tensors[j];
+
+            if (a["buffer"] != b["buffer"] || a["size"] == 0 || b["size"] == 0) {
+                continue;
+            }
+            // a tensor computed in-place takes over the memory of its parent on the last node of the parent
+            if (b["inplace_of"] == (int) i || a["inplace_of"] == (int) j) {
+                continue;
+            }
+
+            const size_t a0 = a["offset"], a1 = a0 + (size_t) a["size"];
+            const size_t b0 = b["offset"], b1 = b0 + (size_t) b["size"];
+
+            const int a_alloc = a["alloc"], a_free = a["free"] < 0 ? n_nodes : (int) a["free"];
+            const int b_alloc = b["alloc"], b_free = b["free"] < 0 ? n_nodes : (int) b["free"];
+
+            if (a0 < b1 && b0 < a1 && a_alloc <= b_free && b_alloc <= a_free) {
+                fprintf(stderr, "%s: %s [%d, %d] and %s [%d, %d] overlap\n", __func__,
+                        a["name"].get<std::string>().c_str(), a_alloc, a_free, b["name"].get<std::string>().c_str(), b_alloc, b_free);
+                n_overlap++;
+            }
+        }
+    }
+
+    return n_overlap;
+}
+
+static std::vector<float> compute(ggml_backend_t backend, const test_graph & g, const test_weights & tw, const char * fname, int & n_failed) {
+    ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    GGML_ASSERT(ggml_gallocr_alloc_graph(galloc, g.gf));
+
+    if (!ggml_gallocr_dump_plan(galloc, fname)) {
+        n_failed++;
+    } else {
+        n_failed += check_plan(fname);
+    }
+    std::remove(fname);
+
+    std::vector<float> zeros(ggml_nelements(tw.cache), 0.0f);
+    ggml_backend_tensor_set(tw.cache, zeros.data(), 0, ggml_nbytes(tw.cache));
+
+    GGML_ASSERT(ggml_backend_graph_compute(backend, g.gf) == GGML_STATUS_SUCCESS);
+
+    std::vector<float> res(ggml_nelements(g.out));
+    ggml_backend_tensor_get(g.out, res.data(), 0, ggml_nbytes(g.out));
+
+    ggml_gallocr_free(galloc);
+
+    return res;
+}
+
+int main(void) {
+    ggml_backend_t backend = ggml_backend_cpu_init();
+
+    test_weights tw;
+    {
+        ggml_init_params params = {
+            /* .mem_size   = */ ggml_tensor_overhead()*16,
+            /* .mem_buffer = */ NULL,
+            /* .no_alloc   = */ true,
+        };
+        tw.ctx   = ggml_init(params);
+        tw.x     = ggml_new_tensor_1d(tw.ctx, GGML_TYPE_F32, n_embd);
+        tw.cache = ggml_new_tensor_2d(tw.ctx, GGML_TYPE_F32, n_embd, 2*n_rows);
+        for (int k = 0; k < 8; k++) {
+            tw.w.push_back(ggml_new_tensor_2d(tw.ctx, GGML_TYPE_F32, n_embd, n_rows));
+        }
+        tw.buf = ggml_backend_alloc_ctx_tensors(tw.ctx, backend);
+
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        for (ggml_tensor * t = ggml_get_first_tensor(tw.ctx); t != nullptr; t = ggml_get_next_tensor(tw.ctx, t)) {
+            std::vector<float> data(ggml_nelements(t));
+            for (auto & v : data) {
+                v = dist(rng);
+            }
+            ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+        }
+    }
+
+    struct test_case {
+        std::string   name;
+        graph_builder build;
+        bool          must_shrink;
+    };
+
+    std::vector<test_case> cases = {
+        { "fan-out", build_fan_out, true  },
+        { "cache",   build_cache,   false },
+    };
+    for (uint32_t seed = 0; seed < 32; seed++) {
+        cases.push_back({ "random-" + std::to_string(seed), make_random(seed), false });
+    }
+
+    int n_failed = 0;
+
+    for (const auto & tc : cases) {
+        test_graph g_ref(tc.build, tw);
+        test_graph g_new(tc.build, tw);
+
+        const bool changed = ggml_graph_reorder_min_memory(g_new.gf);
+
+        const size_t size_ref = reserve_size(g_ref.gf);
+        const size_t size_new = reserve_size(g_new.gf);
+
+        const std::vector<float> res_ref = compute(backend, g_ref, tw, "test-graph-reorder-ref.json", n_failed);
+        const std::vector<float> res_new = compute(backend, g_new, tw, "test-graph-reorder-new.json", n_failed);
+
+        bool ok = res_ref.size() == res_new.size() && memcmp(res_ref.data(), res_new.data(), res_ref.size()*sizeof(float)) == 0;
+        if (!ok) {
+            fprintf(stderr, "%s: %s: the results differ after reordering\n", __func__, tc.name.c_str());
+        }
+        if (tc.must_shrink && (!changed || size_new >= size_ref)) {
+            fprintf(stderr, "%s: %s: the compute buffer did not shrink\n", __func__, tc.name.c_str());
+            ok = false;
+        }
+        if (!changed && size_new != size_ref) {
+            fprintf(stderr, "%s: %s: the graph did not change but the compute buffer did\n", __func__, tc.name.c_str());
+            ok = false;
+        }
+
+        fprintf(stderr, "%-10s: %3d nodes, reordered: %-3s, compute buffer %8zu -> %8zu bytes\n",
+                tc.name.c_str(), ggml_graph_n_nodes(g_ref.gf), changed ? "yes" : "no", size_ref, size_new);
+
+        n_failed += ok ? 0 : 1;
+    }
+
+    ggml_backend_buffer_free(tw.buf);
+    ggml_free(tw.ctx);
+    ggml_backend_free(backend);
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,312 @@
+// checks the KV cache with a model, or with a random model for a vocab:
+//   the logits computed with a fragmented paged cache must match the ones computed from scratch in a contiguous cache
+//   the tokens shared by several sequences are placed in a paged cache too
+//   a sequence saved right after a copy-on-write of its shared cells must be restored with the same data
+//   the compute graph reused for ubatches stored in other cells must give the same logits as a new graph
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+#include "model-utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+static const int n_blk   = 8;
+static const int n_seq   = 4;
+static const int n_ctx   = 1024;
+static const int n_chunk = 8;   // tokens decoded per sequence and round when filling the cache
+static const int n_round = 28;  // fills n_round*n_seq*n_chunk cells with interleaved blocks of the sequences
+static const int n_long  = 240; // longer than any contiguous range of free cells
+
+static std::vector<float> get_logits(llama_context * ctx) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    return std::vector<float>(logits, logits + n_vocab);
+}
+
+// logits of the tokens [0, n) of seq computed in a new contiguous cache
+static std::vector<float> get_logits_ref(llama_model * model, llama_seq_id seq, int n) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx    = n_ctx;
+    cparams.n_batch  = n_ctx;
+    cparams.n_ubatch = n_ctx;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    std::vector<float> res;
+    if (test_decode(ctx, seq, 0, n)) {
+        res = get_logits(ctx);
+    }
+    llama_free(ctx);
+    return res;
+}
+
+static bool check_logits(const char * name, const std::vector<float> & cur, const std::vector<float> & ref) {
+    if (cur.empty() || cur.size() != ref.size()) {
+        fprintf(stderr, "%s: %s: no logits\n", __func__, name);
+        return false;
+    }
+    float max_ref  = 0.0f;
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < cur.size(); i++) {
+        max_ref  = std::max(max_ref,  std::fabs(ref[i]));
+        max_diff = std::max(max_diff, std::fabs(cur[i] - ref[i]));
+    }
+    const bool ok = max_diff <= 1e-3f*std::max(1.0f, max_ref);
+    fprintf(stderr, "%s: %-24s max diff = %g %s\n", __func__, name, max_diff, ok ? "" : "- FAILED");
+    return ok;
+}
+
+// fills a paged cache with blocks of interleaved sequences, frees every other block and decodes a long prompt
+// that does not fit in a contiguous range of free cells: its cells are scattered over the freed blocks
+static int test_paged_fragmented(llama_model * model) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx         = n_ctx;
+    cparams.n_batch       = n_ctx;
+    cparams.n_ubatch      = n_ctx/2;
+    cparams.n_seq_max     = n_seq;
+    cparams.kv_block_size = n_blk;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    int n_failed = 0;
+
+    for (int r = 0; r < n_round && n_failed == 0; r++) {
+        for (int s = 0; s < n_seq && n_failed == 0; s++) {
+            n_failed += test_decode(ctx, s, r*n_chunk, (r + 1)*n_chunk) ? 0 : 1;
+        }
+    }
+
+    if (n_failed == 0) {
+        llama_kv_self_seq_rm(ctx, 1, -1, -1);
+        llama_kv_self_seq_rm(ctx, 3, -1, -1);
+
+        if (!test_decode(ctx, 1, 0, n_long)) {
+            n_failed++;
+        } else if (!check_logits("paged: long prompt", get_logits(ctx), get_logits_ref(model, 1, n_long))) {
+            n_failed++;
+        }
+    }
+
+    // the sequences that were kept must not be affected
+    const int n_past = n_round*n_chunk;
+    if (n_failed == 0) {
+        if (!test_decode(ctx, 2, n_past, n_past + 1)) {
+            n_failed++;
+        } else if (!check_logits("paged: kept sequence", get_logits(ctx), get_logits_ref(model, 2, n_past + 1))) {
+            n_failed++;
+        }
+    }
+
+    llama_free(ctx);
+
+    return n_failed;
+}
+
+// the tokens of a prompt shared by two sequences of a paged cache are not placed in the blocks of one of them
+static int test_paged_shared(llama_model * model) {
+    const int n_past = 40;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx         = n_ctx;
+    cparams.n_batch       = n_ctx;
+    cparams.n_ubatch      = n_ctx;
+    cparams.n_seq_max     = 2;
+    cparams.kv_block_size = n_blk;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    int n_failed = 0;
+
+    llama_batch batch = llama_batch_init(n_past, 0, 2);
+    for (int i = 0; i < n_past; i++) {
+        common_batch_add(batch, test_tok(i, 1), i, { 0, 1 }, false);
+    }
+    if (llama_decode(ctx, batch) != 0) {
+        fprintf(stderr, "%s: llama_decode failed for the shared prompt\n", __func__);
+        n_failed++;
+    }
+    llama_batch_free(batch);
+
+    if (n_failed == 0) {
+        if (!test_decode(ctx, 1, n_past, n_past + 1)) {
+            n_failed++;
+        } else if (!check_logits("paged: shared prompt", get_logits(ctx), get_logits_ref(model, 1, n_past + 1))) {
+            n_failed++;
+        }
+    }
+
+    llama_free(ctx);
+
+    return n_failed;
+}
+
+// shares the cells of a sequence with a copy, moves the copy with seq_add so that the shared cells are copied on
+// write, then copies it again and saves it before anything else is decoded and restores it in another context
+static int test_cow_save(llama_model * model) {
+    const int n_past = 64;
+    const int n_div  = 8;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = n_ctx;
+    cparams.n_batch   = n_ctx;
+    cparams.n_ubatch  = n_ctx;
+    cparams.n_seq_max = 3;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    int n_failed = 0;
+
+    n_failed += test_decode(ctx, 0, 0, n_past) ? 0 : 1;
+
+    if (n_failed == 0) {
+        llama_kv_self_seq_cp(ctx, 0, 1, -1, -1);
+
+        n_failed += test_decode(ctx, 0, n_past, n_past + n_div) ? 0 : 1;
+        n_failed += test_decode(ctx, 1, n_past, n_past + n_div) ? 0 : 1;
+    }
+
+    std::vector<uint8_t> state;
+    if (n_failed == 0) {
+        // drop [8, 16) from the copy and move the rest back - the shared cells after them are copied on write
+        llama_kv_self_seq_rm (ctx, 1, 8, 16);
+        llama_kv_self_seq_add(ctx, 1, 16, -1, -8);
+
+        // the cells of the copy are still waiting for their data
+        llama_kv_self_seq_cp(ctx, 1, 2, -1, -1);
+
+        state.resize(llama_state_seq_get_size(ctx, 1));
+        if (llama_state_seq_get_data(ctx, state.data(), state.size(), 1) != state.size()) {
+            fprintf(stderr, "%s: failed to save the sequence\n", __func__);
+            n_failed++;
+        }
+    }
+
+    const int n_cur = n_past + n_div - 8;
+
+    if (n_failed == 0) {
+        cparams.n_seq_max = 1;
+
+        llama_context * ctx_dst = llama_init_from_model(model, cparams);
+
+        if (llama_state_seq_set_data(ctx_dst, state.data(), state.size(), 0) != state.size()) {
+            fprintf(stderr, "%s: failed to restore the sequence\n", __func__);
+            n_failed++;
+        } else if (!test_decode(ctx, 1, n_cur, n_cur + 1) || !test_decode(ctx_dst, 0, n_cur, n_cur + 1, 1)) {
+            n_failed++;
+        } else if (!check_logits("cow: restored sequence", get_logits(ctx_dst), get_logits(ctx))) {
+            n_failed++;
+        } else {
+            const auto ref = get_logits(ctx);
+            if (!test_decode(ctx, 2, n_cur, n_cur + 1, 1) || !check_logits("cow: copied sequence", get_logits(ctx), ref)) {
+                n_failed++;
+            }
+        }
+
+        llama_free(ctx_dst);
+    }
+
+    // the sequence that was copied must not be affected
+    if (n_failed == 0) {
+        if (!test_decode(ctx, 0, n_past + n_div, n_past + n_div + 1)) {
+            n_failed++;
+        } else if (!check_logits("cow: source sequence", get_logits(ctx), get_logits_ref(model, 0, n_past + n_div + 1))) {
+            n_failed++;
+        }
+    }
+
+    llama_free(ctx);
+
+    return n_failed;
+}
+
+// decodes one token of each sequence per ubatch in a paged cache, so that the cells of the ubatches are scattered
+// over the blocks of the sequences and change from one ubatch to the next
+static std::vector<float> generate_paged(llama_model * model, bool graph_reuse, int32_t & n_reused) {
+    const int n_steps = 24;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx         = n_ctx;
+    cparams.n_seq_max     = n_seq;
+    cparams.kv_block_size = n_blk;
+    cparams.graph_reuse   = graph_reuse;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::vector<float> res;
+
+    bool ok = true;
+    for (int s = 0; s < n_seq && ok; s++) {
+        ok = test_decode(ctx, s, 0, n_chunk);
+    }
+
+    llama_batch batch = llama_batch_init(n_seq, 0, 1);
+    for (int i = n_chunk; i < n_chunk + n_steps && ok; i++) {
+        common_batch_clear(batch);
+        for (int s = 0; s < n_seq; s++) {
+            common_batch_add(batch, test_tok(i, s), i, { s }, true);
+        }
+        ok = llama_decode(ctx, batch) == 0;
+        if (ok) {
+            const float * logits = llama_get_logits(ctx);
+            res.insert(res.end(), logits, logits + n_seq*n_vocab);
+        }
+    }
+    llama_batch_free(batch);
+
+    if (!ok) {
+        fprintf(stderr, "%s: generation failed\n", __func__);
+        res.clear();
+    }
+
+    n_reused = llama_perf_context(ctx).n_reused;
+
+    llama_free(ctx);
+
+    return res;
+}
+
+static int test_graph_reuse(llama_model * model) {
+    int32_t n_reused_ref = 0;
+    int32_t n_reused     = 0;
+
+    const auto ref = generate_paged(model, false, n_reused_ref);
+    const auto cur = generate_paged(model, true,  n_reused);
+
+    if (n_reused == 0) {
+        fprintf(stderr, "%s: the graph was not reused\n", __func__);
+        return 1;
+    }
+
+    return check_logits("graph reuse: paged", cur, ref) ? 0 : 1;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = test_load_model(model_path);
+    if (model == nullptr) {
+        return 1;
+    }
+
+    int n_failed = 0;
+
+    n_failed += test_paged_fragmented(model);
+    n_failed += test_paged_shared(model);
+    n_failed += test_cow_save(model);
+    n_failed += test_graph_reuse(model);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,130 @@
+// checks the sampling from the top logits computed in the graph (n_logits_top) with a model or a vocab:
+//   the top logits are not sorted anymore once the logit bias has been applied
+//   a grammar is not sampled from the top logits, the context params of a grammar keep the full logits
+
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "get-model.h"
+#include "model-utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <numeric>
+#include <vector>
+
+static const int n_top    = 8;
+static const int n_prompt = 16;
+
+static llama_context * init_context(llama_model * model, uint32_t n_logits_top) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx        = 256;
+    cparams.n_logits_top = n_logits_top;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    if (!test_decode(ctx, 0, 0, n_prompt)) {
+        llama_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+static bool check(const char * name, bool ok) {
+    fprintf(stderr, "%s: %-32s %s\n", __func__, name, ok ? "" : "- FAILED");
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = test_load_model(model_path);
+    if (model == nullptr) {
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    llama_context * ctx_ref = init_context(model, 0);
+    llama_context * ctx_top = init_context(model, n_top);
+    if (ctx_ref == nullptr || ctx_top == nullptr) {
+        return 1;
+    }
+
+    // the tokens by decreasing logit
+    std::vector<llama_token> order(n_vocab);
+    {
+        const float * logits = llama_get_logits_ith(ctx_ref, -1);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](llama_token a, llama_token b) { return logits[a] > logits[b]; });
+    }
+
+    int n_failed = 0;
+
+    // the logit bias moves one of the top tokens first, top-k 1 must keep it
+    {
+        const llama_token id_bias = order[n_top/2];
+
+        const llama_logit_bias bias = { id_bias, 100.0f };
+
+        llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(smpl, llama_sampler_init_logit_bias(n_vocab, 1, &bias));
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(1));
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+
+        n_failed += check("bias: llama_sampler", llama_sampler_sample(smpl, ctx_top, -1) == id_bias) ? 0 : 1;
+
+        llama_sampler_free(smpl);
+
+        common_params_sampling params;
+        params.logit_bias = { bias };
+        params.top_k      = 1;
+
+        common_sampler * gsmpl = common_sampler_init(model, params);
+
+        n_failed += check("bias: common_sampler", common_sampler_sample(gsmpl, ctx_top, -1) == id_bias) ? 0 : 1;
+
+        common_sampler_free(gsmpl);
+    }
+
+    // a grammar needs the logits of the full vocab: the top logits of the context are not sampled with a grammar
+    {
+        common_params_sampling params;
+        params.grammar = "root ::= [a-z]+";
+
+        common_sampler * gsmpl = common_sampler_init(model, params);
+
+        for (bool grammar_first : { false, true }) {
+            bool thrown = false;
+            try {
+                common_sampler_sample(gsmpl, ctx_top, -1, grammar_first);
+            } catch (const std::exception &) {
+                thrown = true;
+            }
+
+            n_failed += check(grammar_first ? "grammar first: top logits" : "grammar: top logits", thrown) ? 0 : 1;
+        }
+
+        common_sampler_free(gsmpl);
+
+        common_params cparams;
+        cparams.n_logits_top     = n_top;
+        cparams.sampling.grammar = params.grammar;
+
+        n_failed += check("grammar: context params", common_context_params_to_llama(cparams).n_logits_top == 0) ? 0 : 1;
+    }
+
+    llama_free(ctx_top);
+    llama_free(ctx_ref);
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+// checks that with the NUMA mirror strategy the matrix multiplications read the weights from the copies of the buffer
+//   GGML_NUMA_MIRROR_NODES emulates several nodes, so this runs on single-node machines too
+//   other buffers are mirrored and unmirrored by another thread while the graph is computed, like when another model
+//   is loaded or freed
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static std::vector<float> compute(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * out, int n_threads) {
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+    const float * data = (const float *) out->data;
+    return std::vector<float>(data, data + ggml_nelements(out));
+}
+
+int main(void) {
+#ifndef _WIN32
+    setenv("GGML_NUMA_MIRROR_NODES", "2", 1);
+#endif
+    ggml_numa_init(GGML_NUMA_STRATEGY_MIRROR);
+
+    const int n_embd   = 256;
+    const int n_out    = 128;
+    const int n_tokens = 8;
+
+    // the weights are in their own buffer, like the model weights
+    std::vector<float> w_data(n_embd*n_out);
+    for (size_t i = 0; i < w_data.size(); i++) {
+        w_data[i] = std::sin(0.01f*i);
+    }
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_out);
+    w->data = w_data.data();
+
+    ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+    for (int64_t i = 0; i < ggml_nelements(x); i++) {
+        ((float *) x->data)[i] = std::cos(0.02f*i);
+    }
+
+    ggml_tensor * out = ggml_mul_mat(ctx, w, x);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    const std::vector<float> ref = compute(ctx, gf, out, 4);
+
+    if (!ggml_numa_mirror(w_data.data(), w_data.size()*sizeof(float))) {
+        fprintf(stderr, "NUMA mirror not supported, skipping\n");
+        ggml_free(ctx);
+        return 0;
+    }
+
+    // the original is not read anymore: the result is computed from the copies
+    std::fill(w_data.begin(), w_data.end(), 0.0f);
+
+    bool ok = true;
+
+    for (int n_threads : { 1, 2, 3, 4 }) {
+        if (compute(ctx, gf, out, n_threads) != ref) {
+            fprintf(stderr, "n_threads = %d: the result does not match the result without the mirror\n", n_threads);
+            ok = false;
+        }
+    }
+
+    {
+        std::atomic<bool> stop(false);
+
+        std::thread other([&stop]() {
+            std::vector<std::vector<uint8_t>> bufs(8, std::vector<uint8_t>(64*1024, 1));
+            while (!stop) {
+                for (auto & buf : bufs) {
+                    ggml_numa_mirror(buf.data(), buf.size());
+                }
+                for (auto & buf : bufs) {
+                    ggml_numa_unmirror(buf.data());
+                }
+            }
+        });
+
+        for (int i = 0; i < 16 && ok; i++) {
+            if (compute(ctx, gf, out, 4) != ref) {
+                fprintf(stderr, "the result does not match while other buffers are mirrored\n");
+                ok = false;
+            }
+        }
+
+        stop = true;
+        other.join();
+    }
+
+    // after unmirror the original is used again
+    ggml_numa_unmirror(w_data.data());
+
+    for (float v : compute(ctx, gf, out, 4)) {
+        if (v != 0.0f) {
+            fprintf(stderr, "the copies are still used after ggml_numa_unmirror\n");
+            ok = false;
+            break;
+        }
+    }
+
+    ggml_free(ctx);
+
+    fprintf(stderr, "%s\n", ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
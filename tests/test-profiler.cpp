@@ -0,0 +1,175 @@
+// checks the profiler of ggml_backend_sched with the CPU backend
+//   the trace must be valid JSON and contain the splits and each node computed by each thread, but not the views
+//   the FLOPs and bytes estimated for a matrix multiplication are checked
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static const int n_k     = 256;
+static const int n_m     = 128;
+static const int n_n     = 32;
+static const int n_graph = 3;
+
+int main(void) {
+    const int n_threads = 2;
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_backend_cpu_set_n_threads(backend, n_threads);
+
+    ggml_context * ctx_w = nullptr;
+    ggml_backend_buffer_t buf_w = nullptr;
+    ggml_tensor * w = nullptr;
+    ggml_tensor * x = nullptr;
+    {
+        ggml_init_params params = {
+            /* .mem_size   = */ ggml_tensor_overhead()*2,
+            /* .mem_buffer = */ NULL,
+            /* .no_alloc   = */ true,
+        };
+        ctx_w = ggml_init(params);
+        w = ggml_new_tensor_2d(ctx_w, GGML_TYPE_F32, n_k, n_m);
+        x = ggml_new_tensor_2d(ctx_w, GGML_TYPE_F32, n_k, n_n);
+        buf_w = ggml_backend_alloc_ctx_tensors(ctx_w, backend);
+
+        for (ggml_tensor * t : { w, x }) {
+            std::vector<float> data(ggml_nelements(t));
+            for (size_t i = 0; i < data.size(); i++) {
+                data[i] = std::sin(0.01f*i);
+            }
+            ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+        }
+    }
+
+    ggml_init_params params = {
+        /* .mem_size   = */ ggml_tensor_overhead()*64 + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+    ggml_cgraph  * gf  = ggml_new_graph(ctx);
+
+    // none of these nodes are fused by the CPU backend
+    ggml_tensor * mm = ggml_mul_mat(ctx, w, x);
+    ggml_set_name(mm, "mm");
+    ggml_tensor * s = ggml_scale(ctx, mm, 0.5f);
+    ggml_set_name(s, "s");
+    ggml_tensor * r = ggml_reshape_2d(ctx, s, n_m*n_n/4, 4);
+    ggml_set_name(r, "r");
+    ggml_tensor * t = ggml_tanh(ctx, r);
+    ggml_set_name(t, "t");
+    ggml_tensor * out = ggml_sum_rows(ctx, t);
+    ggml_set_name(out, "out");
+    ggml_set_output(out);
+    ggml_build_forward_expand(gf, out);
+
+    ggml_backend_sched_t sched = ggml_backend_sched_new(&backend, nullptr, 1, GGML_DEFAULT_GRAPH_SIZE, false, false);
+    ggml_backend_profiler_t profiler = ggml_backend_profiler_new(1 << 16);
+    ggml_backend_sched_set_profiler(sched, profiler);
+
+    for (int i = 0; i < n_graph; i++) {
+        GGML_ASSERT(ggml_backend_sched_graph_compute(sched, gf) == GGML_STATUS_SUCCESS);
+    }
+
+    ggml_backend_sched_set_profiler(sched, nullptr);
+
+    // not profiled
+    GGML_ASSERT(ggml_backend_sched_graph_compute(sched, gf) == GGML_STATUS_SUCCESS);
+
+    int n_failed = 0;
+
+    const char * fname = "test-profiler.json";
+    if (!ggml_backend_profiler_write_trace(profiler, fname)) {
+        fprintf(stderr, "%s: failed to write the trace\n", __func__);
+        n_failed++;
+    } else {
+        std::ifstream f(fname);
+        const json trace = json::parse(f);
+
+        // number of events of each category and name on the first thread
+        std::map<std::string, int> n_events;
+        int n_threads_seen = 0;
+        for (const auto & ev : trace["traceEvents"]) {
+            if (ev["ph"] != "X") {
+                continue;
+            }
+            const std::string cat  = ev["cat"];
+            const std::string name = ev["name"];
+            const int tid = ev["tid"];
+
+            n_threads_seen = std::max(n_threads_seen, tid);
+
+            if (cat == "RESHAPE" || cat == "VIEW" || name == "r") {
+                fprintf(stderr, "%s: the view %s is in the trace\n", __func__, name.c_str());
+                n_failed++;
+            }
+
+            if (tid != 1 && tid != 0) {
+                continue;
+            }
+            n_events[cat + ":" + (tid == 0 ? cat : name)]++;
+
+            if (tid == 1 && name == "mm") {
+                const int64_t flops = ev["args"]["flops"];
+                const int64_t bytes = ev["args"]["bytes"];
+                const int64_t flops_ref = 2ll*n_k*n_m*n_n;
+                const int64_t bytes_ref = (int64_t) (ggml_nbytes(w) + ggml_nbytes(x) + ggml_nbytes(mm));
+                if (flops != flops_ref || bytes != bytes_ref) {
+                    fprintf(stderr, "%s: mm: %lld FLOPs and %lld bytes, expected %lld and %lld\n", __func__,
+                            (long long) flops, (long long) bytes, (long long) flops_ref, (long long) bytes_ref);
+                    n_failed++;
+                }
+            }
+        }
+
+        const std::map<std::string, int> n_events_ref = {
+            { "graph:graph",  n_graph },
+            { "split:split",  n_graph },
+            { "MUL_MAT:mm",   n_graph },
+            { "SCALE:s",      n_graph },
+            { "TANH:t",       n_graph },
+            { "SUM_ROWS:out", n_graph },
+        };
+        if (n_events != n_events_ref) {
+            fprintf(stderr, "%s: unexpected events:", __func__);
+            for (const auto & it : n_events) {
+                fprintf(stderr, " %s x %d", it.first.c_str(), it.second);
+            }
+            fprintf(stderr, "\n");
+            n_failed++;
+        }
+
+        // with OpenMP, fewer threads than requested can be started
+        if (n_threads_seen < 1 || n_threads_seen > n_threads) {
+            fprintf(stderr, "%s: %d threads in the trace\n", __func__, n_threads_seen);
+            n_failed++;
+        }
+    }
+    std::remove(fname);
+
+    ggml_backend_profiler_print_summary(profiler, stderr);
+
+    ggml_backend_profiler_free(profiler);
+    ggml_backend_sched_free(sched);
+    ggml_free(ctx);
+    ggml_backend_buffer_free(buf_w);
+    ggml_free(ctx_w);
+    ggml_backend_free(backend);
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+// checks the sampling of several sequences in parallel with a model, or with a random model for a vocab:
+//   llama_sampler_sample_seqs must sample the same tokens as llama_sampler_sample called for each sequence
+//   an exception thrown by a sampler must be returned as an error
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+#include "model-utils.h"
+
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+static const int n_seq    = 8;
+static const int n_prompt = 8;
+static const int n_steps  = 16;
+
+static llama_sampler * make_sampler(uint32_t seed) {
+    llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.8f));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+    return smpl;
+}
+
+// decodes the prompts of the sequences, with one output per sequence
+static bool decode_prompts(llama_context * ctx) {
+    llama_batch batch = llama_batch_init(n_seq*n_prompt, 0, 1);
+    for (int s = 0; s < n_seq; s++) {
+        test_batch_add_seq(batch, s, 0, n_prompt);
+    }
+    const int ret = llama_decode(ctx, batch);
+    llama_batch_free(batch);
+    return ret == 0;
+}
+
+// decodes the last sampled token of each sequence
+static bool decode_tokens(llama_context * ctx, const std::vector<llama_token> & tokens, int pos) {
+    llama_batch batch = llama_batch_init(n_seq, 0, 1);
+    for (int s = 0; s < n_seq; s++) {
+        common_batch_add(batch, tokens[s], pos, { s }, true);
+    }
+    const int ret = llama_decode(ctx, batch);
+    llama_batch_free(batch);
+    return ret == 0;
+}
+
+// samples n_steps tokens for each sequence, in parallel or one sequence after the other
+static std::vector<llama_token> generate(llama_model * model, bool parallel) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = 4;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    std::vector<llama_sampler *> smpls(n_seq);
+    for (int s = 0; s < n_seq; s++) {
+        smpls[s] = make_sampler(1234 + s);
+    }
+
+    // the outputs are the last tokens of the prompts, then all the tokens of the batch
+    std::vector<int32_t> idxs(n_seq);
+    for (int s = 0; s < n_seq; s++) {
+        idxs[s] = s*n_prompt + n_prompt - 1;
+    }
+
+    std::vector<llama_token> res;
+    std::vector<llama_token> tokens(n_seq);
+
+    bool ok = decode_prompts(ctx);
+    for (int k = 0; k < n_steps && ok; k++) {
+        if (parallel) {
+            ok = llama_sampler_sample_seqs(smpls.data(), ctx, idxs.data(), n_seq, tokens.data()) == 0;
+        } else {
+            for (int s = 0; s < n_seq; s++) {
+                tokens[s] = llama_sampler_sample(smpls[s], ctx, idxs[s]);
+            }
+        }
+        res.insert(res.end(), tokens.begin(), tokens.end());
+
+        ok = ok && decode_tokens(ctx, tokens, n_prompt + k);
+
+        for (int s = 0; s < n_seq; s++) {
+            idxs[s] = s;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: generation failed\n", __func__);
+        res.clear();
+    }
+
+    for (auto * smpl : smpls) {
+        llama_sampler_free(smpl);
+    }
+    llama_free(ctx);
+
+    return res;
+}
+
+static void throwing_apply(llama_sampler * /*smpl*/, llama_token_data_array * /*cur_p*/) {
+    throw std::runtime_error("sampler failed");
+}
+
+// one of the samplers throws
+static bool test_error(llama_model * model) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = 4;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    static const llama_sampler_i iface = {
+        /* .name   = */ nullptr,
+        /* .accept = */ nullptr,
+        /* .apply  = */ throwing_apply,
+        /* .reset  = */ nullptr,
+        /* .clone  = */ nullptr,
+        /* .free   = */ nullptr,
+    };
+
+    std::vector<llama_sampler *> smpls(n_seq);
+    std::vector<int32_t>         idxs(n_seq);
+    std::vector<llama_token>     tokens(n_seq);
+    for (int s = 0; s < n_seq; s++) {
+        smpls[s] = s == n_seq/2 ? llama_sampler_init(&iface, nullptr) : make_sampler(s);
+        idxs[s]  = s*n_prompt + n_prompt - 1;
+    }
+
+    bool ok = decode_prompts(ctx);
+    if (ok) {
+        ok = llama_sampler_sample_seqs(smpls.data(), ctx, idxs.data(), n_seq, tokens.data()) == -1;
+
+        // the threads are still usable after the error
+        llama_sampler_free(smpls[n_seq/2]);
+        smpls[n_seq/2] = make_sampler(n_seq/2);
+        ok = ok && llama_sampler_sample_seqs(smpls.data(), ctx, idxs.data(), n_seq, tokens.data()) == 0;
+    }
+
+    for (auto * smpl : smpls) {
+        llama_sampler_free(smpl);
+    }
+    llama_free(ctx);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model * model = test_load_model(model_path);
+    if (model == nullptr) {
+        return 1;
+    }
+
+    int n_failed = 0;
+
+    {
+        const auto ref = generate(model, false);
+        const auto cur = generate(model, true);
+        const bool ok = !ref.empty() && cur == ref;
+        fprintf(stderr, "%s: %-24s %s\n", __func__, "same tokens", ok ? "" : "- FAILED");
+        n_failed += ok ? 0 : 1;
+    }
+
+    {
+        const bool ok = test_error(model);
+        fprintf(stderr, "%s: %-24s %s\n", __func__, "sampler error", ok ? "" : "- FAILED");
+        n_failed += ok ? 0 : 1;
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+// benchmark of the fused path of the sampler chains
+//   compares llama_sampler_chain_apply_fused with building the candidates of the full vocab and applying the chain
+//   the same tokens must be selected, up to the order of the candidates and the rounding of the probabilities at the edges of top-p
+//   a chain without the fused param must keep the regular path, so that a seed selects exactly the same tokens
+
+#include "llama.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <vector>
+
+struct chain_config {
+    const char * name;
+    std::function<void(llama_sampler *)> add;
+};
+
+static llama_sampler * make_chain(const chain_config & cfg, bool fused) {
+    llama_sampler_chain_params params = llama_sampler_chain_default_params();
+    params.fused = fused;
+
+    llama_sampler * chain = llama_sampler_chain_init(params);
+    cfg.add(chain);
+    return chain;
+}
+
+// same as llama_sampler_sample: the fused path if the chain allows it, the candidates of the full vocab otherwise
+static llama_token sample(llama_sampler * chain, const std::vector<float> & logits, std::vector<llama_token_data> & cur) {
+    const int32_t n_vocab = logits.size();
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    if (!llama_sampler_chain_apply_fused(chain, logits.data(), n_vocab, &cur_p)) {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur[id] = llama_token_data{id, logits[id], 0.0f};
+        }
+        cur_p = { cur.data(), cur.size(), -1, false };
+        llama_sampler_apply(chain, &cur_p);
+    }
+
+    return cur_p.data[cur_p.selected].id;
+}
+
+int main(int argc, char ** argv) {
+    int n_rounds = 16;
+    if (argc > 1) {
+        n_rounds = std::atoi(argv[1]);
+    }
+
+    const std::vector<llama_logit_bias> logit_bias = {
+        { 0, -INFINITY },
+        { 1,  5.0f     },
+        { 7, -2.0f     },
+    };
+
+    const chain_config configs[] = {
+        { "top-k + temp + dist", [](llama_sampler * c) {
+            llama_sampler_chain_add(c, llama_sampler_init_top_k(40));
+            llama_sampler_chain_add(c, llama_sampler_init_temp (0.8f));
+            llama_sampler_chain_add(c, llama_sampler_init_dist (1234));
+        } },
+        { "top-p + temp + dist", [](llama_sampler * c) {
+            llama_sampler_chain_add(c, llama_sampler_init_top_p(0.9f, 1));
+            llama_sampler_chain_add(c, llama_sampler_init_temp (0.8f));
+            llama_sampler_chain_add(c, llama_sampler_init_dist (1234));
+        } },
+        { "min-p + temp + dist", [](llama_sampler * c) {
+            llama_sampler_chain_add(c, llama_sampler_init_min_p(0.05f, 1));
+            llama_sampler_chain_add(c, llama_sampler_init_temp (0.8f));
+            llama_sampler_chain_add(c, llama_sampler_init_dist (1234));
+        } },
+        { "penalties + top-k/p + min-p + dist", [](llama_sampler * c) {
+            llama_sampler_chain_add(c, llama_sampler_init_penalties(64, 1.3f, 0.1f, 0.1f));
+            llama_sampler_chain_add(c, llama_sampler_init_dry      (nullptr, 0, 0.0f, 1.75f, 2, -1, nullptr, 0));
+            llama_sampler_chain_add(c, llama_sampler_init_top_k    (40));
+            llama_sampler_chain_add(c, llama_sampler_init_top_p    (0.95f, 1));
+            llama_sampler_chain_add(c, llama_sampler_init_min_p    (0.05f, 1));
+            llama_sampler_chain_add(c, llama_sampler_init_temp_ext (0.8f, 0.0f, 1.0f));
+            llama_sampler_chain_add(c, llama_sampler_init_dist     (1234));
+        } },
+        { "logit-bias + greedy", [&logit_bias](llama_sampler * c) {
+            llama_sampler_chain_add(c, llama_sampler_init_logit_bias(0, logit_bias.size(), logit_bias.data()));
+            llama_sampler_chain_add(c, llama_sampler_init_greedy());
+        } },
+    };
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist_logit(0.0f, 2.5f);
+
+    int n_mismatch = 0;
+    int n_total    = 0;
+    int n_seed     = 0; // tokens of the chains without the fused param that differ from the regular path
+
+    for (int n_vocab : { 32000, 65536, 131072, 151936, 262144 }) {
+        std::vector<float>            logits(n_vocab);
+        std::vector<llama_token_data> cur_ref(n_vocab);
+        std::vector<llama_token_data> cur_fused(n_vocab);
+
+        for (const auto & cfg : configs) {
+            llama_sampler * chain_ref   = make_chain(cfg, false);
+            llama_sampler * chain_plain = make_chain(cfg, false);
+            llama_sampler * chain_fused = make_chain(cfg, true);
+
+            double t_ref_us   = 0.0;
+            double t_fused_us = 0.0;
+
+            int n_diff = 0;
+            int n_same = 0;
+
+            for (int r = 0; r < n_rounds; ++r) {
+                for (auto & l : logits) {
+                    l = dist_logit(rng);
+                }
+                // a few likely tokens, as in real models
+                for (int i = 0; i < 8; ++i) {
+                    logits[rng() % n_vocab] += 12.0f;
+                }
+
+                const auto t0 = std::chrono::high_resolution_clock::now();
+
+                for (llama_token id = 0; id < n_vocab; ++id) {
+                    cur_ref[id] = llama_token_data{id, logits[id], 0.0f};
+                }
+                llama_token_data_array cur_p_ref = { cur_ref.data(), cur_ref.size(), -1, false };
+                llama_sampler_apply(chain_ref, &cur_p_ref);
+
+                const auto t1 = std::chrono::high_resolution_clock::now();
+
+                llama_token_data_array cur_p_fused = { cur_fused.data(), cur_fused.size(), -1, false };
+                if (!llama_sampler_chain_apply_fused(chain_fused, logits.data(), n_vocab, &cur_p_fused)) {
+                    fprintf(stderr, "%s: the fused path does not support the chain '%s'\n", __func__, cfg.name);
+                    return 1;
+                }
+
+                const auto t2 = std::chrono::high_resolution_clock::now();
+
+                t_ref_us   += std::chrono::duration<double, std::micro>(t1 - t0).count();
+                t_fused_us += std::chrono::duration<double, std::micro>(t2 - t1).count();
+
+                const llama_token id_ref   = cur_p_ref.data[cur_p_ref.selected].id;
+                const llama_token id_fused = cur_p_fused.data[cur_p_fused.selected].id;
+
+                if (id_ref != id_fused) {
+                    n_diff++;
+                }
+
+                // same seed, without the fused param
+                if (sample(chain_plain, logits, cur_fused) == id_ref) {
+                    n_same++;
+                }
+
+                // keep the state of the chains in sync (penalties)
+                llama_sampler_accept(chain_ref,   id_ref);
+                llama_sampler_accept(chain_plain, id_ref);
+                llama_sampler_accept(chain_fused, id_ref);
+            }
+
+            fprintf(stderr, "n_vocab = %6d, %-36s: reference %8.1f us, fused %8.1f us, speedup %5.1fx, mismatches %d/%d, same seed %d/%d\n",
+                    n_vocab, cfg.name, t_ref_us/n_rounds, t_fused_us/n_rounds, t_ref_us/t_fused_us, n_diff, n_rounds, n_same, n_rounds);
+
+            n_mismatch += n_diff;
+            n_total    += n_rounds;
+            n_seed     += n_rounds - n_same;
+
+            llama_sampler_free(chain_ref);
+            llama_sampler_free(chain_plain);
+            llama_sampler_free(chain_fused);
+        }
+    }
+
+    // the probabilities are normalized in a different order, which can move a random draw across the edge of two tokens
+    const bool ok = n_mismatch <= n_total/50 && n_seed == 0;
+
+    fprintf(stderr, "%s\n", ok ? "OK" : "FAILED");
+
+    return ok ? 0 : 1;
+}
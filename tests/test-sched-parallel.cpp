@@ -0,0 +1,223 @@
+// checks the parallel execution of the graph splits of ggml_backend_sched, with two CPU backends that have their own threadpools
+//   each backend computes a chain of layers, the second one writes a row of a tensor outside of the compute buffers (like the
+//   KV cache) in each layer and the first one reads the rows written by the previous layers
+//   the results must match the sequential execution, and the chains must overlap: they contain ops that wait for a while
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static const int n_embd  = 512;
+static const int n_layer = 4;
+static const int wait_ms = 20;
+
+// copy of the source that takes a while, without using the CPU
+static void slow_copy(ggml_tensor * dst, const ggml_tensor * a, int ith, int /* nth */, void * /* userdata */) {
+    if (ith == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+        memcpy(dst->data, a->data, ggml_nbytes(a));
+    }
+}
+
+struct test_model {
+    ggml_context * ctx = nullptr;
+    ggml_backend_buffer_t buf = nullptr;
+
+    ggml_tensor * x     = nullptr;
+    ggml_tensor * cache = nullptr;
+    std::vector<ggml_tensor *> w0;
+    std::vector<ggml_tensor *> w1;
+};
+
+struct test_graph {
+    ggml_context * ctx = nullptr;
+    ggml_cgraph  * gf  = nullptr;
+    ggml_tensor  * out = nullptr;
+
+    std::vector<ggml_tensor *> nodes[2]; // nodes computed by each backend
+};
+
+static test_graph build_graph(const test_model & model) {
+    test_graph g;
+
+    ggml_init_params params = {
+        /* .mem_size   = */ ggml_tensor_overhead()*1024 + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    g.ctx = ggml_init(params);
+    g.gf  = ggml_new_graph(g.ctx);
+
+    ggml_tensor * a = model.x;
+    ggml_tensor * b = model.x;
+    for (int il = 0; il < n_layer; il++) {
+        ggml_tensor * b0 = ggml_mul(g.ctx, b, model.w1[il]);
+        ggml_tensor * b1 = ggml_tanh(g.ctx, b0);
+        b = ggml_map_custom1(g.ctx, b1, slow_copy, 1, nullptr);
+        ggml_tensor * kv = ggml_cpy(g.ctx, b, ggml_view_1d(g.ctx, model.cache, n_embd, il*model.cache->nb[1]));
+
+        g.nodes[1].insert(g.nodes[1].end(), { b0, b1, b, kv });
+
+        ggml_build_forward_expand(g.gf, kv);
+
+        ggml_tensor * a0 = ggml_mul(g.ctx, a, model.w0[il]);
+        a = ggml_map_custom1(g.ctx, a0, slow_copy, 1, nullptr);
+        g.nodes[0].insert(g.nodes[0].end(), { a0, a });
+        if (il > 0) {
+            // read back the rows of the cache written by the previous layers
+            ggml_tensor * rows = ggml_view_2d(g.ctx, model.cache, n_embd, il, model.cache->nb[1], 0);
+            ggml_tensor * s    = ggml_reshape_1d(g.ctx, ggml_sum_rows(g.ctx, ggml_cont(g.ctx, ggml_transpose(g.ctx, rows))), n_embd);
+
+            a = ggml_add(g.ctx, a, ggml_scale(g.ctx, s, 0.1f));
+            g.nodes[0].push_back(a);
+        }
+        ggml_build_forward_expand(g.gf, a);
+    }
+
+    // joined after both chains, in a split of its own
+    g.out = ggml_add(g.ctx, b, a);
+    g.nodes[1].push_back(g.out);
+    ggml_set_output(g.out);
+    ggml_build_forward_expand(g.gf, g.out);
+
+    return g;
+}
+
+// computes a new graph n_rep times, returns the result and the average time
+static std::vector<float> run(ggml_backend_t * backends, const test_model & model, bool parallel, int n_rep, double & t_ms, int & n_splits) {
+    ggml_backend_sched_t sched = ggml_backend_sched_new(backends, nullptr, 2, GGML_DEFAULT_GRAPH_SIZE, false, false);
+    ggml_backend_sched_set_parallel_splits(sched, parallel);
+
+    std::vector<float> res;
+    std::vector<float> zeros(ggml_nelements(model.cache), 0.0f);
+
+    t_ms = 0.0;
+
+    for (int r = 0; r < n_rep; r++) {
+        test_graph g = build_graph(model);
+
+        ggml_backend_sched_reset(sched);
+        for (int i = 0; i < 2; i++) {
+            for (ggml_tensor * t : g.nodes[i]) {
+                ggml_backend_sched_set_tensor_backend(sched, t, backends[i]);
+            }
+        }
+        GGML_ASSERT(ggml_backend_sched_alloc_graph(sched, g.gf));
+
+        n_splits = ggml_backend_sched_get_n_splits(sched);
+
+        ggml_backend_tensor_set(model.cache, zeros.data(), 0, ggml_nbytes(model.cache));
+
+        const auto t0 = std::chrono::high_resolution_clock::now();
+        GGML_ASSERT(ggml_backend_sched_graph_compute(sched, g.gf) == GGML_STATUS_SUCCESS);
+        const auto t1 = std::chrono::high_resolution_clock::now();
+
+        t_ms += std::chrono::duration<double, std::milli>(t1 - t0).count()/n_rep;
+
+        std::vector<float> cur(ggml_nelements(g.out));
+        ggml_backend_tensor_get(g.out, cur.data(), 0, ggml_nbytes(g.out));
+
+        ggml_free(g.ctx);
+
+        if (r > 0 && memcmp(cur.data(), res.data(), res.size()*sizeof(float)) != 0) {
+            fprintf(stderr, "%s: the result changed between two runs\n", __func__);
+            res.clear();
+            break;
+        }
+        res = cur;
+    }
+
+    ggml_backend_sched_free(sched);
+
+    return res;
+}
+
+int main(void) {
+    const int n_cpus    = std::max(2u, std::thread::hardware_concurrency());
+    const int n_threads = std::max(1, std::min(4, n_cpus/2));
+
+    // two CPU backends with threadpools on disjoint sets of cores
+    ggml_backend_t    backends[2];
+    ggml_threadpool_t threadpools[2];
+    for (int i = 0; i < 2; i++) {
+        ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+        if ((int) std::thread::hardware_concurrency() >= 2*n_threads) {
+            for (int c = 0; c < n_threads; c++) {
+                tpp.cpumask[i*n_threads + c] = true;
+            }
+        }
+        threadpools[i] = ggml_threadpool_new(&tpp);
+        backends[i]    = ggml_backend_cpu_init();
+        ggml_backend_cpu_set_n_threads(backends[i], n_threads);
+        ggml_backend_cpu_set_threadpool(backends[i], threadpools[i]);
+    }
+
+    test_model model;
+    {
+        ggml_init_params params = {
+            /* .mem_size   = */ ggml_tensor_overhead()*(2*n_layer + 2),
+            /* .mem_buffer = */ NULL,
+            /* .no_alloc   = */ true,
+        };
+        model.ctx   = ggml_init(params);
+        model.x     = ggml_new_tensor_1d(model.ctx, GGML_TYPE_F32, n_embd);
+        model.cache = ggml_new_tensor_2d(model.ctx, GGML_TYPE_F32, n_embd, n_layer);
+        for (int il = 0; il < n_layer; il++) {
+            model.w0.push_back(ggml_new_tensor_1d(model.ctx, GGML_TYPE_F32, n_embd));
+            model.w1.push_back(ggml_new_tensor_1d(model.ctx, GGML_TYPE_F32, n_embd));
+        }
+        model.buf = ggml_backend_alloc_ctx_tensors(model.ctx, backends[0]);
+
+        int seed = 0;
+        for (ggml_tensor * t = ggml_get_first_tensor(model.ctx); t != nullptr; t = ggml_get_next_tensor(model.ctx, t), seed++) {
+            std::vector<float> data(ggml_nelements(t));
+            for (size_t i = 0; i < data.size(); i++) {
+                data[i] = std::sin(0.01f*i + seed);
+            }
+            ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+        }
+    }
+
+    double t_seq_ms = 0.0;
+    double t_par_ms = 0.0;
+    int n_splits_seq = 0;
+    int n_splits_par = 0;
+
+    const std::vector<float> res_seq = run(backends, model, false, 3, t_seq_ms, n_splits_seq);
+    const std::vector<float> res_par = run(backends, model, true,  3, t_par_ms, n_splits_par);
+
+    int n_failed = 0;
+
+    if (res_seq.empty() || res_par.size() != res_seq.size() || memcmp(res_seq.data(), res_par.data(), res_seq.size()*sizeof(float)) != 0) {
+        fprintf(stderr, "%s: the results of the parallel splits differ from the sequential ones\n", __func__);
+        n_failed++;
+    }
+
+    // each chain waits for wait_ms in each layer
+    if (t_par_ms > 0.75*t_seq_ms) {
+        fprintf(stderr, "%s: the splits did not run in parallel\n", __func__);
+        n_failed++;
+    }
+
+    fprintf(stderr, "%s: %d splits, sequential %.1f ms, parallel %.1f ms\n", __func__, n_splits_par, t_seq_ms, t_par_ms);
+
+    ggml_backend_buffer_free(model.buf);
+    ggml_free(model.ctx);
+    for (int i = 0; i < 2; i++) {
+        ggml_backend_free(backends[i]);
+        ggml_threadpool_free(threadpools[i]);
+    }
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
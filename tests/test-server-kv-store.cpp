@@ -0,0 +1,139 @@
+// checks the spill store of the server:
+//   the states over the budget are written to disk in the background and read back on demand
+//   the states that cannot be written are dropped
+
+#include "utils.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <thread>
+
+static int n_failed = 0;
+
+static void check(bool ok, const char * name) {
+    fprintf(stderr, "%s: %-40s %s\n", __func__, name, ok ? "" : "- FAILED");
+    if (!ok) {
+        n_failed++;
+    }
+}
+
+static ggml_backend_buffer_ptr make_data(const server_kv_store & store, size_t n, uint8_t seed) {
+    ggml_backend_buffer_ptr buf = store.alloc(n);
+    uint8_t * data = (uint8_t *) ggml_backend_buffer_get_base(buf.get());
+    for (size_t i = 0; i < n; i++) {
+        data[i] = (uint8_t) (seed + i*7);
+    }
+    return buf;
+}
+
+static bool check_data(const ggml_backend_buffer_ptr & buf, size_t n, uint8_t seed) {
+    if (!buf || ggml_backend_buffer_get_size(buf.get()) < n) {
+        return false;
+    }
+    const uint8_t * data = (const uint8_t *) ggml_backend_buffer_get_base(buf.get());
+    for (size_t i = 0; i < n; i++) {
+        if (data[i] != (uint8_t) (seed + i*7)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int n_spill_files(const std::string & dir) {
+    int n = 0;
+    for (const auto & it : std::filesystem::directory_iterator(dir)) {
+        if (it.path().filename().string().rfind("kv-spill-", 0) == 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static const size_t n_bytes = 4096;
+
+static void test_spill(const std::string & dir) {
+    const std::vector<common_adapter_lora_info> lora;
+
+    server_kv_store store;
+    store.init(2*n_bytes, dir);
+
+    store.add({ 1, 2, 3 },       lora, make_data(store, n_bytes, 1), n_bytes);
+    store.add({ 4, 5, 6 },       lora, make_data(store, n_bytes, 2), n_bytes);
+    store.add({ 7, 8, 9, 10 },   lora, make_data(store, n_bytes, 3), n_bytes); // the first state goes to disk
+    store.add({ 1, 2, 3, 4, 5 }, lora, make_data(store, n_bytes, 4), n_bytes); // replaces the first state, the second one goes to disk
+
+    check(store.n_entries() == 3, "extended state replaced");
+
+    // the state that was written to disk
+    {
+        const auto res = store.find({ 4, 5, 6, 7 }, lora);
+        check(res.seq_id >= 0 && res.n_tokens == 3, "find spilled state");
+
+        std::atomic<int> n_done{0};
+        store.prefetch(res.seq_id, [&]() { n_done++; });
+
+        // the reading thread calls on_done before its result is ready
+        while (n_done == 0 || !store.ready(res.seq_id)) {
+            std::this_thread::yield();
+        }
+        check(n_done == 1, "prefetch done");
+
+        llama_tokens            tokens;
+        ggml_backend_buffer_ptr buf;
+        size_t                  n = 0;
+        check(store.take(res.seq_id, tokens, buf, n), "take spilled state");
+        check(tokens == llama_tokens({ 4, 5, 6 }) && n == n_bytes && check_data(buf, n, 2), "spilled state data");
+    }
+
+    // the state in host memory
+    {
+        const auto res = store.find({ 1, 2, 3, 4, 5, 6 }, lora);
+        check(res.seq_id >= 0 && res.n_tokens == 5, "find state in memory");
+
+        llama_tokens            tokens;
+        ggml_backend_buffer_ptr buf;
+        size_t                  n = 0;
+        check(store.take(res.seq_id, tokens, buf, n), "take state in memory");
+        check(n == n_bytes && check_data(buf, n, 4), "state in memory data");
+
+        check(!store.take(res.seq_id, tokens, buf, n), "take twice");
+    }
+
+    check(store.n_entries() == 1, "entries left");
+    check(n_spill_files(dir) == 0, "files of the taken states removed");
+}
+
+// the states that do not fit in the budget are dropped when they cannot be written
+static void test_write_failed(const std::string & dir) {
+    const std::vector<common_adapter_lora_info> lora;
+
+    server_kv_store store;
+    store.init(n_bytes, dir);
+
+    store.add({ 1, 2, 3 }, lora, make_data(store, n_bytes, 1), n_bytes);
+    store.add({ 4, 5, 6 }, lora, make_data(store, n_bytes, 2), n_bytes);
+
+    // wait for the write to fail
+    const auto res = store.find({ 1, 2, 3 }, lora);
+    store.prefetch(res.seq_id);
+    while (!store.ready(res.seq_id)) {
+        std::this_thread::yield();
+    }
+
+    check(store.find({ 1, 2, 3 }, lora).seq_id < 0, "failed write dropped");
+    check(store.find({ 4, 5, 6 }, lora).seq_id >= 0, "state in memory kept");
+    check(store.n_entries() == 1, "entries left after failed write");
+}
+
+int main(void) {
+    test_spill("./");
+    test_write_failed("./does-not-exist/");
+
+    // the files are removed with the store
+    check(n_spill_files("./") == 0, "no files left");
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
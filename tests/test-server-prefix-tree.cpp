@@ -0,0 +1,103 @@
+// checks the radix tree of the server over the cached token prefixes of the sequences:
+//   find() must return the sequence with the longest common prefix, preferring the shortest cached prompt
+//   set() and remove() must keep the tree consistent, find_lru() must return the least recently used tail
+
+#include "utils.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+static int n_failed = 0;
+
+static void check_find(
+        server_prefix_tree & tree, const char * name, const llama_tokens & tokens, const server_prefix_tree::seq_filter & filter,
+        llama_seq_id seq_id_ref, int32_t n_tokens_ref) {
+    const auto res = tree.find(tokens, filter);
+    const bool ok = res.seq_id == seq_id_ref && res.n_tokens == n_tokens_ref;
+    fprintf(stderr, "%s: %-32s seq %2d, %2d tokens %s\n", __func__, name, res.seq_id, res.n_tokens, ok ? "" : "- FAILED");
+    if (!ok) {
+        fprintf(stderr, "%s: expected seq %d, %d tokens\n", __func__, seq_id_ref, n_tokens_ref);
+        n_failed++;
+    }
+}
+
+static void check_lru(const server_prefix_tree & tree, const char * name, const server_prefix_tree::seq_filter & filter, llama_seq_id seq_id_ref) {
+    const auto * nd = tree.find_lru(filter);
+    const llama_seq_id seq_id = nd == nullptr || nd->seqs.size() != 1 ? -1 : *nd->seqs.begin();
+    const bool ok = seq_id == seq_id_ref;
+    fprintf(stderr, "%s: %-32s seq %2d %s\n", __func__, name, seq_id, ok ? "" : "- FAILED");
+    if (!ok) {
+        fprintf(stderr, "%s: expected seq %d\n", __func__, seq_id_ref);
+        n_failed++;
+    }
+}
+
+// the time of last use of the nodes is in microseconds
+static void tick() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+}
+
+int main(void) {
+    const auto all = [](llama_seq_id) { return true; };
+
+    server_prefix_tree tree;
+
+    // [1 2 3] -> [4 5] -> [6 7]
+    //         -> [9]
+    tree.set(0, { 1, 2, 3, 4, 5 });
+    tick();
+    tree.set(1, { 1, 2, 3, 9 });
+    tick();
+    tree.set(2, { 1, 2, 3, 4, 5, 6, 7 });
+    tick();
+
+    check_find(tree, "longest prefix",      { 1, 2, 3, 4, 5, 6, 8 }, all, 2, 6);
+    check_find(tree, "shortest cached",     { 1, 2, 3, 4, 5 },       all, 0, 5);
+    check_find(tree, "shortest cached (2)", { 1, 2, 3, 4, 8 },       all, 0, 4);
+    check_find(tree, "other branch",        { 1, 2, 3, 9, 9 },       all, 1, 4);
+    check_find(tree, "no match",            { 7, 1, 2 },             all, -1, 0);
+    check_find(tree, "empty prompt",        { },                     all, -1, 0);
+
+    check_find(tree, "filter: skip longest", { 1, 2, 3, 4, 5, 6, 7 }, [](llama_seq_id id) { return id != 2; }, 0, 5);
+    check_find(tree, "filter: other branch", { 1, 2, 3, 4, 5 },       [](llama_seq_id id) { return id == 1; }, 1, 3);
+    check_find(tree, "filter: none",         { 1, 2, 3, 4, 5 },       [](llama_seq_id)    { return false;   }, -1, 0);
+
+    // seq 1 was the last one used by find(), the tail of seq 2 is the least recently used
+    tick();
+    check_find(tree, "touch seq 1", { 1, 2, 3, 9 }, [](llama_seq_id id) { return id == 1; }, 1, 4);
+    check_lru(tree, "lru",            all,                                             2);
+    check_lru(tree, "lru: filter",    [](llama_seq_id id) { return id != 2; },         1);
+    check_lru(tree, "lru: none",      [](llama_seq_id)    { return false; },           -1);
+
+    // evict the least recently used sequence, the tail of seq 0 becomes the most recently used one
+    tree.remove(2);
+    tick();
+    check_find(tree, "evicted",        { 1, 2, 3, 4, 5, 6, 7 }, all, 0, 5);
+    check_lru(tree, "lru after evict", all,                            1);
+
+    // replacing the tokens of a sequence moves it to another branch
+    tree.set(0, { 1, 2, 8 });
+    check_find(tree, "replaced",       { 1, 2, 3, 4, 5 }, all, 1, 3);
+    check_find(tree, "replaced (2)",   { 1, 2, 8, 4 },    all, 0, 3);
+
+    // only the leading text tokens are indexed
+    tree.set(3, { 5, 6, LLAMA_TOKEN_NULL, 7 });
+    check_find(tree, "text tokens",    { 5, 6, 7 }, all, 3, 2);
+
+    // the sequence with the lowest id is not the best candidate
+    tree.set(5, { 1, 2, 3, 4, 5, 6 });
+    tree.set(6, { 1, 2, 3, 4 });
+    check_find(tree, "shortest cached (3)", { 1, 2, 3, 4 },       all, 6, 4);
+    check_find(tree, "longest prefix (2)",  { 1, 2, 3, 4, 5, 9 }, all, 5, 5);
+
+    for (llama_seq_id id : { 0, 1, 3, 5, 6 }) {
+        tree.remove(id);
+    }
+    check_find(tree, "all removed",    { 1, 2, 3 }, all, -1, 0);
+    check_lru(tree, "lru all removed", all,              -1);
+
+    fprintf(stderr, "%s\n", n_failed == 0 ? "OK" : "FAILED");
+
+    return n_failed == 0 ? 0 : 1;
+}
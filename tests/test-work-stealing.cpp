@@ -0,0 +1,148 @@
+// checks the scheduling of the CPU threadpool
+//   the graph computed with the work-stealing chunks and the skipped barriers must give the same results as the static
+//   split of the work between the threads and as a single thread, for several numbers of threads
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+struct sched_config {
+    const char * name;
+    bool work_stealing;
+    bool skip_barriers;
+};
+
+static void fill(ggml_tensor * t, float scale) {
+    float * data = (float *) t->data;
+    for (int64_t i = 0; i < ggml_nelements(t); i++) {
+        data[i] = scale*std::sin(0.1f*i);
+    }
+}
+
+// the results of each config are checked after every round, a race between the threads does not always show up
+static const int n_rounds = 4;
+
+int main(void) {
+    // odd sizes, so that the chunks of the threads are not all the same
+    const int n_embd   = 320;
+    const int n_ff     = 704;
+    const int n_tokens = 13;
+    const int n_head   = 5;
+    const int n_layer  = 4;
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 512*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+    fill(x, 1.0f);
+
+    ggml_tensor * cur = x;
+
+    // a simplified transformer: heavy matrix multiplications mixed with many small independent element-wise ops
+    for (int il = 0; il < n_layer; il++) {
+        ggml_tensor * wq = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_embd);
+        ggml_tensor * wk = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_embd);
+        ggml_tensor * w1 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_ff);
+        ggml_tensor * w2 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_ff, n_embd);
+        ggml_tensor * bq = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+        ggml_tensor * bk = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+
+        fill(wq, 0.05f);
+        fill(wk, 0.04f);
+        fill(w1, 0.03f);
+        fill(w2, 0.02f);
+        fill(bq, 0.1f);
+        fill(bk, 0.2f);
+
+        ggml_tensor * q = ggml_add(ctx, ggml_mul_mat(ctx, wq, cur), bq);
+        ggml_tensor * k = ggml_add(ctx, ggml_mul_mat(ctx, wk, cur), bk);
+
+        q = ggml_scale(ctx, q, 0.125f);
+        k = ggml_cont(ctx, ggml_permute(ctx, ggml_reshape_3d(ctx, k, n_embd/n_head, n_head, n_tokens), 0, 2, 1, 3));
+        q = ggml_cont(ctx, ggml_permute(ctx, ggml_reshape_3d(ctx, q, n_embd/n_head, n_head, n_tokens), 0, 2, 1, 3));
+
+        ggml_tensor * kq = ggml_soft_max(ctx, ggml_mul_mat(ctx, k, q));
+
+        ggml_tensor * kqv = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, k)), kq);
+        kqv = ggml_cont(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3));
+
+        cur = ggml_add(ctx, cur, ggml_reshape_2d(ctx, kqv, n_embd, n_tokens));
+
+        ggml_tensor * ff = ggml_gelu(ctx, ggml_mul_mat(ctx, w1, cur));
+        cur = ggml_add(ctx, cur, ggml_mul_mat(ctx, w2, ff));
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, cur);
+
+    const sched_config configs[] = {
+        { "static",                        false, false },
+        { "work stealing",                 true,  false },
+        { "work stealing + skip barriers", true,  true  },
+    };
+
+    // single thread reference
+    std::vector<float> ref;
+    {
+        ggml_cplan cplan = ggml_graph_plan(gf, 1, nullptr);
+
+        std::vector<uint8_t> work_data(cplan.work_size);
+        cplan.work_data = work_data.data();
+
+        if (ggml_graph_compute(gf, &cplan) != GGML_STATUS_SUCCESS) {
+            fprintf(stderr, "%s: graph compute failed\n", __func__);
+            return 1;
+        }
+
+        const float * out = (const float *) cur->data;
+        ref.assign(out, out + ggml_nelements(cur));
+    }
+
+    int n_failed = 0;
+
+    for (int n_threads : { 2, 3, 4 }) {
+        ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+        ggml_threadpool * threadpool = ggml_threadpool_new(&tpp);
+        if (!threadpool) {
+            fprintf(stderr, "threadpool create failed : n_threads %d\n", n_threads);
+            return 1;
+        }
+
+        for (const auto & cfg : configs) {
+            ggml_cplan cplan = ggml_graph_plan(gf, n_threads, threadpool);
+
+            std::vector<uint8_t> work_data(cplan.work_size);
+            cplan.work_data     = work_data.data();
+            cplan.work_stealing = cfg.work_stealing;
+            cplan.skip_barriers = cfg.skip_barriers;
+
+            // every element is computed by a single thread in all configs, so the results must match exactly
+            bool ok = true;
+            for (int i = 0; i < n_rounds && ok; i++) {
+                memset(cur->data, 0, ggml_nbytes(cur));
+
+                ok = ggml_graph_compute(gf, &cplan) == GGML_STATUS_SUCCESS &&
+                     memcmp(ref.data(), cur->data, ref.size()*sizeof(float)) == 0;
+            }
+
+            fprintf(stderr, "n_threads = %d, %-30s: %s\n", n_threads, cfg.name, ok ? "OK" : "FAILED");
+
+            n_failed += ok ? 0 : 1;
+        }
+
+        ggml_threadpool_free(threadpool);
+    }
+
+    ggml_free(ctx);
+
+    return n_failed == 0 ? 0 : 1;
+}
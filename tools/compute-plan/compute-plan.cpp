@@ -0,0 +1,222 @@
+// size of the compute buffers of a model for a range of context and ubatch sizes
+//   the allocation plan of each configuration (offset, size and lifetime of each tensor) can be written as JSON
+
+#include "common.h"
+#include "llama.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+struct cmd_params {
+    std::string model;
+
+    std::vector<int> n_ctx    = { 512, 4096 };
+    std::vector<int> n_ubatch = { 128, 512 };
+    std::vector<int> reorder  = { 0 };
+
+    int  n_gpu_layers = 0;
+    bool flash_attn   = false;
+
+    std::string dump; // prefix of the files of the allocation plans
+
+    std::string output = "md";
+};
+
+static std::vector<std::string> transform(const std::vector<int> & values) {
+    std::vector<std::string> res;
+    for (int v : values) {
+        res.push_back(std::to_string(v));
+    }
+    return res;
+}
+
+static void print_usage(int /* argc */, char ** argv) {
+    const cmd_params defaults;
+
+    printf("usage: %s -m <model> [options]\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help\n");
+    printf("  -m, --model <filename>          model file\n");
+    printf("  -c, --ctx-size <n>              context size (default: %s)\n", string_join(transform(defaults.n_ctx), ",").c_str());
+    printf("  -ub, --ubatch-size <n>          physical batch size (default: %s)\n", string_join(transform(defaults.n_ubatch), ",").c_str());
+    printf("  -ngl, --n-gpu-layers <n>        number of layers to offload (default: %d)\n", defaults.n_gpu_layers);
+    printf("  -fa, --flash-attn <0|1>         use flash attention (default: %d)\n", defaults.flash_attn);
+    printf("  --reorder <0|1>                 reorder the compute graphs to reduce the memory (default: %s)\n", string_join(transform(defaults.reorder), ",").c_str());
+    printf("  --dump <prefix>                 write the allocation plan of each configuration to <prefix>-c<n>-ub<n>-r<0|1>.json\n");
+    printf("  -o, --output <md|json>          output format printed to stdout (default: %s)\n", defaults.output.c_str());
+    printf("\n");
+    printf("Multiple values can be given for -c, -ub and --reorder by separating them with ','\n");
+    printf("or by specifying the parameter multiple times.\n");
+}
+
+static bool parse_cmd_params(int argc, char ** argv, cmd_params & params) {
+    bool n_ctx_set    = false;
+    bool n_ubatch_set = false;
+    bool reorder_set  = false;
+
+    auto parse_list = [](const std::string & value, std::vector<int> & dst, bool & is_set, int min_value) {
+        if (!is_set) {
+            dst.clear();
+            is_set = true;
+        }
+        for (int v : string_split<int>(value, ',')) {
+            if (v < min_value) {
+                fprintf(stderr, "error: invalid value %d\n", v);
+                return false;
+            }
+            dst.push_back(v);
+        }
+        return true;
+    };
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        const std::string value = argv[++i];
+
+        if (arg == "-m" || arg == "--model") {
+            params.model = value;
+        } else if (arg == "-c" || arg == "--ctx-size") {
+            if (!parse_list(value, params.n_ctx, n_ctx_set, 1)) {
+                return false;
+            }
+        } else if (arg == "-ub" || arg == "--ubatch-size") {
+            if (!parse_list(value, params.n_ubatch, n_ubatch_set, 1)) {
+                return false;
+            }
+        } else if (arg == "--reorder") {
+            if (!parse_list(value, params.reorder, reorder_set, 0)) {
+                return false;
+            }
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            params.n_gpu_layers = std::stoi(value);
+        } else if (arg == "-fa" || arg == "--flash-attn") {
+            params.flash_attn = std::stoi(value) != 0;
+        } else if (arg == "--dump") {
+            params.dump = value;
+        } else if (arg == "-o" || arg == "--output") {
+            if (value != "md" && value != "json") {
+                fprintf(stderr, "error: unknown output format '%s'\n", value.c_str());
+                return false;
+            }
+            params.output = value;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    if (params.model.empty()) {
+        fprintf(stderr, "error: no model file given\n");
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    cmd_params params;
+    if (!parse_cmd_params(argc, argv, params)) {
+        print_usage(argc, argv);
+        return 1;
+    }
+
+    llama_log_set([](ggml_log_level level, const char * text, void * /* user_data */) {
+        if (level == GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.n_gpu_layers = params.n_gpu_layers;
+
+    llama_model * model = llama_model_load_from_file(params.model.c_str(), mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "error: failed to load model '%s'\n", params.model.c_str());
+        return 1;
+    }
+
+    if (params.output == "md") {
+        printf("| %8s | %8s | %7s | %12s |\n", "n_ctx", "n_ubatch", "reorder", "compute MiB");
+        printf("| %s | %s | %s | %s |\n",
+                std::string(7, '-').append(":").c_str(), std::string(7, '-').append(":").c_str(),
+                std::string(6, '-').append(":").c_str(), std::string(11, '-').append(":").c_str());
+    }
+
+    json results = json::array();
+
+    int n_failed = 0;
+
+    for (int n_ctx : params.n_ctx) {
+        for (int n_ubatch : params.n_ubatch) {
+            for (int reorder : params.reorder) {
+                auto cparams = llama_context_default_params();
+                cparams.n_ctx         = n_ctx;
+                cparams.n_batch       = std::min(n_ubatch, n_ctx);
+                cparams.n_ubatch      = std::min(n_ubatch, n_ctx);
+                cparams.flash_attn    = params.flash_attn;
+                cparams.graph_reorder = reorder != 0;
+
+                llama_context * ctx = llama_init_from_model(model, cparams);
+                if (ctx == nullptr) {
+                    fprintf(stderr, "error: failed to create a context with n_ctx = %d, n_ubatch = %d\n", n_ctx, n_ubatch);
+                    n_failed++;
+                    continue;
+                }
+
+                const size_t size = llama_get_compute_buffer_size(ctx);
+
+                std::string fname;
+                if (!params.dump.empty()) {
+                    fname = params.dump + "-c" + std::to_string(n_ctx) + "-ub" + std::to_string(n_ubatch) + "-r" + std::to_string(reorder != 0) + ".json";
+                    if (!llama_dump_compute_plan(ctx, fname.c_str())) {
+                        n_failed++;
+                    }
+                }
+
+                if (params.output == "md") {
+                    printf("| %8d | %8d | %7d | %12.2f |\n", n_ctx, (int) llama_n_ubatch(ctx), reorder != 0, size/1024.0/1024.0);
+                    fflush(stdout);
+                } else {
+                    results.push_back({
+                        { "n_ctx",         n_ctx                },
+                        { "n_ubatch",      llama_n_ubatch(ctx)  },
+                        { "reorder",       reorder != 0         },
+                        { "compute_bytes", size                 },
+                        { "plan",          fname                },
+                    });
+                }
+
+                llama_free(ctx);
+            }
+        }
+    }
+
+    if (params.output == "json") {
+        printf("%s\n", results.dump(4).c_str());
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    return n_failed == 0 ? 0 : 1;
+}
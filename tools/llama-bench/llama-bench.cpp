@@ -245,6 +245,7 @@ struct cmd_params {
     std::vector<int>                 n_ubatch;
     std::vector<ggml_type>           type_k;
     std::vector<ggml_type>           type_v;
+    std::vector<std::vector<llama_kv_cache_layer_type>> type_layers;
     std::vector<float>               defrag_thold;
     std::vector<int>                 n_threads;
     std::vector<std::string>         cpu_mask;
@@ -261,12 +262,14 @@ struct cmd_params {
     std::vector<bool>                use_mmap;
     std::vector<bool>                embeddings;
     std::vector<bool>                no_op_offload;
+    std::vector<bool>                graph_reuse;
     ggml_numa_strategy               numa;
     int                              reps;
     ggml_sched_priority              prio;
     int                              delay;
     bool                             verbose;
     bool                             progress;
+    std::string                      profile;
     output_formats                   output_format;
     output_formats                   output_format_stderr;
 };
@@ -281,6 +284,7 @@ static const cmd_params cmd_params_defaults = {
     /* n_ubatch             */ { 512 },
     /* type_k               */ { GGML_TYPE_F16 },
     /* type_v               */ { GGML_TYPE_F16 },
+    /* type_layers          */ { {} },
     /* defrag_thold         */ { -1.0f },
     /* n_threads            */ { cpu_get_num_math() },
     /* cpu_mask             */ { "0x0" },
@@ -297,12 +301,14 @@ static const cmd_params cmd_params_defaults = {
     /* use_mmap             */ { true },
     /* embeddings           */ { false },
     /* no_op_offload        */ { false },
+    /* graph_reuse          */ { false },
     /* numa                 */ GGML_NUMA_STRATEGY_DISABLED,
     /* reps                 */ 5,
     /* prio                 */ GGML_SCHED_PRIO_NORMAL,
     /* delay                */ 0,
     /* verbose              */ false,
     /* progress             */ false,
+    /* profile              */ "",
     /* output_format        */ MARKDOWN,
     /* output_format_stderr */ NONE,
 };
@@ -312,7 +318,7 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("\n");
     printf("options:\n");
     printf("  -h, --help\n");
-    printf("  --numa <distribute|isolate|numactl>       numa mode (default: disabled)\n");
+    printf("  --numa <distribute|isolate|numactl|mirror> numa mode (default: disabled)\n");
     printf("  -r, --repetitions <n>                     number of times to repeat each test (default: %d)\n",
            cmd_params_defaults.reps);
     printf("  --prio <-1|0|1|2|3>                          process/thread priority (default: %d)\n",
@@ -325,6 +331,8 @@ static void print_usage(int /* argc */, char ** argv) {
            output_format_str(cmd_params_defaults.output_format_stderr));
     printf("  -v, --verbose                             verbose output\n");
     printf("  --progress                                print test progress indicators\n");
+    printf("  --profile <prefix>                        profile the graphs of each test, write the trace to <prefix>-<n>.json\n");
+    printf("                                            and print a summary to stderr (default: disabled)\n");
     printf("\n");
     printf("test parameters:\n");
     printf("  -m, --model <filename>                    (default: %s)\n", join(cmd_params_defaults.model, ",").c_str());
@@ -343,6 +351,7 @@ static void print_usage(int /* argc */, char ** argv) {
            join(transform_to_str(cmd_params_defaults.type_k, ggml_type_name), ",").c_str());
     printf("  -ctv, --cache-type-v <t>                  (default: %s)\n",
            join(transform_to_str(cmd_params_defaults.type_v, ggml_type_name), ",").c_str());
+    printf("  -ctl, --cache-type-layers <i..j=t;...>    (default: none)\n");
     printf("  -dt, --defrag-thold <f>                   (default: %s)\n",
            join(cmd_params_defaults.defrag_thold, ",").c_str());
     printf("  -t, --threads <n>                         (default: %s)\n",
@@ -374,6 +383,8 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -ot --override-tensors <tensor name pattern>=<buffer type>;...\n");
     printf("                                            (default: disabled)\n");
     printf("  -nopo, --no-op-offload <0|1>              (default: 0)\n");
+    printf("  -gr, --graph-reuse <0|1>                  (default: %s)\n",
+           join(cmd_params_defaults.graph_reuse, ",").c_str());
     printf("\n");
     printf(
         "Multiple values can be given for each parameter by separating them with ','\n"
@@ -425,6 +436,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     params.prio                 = cmd_params_defaults.prio;
     params.delay                = cmd_params_defaults.delay;
     params.progress             = cmd_params_defaults.progress;
+    params.profile              = cmd_params_defaults.profile;
 
     for (int i = 1; i < argc; i++) {
         arg = argv[i];
@@ -529,6 +541,30 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                     break;
                 }
                 params.type_v.insert(params.type_v.end(), types.begin(), types.end());
+            } else if (arg == "-ctl" || arg == "--cache-type-layers") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                for (const auto & group : string_split<std::string>(argv[i], split_delim)) {
+                    std::vector<llama_kv_cache_layer_type> types;
+                    for (const auto & item : string_split<std::string>(group, ';')) {
+                        if (item.empty() || item == "none") {
+                            continue;
+                        }
+                        if (!string_parse_kv_layer_type(item.c_str(), types)) {
+                            invalid_param = true;
+                            break;
+                        }
+                    }
+                    if (invalid_param) {
+                        break;
+                    }
+                    if (!types.empty()) {
+                        types.push_back({ 0, 0, GGML_TYPE_COUNT, GGML_TYPE_COUNT });
+                    }
+                    params.type_layers.push_back(types);
+                }
             } else if (arg == "-dt" || arg == "--defrag-thold") {
                 if (++i >= argc) {
                     invalid_param = true;
@@ -628,6 +664,8 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                     params.numa = GGML_NUMA_STRATEGY_ISOLATE;
                 } else if (value == "numactl") {
                     params.numa = GGML_NUMA_STRATEGY_NUMACTL;
+                } else if (value == "mirror") {
+                    params.numa = GGML_NUMA_STRATEGY_MIRROR;
                 } else {
                     invalid_param = true;
                     break;
@@ -660,6 +698,13 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 }
                 auto p = string_split<bool>(argv[i], split_delim);
                 params.no_op_offload.insert(params.no_op_offload.end(), p.begin(), p.end());
+            } else if (arg == "-gr" || arg == "--graph-reuse") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                auto p = string_split<bool>(argv[i], split_delim);
+                params.graph_reuse.insert(params.graph_reuse.end(), p.begin(), p.end());
             } else if (arg == "-ts" || arg == "--tensor-split") {
                 if (++i >= argc) {
                     invalid_param = true;
@@ -798,6 +843,12 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 params.verbose = true;
             } else if (arg == "--progress") {
                 params.progress = true;
+            } else if (arg == "--profile") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.profile = argv[i];
             } else {
                 invalid_param = true;
                 break;
@@ -843,6 +894,9 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.type_v.empty()) {
         params.type_v = cmd_params_defaults.type_v;
     }
+    if (params.type_layers.empty()) {
+        params.type_layers = cmd_params_defaults.type_layers;
+    }
     if (params.defrag_thold.empty()) {
         params.defrag_thold = cmd_params_defaults.defrag_thold;
     }
@@ -879,6 +933,9 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.no_op_offload.empty()) {
         params.no_op_offload = cmd_params_defaults.no_op_offload;
     }
+    if (params.graph_reuse.empty()) {
+        params.graph_reuse = cmd_params_defaults.graph_reuse;
+    }
     if (params.n_threads.empty()) {
         params.n_threads = cmd_params_defaults.n_threads;
     }
@@ -904,6 +961,7 @@ struct cmd_params_instance {
     int                n_ubatch;
     ggml_type          type_k;
     ggml_type          type_v;
+    std::vector<llama_kv_cache_layer_type> type_layers;
     float              defrag_thold;
     int                n_threads;
     std::string        cpu_mask;
@@ -920,6 +978,7 @@ struct cmd_params_instance {
     bool               use_mmap;
     bool               embeddings;
     bool               no_op_offload;
+    bool               graph_reuse;
 
     llama_model_params to_llama_mparams() const {
         llama_model_params mparams = llama_model_default_params();
@@ -986,12 +1045,14 @@ struct cmd_params_instance {
         cparams.n_ubatch     = n_ubatch;
         cparams.type_k       = type_k;
         cparams.type_v       = type_v;
+        cparams.kv_layer_types = type_layers.empty() ? nullptr : type_layers.data();
         cparams.defrag_thold = defrag_thold;
         cparams.offload_kqv  = !no_kv_offload;
         cparams.flash_attn   = flash_attn;
         cparams.embeddings   = embeddings;
         cparams.op_offload   = !no_op_offload;
         cparams.swa_full     = false;
+        cparams.graph_reuse  = graph_reuse;
 
         return cparams;
     }
@@ -1012,10 +1073,12 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
     for (const auto & mmp : params.use_mmap)
     for (const auto & embd : params.embeddings)
     for (const auto & nopo : params.no_op_offload)
+    for (const auto & gr : params.graph_reuse)
     for (const auto & nb : params.n_batch)
     for (const auto & nub : params.n_ubatch)
     for (const auto & tk : params.type_k)
     for (const auto & tv : params.type_v)
+    for (const auto & tl : params.type_layers)
     for (const auto & defrag_thold : params.defrag_thold)
     for (const auto & nkvo : params.no_kv_offload)
     for (const auto & fa : params.flash_attn)
@@ -1037,6 +1100,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
+                /* .type_layers  = */ tl,
                 /* .defrag_thold = */ defrag_thold,
                 /* .n_threads    = */ nt,
                 /* .cpu_mask     = */ cm,
@@ -1053,6 +1117,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .use_mmap     = */ mmp,
                 /* .embeddings   = */ embd,
                 /* .no_op_offload= */ nopo,
+                /* .graph_reuse  = */ gr,
             };
             instances.push_back(instance);
         }
@@ -1070,6 +1135,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
+                /* .type_layers  = */ tl,
                 /* .defrag_thold = */ defrag_thold,
                 /* .n_threads    = */ nt,
                 /* .cpu_mask     = */ cm,
@@ -1086,6 +1152,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .use_mmap     = */ mmp,
                 /* .embeddings   = */ embd,
                 /* .no_op_offload= */ nopo,
+                /* .graph_reuse  = */ gr,
             };
             instances.push_back(instance);
         }
@@ -1103,6 +1170,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
+                /* .type_layers  = */ tl,
                 /* .defrag_thold = */ defrag_thold,
                 /* .n_threads    = */ nt,
                 /* .cpu_mask     = */ cm,
@@ -1119,6 +1187,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .use_mmap     = */ mmp,
                 /* .embeddings   = */ embd,
                 /* .no_op_offload= */ nopo,
+                /* .graph_reuse  = */ gr,
             };
             instances.push_back(instance);
         }
@@ -1145,6 +1214,7 @@ struct test {
     int                      poll;
     ggml_type                type_k;
     ggml_type                type_v;
+    std::vector<llama_kv_cache_layer_type> type_layers;
     float                    defrag_thold;
     int                      n_gpu_layers;
     llama_split_mode         split_mode;
@@ -1156,6 +1226,7 @@ struct test {
     bool                     use_mmap;
     bool                     embeddings;
     bool                     no_op_offload;
+    bool                     graph_reuse;
     int                      n_prompt;
     int                      n_gen;
     int                      n_depth;
@@ -1180,6 +1251,7 @@ struct test {
         poll           = inst.poll;
         type_k         = inst.type_k;
         type_v         = inst.type_v;
+        type_layers    = inst.type_layers;
         defrag_thold   = inst.defrag_thold;
         n_gpu_layers   = inst.n_gpu_layers;
         split_mode     = inst.split_mode;
@@ -1191,6 +1263,7 @@ struct test {
         use_mmap       = inst.use_mmap;
         embeddings     = inst.embeddings;
         no_op_offload  = inst.no_op_offload;
+        graph_reuse    = inst.graph_reuse;
         n_prompt       = inst.n_prompt;
         n_gen          = inst.n_gen;
         n_depth        = inst.n_depth;
@@ -1234,10 +1307,11 @@ struct test {
         static const std::vector<std::string> fields = {
             "build_commit", "build_number", "cpu_info",       "gpu_info",   "backends",     "model_filename",
             "model_type",   "model_size",   "model_n_params", "n_batch",    "n_ubatch",     "n_threads",
-            "cpu_mask",     "cpu_strict",   "poll",           "type_k",     "type_v",       "n_gpu_layers",
+            "cpu_mask",     "cpu_strict",   "poll",           "type_k",     "type_v",       "type_layers",  "n_gpu_layers",
             "split_mode",   "main_gpu",     "no_kv_offload",  "flash_attn", "tensor_split", "tensor_buft_overrides",
             "defrag_thold",
-            "use_mmap",     "embeddings",   "no_op_offload",   "n_prompt",       "n_gen",      "n_depth",      "test_time",
+            "use_mmap",     "embeddings",   "no_op_offload",   "graph_reuse",    "n_prompt",   "n_gen",        "n_depth",
+            "test_time",
             "avg_ns",       "stddev_ns",    "avg_ts",         "stddev_ts",
         };
         return fields;
@@ -1253,7 +1327,7 @@ struct test {
             return INT;
         }
         if (field == "f16_kv" || field == "no_kv_offload" || field == "cpu_strict" || field == "flash_attn" ||
-            field == "use_mmap" || field == "embeddings") {
+            field == "use_mmap" || field == "embeddings" || field == "graph_reuse") {
             return BOOL;
         }
         if (field == "avg_ts" || field == "stddev_ts" || field == "defrag_thold") {
@@ -1299,6 +1373,9 @@ struct test {
                 }
             }
         }
+        // use the same separator as the command line, ',' separates the values of the parameter
+        std::string type_layers_str = type_layers.empty() ? "none" : string_from(type_layers);
+        std::replace(type_layers_str.begin(), type_layers_str.end(), ',', ';');
         std::vector<std::string> values = { build_commit,
                                             std::to_string(build_number),
                                             cpu_info,
@@ -1316,6 +1393,7 @@ struct test {
                                             std::to_string(poll),
                                             ggml_type_name(type_k),
                                             ggml_type_name(type_v),
+                                            type_layers_str,
                                             std::to_string(n_gpu_layers),
                                             split_mode_str(split_mode),
                                             std::to_string(main_gpu),
@@ -1327,6 +1405,7 @@ struct test {
                                             std::to_string(use_mmap),
                                             std::to_string(embeddings),
                                             std::to_string(no_op_offload),
+                                            std::to_string(graph_reuse),
                                             std::to_string(n_prompt),
                                             std::to_string(n_gen),
                                             std::to_string(n_depth),
@@ -1512,6 +1591,9 @@ struct markdown_printer : public printer {
         if (field == "no_op_offload") {
             return 4;
         }
+        if (field == "graph_reuse") {
+            return 2;
+        }
 
         int width = std::max((int) field.length(), 10);
 
@@ -1546,6 +1628,9 @@ struct markdown_printer : public printer {
         if (field == "no_op_offload") {
             return "nopo";
         }
+        if (field == "graph_reuse") {
+            return "gr";
+        }
         if (field == "tensor_split") {
             return "ts";
         }
@@ -1590,6 +1675,9 @@ struct markdown_printer : public printer {
         if (params.type_v.size() > 1 || params.type_v != cmd_params_defaults.type_v) {
             fields.emplace_back("type_v");
         }
+        if (params.type_layers.size() > 1 || !params.type_layers[0].empty()) {
+            fields.emplace_back("type_layers");
+        }
         if (params.defrag_thold.size() > 1 || params.defrag_thold != cmd_params_defaults.defrag_thold) {
             fields.emplace_back("defrag_thold");
         }
@@ -1620,6 +1708,9 @@ struct markdown_printer : public printer {
         if (params.no_op_offload.size() > 1 || params.no_op_offload != cmd_params_defaults.no_op_offload) {
             fields.emplace_back("no_op_offload");
         }
+        if (params.graph_reuse.size() > 1 || params.graph_reuse != cmd_params_defaults.graph_reuse) {
+            fields.emplace_back("graph_reuse");
+        }
         fields.emplace_back("test");
         fields.emplace_back("t/s");
 
@@ -1947,6 +2038,12 @@ int main(int argc, char ** argv) {
             }
         }
 
+        // only the timed runs are profiled
+        ggml_backend_profiler_t profiler = nullptr;
+        if (!params.profile.empty()) {
+            profiler = ggml_backend_profiler_new(1 << 20);
+        }
+
         for (int i = 0; i < params.reps; i++) {
             llama_kv_self_clear(ctx);
 
@@ -1962,6 +2059,10 @@ int main(int argc, char ** argv) {
                 }
             }
 
+            if (profiler) {
+                llama_set_profiler(ctx, profiler);
+            }
+
             uint64_t t_start = get_time_ns();
 
             if (t.n_prompt > 0) {
@@ -1989,6 +2090,19 @@ int main(int argc, char ** argv) {
 
             uint64_t t_ns = get_time_ns() - t_start;
             t.samples_ns.push_back(t_ns);
+
+            if (profiler) {
+                llama_set_profiler(ctx, nullptr);
+            }
+        }
+
+        if (profiler) {
+            const std::string fname = params.profile + "-" + std::to_string(params_idx) + ".json";
+            if (ggml_backend_profiler_write_trace(profiler, fname.c_str())) {
+                fprintf(stderr, "llama-bench: benchmark %d/%zu: profile written to %s\n", params_idx, params_count, fname.c_str());
+            }
+            ggml_backend_profiler_print_summary(profiler, stderr);
+            ggml_backend_profiler_free(profiler);
         }
 
         if (p) {
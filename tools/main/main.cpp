@@ -541,6 +541,37 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // matches all the antiprompts in the text of the tokens accepted by the sampler, each token is fed once
+    std::vector<const char *> antiprompt_cstr;
+    for (const std::string & antiprompt : params.antiprompt) {
+        antiprompt_cstr.push_back(antiprompt.c_str());
+    }
+
+    llama_stop_matcher_ptr antiprompt_matcher(llama_stop_matcher_init(antiprompt_cstr.data(), antiprompt_cstr.size()));
+
+    // bytes of output after the end of the last antiprompt found, -1 if none
+    int32_t n_after_antiprompt = -1;
+
+    auto antiprompt_feed = [&](llama_token id) {
+        if (params.antiprompt.empty()) {
+            return;
+        }
+
+        const std::string piece = common_token_to_piece(ctx, id);
+        const int32_t n_piece = piece.length();
+
+        int32_t n_fed = 0;
+        while (n_fed < n_piece) {
+            int32_t n = 0;
+            if (llama_stop_matcher_feed(antiprompt_matcher.get(), piece.data() + n_fed, n_piece - n_fed, &n) >= 0) {
+                n_after_antiprompt = 0;
+            } else if (n_after_antiprompt >= 0) {
+                n_after_antiprompt += n;
+            }
+            n_fed += n;
+        }
+    };
+
     if (llama_model_has_encoder(model)) {
         int enc_input_size = embd_inp.size();
         llama_token * enc_input_buf = embd_inp.data();
@@ -699,6 +730,7 @@ int main(int argc, char ** argv) {
             const llama_token id = common_sampler_sample(smpl, ctx, -1);
 
             common_sampler_accept(smpl, id, /* accept_grammar= */ true);
+            antiprompt_feed(id);
 
             // LOG_DBG("last: %s\n", string_from(ctx, smpl->prev.to_vector()).c_str());
 
@@ -720,6 +752,7 @@ int main(int argc, char ** argv) {
                 // push the prompt in the sampling context in order to apply repetition penalties later
                 // for the prompt, we don't apply grammar rules
                 common_sampler_accept(smpl, embd_inp[n_consumed], /* accept_grammar= */ false);
+                antiprompt_feed(embd_inp[n_consumed]);
 
                 ++n_consumed;
                 if ((int) embd.size() >= params.n_batch) {
@@ -757,27 +790,20 @@ int main(int argc, char ** argv) {
 
         // if not currently processing queued inputs;
         if ((int) embd_inp.size() <= n_consumed) {
-            // check for reverse prompt in the last n_prev tokens
+            // check for reverse prompt at the end of the output
             if (!params.antiprompt.empty()) {
-                const int n_prev = 32;
-                const std::string last_output = common_sampler_prev_str(smpl, ctx, n_prev);
-
                 is_antiprompt = false;
-                // Check if each of the reverse prompts appears at the end of the output.
+                // Check if one of the reverse prompts appears at the end of the output.
                 // If we're not running interactively, the reverse prompt might be tokenized with some following characters
                 // so we'll compensate for that by widening the search window a bit.
-                for (std::string & antiprompt : params.antiprompt) {
-                    size_t extra_padding = params.interactive ? 0 : 2;
-                    size_t search_start_pos = last_output.length() > static_cast<size_t>(antiprompt.length() + extra_padding)
-                        ? last_output.length() - static_cast<size_t>(antiprompt.length() + extra_padding)
-                        : 0;
+                {
+                    const int32_t extra_padding = params.interactive ? 0 : 2;
 
-                    if (last_output.find(antiprompt, search_start_pos) != std::string::npos) {
+                    if (n_after_antiprompt >= 0 && n_after_antiprompt <= extra_padding) {
                         if (params.interactive) {
                             is_interacting = true;
                         }
                         is_antiprompt = true;
-                        break;
                     }
                 }
 
@@ -794,7 +820,8 @@ int main(int argc, char ** argv) {
                 }
 
                 if (is_antiprompt) {
-                    LOG_DBG("found antiprompt: %s\n", last_output.c_str());
+                    const int n_prev = 32;
+                    LOG_DBG("found antiprompt: %s\n", common_sampler_prev_str(smpl, ctx, n_prev).c_str());
                 }
             }
 
@@ -933,6 +960,9 @@ int main(int argc, char ** argv) {
             if (n_past > 0 || waiting_for_first_input) {
                 if (is_interacting) {
                     common_sampler_reset(smpl);
+
+                    llama_stop_matcher_reset(antiprompt_matcher.get());
+                    n_after_antiprompt = -1;
                 }
                 is_interacting = false;
 
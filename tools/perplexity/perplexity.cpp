@@ -2041,6 +2041,15 @@ int main(int argc, char ** argv) {
         LOG_INF("%s\n", common_params_get_system_info(params).c_str());
     }
 
+    // print the KV cache types, as they affect the results
+    {
+        const std::string type_layers = string_from(params.cache_type_layers);
+
+        LOG_INF("%s: KV cache types: K = %s, V = %s, layers = %s\n", __func__,
+                ggml_type_name(params.cache_type_k), ggml_type_name(params.cache_type_v),
+                type_layers.empty() ? "none" : type_layers.c_str());
+    }
+
     struct results_perplexity results;
     if (params.hellaswag) {
         hellaswag_score(ctx, params);
@@ -215,10 +215,16 @@ struct server_task {
     // used by SERVER_TASK_TYPE_METRICS
     bool metrics_reset_bucket = false;
 
+    // set once the task has been admitted to the queue of deferred tasks
+    bool deferred = false;
+
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_adapter_lora_info> set_lora;
 
-    server_task(server_task_type type) : type(type) {}
+    // time when the request of the task was received
+    int64_t t_arrival = 0;
+
+    server_task(server_task_type type) : type(type), t_arrival(ggml_time_us()) {}
 
     static slot_params params_from_json_cmpl(
             const llama_context * ctx,
@@ -510,6 +516,9 @@ struct result_timings {
     int32_t draft_n = 0;
     int32_t draft_n_accepted = 0;
 
+    // Optional jump-forward metrics - only included when > 0
+    int32_t forced_n = 0;
+
     json to_json() const {
         json base = {
             {"prompt_n",               prompt_n},
@@ -528,6 +537,10 @@ struct result_timings {
             base["draft_n_accepted"] = draft_n_accepted;
         }
 
+        if (forced_n > 0) {
+            base["forced_n"] = forced_n;
+        }
+
         return base;
     }
 };
@@ -1138,6 +1151,15 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_prompt_tokens_pending = 0;
+
+    int32_t n_prefill_budget      = 0;
+    int32_t n_prefill_budget_used = 0;
+
+    uint64_t n_rejected_total      = 0;
+    uint64_t n_slo_ttft_miss_total = 0;
+    uint64_t n_slo_itl_miss_total  = 0;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1162,6 +1184,13 @@ struct server_task_result_metrics : server_task_result {
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
 
+            { "n_prompt_tokens_pending",         n_prompt_tokens_pending },
+            { "n_prefill_budget",                n_prefill_budget },
+            { "n_prefill_budget_used",           n_prefill_budget_used },
+            { "n_rejected_total",                n_rejected_total },
+            { "n_slo_ttft_miss_total",           n_slo_ttft_miss_total },
+            { "n_slo_itl_miss_total",            n_slo_itl_miss_total },
+
             { "slots",                           slots_data },
         };
     }
@@ -1254,6 +1283,9 @@ struct server_slot {
     int32_t i_batch     = -1;
     int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
 
+    // spilled KV cache to restore before processing the prompt (-1 = none)
+    int32_t id_spill = -1;
+
     // n_prompt_tokens may not be equal to prompt_tokens.size(), because prompt maybe truncated
     int32_t n_prompt_tokens           = 0;
     int32_t n_prompt_tokens_processed = 0;
@@ -1283,14 +1315,21 @@ struct server_slot {
 
     struct common_sampler * smpl = nullptr;
 
+    // streams the generated text, holds back incomplete UTF-8 characters and partial stop words
+    struct llama_detokenizer * detok = nullptr;
+
     llama_token sampled;
 
+    // tokens that precede `sampled` in the next batch: the last sampled token and the text forced by the grammar after it
+    llama_tokens jump_forward;
+
     common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
     std::vector<std::string> generated_tool_call_ids;
 
     // stats
     size_t n_sent_text        = 0; // number of sent text character
 
+    int64_t t_start_task = 0; // time when the request of the task was received
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
@@ -1303,6 +1342,9 @@ struct server_slot {
     int32_t n_draft_total = 0;      // Total draft tokens generated
     int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
 
+    // Jump-forward decoding stats
+    int32_t n_forced = 0;           // Tokens forced by the grammar, evaluated without sampling
+
     void reset() {
         SLT_DBG(*this, "%s", "\n");
 
@@ -1327,6 +1369,9 @@ struct server_slot {
         // clear speculative decoding stats
         n_draft_total = 0;
         n_draft_accepted = 0;
+
+        jump_forward.clear();
+        n_forced = 0;
     }
 
     bool is_non_causal() const {
@@ -1376,6 +1421,7 @@ struct server_slot {
 
             t_last_used = ggml_time_us();
             t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
+            t_start_task = 0;
             state = SLOT_STATE_IDLE;
             callback_on_release(id);
         }
@@ -1399,6 +1445,8 @@ struct server_slot {
             timings.draft_n_accepted = n_draft_accepted;
         }
 
+        timings.forced_n = n_forced;
+
         return timings;
     }
 
@@ -1417,35 +1465,6 @@ struct server_slot {
         return chat_msg;
     }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
-
-            if (is_full_stop) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-
-                pos = text.find(word, from_pos);
-            } else {
-                // otherwise, partial stop
-                pos = string_find_partial_stop(text, word);
-            }
-
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (is_full_stop) {
-                    stop           = STOP_TYPE_WORD;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
-        }
-
-        return stop_pos;
-    }
-
     void print_timings() const {
         const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
         const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
@@ -1470,6 +1489,10 @@ struct server_slot {
                     draft_ratio, n_draft_accepted, n_draft_total
             );
         }
+
+        if (n_forced > 0) {
+            SLT_INF(*this, "jump-forward: %d tokens forced by the grammar\n", n_forced);
+        }
     }
 
     json to_json() const {
@@ -1547,6 +1570,107 @@ struct server_metrics {
     }
 };
 
+// decides how many prompt tokens go into each batch
+// the tokens of the generating slots are always batched first, the pending prompts are then processed in
+// chunks that fit in the prefill budget so that a long prompt does not stall the generation of the other slots
+struct server_scheduler {
+    int32_t n_batch      = 0;
+    int32_t n_budget_min = 0;
+    int32_t n_budget_max = 0;
+    int32_t n_budget     = 0; // current prefill budget, adapted to the ITL target
+
+    int32_t n_queue_max = 0;
+
+    int64_t t_slo_ttft = 0; // us
+    int64_t t_slo_itl  = 0; // us
+
+    int64_t t_last_decode = 0; // time of the last batch with tokens of generating slots
+
+    // stats of the last batch
+    int32_t n_budget_last  = 0;
+    int32_t n_prefill_last = 0;
+
+    uint64_t n_rejected_total       = 0;
+    uint64_t n_slo_ttft_miss_total  = 0;
+    uint64_t n_slo_itl_miss_total   = 0;
+
+    void init(const common_params & params, int32_t n_batch) {
+        this->n_batch = n_batch;
+
+        n_budget_max = params.n_prefill > 0 ? std::min(params.n_prefill, n_batch) : n_batch;
+        n_budget_min = std::min(32, n_budget_max);
+        n_budget     = n_budget_max;
+
+        n_queue_max = params.n_queue_max;
+
+        t_slo_ttft = 1000ll*params.slo_ttft;
+        t_slo_itl  = 1000ll*params.slo_itl;
+    }
+
+    // returns false if a new task has to be rejected because too many tasks are already waiting
+    bool admit(const server_task & task, size_t n_deferred) {
+        if (task.deferred || n_queue_max <= 0 || n_deferred < (size_t) n_queue_max) {
+            return true;
+        }
+
+        n_rejected_total++;
+
+        return false;
+    }
+
+    // max number of prompt tokens to add to the next batch
+    //   n_decode  - number of tokens of generating slots that are already in the batch
+    //   t_waiting - longest time that a pending prompt has been waiting for its first token (us)
+    int32_t budget(int32_t n_decode, int64_t t_waiting) const {
+        if (n_decode == 0) {
+            // no slot is generating, process the prompts as fast as possible
+            return n_batch;
+        }
+
+        if (t_slo_ttft > 0 && t_waiting > t_slo_ttft) {
+            // the prompts are late for their first token, stop limiting them
+            return n_batch;
+        }
+
+        return n_budget;
+    }
+
+    void on_first_token(int64_t t_ttft) {
+        if (t_slo_ttft > 0 && t_ttft > t_slo_ttft) {
+            n_slo_ttft_miss_total++;
+        }
+    }
+
+    // call after each processed batch
+    void on_batch(int32_t n_decode, int32_t n_prefill, int32_t n_budget_cur) {
+        n_budget_last  = n_budget_cur;
+        n_prefill_last = n_prefill;
+
+        if (n_decode == 0) {
+            t_last_decode = 0;
+            return;
+        }
+
+        const int64_t t_now = ggml_time_us();
+
+        if (t_last_decode > 0 && t_slo_itl > 0) {
+            if (t_now - t_last_decode > t_slo_itl) {
+                n_slo_itl_miss_total++;
+
+                // the prompt tokens slowed down the generation - halve the budget
+                if (n_prefill > 0) {
+                    n_budget = std::max(n_budget/2, n_budget_min);
+                }
+            } else if (n_prefill >= n_budget) {
+                // within the target and the budget was fully used - grow it slowly
+                n_budget = std::min(n_budget + n_budget_min, n_budget_max);
+            }
+        }
+
+        t_last_decode = t_now;
+    }
+};
+
 struct server_queue {
     int id = 0;
     bool running;
@@ -1880,6 +2004,14 @@ struct server_context {
 
     server_metrics metrics;
 
+    // token prefixes held in the KV cache by all slots
+    server_prefix_tree prefix_tree;
+
+    // KV cache of the conversations that have been evicted from the slots
+    server_kv_store kv_store;
+
+    server_scheduler scheduler;
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
@@ -1894,6 +2026,9 @@ struct server_context {
             common_sampler_free(slot.smpl);
             slot.smpl = nullptr;
 
+            llama_detokenizer_free(slot.detok);
+            slot.detok = nullptr;
+
             llama_free(slot.ctx_dft);
             slot.ctx_dft = nullptr;
 
@@ -2000,6 +2135,16 @@ struct server_context {
                 SRV_WRN("%s\n", "cache_reuse is not supported by multimodal, it will be disabled");
             }
 
+            if (params_base.n_cache_share) {
+                params_base.n_cache_share = 0;
+                SRV_WRN("%s\n", "cache_share is not supported by multimodal, it will be disabled");
+            }
+
+            if (params_base.n_cache_spill) {
+                params_base.n_cache_spill = 0;
+                SRV_WRN("%s\n", "cache_spill is not supported by multimodal, it will be disabled");
+            }
+
             if (!params_base.speculative.model.path.empty()) {
                 SRV_ERR("%s\n", "err: speculative decode is not supported by multimodal");
                 return false;
@@ -2017,6 +2162,11 @@ struct server_context {
                 SRV_WRN("%s\n", "cache_reuse is not supported by this context, it will be disabled");
             }
 
+            if (params_base.n_cache_share) {
+                params_base.n_cache_share = 0;
+                SRV_WRN("%s\n", "cache_share is not supported by this context, it will be disabled");
+            }
+
             if (!params_base.speculative.model.path.empty()) {
                 SRV_ERR("%s\n", "err: speculative decode is not supported by this context");
                 return false;
@@ -2061,8 +2211,9 @@ struct server_context {
 
             slot.params.sampling = params_base.sampling;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id_slot) {
                 queue_tasks.pop_deferred_task();
+                slot_cache_index(*get_slot_by_id(id_slot));
             };
 
             slot.reset();
@@ -2081,6 +2232,30 @@ struct server_context {
 
         metrics.init();
 
+        {
+            // the states are copied between the KV cache and the pinned host memory of the GPU, if it has one
+            ggml_backend_buffer_type_t buft = ggml_backend_cpu_buffer_type();
+
+            std::vector<ggml_backend_dev_t> devices = params_base.devices;
+            if (devices.empty()) {
+                for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+                    devices.push_back(ggml_backend_dev_get(i));
+                }
+            }
+
+            for (auto * dev : devices) {
+                if (dev != nullptr && params_base.n_gpu_layers != 0 && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU &&
+                        ggml_backend_dev_host_buffer_type(dev) != nullptr) {
+                    buft = ggml_backend_dev_host_buffer_type(dev);
+                    break;
+                }
+            }
+
+            kv_store.init((size_t) params_base.n_cache_spill*1024*1024, params_base.cache_spill_path, buft);
+        }
+
+        scheduler.init(params_base, llama_n_batch(ctx));
+
         oai_parser_opt = {
             /* use_jinja             */ params_base.use_jinja,
             /* prefill_assistant     */ params_base.prefill_assistant,
@@ -2106,7 +2281,27 @@ struct server_context {
         server_slot * ret = nullptr;
 
         // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
+        if (ret == nullptr && slot_prompt_similarity != 0.0f && !mctx) {
+            // look up the idle slot that holds the longest prefix of the prompt
+            const auto res = prefix_tree.find(task.prompt_tokens.get_text_tokens(), [this](llama_seq_id id) {
+                return !get_slot_by_id(id)->is_processing();
+            });
+
+            if (res.seq_id >= 0) {
+                server_slot & slot = *get_slot_by_id(res.seq_id);
+
+                const float similarity = static_cast<float>(res.n_tokens) / static_cast<int>(slot.cache_tokens.size());
+
+                if (similarity > slot_prompt_similarity) {
+                    ret = &slot;
+
+                    SLT_DBG(*ret, "selected slot by prefix tree, n_tokens = %d, similarity = %f\n", res.n_tokens, similarity);
+                }
+            }
+        }
+
+        // the prefix tree does not index media chunks, fall back to comparing all slots
+        if (ret == nullptr && slot_prompt_similarity != 0.0f && mctx) {
             int lcs_len = 0;
             float similarity = 0;
 
@@ -2164,10 +2359,203 @@ struct server_context {
         return ret;
     }
 
+    // reuse the KV cells of a longer common prefix that has already been computed by another slot
+    // the cells are shared between the sequences (llama_kv_self_seq_cp) and no data is copied
+    // the KV cache takes care of un-sharing the cells if one of the sequences shifts them later
+    void slot_share_prefix(server_slot & slot, const server_tokens & prompt_tokens) {
+        const auto res = prefix_tree.find(prompt_tokens.get_text_tokens(), [&](llama_seq_id id) {
+            return id != slot.id && are_lora_equal(get_slot_by_id(id)->lora, slot.lora);
+        });
+
+        if (res.seq_id < 0) {
+            return;
+        }
+
+        const server_slot * donor = get_slot_by_id(res.seq_id);
+
+        // only the tokens that are already in the KV cache can be shared
+        const int n_best = std::min<int>(res.n_tokens, llama_kv_self_seq_pos_max(ctx, donor->id) + 1);
+
+        if (n_best < slot.n_past + params_base.n_cache_share) {
+            return;
+        }
+
+        SLT_INF(slot, "sharing %d prompt tokens with slot %d (n_past = %d)\n", n_best, donor->id, slot.n_past);
+
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        llama_kv_self_seq_cp(ctx, donor->id, slot.id, -1, n_best);
+
+        slot.cache_tokens.keep_first(slot.n_past);
+        for (int i = slot.n_past; i < n_best; ++i) {
+            slot.cache_tokens.push_back(prompt_tokens[i]);
+        }
+
+        slot.n_past = n_best;
+    }
+
+    // update the prefix tree with the tokens of the slot that are currently stored in the KV cache
+    void slot_cache_index(server_slot & slot) {
+        if (mctx) {
+            return;
+        }
+
+        const llama_pos pos_min = llama_kv_self_seq_pos_min(ctx, slot.id);
+        const llama_pos pos_max = llama_kv_self_seq_pos_max(ctx, slot.id);
+
+        if (pos_min != 0 || pos_max < 0) {
+            prefix_tree.remove(slot.id);
+            return;
+        }
+
+        const llama_tokens & tokens = slot.cache_tokens.get_text_tokens();
+
+        prefix_tree.set(slot.id, llama_tokens(tokens.begin(), tokens.begin() + std::min<size_t>(tokens.size(), pos_max + 1)));
+    }
+
+    // free KV cells by dropping the least recently used cached prefix of the idle slots
+    // returns false if there is nothing left to evict
+    bool slot_cache_evict() {
+        if (mctx) {
+            return false;
+        }
+
+        const auto * nd = prefix_tree.find_lru([this](llama_seq_id id) {
+            return !get_slot_by_id(id)->is_processing();
+        });
+
+        if (nd == nullptr) {
+            return false;
+        }
+
+        const int32_t n_keep = nd->n_pos;
+
+        const std::set<llama_seq_id> seqs = nd->seqs; // copy, the node is removed below
+
+        for (llama_seq_id seq_id : seqs) {
+            server_slot & slot = *get_slot_by_id(seq_id);
+
+            SLT_INF(slot, "evicting cached tokens [%d, %d)\n", n_keep, (int) slot.cache_tokens.size());
+
+            slot_spill_save(slot);
+
+            if (!llama_kv_self_seq_rm(ctx, slot.id, n_keep, -1)) {
+                llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                slot.cache_tokens.clear();
+            } else {
+                slot.cache_tokens.keep_first(std::min<size_t>(n_keep, slot.cache_tokens.size()));
+            }
+
+            slot_cache_index(slot);
+        }
+
+        return true;
+    }
+
+    // move the KV cache of the slot to the spill store, the cells of the slot are left untouched
+    void slot_spill_save(server_slot & slot) {
+        if (!kv_store.enabled() || slot.cache_tokens.empty()) {
+            return;
+        }
+
+        const llama_pos pos_min = llama_kv_self_seq_pos_min(ctx, slot.id);
+        const llama_pos pos_max = llama_kv_self_seq_pos_max(ctx, slot.id);
+
+        if (pos_min != 0 || pos_max < 0) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        const size_t n_bytes = llama_state_seq_get_size(ctx, slot.id);
+
+        ggml_backend_buffer_ptr buf = kv_store.alloc(n_bytes);
+        if (!buf) {
+            return;
+        }
+
+        const size_t n_written = llama_state_seq_get_data(ctx, (uint8_t *) ggml_backend_buffer_get_base(buf.get()), n_bytes, slot.id);
+        if (n_written == 0) {
+            return;
+        }
+
+        const llama_tokens & tokens = slot.cache_tokens.get_text_tokens();
+        const int n_tokens = std::min<int>(tokens.size(), pos_max + 1);
+
+        kv_store.add(llama_tokens(tokens.begin(), tokens.begin() + n_tokens), slot.lora, std::move(buf), n_written);
+
+        SLT_INF(slot, "spilled %d tokens of KV cache (%.2f MiB) in %.2f ms, n_spilled = %zu\n",
+                n_tokens, n_written/1024.0/1024.0, (ggml_time_us() - t_start)/1000.0, kv_store.n_entries());
+    }
+
+    // look for a spilled KV cache that matches more of the prompt than the slot currently holds
+    // if it has to be read from disk, this starts loading it in the background
+    void slot_spill_prefetch(server_slot & slot) {
+        slot.id_spill = -1;
+
+        if (!kv_store.enabled() || !slot.params.cache_prompt) {
+            return;
+        }
+
+        const auto res = kv_store.find(slot.prompt_tokens.get_text_tokens(), slot.lora);
+
+        if (res.seq_id < 0 || res.n_tokens <= (int) slot.cache_tokens.get_common_prefix(slot.prompt_tokens)) {
+            return;
+        }
+
+        slot.id_spill = res.seq_id;
+
+        // the slot is parked until the state is read, wake up the loop once it is available
+        kv_store.prefetch(slot.id_spill, [this]() {
+            server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+            task.id = queue_tasks.get_new_id();
+            queue_tasks.post(std::move(task));
+        });
+    }
+
+    // the spilled KV cache of the slot is still being read from disk
+    bool slot_spill_pending(server_slot & slot) {
+        return slot.state == SLOT_STATE_STARTED && slot.id_spill >= 0 && !kv_store.ready(slot.id_spill);
+    }
+
+    // replace the KV cache of the slot with the spilled one
+    void slot_spill_restore(server_slot & slot) {
+        const int64_t t_start = ggml_time_us();
+
+        const int32_t id_spill = slot.id_spill;
+        slot.id_spill = -1;
+
+        llama_tokens            tokens;
+        ggml_backend_buffer_ptr buf;
+        size_t                  n_bytes = 0;
+
+        if (!kv_store.take(id_spill, tokens, buf, n_bytes)) {
+            // loading failed or another slot has taken it
+            return;
+        }
+
+        slot_spill_save(slot);
+
+        const size_t n_read = llama_state_seq_set_data(ctx, (const uint8_t *) ggml_backend_buffer_get_base(buf.get()), n_bytes, slot.id);
+
+        slot.cache_tokens.clear();
+        if (n_read == 0) {
+            SLT_WRN(slot, "%s", "failed to restore the spilled KV cache\n");
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        } else {
+            slot.cache_tokens.insert(tokens);
+        }
+
+        slot_cache_index(slot);
+
+        SLT_INF(slot, "restored %d tokens of spilled KV cache in %.2f ms, n_spilled = %zu\n",
+                (int) slot.cache_tokens.size(), (ggml_time_us() - t_start)/1000.0, kv_store.n_entries());
+    }
+
     bool launch_slot_with_task(server_slot & slot, server_task && task) {
         slot.reset();
         slot.id_task       = task.id;
         slot.index         = task.index;
+        slot.t_start_task  = task.t_arrival;
         slot.task_type     = task.type;
         slot.params        = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
@@ -2182,6 +2570,7 @@ struct server_context {
             send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
             return false;
         }
+
         SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
 
         if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
@@ -2205,6 +2594,23 @@ struct server_context {
                 send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
                 return false;
             }
+
+            // the context returns only the top logits, see common_context_params_to_llama
+            if (!slot.params.sampling.grammar.empty() && params_base.n_logits_top > 0 && params_base.sampling.grammar.empty()) {
+                send_error(task, "Grammars are not supported with --logits-top", ERROR_TYPE_NOT_SUPPORTED);
+                return false;
+            }
+        }
+
+        {
+            llama_detokenizer_free(slot.detok);
+
+            std::vector<const char *> stop;
+            for (const std::string & word : slot.params.antiprompt) {
+                stop.push_back(word.c_str());
+            }
+
+            slot.detok = llama_detokenizer_init(vocab, stop.data(), stop.size());
         }
 
         if (slot.ctx_dft) {
@@ -2213,6 +2619,9 @@ struct server_context {
             slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
         }
 
+        // only start reading from disk once the task has been accepted
+        slot_spill_prefetch(slot);
+
         slot.state = SLOT_STATE_STARTED;
 
         SLT_INF(slot, "%s", "processing task\n");
@@ -2228,54 +2637,31 @@ struct server_context {
         clean_kv_cache = false;
     }
 
-    bool process_token(completion_token_output & result, server_slot & slot) {
+    bool process_token(completion_token_output & result, server_slot & slot, bool special) {
         // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = result.text_to_send;
         slot.sampled = result.tok;
 
+        const std::string token_str = common_token_to_piece(vocab, result.tok, special);
+
         slot.generated_text += token_str;
         if (slot.params.return_tokens) {
             slot.generated_tokens.push_back(result.tok);
         }
         slot.has_next_token = true;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
-
-        // search stop word and delete it
-        if (!incomplete) {
-            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
-
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool send_text = true;
-
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
-            if (stop_pos != std::string::npos) {
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            } else if (slot.has_next_token) {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
-                send_text = stop_pos == std::string::npos;
-            }
+        // only the text that cannot be part of a stop word or of an incomplete UTF-8 character is sent
+        result.text_to_send = common_detokenizer_push(slot.detok, { result.tok }, special);
 
-            // check if there is any token to predict
-            if (send_text) {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
-            } else {
-                result.text_to_send = "";
-            }
-
-            slot.add_token(result);
-            if (slot.params.stream) {
-                send_partial_response(slot, result);
-            }
+        const int32_t stop_idx = llama_detokenizer_stop(slot.detok);
+        if (stop_idx >= 0) {
+            slot.stop           = STOP_TYPE_WORD;
+            slot.stopping_word  = slot.params.antiprompt[stop_idx];
+            slot.has_next_token = false;
         }
 
+        // the token ends with an incomplete UTF-8 character and there is nothing to send yet
+        const bool incomplete = stop_idx < 0 && result.text_to_send.empty() && llama_detokenizer_incomplete(slot.detok);
+
         if (incomplete) {
             slot.has_next_token = true;
         }
@@ -2375,6 +2761,29 @@ struct server_context {
                     slot.params.n_predict, n_ctx_train);
         }
 
+        // the generation ends: the text held back by the detokenizer, e.g. the beginning of a stop word that was not
+        // completed, is sent with the last token
+        if (!slot.has_next_token && stop_idx < 0) {
+            std::string text_held = common_detokenizer_flush(slot.detok);
+            text_held.resize(validate_utf8(text_held));
+
+            result.text_to_send += text_held;
+        }
+
+        if (!incomplete || !slot.has_next_token) {
+            slot.n_sent_text += result.text_to_send.size();
+
+            // delete the stop word
+            if (stop_idx >= 0) {
+                slot.generated_text.resize(std::min(slot.n_sent_text, slot.generated_text.size()));
+            }
+
+            slot.add_token(result);
+            if (slot.params.stream) {
+                send_partial_response(slot, result);
+            }
+        }
+
         SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining, result.tok, token_str.c_str());
 
         return slot.has_next_token; // continue
@@ -2382,7 +2791,6 @@ struct server_context {
 
     void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) {
         size_t n_probs = slot.params.sampling.n_probs;
-        size_t n_vocab = llama_vocab_n_tokens(vocab);
         if (post_sampling) {
             const auto * cur_p = common_sampler_get_candidates(slot.smpl);
             const size_t max_probs = cur_p->size;
@@ -2409,7 +2817,7 @@ struct server_context {
             std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
 
             // set probability for sampled token
-            for (size_t i = 0; i < n_vocab; i++) {
+            for (size_t i = 0; i < cur.size(); i++) {
                 // set probability for sampled token
                 if (cur[i].id == result.tok) {
                     result.prob = cur[i].p;
@@ -2419,7 +2827,7 @@ struct server_context {
 
             // set probability for top n_probs tokens
             result.probs.reserve(n_probs);
-            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++) {
+            for (size_t i = 0; i < std::min(cur.size(), n_probs); i++) {
                 result.probs.push_back({
                     cur[i].id,
                     common_token_to_piece(ctx, cur[i].id, special),
@@ -2726,6 +3134,14 @@ struct server_context {
 
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                    if (slot == nullptr || slot->is_processing()) {
+                        if (!scheduler.admit(task, queue_tasks.queue_tasks_deferred.size())) {
+                            send_error(task, "the server is busy, too many requests are waiting", ERROR_TYPE_UNAVAILABLE);
+                            break;
+                        }
+                        task.deferred = true;
+                    }
+
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
@@ -2765,6 +3181,8 @@ struct server_context {
                     int n_idle_slots       = 0;
                     int n_processing_slots = 0;
 
+                    uint64_t n_prompt_tokens_pending = 0;
+
                     for (server_slot & slot : slots) {
                         json slot_data = slot.to_json();
 
@@ -2774,6 +3192,12 @@ struct server_context {
                             n_idle_slots++;
                         }
 
+                        if (slot.state == SLOT_STATE_STARTED) {
+                            n_prompt_tokens_pending += slot.prompt_tokens.size();
+                        } else if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+                            n_prompt_tokens_pending += slot.n_prompt_tokens - slot.n_past;
+                        }
+
                         slots_data.push_back(slot_data);
                     }
                     SRV_DBG("n_idle_slots = %d, n_processing_slots = %d\n", n_idle_slots, n_processing_slots);
@@ -2799,6 +3223,15 @@ struct server_context {
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    res->n_prompt_tokens_pending = n_prompt_tokens_pending;
+
+                    res->n_prefill_budget        = scheduler.n_budget_last;
+                    res->n_prefill_budget_used   = scheduler.n_prefill_last;
+
+                    res->n_rejected_total        = scheduler.n_rejected_total;
+                    res->n_slo_ttft_miss_total   = scheduler.n_slo_ttft_miss_total;
+                    res->n_slo_itl_miss_total    = scheduler.n_slo_itl_miss_total;
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
@@ -2872,12 +3305,14 @@ struct server_context {
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
                     if (nread == 0) {
                         slot->cache_tokens.clear(); // KV may already been invalidated?
+                        prefix_tree.remove(slot->id);
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
                     tokens.resize(token_count);
                     slot->cache_tokens.clear();
                     slot->cache_tokens.insert(tokens);
+                    slot_cache_index(*slot);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -2912,6 +3347,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    prefix_tree.remove(slot->id);
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -2952,6 +3388,23 @@ struct server_context {
             }
         }
 
+        // the slots that wait for their spilled KV cache are parked, the reading thread wakes up the loop when it is done
+        {
+            bool all_parked = true;
+
+            for (auto & slot : slots) {
+                if (slot.is_processing() && !slot_spill_pending(slot)) {
+                    all_parked = false;
+                    break;
+                }
+            }
+
+            if (all_parked) {
+                SRV_DBG("%s", "waiting for the spilled KV cache\n");
+                return;
+            }
+        }
+
         {
             SRV_DBG("%s", "posting NEXT_RESPONSE\n");
 
@@ -3002,6 +3455,8 @@ struct server_context {
 
                 slot.n_past -= n_discard;
 
+                slot_cache_index(slot);
+
                 slot.truncated = true;
             }
         }
@@ -3016,12 +3471,24 @@ struct server_context {
             return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
         };
 
+        // the generating slots left to add to the batch, each of them needs room for at least one token
+        int32_t n_generating = 0;
+        for (const auto & slot : slots) {
+            if (slot.state == SLOT_STATE_GENERATING) {
+                n_generating++;
+            }
+        }
+
+        const int32_t n_batch_max = std::max((int32_t) llama_n_batch(ctx), params_base.n_parallel);
+
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
                 continue;
             }
 
+            n_generating--;
+
             // check if we can batch this slot with the previous one
             if (!slot_batched) {
                 slot_batched = &slot;
@@ -3029,6 +3496,30 @@ struct server_context {
                 continue;
             }
 
+            // the text forced by the grammar is evaluated in the same batch, only the last token needs logits
+            // the forced tokens that do not fit in the room left by the other slots are evaluated in the next batches,
+            // followed by the sampled token
+            {
+                const int32_t n_room = n_batch_max - batch.n_tokens - n_generating;
+
+                const bool fits = (int32_t) slot.jump_forward.size() < n_room;
+
+                const int32_t n_forced = fits ? (int32_t) slot.jump_forward.size() : n_room;
+
+                for (int32_t k = 0; k < n_forced; k++) {
+                    common_batch_add(batch, slot.jump_forward[k], slot.n_past, { slot.id }, false);
+
+                    slot.n_past += 1;
+                    slot.cache_tokens.push_back(slot.jump_forward[k]);
+                }
+                slot.jump_forward.erase(slot.jump_forward.begin(), slot.jump_forward.begin() + n_forced);
+
+                if (!fits) {
+                    SLT_DBG(slot, "jump-forward: %d forced tokens deferred to the next batch\n", (int) slot.jump_forward.size());
+                    continue;
+                }
+            }
+
             slot.i_batch = batch.n_tokens;
 
             common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
@@ -3044,9 +3535,42 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
-        // next, batch any pending prompts without exceeding n_batch
-        if (params_base.cont_batching || batch.n_tokens == 0) {
+        const int32_t n_decode = batch.n_tokens;
+
+        // the pending prompts are processed in the order of arrival of their tasks
+        std::vector<server_slot *> slots_prompt;
+        int64_t t_waiting = 0;
+        {
+            const int64_t t_now = ggml_time_us();
+
             for (auto & slot : slots) {
+                slots_prompt.push_back(&slot);
+
+                if (slot.state == SLOT_STATE_STARTED || slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+                    t_waiting = std::max(t_waiting, t_now - slot.t_start_task);
+                }
+            }
+
+            std::stable_sort(slots_prompt.begin(), slots_prompt.end(), [](const server_slot * a, const server_slot * b) {
+                return a->t_start_task < b->t_start_task;
+            });
+        }
+
+        // max number of prompt tokens in this batch
+        const int32_t n_prefill_max = scheduler.budget(n_decode, t_waiting);
+
+        int32_t n_prefill = 0;
+
+        // next, batch any pending prompts without exceeding n_batch and the prefill budget
+        if (params_base.cont_batching || batch.n_tokens == 0) {
+            for (server_slot * pslot : slots_prompt) {
+                auto & slot = *pslot;
+
+                // the spilled KV cache of this slot is still being read, let the other slots proceed meanwhile
+                if (slot_spill_pending(slot)) {
+                    continue;
+                }
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -3155,9 +3679,18 @@ struct server_context {
                             }
 
                             if (slot.params.cache_prompt) {
+                                if (slot.id_spill >= 0) {
+                                    slot_spill_restore(slot);
+                                }
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = slot.cache_tokens.get_common_prefix(prompt_tokens);
 
+                                // most of the cached conversation is about to be discarded, keep it for later
+                                if (slot.n_past < (int) slot.cache_tokens.size() / 2) {
+                                    slot_spill_save(slot);
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3206,6 +3739,10 @@ struct server_context {
 
                                     SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
                                 }
+
+                                if (params_base.n_cache_share > 0) {
+                                    slot_share_prefix(slot, prompt_tokens);
+                                }
                             } else {
                                 // if we don't cache the prompt, we have to remove the entire KV cache
                                 slot.n_past = 0;
@@ -3260,6 +3797,8 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.keep_first(slot.n_past);
 
+                    slot_cache_index(slot);
+
                     // check if we should process the image
                     if (slot.n_past < slot.n_prompt_tokens
                             && slot.prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
@@ -3285,8 +3824,11 @@ struct server_context {
                         slot.n_prompt_tokens_processed += n_pos;
                     }
 
+                    // non-causal prompts cannot be split across batches
+                    const int32_t n_prefill_slot = slot.is_non_causal() ? n_batch : n_prefill_max;
+
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch && n_prefill < n_prefill_slot) {
                         // get next token to process
                         llama_token cur_tok = slot.prompt_tokens[slot.n_past];
                         if (cur_tok == LLAMA_TOKEN_NULL) {
@@ -3301,6 +3843,8 @@ struct server_context {
 
                         slot.n_prompt_tokens_processed++;
                         slot.n_past++;
+
+                        n_prefill++;
                     }
 
                     // SLT_INF(slot, "new cache_tokens: %s\n", slot.cache_tokens.str().c_str());
@@ -3334,7 +3878,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch || n_prefill >= n_prefill_max) {
                     break;
                 }
             }
@@ -3406,6 +3950,13 @@ struct server_context {
             metrics.on_decoded(slots);
 
             if (ret != 0) {
+                // make room by evicting cached prompts of the idle slots before shrinking the batch
+                if (ret == 1 && slot_cache_evict()) {
+                    SRV_WRN("failed to find free space in the KV cache, retrying after evicting cached tokens, i = %d, n_batch = %d\n", i, n_batch);
+
+                    continue; // continue loop of n_batch
+                }
+
                 {
                     std::string err;
 
@@ -3445,6 +3996,11 @@ struct server_context {
             // on successful decode, restore the original batch size
             n_batch = llama_n_batch(ctx);
 
+            // the slots that sample a token from this batch
+            std::vector<server_slot *>    slots_sample;
+            std::vector<common_sampler *> smpls_sample;
+            std::vector<int>              idxs_sample;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -3468,13 +4024,27 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    // make the prompt available to the other slots
+                    slot_cache_index(slot);
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
-                const int tok_idx = slot.i_batch - i;
+                slots_sample.push_back(&slot);
+                smpls_sample.push_back(slot.smpl);
+                idxs_sample.push_back(slot.i_batch - i);
+            }
+
+            // sample the next token of all the slots at once
+            const std::vector<llama_token> ids = common_sampler_sample_seqs(smpls_sample, ctx, idxs_sample);
+
+            for (size_t k = 0; k < slots_sample.size(); ++k) {
+                auto & slot = *slots_sample[k];
+
+                const int tok_idx = idxs_sample[k];
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                llama_token id = ids[k];
 
                 slot.i_batch = -1;
 
@@ -3488,20 +4058,20 @@ struct server_context {
                     slot.t_start_generation = t_current;
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+                    scheduler.on_first_token(t_current - slot.t_start_task);
                 }
 
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
                 completion_token_output result;
                 result.tok          = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
                 result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
 
                 if (slot.params.sampling.n_probs > 0) {
                     populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
                 }
 
-                if (!process_token(result, slot)) {
+                if (!process_token(result, slot, accept_special_token(slot, result.tok))) {
                     // release slot because of stop condition
                     slot.release();
                     slot.print_timings();
@@ -3509,6 +4079,45 @@ struct server_context {
                     metrics.on_prediction(slot);
                     continue;
                 }
+
+                // jump-forward: the text forced by the grammar after the sampled token is accepted as generated
+                // the speculative slots draft it instead (see common_speculative_gen_draft)
+                if (params_base.jump_forward && !slot.can_speculate()) {
+                    llama_tokens forced = common_grammar_forced_tokens(ctx, common_sampler_get_grammar(slot.smpl));
+
+                    // leave space for 1 extra token to allow context shifts
+                    forced.resize(std::max(0, std::min<int>(forced.size(), slot.n_ctx - slot.n_past - 2)));
+
+                    if (forced.empty()) {
+                        continue;
+                    }
+
+                    SLT_DBG(slot, "jump-forward: %d tokens forced by the grammar\n", (int) forced.size());
+
+                    // the last forced token takes the place of the sampled one
+                    slot.jump_forward.push_back(id);
+                    slot.jump_forward.insert(slot.jump_forward.end(), forced.begin(), forced.end() - 1);
+
+                    for (const llama_token id_forced : forced) {
+                        common_sampler_accept(slot.smpl, id_forced, true);
+
+                        slot.n_decoded += 1;
+                        slot.n_forced  += 1;
+
+                        completion_token_output result;
+                        result.tok          = id_forced;
+                        result.prob         = 1.0f;
+
+                        if (!process_token(result, slot, accept_special_token(slot, result.tok))) {
+                            // release slot because of stop condition
+                            slot.release();
+                            slot.print_timings();
+                            send_final_response(slot);
+                            metrics.on_prediction(slot);
+                            break;
+                        }
+                    }
+                }
             }
 
             // do speculative decoding
@@ -3551,6 +4160,7 @@ struct server_context {
                 params_spec.n_draft   = n_draft_max;
                 params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
                 params_spec.p_min     = slot.params.speculative.p_min;
+                params_spec.grmr      = common_sampler_get_grammar(slot.smpl);
 
                 const llama_tokens & cached_text_tokens = slot.cache_tokens.get_text_tokens();
                 llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
@@ -3595,12 +4205,11 @@ struct server_context {
                     completion_token_output result;
 
                     result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
                     result.prob         = 1.0f; // set later
 
                     // TODO: set result.probs
 
-                    if (!process_token(result, slot)) {
+                    if (!process_token(result, slot, accept_special_token(slot, result.tok))) {
                         // release slot because of stop condition
                         slot.release();
                         slot.print_timings();
@@ -3614,6 +4223,8 @@ struct server_context {
             }
         }
 
+        scheduler.on_batch(n_decode, n_prefill, n_prefill_max);
+
         SRV_DBG("%s", "run slots completed\n");
     }
 
@@ -3940,6 +4551,18 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / std::max((float) res_metrics->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "requests_rejected_total"},
+                    {"help",  "Number of requests rejected because too many requests were waiting."},
+                    {"value",  res_metrics->n_rejected_total}
+            }, {
+                    {"name",  "slo_ttft_missed_total"},
+                    {"help",  "Number of requests whose time to first token exceeded the target."},
+                    {"value",  res_metrics->n_slo_ttft_miss_total}
+            }, {
+                    {"name",  "slo_itl_missed_total"},
+                    {"help",  "Number of batches whose inter-token latency exceeded the target."},
+                    {"value",  res_metrics->n_slo_itl_miss_total}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3957,6 +4580,18 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "prompt_tokens_pending"},
+                    {"help",  "Number of prompt tokens waiting to be processed."},
+                    {"value",  res_metrics->n_prompt_tokens_pending}
+            },{
+                    {"name",  "prefill_budget"},
+                    {"help",  "Max number of prompt tokens in the last batch."},
+                    {"value",  res_metrics->n_prefill_budget}
+            },{
+                    {"name",  "prefill_budget_usage"},
+                    {"help",  "Fraction of the prefill budget used by the last batch."},
+                    {"value",  res_metrics->n_prefill_budget ? (float) res_metrics->n_prefill_budget_used / res_metrics->n_prefill_budget : 0.f}
             }}}
         };
 
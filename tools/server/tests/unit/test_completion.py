@@ -462,3 +462,45 @@ def test_cancel_request():
     time.sleep(1) # wait for HTTP_POLLING_SECONDS
     res = server.make_request("GET", "/slots")
     assert res.body[0]["is_processing"] == False
+
+
+@pytest.mark.parametrize("jump_forward", [True, False])
+def test_completion_jump_forward(jump_forward: bool):
+    global server
+    server.jump_forward = jump_forward
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 64,
+        "temperature": 0.0,
+        "grammar": 'root ::= "{\\"name\\": \\"" [a-z]{1,8} "\\", \\"age\\": " [0-9]{1,2} "}"',
+    })
+    assert res.status_code == 200
+    assert match_regex(r'\{"name": "[a-z]{1,8}", "age": [0-9]{1,2}\}', res.body["content"])
+    # the keys and the punctuation are forced by the grammar
+    assert (res.body["timings"].get("forced_n", 0) > 0) == jump_forward
+
+
+def test_completion_jump_forward_full_batch():
+    global server
+    # the forced text of the 2 slots does not fit in a single batch (64 is the smallest batch size)
+    server.jump_forward = True
+    server.n_batch = 64
+    server.n_ubatch = 64
+    server.n_slots = 2
+    server.n_predict = 256
+    server.start()
+    key = "0123456789" * 6
+    tasks = []
+    for _ in range(2):
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 256,
+            "temperature": 0.0,
+            "grammar": 'root ::= "{\\"' + key + '\\": \\"" [a-z]{1,8} "\\"}"',
+        })))
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert match_regex(r'\{"' + key + r'": "[a-z]{1,8}"\}', res.body["content"])
+        assert res.body["timings"].get("forced_n", 0) > 32
@@ -83,6 +83,7 @@ class ServerProcess:
     draft_min: int | None = None
     draft_max: int | None = None
     no_webui: bool | None = None
+    jump_forward: bool | None = None
     jinja: bool | None = None
     reasoning_format: Literal['deepseek', 'none', 'nothink'] | None = None
     reasoning_budget: int | None = None
@@ -188,6 +189,8 @@ class ServerProcess:
             server_args.extend(["--draft-min", self.draft_min])
         if self.no_webui:
             server_args.append("--no-webui")
+        if self.jump_forward:
+            server_args.append("--jump-forward")
         if self.jinja:
             server_args.append("--jinja")
         if self.reasoning_format is not None:
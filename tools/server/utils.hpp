@@ -8,6 +8,7 @@
 #include "mtmd.h"
 #include "mtmd-helper.h"
 #include "chat.h"
+#include "ggml-cpp.h"
 
 // increase max payload length to allow use of larger context size
 #define CPPHTTPLIB_FORM_URL_ENCODED_PAYLOAD_MAX_LENGTH 1048576
@@ -18,7 +19,14 @@
 #define JSON_ASSERT GGML_ASSERT
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -974,16 +982,29 @@ static std::string safe_json_to_str(const json & data) {
 
 static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx) {
     std::vector<llama_token_data> cur;
-    const auto * logits = llama_get_logits_ith(ctx, idx);
 
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
+    // with --logits-top only the top logits are available, the probabilities are normalized over these
+    const llama_token * ids    = nullptr;
+    const float       * logits = nullptr;
 
-    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int n_top = llama_get_logits_top_ith(ctx, idx, &ids, &logits);
+    if (n_top > 0) {
+        cur.resize(n_top);
+        for (int i = 0; i < n_top; i++) {
+            cur[i] = llama_token_data{ids[i], logits[i], 0.0f};
+        }
+    } else {
+        logits = llama_get_logits_ith(ctx, idx);
+
+        const llama_model * model = llama_get_model(ctx);
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
 
-    cur.resize(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        cur.resize(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
     }
 
     // sort tokens by logits
@@ -1316,6 +1337,544 @@ public:
     }
 };
 
+//
+// server_prefix_tree
+//
+
+/**
+ * radix tree over the token prefixes that the sequences currently hold in the KV cache, shared by all slots
+ * each node stores a run of tokens and the set of sequences whose cached prefix covers the whole path up to the end of that run
+ * a sequence always ends at a node boundary, so the children of a node hold a subset of its sequences
+ */
+struct server_prefix_tree {
+    struct node {
+        llama_tokens tokens;    // tokens on the edge from the parent to this node
+        int32_t      n_pos = 0; // number of tokens from the root to the start of the edge
+
+        std::set<llama_seq_id> seqs;
+
+        int64_t t_last_used = 0;
+
+        node * parent = nullptr;
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+    };
+
+    struct match {
+        llama_seq_id seq_id   = -1;
+        int32_t      n_tokens =  0;
+    };
+
+    using seq_filter = std::function<bool(llama_seq_id)>;
+
+    // register the cached tokens of a sequence, replacing the previous ones
+    // only the leading text tokens are indexed
+    void set(llama_seq_id seq_id, const llama_tokens & tokens) {
+        remove(seq_id);
+
+        size_t n = 0;
+        while (n < tokens.size() && tokens[n] != LLAMA_TOKEN_NULL) {
+            n++;
+        }
+
+        if (n == 0) {
+            return;
+        }
+
+        const int64_t t_now = ggml_time_us();
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < n) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->tokens.assign(tokens.begin() + i, tokens.begin() + n);
+                child->n_pos       = i;
+                child->parent      = cur;
+                child->t_last_used = t_now;
+                child->seqs.insert(seq_id);
+
+                cur->children.emplace(tokens[i], std::move(child));
+                break;
+            }
+
+            node * child = it->second.get();
+
+            size_t k = 0;
+            while (k < child->tokens.size() && i + k < n && child->tokens[k] == tokens[i + k]) {
+                k++;
+            }
+
+            if (k < child->tokens.size()) {
+                child = split(child, k);
+            }
+
+            child->t_last_used = t_now;
+            child->seqs.insert(seq_id);
+
+            cur = child;
+            i  += k;
+        }
+
+        seq_tokens[seq_id].assign(tokens.begin(), tokens.begin() + n);
+    }
+
+    void remove(llama_seq_id seq_id) {
+        auto it = seq_tokens.find(seq_id);
+        if (it == seq_tokens.end()) {
+            return;
+        }
+
+        const llama_tokens & tokens = it->second;
+
+        std::vector<node *> path;
+
+        node * cur = &root;
+        for (size_t i = 0; i < tokens.size(); i += cur->tokens.size()) {
+            cur = cur->children.at(tokens[i]).get();
+            cur->seqs.erase(seq_id);
+            path.push_back(cur);
+        }
+
+        seq_tokens.erase(it);
+
+        // drop the nodes that are no longer used and merge the runs that no sequence ends in
+        for (auto pit = path.rbegin(); pit != path.rend(); ++pit) {
+            node * nd = *pit;
+            if (nd->seqs.empty()) {
+                nd->parent->children.erase(nd->tokens[0]);
+            } else if (nd->children.size() == 1 && nd->children.begin()->second->seqs == nd->seqs) {
+                merge(nd);
+            }
+        }
+    }
+
+    // find the sequence that holds the longest prefix of the tokens, considering only the sequences accepted by the filter
+    // among the sequences that hold the same prefix, the one with the fewest cached tokens after it is preferred, so that
+    // the longer cached prompts are kept for the requests that can reuse more of them
+    match find(const llama_tokens & tokens, const seq_filter & filter) {
+        match res;
+
+        const int64_t t_now = ggml_time_us();
+
+        // the deepest node on the path of the tokens that holds an accepted sequence
+        const node * best = nullptr;
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            node * child = it->second.get();
+
+            if (std::none_of(child->seqs.begin(), child->seqs.end(), filter)) {
+                break;
+            }
+
+            size_t k = 0;
+            while (k < child->tokens.size() && i + k < tokens.size() && child->tokens[k] == tokens[i + k]) {
+                k++;
+            }
+
+            child->t_last_used = t_now;
+
+            best = child;
+
+            if (k < child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+            i  += k;
+        }
+
+        if (best == nullptr) {
+            return res;
+        }
+
+        // the sequences of the node can end anywhere in its subtree - compare the tokens of each of them
+        size_t n_cached_best = 0;
+
+        for (const llama_seq_id seq_id : best->seqs) {
+            if (!filter(seq_id)) {
+                continue;
+            }
+
+            const llama_tokens & cached = seq_tokens.at(seq_id);
+
+            size_t n = 0;
+            while (n < cached.size() && n < tokens.size() && cached[n] == tokens[n]) {
+                n++;
+            }
+
+            if (res.seq_id < 0 || (int32_t) n > res.n_tokens || ((int32_t) n == res.n_tokens && cached.size() < n_cached_best)) {
+                res.seq_id    = seq_id;
+                res.n_tokens  = n;
+                n_cached_best = cached.size();
+            }
+        }
+
+        return res;
+    }
+
+    // the least recently used node at the tail of the cached prefixes, that only holds sequences accepted by the filter
+    const node * find_lru(const seq_filter & filter) const {
+        const node * res = nullptr;
+
+        std::vector<const node *> stack = { &root };
+        while (!stack.empty()) {
+            const node * cur = stack.back();
+            stack.pop_back();
+
+            for (const auto & it : cur->children) {
+                stack.push_back(it.second.get());
+            }
+
+            if (cur == &root || !cur->children.empty()) {
+                continue;
+            }
+
+            if (!std::all_of(cur->seqs.begin(), cur->seqs.end(), filter)) {
+                continue;
+            }
+
+            if (res == nullptr || cur->t_last_used < res->t_last_used) {
+                res = cur;
+            }
+        }
+
+        return res;
+    }
+
+private:
+    node root;
+
+    std::map<llama_seq_id, llama_tokens> seq_tokens;
+
+    // split the edge of a node after the first k tokens, returns the new node that holds these tokens
+    node * split(node * nd, size_t k) {
+        GGML_ASSERT(k > 0 && k < nd->tokens.size());
+
+        node * parent = nd->parent;
+
+        auto & owner = parent->children.at(nd->tokens[0]);
+
+        auto head = std::make_unique<node>();
+        head->tokens.assign(nd->tokens.begin(), nd->tokens.begin() + k);
+        head->n_pos       = nd->n_pos;
+        head->seqs        = nd->seqs;
+        head->t_last_used = nd->t_last_used;
+        head->parent      = parent;
+
+        std::unique_ptr<node> tail = std::move(owner);
+        tail->tokens.erase(tail->tokens.begin(), tail->tokens.begin() + k);
+        tail->n_pos += k;
+        tail->parent = head.get();
+
+        head->children.emplace(tail->tokens[0], std::move(tail));
+
+        owner = std::move(head);
+
+        return owner.get();
+    }
+
+    // merge a node with its only child
+    void merge(node * nd) {
+        GGML_ASSERT(nd->children.size() == 1);
+
+        std::unique_ptr<node> child = std::move(nd->children.begin()->second);
+        nd->children.clear();
+
+        nd->tokens.insert(nd->tokens.end(), child->tokens.begin(), child->tokens.end());
+        nd->t_last_used = std::max(nd->t_last_used, child->t_last_used);
+        nd->children    = std::move(child->children);
+
+        for (auto & it : nd->children) {
+            it.second->parent = nd;
+        }
+    }
+};
+
+//
+// server_kv_store
+//
+
+/**
+ * holds the KV cache state of sequences that have been evicted from the slots, keyed by their tokens
+ * the states are kept in host memory up to a byte budget, then the least recently used ones are written to files (if a path is set) or dropped
+ * the host memory is allocated from a buffer type, e.g. the pinned memory of a GPU device, which the state is copied to and from directly
+ * writing a state to a file and reading it back happen on worker threads, so that the other slots can keep decoding meanwhile
+ */
+struct server_kv_store {
+    struct entry {
+        llama_tokens tokens;
+
+        std::vector<common_adapter_lora_info> lora;
+
+        ggml_backend_buffer_ptr buf;  // null while the state is only on disk
+        std::string             path; // file holding the state, empty if it was never written
+
+        size_t  n_bytes     = 0;
+        int64_t t_last_used = 0;
+
+        std::shared_future<bool>             saving; // the state is written to the file in the background
+        std::future<ggml_backend_buffer_ptr> loading;
+    };
+
+    server_kv_store() = default;
+    server_kv_store(const server_kv_store &) = delete;
+    server_kv_store & operator=(const server_kv_store &) = delete;
+
+    ~server_kv_store() {
+        for (auto & it : entries) {
+            if (it.second.saving.valid()) {
+                it.second.saving.wait();
+            }
+            if (it.second.loading.valid()) {
+                it.second.loading.wait();
+            }
+            if (!it.second.path.empty()) {
+                std::remove(it.second.path.c_str());
+            }
+        }
+    }
+
+    void init(size_t n_bytes_max, const std::string & path, ggml_backend_buffer_type_t buft = ggml_backend_cpu_buffer_type()) {
+        this->n_bytes_max = n_bytes_max;
+        this->path_prefix = path.empty() ? "" : path + "kv-spill-" + std::to_string(ggml_time_us()) + "-";
+        this->buft        = buft;
+    }
+
+    // host memory for a state of n_bytes, null if it cannot be allocated
+    ggml_backend_buffer_ptr alloc(size_t n_bytes) const {
+        return ggml_backend_buffer_ptr(ggml_backend_buft_alloc_buffer(buft, n_bytes));
+    }
+
+    bool enabled() const {
+        return n_bytes_max > 0;
+    }
+
+    size_t n_entries() const {
+        return entries.size();
+    }
+
+    // store the state of a sequence, the first n_bytes of buf, replacing the stored states that it extends
+    void add(const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora, ggml_backend_buffer_ptr && buf, size_t n_bytes) {
+        drop_failed();
+
+        while (true) {
+            const auto res = find(tokens, lora);
+            if (res.seq_id < 0 || res.n_tokens < (int32_t) entries.at(res.seq_id).tokens.size()) {
+                break;
+            }
+            erase(res.seq_id);
+        }
+
+        const int32_t id = id_next++;
+
+        entry & e = entries[id];
+        e.tokens      = tokens;
+        e.lora        = lora;
+        e.n_bytes     = n_bytes;
+        e.buf         = std::move(buf);
+        e.t_last_used = ggml_time_us();
+
+        n_bytes_ram += e.n_bytes;
+
+        tree.set(id, tokens);
+
+        fit();
+    }
+
+    // find the stored state with the longest common prefix with the tokens
+    server_prefix_tree::match find(const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora) {
+        drop_failed();
+
+        return tree.find(tokens, [&](llama_seq_id id) {
+            return are_lora_equal(entries.at(id).lora, lora);
+        });
+    }
+
+    // start reading the state from disk in the background, on_done is called by the reading thread once it is done
+    void prefetch(int32_t id, const std::function<void()> & on_done = nullptr) {
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return;
+        }
+
+        entry & e = it->second;
+        e.t_last_used = ggml_time_us();
+
+        if (e.buf || e.loading.valid()) {
+            return;
+        }
+
+        e.loading = std::async(std::launch::async, [this, path = e.path, n_bytes = e.n_bytes, saving = e.saving, on_done]() {
+            ggml_backend_buffer_ptr buf;
+
+            // the state may still be being written
+            if (!saving.valid() || saving.get()) {
+                buf = alloc(n_bytes);
+
+                std::ifstream file(path, std::ios::binary);
+                if (buf && !file.read((char *) ggml_backend_buffer_get_base(buf.get()), n_bytes)) {
+                    buf.reset();
+                }
+            }
+
+            if (on_done) {
+                on_done();
+            }
+
+            return buf;
+        });
+    }
+
+    // returns true if the state can be taken without waiting for the disk
+    bool ready(int32_t id) {
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return true;
+        }
+
+        const entry & e = it->second;
+
+        return !e.loading.valid() || e.loading.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    // remove the state from the store, its data is the first n_bytes of buf, returns false if it is not available anymore
+    bool take(int32_t id, llama_tokens & tokens, ggml_backend_buffer_ptr & buf, size_t & n_bytes) {
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return false;
+        }
+
+        prefetch(id);
+
+        entry & e = it->second;
+
+        if (e.loading.valid()) {
+            e.buf = e.loading.get();
+        } else {
+            n_bytes_ram -= e.n_bytes;
+        }
+
+        const bool ok = e.buf != nullptr;
+
+        tokens  = std::move(e.tokens);
+        buf     = std::move(e.buf);
+        n_bytes = e.n_bytes;
+
+        if (!e.path.empty()) {
+            std::remove(e.path.c_str());
+        }
+
+        tree.remove(id);
+        entries.erase(it);
+
+        return ok;
+    }
+
+private:
+    size_t n_bytes_max = 0;
+    size_t n_bytes_ram = 0;
+
+    std::string path_prefix;
+
+    ggml_backend_buffer_type_t buft = nullptr;
+
+    int32_t id_next = 0;
+
+    std::map<int32_t, entry> entries;
+
+    // ids of the entries, by tokens
+    server_prefix_tree tree;
+
+    void erase(int32_t id) {
+        entry & e = entries.at(id);
+
+        if (e.saving.valid()) {
+            e.saving.wait();
+        }
+
+        if (e.loading.valid()) {
+            e.loading.wait();
+        } else if (e.buf) {
+            n_bytes_ram -= e.n_bytes;
+        }
+
+        if (!e.path.empty()) {
+            std::remove(e.path.c_str());
+        }
+
+        tree.remove(id);
+        entries.erase(id);
+    }
+
+    // move the least recently used states out of host memory until the budget is met
+    void fit() {
+        while (n_bytes_ram > n_bytes_max) {
+            int32_t id_lru = -1;
+            for (const auto & it : entries) {
+                if (!it.second.buf || it.second.loading.valid()) {
+                    continue;
+                }
+                if (id_lru < 0 || it.second.t_last_used < entries.at(id_lru).t_last_used) {
+                    id_lru = it.first;
+                }
+            }
+
+            if (id_lru < 0) {
+                break;
+            }
+
+            entry & e = entries.at(id_lru);
+
+            if (path_prefix.empty()) {
+                erase(id_lru);
+                continue;
+            }
+
+            // the buffer is released by the writing thread once the state is on disk
+            e.path   = path_prefix + std::to_string(id_lru) + ".bin";
+            e.saving = std::async(std::launch::async, [path = e.path, buf = std::move(e.buf), n_bytes = e.n_bytes]() mutable {
+                std::ofstream file(path, std::ios::binary);
+                const bool ok = !!file.write((const char *) ggml_backend_buffer_get_base(buf.get()), n_bytes);
+                buf.reset();
+
+                if (!ok) {
+                    LOG_WRN("failed to write the KV cache to '%s'\n", path.c_str());
+                }
+
+                return ok;
+            }).share();
+
+            n_bytes_ram -= e.n_bytes;
+        }
+    }
+
+    // remove the states that could not be written to disk
+    void drop_failed() {
+        std::vector<int32_t> ids;
+        for (const auto & it : entries) {
+            const auto & saving = it.second.saving;
+            if (saving.valid() && saving.wait_for(std::chrono::seconds(0)) == std::future_status::ready && !saving.get()) {
+                ids.push_back(it.first);
+            }
+        }
+
+        for (const int32_t id : ids) {
+            erase(id);
+        }
+    }
+};
+
 // Computes FNV-1a hash of the data
 static std::string fnv_hash(const uint8_t * data, size_t len) {
     const uint64_t fnv_prime = 0x100000001b3ULL;
@@ -0,0 +1,450 @@
+// benchmark of llama_tokenize and llama_detokenize across the tokenizer types
+//   the token ids of each test are hashed, so that the output can also be used to find changes of the tokenization
+
+#include "common.h"
+#include "llama.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+// sample texts, repeated up to the length of the test
+static const std::map<std::string, std::string> k_inputs = {
+    { "en",
+        "The quick brown fox jumps over the lazy dog. It was the best of times, it was the worst of times, "
+        "it was the age of wisdom, it was the age of foolishness... \"Don't panic!\" she said; 3.14159 != 22/7.\n\n" },
+    { "code",
+        "template <typename T>\nstatic T stdev(const std::vector<T> & v) {\n    if (v.size() <= 1) {\n        return 0;\n    }\n"
+        "    T mean = avg(v);\n    return std::sqrt(sq_sum / (T) (v.size() - 1) - mean*mean);\n}\n\n"
+        "def fib(n):\n\treturn n if n < 2 else fib(n - 1) + fib(n - 2)  # 0x1F, 1e-5\n" },
+    { "zh",
+        "自然语言处理是计算机科学、人工智能和语言学领域的一个分支，研究如何让计算机理解和生成人类语言。"
+        "今天天气很好，我们去公园散步吧！2024年，模型的参数量达到了数千亿。\n" },
+    { "ru",
+        "Обработка естественного языка — общее направление искусственного интеллекта и математической лингвистики. "
+        "Съешь же ещё этих мягких французских булок, да выпей чаю! В 1961 году Гагарин полетел в космос.\n" },
+    { "ja",
+        "自然言語処理は、人間が日常的に使っている自然言語をコンピュータに処理させる一連の技術である。"
+        "いろはにほへと ちりぬるを わかよたれそ つねならむ。カタカナとひらがなと漢字を混ぜて書きます。\n" },
+    { "mixed",
+        "Hello 世界! Привет 🦙🦙 café naïve coöperate — ½ ≠ 0.5 ✓ 👩‍💻 <tag attr=\"x\">\t\t  spaces   and\n\n\nnewlines "
+        "ÀÉÎÕÜ ß ﬁ ❤️ 1234567890 +-*/=%&|^~ [](){}<> `code` **bold** _italic_ http://example.com/a?b=c#d\n" },
+};
+
+struct cmd_params {
+    std::vector<std::string> models = { "models" };
+    std::vector<std::string> langs  = { "en", "code", "zh", "ru", "ja", "mixed" };
+    std::vector<int>         n_bytes = { 1024, 65536 };
+
+    std::string file;     // custom input, added as the "file" language
+    std::string baseline; // output of a previous run in JSON format, the token ids must not change
+
+    int reps = 5;
+
+    std::string output = "md";
+};
+
+struct test_result {
+    std::string vocab;
+    std::string type;
+    std::string lang;
+
+    int n_bytes  = 0;
+    int n_tokens = 0;
+
+    std::string hash;
+    bool roundtrip = false;
+
+    std::vector<double> tok_us;
+    std::vector<double> detok_us;
+
+    double tok_ts() const {
+        return 1e6*n_tokens/avg(tok_us);
+    }
+
+    double tok_mbs() const {
+        return n_bytes/avg(tok_us);
+    }
+
+    double detok_mbs() const {
+        return n_bytes/avg(detok_us);
+    }
+
+    static double avg(const std::vector<double> & v) {
+        return std::accumulate(v.begin(), v.end(), 0.0)/v.size();
+    }
+
+    static double stdev(const std::vector<double> & v) {
+        if (v.size() <= 1) {
+            return 0.0;
+        }
+        const double mean   = avg(v);
+        const double sq_sum = std::inner_product(v.begin(), v.end(), v.begin(), 0.0);
+        return std::sqrt(sq_sum/(v.size() - 1) - mean*mean*v.size()/(v.size() - 1));
+    }
+
+    json to_json() const {
+        return json {
+            { "vocab",        vocab                },
+            { "type",         type                 },
+            { "lang",         lang                 },
+            { "n_bytes",      n_bytes              },
+            { "n_tokens",     n_tokens             },
+            { "hash",         hash                 },
+            { "roundtrip",    roundtrip            },
+            { "tok_avg_us",   avg(tok_us)          },
+            { "tok_stddev_us", stdev(tok_us)       },
+            { "tok_avg_ts",   tok_ts()             },
+            { "tok_avg_mbs",  tok_mbs()            },
+            { "detok_avg_us", avg(detok_us)        },
+            { "detok_stddev_us", stdev(detok_us)   },
+            { "detok_avg_mbs", detok_mbs()         },
+        };
+    }
+};
+
+static std::vector<std::string> transform(const std::vector<int> & values) {
+    std::vector<std::string> res;
+    for (int v : values) {
+        res.push_back(std::to_string(v));
+    }
+    return res;
+}
+
+static void print_usage(int /* argc */, char ** argv) {
+    const cmd_params defaults;
+
+    printf("usage: %s [options]\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help\n");
+    printf("  -m, --model <filename|dir>      vocab files, all .gguf files of a directory (default: %s)\n", string_join(defaults.models, ",").c_str());
+    printf("  -l, --lang <lang>               built-in inputs: en, code, zh, ru, ja, mixed (default: %s)\n", string_join(defaults.langs, ",").c_str());
+    printf("  -n, --n-bytes <n>               length of the inputs in bytes (default: %s)\n", string_join(transform(defaults.n_bytes), ",").c_str());
+    printf("  -f, --file <filename>           also run the tests with the text of a file, repeated up to the lengths\n");
+    printf("  -r, --repetitions <n>           number of times to repeat each test (default: %d)\n", defaults.reps);
+    printf("  -o, --output <md|json|jsonl>    output format printed to stdout (default: %s)\n", defaults.output.c_str());
+    printf("  --baseline <filename>           JSON output of a previous run, fail if the token ids of a test changed\n");
+    printf("\n");
+    printf("Multiple values can be given for each parameter by separating them with ','\n");
+    printf("or by specifying the parameter multiple times.\n");
+}
+
+static bool parse_cmd_params(int argc, char ** argv, cmd_params & params) {
+    bool models_set = false;
+    bool langs_set  = false;
+    bool n_set      = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        }
+
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        const std::string value = argv[++i];
+
+        if (arg == "-m" || arg == "--model") {
+            if (!models_set) {
+                params.models.clear();
+                models_set = true;
+            }
+            for (const auto & m : string_split<std::string>(value, ',')) {
+                params.models.push_back(m);
+            }
+        } else if (arg == "-l" || arg == "--lang") {
+            if (!langs_set) {
+                params.langs.clear();
+                langs_set = true;
+            }
+            for (const auto & l : string_split<std::string>(value, ',')) {
+                if (k_inputs.find(l) == k_inputs.end()) {
+                    fprintf(stderr, "error: unknown input language '%s'\n", l.c_str());
+                    return false;
+                }
+                params.langs.push_back(l);
+            }
+        } else if (arg == "-n" || arg == "--n-bytes") {
+            if (!n_set) {
+                params.n_bytes.clear();
+                n_set = true;
+            }
+            for (int n : string_split<int>(value, ',')) {
+                if (n <= 0) {
+                    fprintf(stderr, "error: invalid length %d\n", n);
+                    return false;
+                }
+                params.n_bytes.push_back(n);
+            }
+        } else if (arg == "-f" || arg == "--file") {
+            params.file = value;
+        } else if (arg == "-r" || arg == "--repetitions") {
+            params.reps = std::max(1, std::stoi(value));
+        } else if (arg == "-o" || arg == "--output") {
+            if (value != "md" && value != "json" && value != "jsonl") {
+                fprintf(stderr, "error: unknown output format '%s'\n", value.c_str());
+                return false;
+            }
+            params.output = value;
+        } else if (arg == "--baseline") {
+            params.baseline = value;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// repeats the text up to n bytes, without cutting a UTF-8 character
+static std::string make_input(const std::string & text, size_t n) {
+    std::string res;
+    while (res.size() < n) {
+        res += text;
+    }
+    while (n > 0 && (res[n] & 0xC0) == 0x80) {
+        n--;
+    }
+    res.resize(n);
+    return res;
+}
+
+static std::string hash_tokens(const std::vector<llama_token> & tokens) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (llama_token id : tokens) {
+        for (int i = 0; i < 4; i++) {
+            hash ^= (id >> (8*i)) & 0xFF;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, hash);
+    return buf;
+}
+
+static const char * vocab_type_name(enum llama_vocab_type type) {
+    switch (type) {
+        case LLAMA_VOCAB_TYPE_NONE: return "none";
+        case LLAMA_VOCAB_TYPE_SPM:  return "spm";
+        case LLAMA_VOCAB_TYPE_BPE:  return "bpe";
+        case LLAMA_VOCAB_TYPE_WPM:  return "wpm";
+        case LLAMA_VOCAB_TYPE_UGM:  return "ugm";
+        case LLAMA_VOCAB_TYPE_RWKV: return "rwkv";
+    }
+    return "unknown";
+}
+
+static void run_test(const llama_vocab * vocab, const std::string & text, int reps, test_result & res) {
+    std::vector<llama_token> tokens(text.size() + 16);
+    std::string detok(text.size() + 16, '\0');
+
+    for (int r = -1; r < reps; r++) {
+        const auto t0 = std::chrono::high_resolution_clock::now();
+
+        int n_tokens = llama_tokenize(vocab, text.data(), text.size(), tokens.data(), tokens.size(), false, false);
+        if (n_tokens < 0) {
+            tokens.resize(-n_tokens);
+            n_tokens = llama_tokenize(vocab, text.data(), text.size(), tokens.data(), tokens.size(), false, false);
+        }
+
+        const auto t1 = std::chrono::high_resolution_clock::now();
+
+        int n_chars = llama_detokenize(vocab, tokens.data(), n_tokens, &detok[0], detok.size(), false, false);
+        if (n_chars < 0) {
+            detok.resize(-n_chars);
+            n_chars = llama_detokenize(vocab, tokens.data(), n_tokens, &detok[0], detok.size(), false, false);
+        }
+
+        const auto t2 = std::chrono::high_resolution_clock::now();
+
+        // the first run is a warmup
+        if (r < 0) {
+            tokens.resize(n_tokens);
+
+            res.n_tokens  = n_tokens;
+            res.hash      = hash_tokens(tokens);
+            res.roundtrip = detok.compare(0, n_chars, text) == 0 && (size_t) n_chars == text.size();
+
+            tokens.resize(text.size() + 16);
+            continue;
+        }
+
+        res.tok_us  .push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        res.detok_us.push_back(std::chrono::duration<double, std::micro>(t2 - t1).count());
+    }
+}
+
+static void print_md_header() {
+    printf("| %-24s | %-4s | %-5s | %8s | %8s | %-16s | %5s | %15s | %10s | %10s |\n",
+            "vocab", "type", "lang", "bytes", "tokens", "hash", "rt", "tok t/s", "tok MB/s", "detok MB/s");
+    printf("| %s | %s | %s | %s | %s | %s | %s | %s | %s | %s |\n",
+            std::string(24, '-').c_str(), std::string(4, '-').c_str(), std::string(5, '-').c_str(),
+            std::string(7, '-').append(":").c_str(), std::string(7, '-').append(":").c_str(), std::string(16, '-').c_str(),
+            std::string(5, '-').c_str(), std::string(14, '-').append(":").c_str(), std::string(9, '-').append(":").c_str(),
+            std::string(9, '-').append(":").c_str());
+}
+
+static void print_md(const test_result & res) {
+    const double tok_ts_stddev = res.tok_ts()*test_result::stdev(res.tok_us)/test_result::avg(res.tok_us);
+
+    char tok_ts[32];
+    snprintf(tok_ts, sizeof(tok_ts), "%.0f ± %.0f", res.tok_ts(), tok_ts_stddev);
+
+    printf("| %-24s | %-4s | %-5s | %8d | %8d | %-16s | %5s | %16s | %10.2f | %10.2f |\n",
+            res.vocab.c_str(), res.type.c_str(), res.lang.c_str(), res.n_bytes, res.n_tokens, res.hash.c_str(),
+            res.roundtrip ? "yes" : "no", tok_ts, res.tok_mbs(), res.detok_mbs());
+    fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+    cmd_params params;
+    if (!parse_cmd_params(argc, argv, params)) {
+        print_usage(argc, argv);
+        return 1;
+    }
+
+    std::map<std::string, std::string> inputs;
+    for (const auto & lang : params.langs) {
+        inputs[lang] = k_inputs.at(lang);
+    }
+    if (!params.file.empty()) {
+        std::ifstream f(params.file, std::ios::binary);
+        if (!f) {
+            fprintf(stderr, "error: failed to open '%s'\n", params.file.c_str());
+            return 1;
+        }
+        std::stringstream ss;
+        ss << f.rdbuf();
+        inputs["file"] = ss.str();
+        params.langs.push_back("file");
+    }
+
+    // the directories are replaced with their .gguf files
+    std::vector<std::string> models;
+    for (const auto & m : params.models) {
+        if (std::filesystem::is_directory(m)) {
+            std::vector<std::string> files;
+            for (const auto & entry : std::filesystem::directory_iterator(m)) {
+                if (entry.path().extension() == ".gguf") {
+                    files.push_back(entry.path().string());
+                }
+            }
+            std::sort(files.begin(), files.end());
+            models.insert(models.end(), files.begin(), files.end());
+        } else {
+            models.push_back(m);
+        }
+    }
+
+    if (models.empty()) {
+        fprintf(stderr, "error: no vocab files found\n");
+        return 1;
+    }
+
+    json baseline;
+    if (!params.baseline.empty()) {
+        std::ifstream f(params.baseline);
+        if (!f) {
+            fprintf(stderr, "error: failed to open '%s'\n", params.baseline.c_str());
+            return 1;
+        }
+        baseline = json::parse(f);
+    }
+
+    llama_log_set([](ggml_log_level level, const char * text, void * /* user_data */) {
+        if (level == GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    llama_backend_init();
+
+    if (params.output == "md") {
+        print_md_header();
+    } else if (params.output == "json") {
+        printf("[\n");
+    }
+
+    int n_changed = 0;
+    bool first = true;
+
+    for (const auto & path : models) {
+        auto mparams = llama_model_default_params();
+        mparams.vocab_only = true;
+
+        llama_model * model = llama_model_load_from_file(path.c_str(), mparams);
+        if (model == nullptr) {
+            fprintf(stderr, "warning: failed to load vocab '%s', skipping\n", path.c_str());
+            continue;
+        }
+
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        for (const auto & lang : params.langs) {
+            for (int n : params.n_bytes) {
+                test_result res;
+                res.vocab   = std::filesystem::path(path).stem().string();
+                res.type    = vocab_type_name(llama_vocab_type(vocab));
+                res.lang    = lang;
+
+                const std::string text = make_input(inputs.at(lang), n);
+                res.n_bytes = text.size();
+
+                run_test(vocab, text, params.reps, res);
+
+                if (params.output == "md") {
+                    print_md(res);
+                } else if (params.output == "json") {
+                    printf("%s%s", first ? "" : ",\n", res.to_json().dump(2).c_str());
+                } else {
+                    printf("%s\n", res.to_json().dump().c_str());
+                }
+                fflush(stdout);
+                first = false;
+
+                for (const auto & b : baseline) {
+                    if (b.at("vocab") == res.vocab && b.at("lang") == res.lang && b.at("n_bytes") == res.n_bytes &&
+                        (b.at("n_tokens") != res.n_tokens || b.at("hash") != res.hash)) {
+                        fprintf(stderr, "error: %s, %s, %d bytes: the tokens changed, %d tokens %s, baseline %d tokens %s\n",
+                                res.vocab.c_str(), res.lang.c_str(), res.n_bytes, res.n_tokens, res.hash.c_str(),
+                                b.at("n_tokens").get<int>(), b.at("hash").get<std::string>().c_str());
+                        n_changed++;
+                    }
+                }
+            }
+        }
+
+        llama_model_free(model);
+    }
+
+    if (params.output == "json") {
+        printf("\n]\n");
+    }
+
+    llama_backend_free();
+
+    return n_changed == 0 ? 0 : 1;
+}